@@ -7,23 +7,115 @@
 #include <Python.h>
 #include <structmember.h>
 
+#include <pthread.h>
+
 #include "_mpmetrics.h"
 
+unsigned long fork_generation;
+
+static void count_fork(void)
+{
+	fork_generation++;
+}
+
+int PyObject_GetSizeAttr(PyObject *obj, const char *name, size_t *value)
+{
+	PyObject *attr = PyObject_GetAttrString(obj, name);
+
+	if (!attr)
+		return -1;
+
+	*value = PyLong_AsSize_t(attr);
+	Py_DECREF(attr);
+	if (PyErr_Occurred())
+		return -1;
+	return 0;
+}
+
+int PyObject_GetLongAttr(PyObject *obj, const char *name, long *value)
+{
+	PyObject *attr = PyObject_GetAttrString(obj, name);
+
+	if (!attr)
+		return -1;
+
+	*value = PyLong_AsLong(attr);
+	Py_DECREF(attr);
+	if (PyErr_Occurred())
+		return -1;
+	return 0;
+}
+
+/*
+ * Unpack the arguments of a METH_FASTCALL | METH_KEYWORDS method (named fname)
+ * into out, which must have one entry for each of the NULL-terminated
+ * keywords. The first required arguments must be present; missing optional
+ * arguments are set to NULL. References are borrowed.
+ */
+int PyArg_UnpackFastcall(const char *fname, PyObject *const *args,
+			 Py_ssize_t nargs, PyObject *kwnames,
+			 const char *const *keywords, Py_ssize_t required,
+			 PyObject **out)
+{
+	Py_ssize_t i, j, max, nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+
+	for (max = 0; keywords[max]; max++)
+		out[max] = NULL;
+
+	if (nargs > max) {
+		PyErr_Format(PyExc_TypeError,
+			     "%s() takes at most %zd positional arguments (%zd given)",
+			     fname, max, nargs);
+		return -1;
+	}
+
+	for (i = 0; i < nargs; i++)
+		out[i] = args[i];
+
+	for (i = 0; i < nkw; i++) {
+		PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+
+		for (j = 0; j < max; j++)
+			if (!PyUnicode_CompareWithASCIIString(name, keywords[j]))
+				break;
+
+		if (j == max) {
+			PyErr_Format(PyExc_TypeError,
+				     "%s() got an unexpected keyword argument '%U'",
+				     fname, name);
+			return -1;
+		}
+
+		if (out[j]) {
+			PyErr_Format(PyExc_TypeError,
+				     "%s() got multiple values for argument '%s'",
+				     fname, keywords[j]);
+			return -1;
+		}
+
+		out[j] = args[nargs + i];
+	}
+
+	for (i = 0; i < required; i++) {
+		if (!out[i]) {
+			PyErr_Format(PyExc_TypeError,
+				     "%s() missing required argument '%s'",
+				     fname, keywords[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int Buffer_init(BufferObject *self, PyObject *args, PyObject *kwds)
 {
-	PyObject *size_obj;
 	size_t size;
 
 	if (!PyArg_ParseTuple(args, "w*", &self->shm))
 		return -1;
 
-	size_obj = PyObject_GetAttrString((PyObject *)self, "size");
-	if (!size_obj)
-		goto error;
-
-	size = PyLong_AsSize_t(size_obj);
-	Py_DECREF(size_obj);
-	if (PyErr_Occurred())
+	if (PyObject_GetSizeAttr((PyObject *)self, "size", &size))
 		goto error;
 
 	if ((size_t)self->shm.len < size) {
@@ -40,9 +132,13 @@ error:
 	return -1;
 }
 
+/*
+ * Don't visit shm.obj. It can't refer back to us, and if the garbage collector
+ * thinks it's garbage, then it may clear it (unmapping our memory) before
+ * we're deallocated.
+ */
 static int Buffer_traverse(BufferObject *self, visitproc visit, void *arg)
 {
-	Py_VISIT(self->shm.obj);
 	return 0;
 }
 
@@ -166,13 +262,46 @@ PyMODINIT_FUNC PyInit__mpmetrics(void)
 	if (!m)
 		return NULL;
 
+	if (pthread_atfork(NULL, NULL, count_fork)) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"could not register fork handler");
+		goto error;
+	}
+
 	if (PyModule_AddType(m, &BufferType))
 		goto error;
 
 	if (LockType_Add(m))
 		goto error;
 
-	if (AtomicTypes_Add(m)) {
+	if (FutexLockType_Add(m))
+		goto error;
+
+	if (RWLockType_Add(m))
+		goto error;
+
+	if (AtomicTypes_Add(m))
+		goto error;
+
+	if (HistogramTypes_Add(m))
+		goto error;
+
+	if (HashTableType_Add(m))
+		goto error;
+
+	if (MappingType_Add(m))
+		goto error;
+
+	if (ExemplarsType_Add(m))
+		goto error;
+
+	if (SnapshotEncoderType_Add(m))
+		goto error;
+
+	if (StatsType_Add(m))
+		goto error;
+
+	if (ExpositionType_Add(m)) {
 error:
 		Py_DECREF(m);
 		return NULL;
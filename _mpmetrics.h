@@ -27,6 +27,18 @@ typedef struct {
 
 extern PyTypeObject BufferType;
 
+/*
+ * Incremented in the child after every fork, so buffered metrics can discard
+ * the pending updates they inherited from their parent.
+ */
+extern unsigned long fork_generation;
+
+int PyArg_UnpackFastcall(const char *fname, PyObject *const *args,
+			 Py_ssize_t nargs, PyObject *kwnames,
+			 const char *const *keywords, Py_ssize_t required,
+			 PyObject **out);
+int PyObject_GetSizeAttr(PyObject *obj, const char *name, size_t *value);
+int PyObject_GetLongAttr(PyObject *obj, const char *name, long *value);
 int PyType_AddSizeConstant(PyTypeObject *type, const char *name, size_t value);
 int PyType_AddLLConstant(PyTypeObject *type, const char *name, long long value);
 int PyType_AddULLConstant(PyTypeObject *type, const char *name,
@@ -35,6 +47,15 @@ int PyType_AddDoubleConstant(PyTypeObject *type, const char *name,
 			     double value);
 
 int LockType_Add(PyObject *m);
+int FutexLockType_Add(PyObject *m);
+int RWLockType_Add(PyObject *m);
 int AtomicTypes_Add(PyObject *m);
+int HistogramTypes_Add(PyObject *m);
+int HashTableType_Add(PyObject *m);
+int MappingType_Add(PyObject *m);
+int ExpositionType_Add(PyObject *m);
+int ExemplarsType_Add(PyObject *m);
+int SnapshotEncoderType_Add(PyObject *m);
+int StatsType_Add(PyObject *m);
 
 #endif /* _MPMETRICS_H */
@@ -0,0 +1,370 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+/*
+ * Atomic arrays hold a fixed number of atomics in one buffer. Elements are
+ * addressed by index, so there is only one Python object (and one buffer
+ * export) for the whole array, instead of one per element.
+ */
+
+#ifdef DOUBLE
+#define PTYPE double
+#define NAME AtomicDoubleArray
+#define AS PyFloat_AsDouble
+#define FROM PyFloat_FromDouble
+#else /* DOUBLE */
+#ifdef SIGNED
+#define PTYPE int64_t
+#define FORMAT PRId64
+#define NAME AtomicInt64Array
+#define AS PyLong_AsLongLong
+#define FROM PyLong_FromLongLong
+#else /* SIGNED */
+#define PTYPE uint64_t
+#define FORMAT PRIu64
+#define NAME AtomicUInt64Array
+#define AS PyLong_AsUnsignedLongLong
+#define FROM PyLong_FromUnsignedLongLong
+#endif /* SIGNED */
+#endif /* DOUBLE */
+#define OBJECT paste(NAME, Object)
+
+typedef struct {
+	PyObject_HEAD
+	Py_buffer shm;
+	Py_ssize_t length;
+} OBJECT;
+
+#define ELEMENT paste(NAME, _element)
+static _Atomic PTYPE *ELEMENT(OBJECT *self, Py_ssize_t i)
+{
+	return (_Atomic PTYPE *)self->shm.buf + i;
+}
+
+/* Convert a (possibly negative) index into an element, like list does */
+#define LOOKUP paste(NAME, _lookup)
+static _Atomic PTYPE *LOOKUP(OBJECT *self, PyObject *index)
+{
+	Py_ssize_t i = PyNumber_AsSsize_t(index, PyExc_IndexError);
+
+	if (i == -1 && PyErr_Occurred())
+		return NULL;
+
+	if (i < 0)
+		i += self->length;
+	if (i < 0 || i >= self->length) {
+		PyErr_SetString(PyExc_IndexError, "index out of range");
+		return NULL;
+	}
+	return ELEMENT(self, i);
+}
+
+#define SETUP paste(NAME, _setup)
+static int SETUP(OBJECT *self)
+{
+	size_t length;
+
+	if (PyObject_GetSizeAttr((PyObject *)self, "length", &length))
+		return -1;
+
+	if ((size_t)self->shm.len / sizeof(PTYPE) < length) {
+		PyErr_Format(PyExc_ValueError,
+			     "shared memory (%zd bytes) too small for %zu elements",
+			     self->shm.len, length);
+		return -1;
+	}
+
+	self->length = length;
+	return 0;
+}
+
+#define INIT paste(NAME, _init)
+static int INIT(OBJECT *self, PyObject *args, PyObject *kwds)
+{
+	Py_ssize_t i;
+
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return -1;
+
+	if (SETUP(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return -1;
+	}
+
+	for (i = 0; i < self->length; i++)
+		atomic_init(ELEMENT(self, i), 0);
+	return 0;
+}
+
+#define SETSTATE paste(NAME, _setstate)
+static PyObject *SETSTATE(OBJECT *self, PyObject *args, PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return NULL;
+
+	if (SETUP(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+#define GET paste(NAME, _get)
+static PyObject *GET(OBJECT *self, PyObject *index)
+{
+	_Atomic PTYPE *elem = LOOKUP(self, index);
+
+	if (!elem)
+		return NULL;
+	return FROM(atomic_load(elem));
+}
+
+#define SET paste(NAME, _set)
+static PyObject *SET(OBJECT *self, PyObject *const *args, Py_ssize_t nargs)
+{
+	_Atomic PTYPE *elem;
+	PTYPE val;
+
+	if (nargs != 2) {
+		PyErr_Format(PyExc_TypeError,
+			     "set() takes exactly 2 arguments (%zd given)", nargs);
+		return NULL;
+	}
+
+	elem = LOOKUP(self, args[0]);
+	if (!elem)
+		return NULL;
+
+	val = AS(args[1]);
+	if (PyErr_Occurred())
+		return NULL;
+
+	atomic_store(elem, val);
+	Py_RETURN_NONE;
+}
+
+#define DO_ADD paste(NAME, _do_add)
+static PyObject *DO_ADD(_Atomic PTYPE *elem, PTYPE amount, bool raise)
+{
+	PTYPE old;
+
+#ifdef DOUBLE
+	PTYPE new;
+
+	old = atomic_load(elem);
+	new = old + amount;
+	while (!atomic_compare_exchange_weak(elem, &old, new)) {
+		stat_inc(STAT_CAS_RETRIES);
+		new = old + amount;
+	}
+#else
+	PTYPE dummy;
+
+	old = atomic_fetch_add(elem, amount);
+	if (raise && __builtin_add_overflow(old, amount, &dummy)) {
+		PyErr_Format(PyExc_OverflowError,
+			     "%" FORMAT " + %" FORMAT " too large to fit in " stringify(PTYPE),
+			     amount, old);
+		return NULL;
+	}
+#endif
+	return FROM(old);
+}
+
+#define ADD paste(NAME, _add)
+static PyObject *ADD(OBJECT *self, PyObject *const *args, Py_ssize_t nargs,
+		     PyObject *kwnames)
+{
+	static const char *const keywords[] = {
+		"index", "amount", "raise_on_overflow", NULL
+	};
+	PyObject *argv[3] = { NULL, NULL, NULL };
+	_Atomic PTYPE *elem;
+	PTYPE amount;
+	int raise = 1;
+
+	/* Skip the keyword machinery for the common add(index, amount) */
+	if (nargs == 2 && !kwnames) {
+		argv[0] = args[0];
+		argv[1] = args[1];
+	} else if (PyArg_UnpackFastcall("add", args, nargs, kwnames, keywords,
+					2, argv)) {
+		return NULL;
+	}
+
+	elem = LOOKUP(self, argv[0]);
+	if (!elem)
+		return NULL;
+
+	amount = AS(argv[1]);
+	if (PyErr_Occurred())
+		return NULL;
+
+	if (argv[2]) {
+		raise = PyObject_IsTrue(argv[2]);
+		if (raise < 0)
+			return NULL;
+	}
+
+	return DO_ADD(elem, amount, raise);
+}
+
+#define INC paste(NAME, _inc)
+static PyObject *INC(OBJECT *self, PyObject *index)
+{
+	_Atomic PTYPE *elem = LOOKUP(self, index);
+
+	if (!elem)
+		return NULL;
+	return DO_ADD(elem, 1, true);
+}
+
+#define SNAPSHOT paste(NAME, _snapshot)
+static PyObject *SNAPSHOT(OBJECT *self, PyObject *Py_UNUSED(ignored))
+{
+	PyObject *ret = PyTuple_New(self->length);
+	Py_ssize_t i;
+
+	if (!ret)
+		return NULL;
+
+	for (i = 0; i < self->length; i++) {
+		PyObject *val = FROM(atomic_load(ELEMENT(self, i)));
+
+		if (!val) {
+			Py_DECREF(ret);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(ret, i, val);
+	}
+	return ret;
+}
+
+#define LENGTH paste(NAME, _length)
+static Py_ssize_t LENGTH(OBJECT *self)
+{
+	return self->length;
+}
+
+#define ITEM paste(NAME, _item)
+static PyObject *ITEM(OBJECT *self, Py_ssize_t i)
+{
+	if (i < 0 || i >= self->length) {
+		PyErr_SetString(PyExc_IndexError, "index out of range");
+		return NULL;
+	}
+	return FROM(atomic_load(ELEMENT(self, i)));
+}
+
+#define SEQUENCE paste(NAME, _sequence)
+static PySequenceMethods SEQUENCE = {
+	.sq_length = (lenfunc)LENGTH,
+	.sq_item = (ssizeargfunc)ITEM,
+};
+
+#define METHODS paste(NAME, _methods)
+static PyMethodDef METHODS[] = {
+	{
+		.ml_name = "_setstate",
+		.ml_meth = (PyCFunction)SETSTATE,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+	},
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)GET,
+		.ml_flags = METH_O,
+		.ml_doc = "Get the current value of an element",
+	},
+	{
+		.ml_name = "set",
+		.ml_meth = (PyCFunction)SET,
+		.ml_flags = METH_FASTCALL,
+		.ml_doc = "Set the current value of an element",
+	},
+	{
+		.ml_name = "add",
+		.ml_meth = (PyCFunction)ADD,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Add a number to an element",
+	},
+	{
+		.ml_name = "inc",
+		.ml_meth = (PyCFunction)INC,
+		.ml_flags = METH_O,
+		.ml_doc = "Add one to an element",
+	},
+	{
+		.ml_name = "snapshot",
+		.ml_meth = (PyCFunction)SNAPSHOT,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Get a tuple of the values of all elements. Each element is read atomically, but the array as a whole is not.",
+	},
+	{ /* Sentinel */ },
+};
+
+#define TYPE paste(NAME, Type)
+static PyTypeObject TYPE = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(OBJECT),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics." stringify(NAME),
+	.tp_doc = "Array of atomic " stringify(PTYPE),
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)INIT,
+	.tp_methods = METHODS,
+	.tp_as_sequence = &SEQUENCE,
+};
+
+#define TYPE_ADD paste(TYPE, _Add)
+static int TYPE_ADD(PyObject *m)
+{
+	int ret;
+
+	if (!atomic_is_lock_free((_Atomic PTYPE *)NULL)) {
+		Py_INCREF(Py_None);
+		ret = PyModule_AddObject(m, stringify(NAME), Py_None);
+		if (ret)
+			Py_DECREF(Py_None);
+		return ret;
+	}
+
+	if (PyType_AddSizeConstant(&TYPE, "item_size", sizeof(PTYPE)))
+		return -1;
+
+	if (PyType_AddSizeConstant(&TYPE, "align", sizeof(PTYPE)))
+		return -1;
+
+	TYPE.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	ret = PyModule_AddType(m, &TYPE);
+	Py_DECREF(&BufferType);
+	return ret;
+}
+
+#undef ELEMENT
+#undef LOOKUP
+#undef SETUP
+#undef INIT
+#undef SETSTATE
+#undef GET
+#undef SET
+#undef DO_ADD
+#undef ADD
+#undef INC
+#undef SNAPSHOT
+#undef LENGTH
+#undef ITEM
+#undef SEQUENCE
+#undef METHODS
+#undef TYPE
+#undef TYPE_ADD
+
+#undef PTYPE
+#undef FORMAT
+#undef NAME
+#undef OBJECT
+#undef AS
+#undef FROM
@@ -10,6 +10,7 @@
 #define _GNU_SOURCE
 #endif
 #include <pthread.h>
+#include <sched.h>
 #include <stdalign.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -17,6 +18,8 @@
 #include <sys/mman.h>
 
 #include "_mpmetrics.h"
+#include "fixed.h"
+#include "stats.h"
 
 static maybe_unused int PyLong_AsInt(PyObject *obj)
 {
@@ -50,6 +53,46 @@ static maybe_unused unsigned int PyLong_AsUnsignedInt(PyObject *obj)
 	return value;
 }
 
+/*
+ * Check whether a buffer holds native numbers of a given kind ('f' for
+ * floating-point, 'i' for signed, or 'u' for unsigned integers) and size
+ */
+static bool buffer_matches(const Py_buffer *view, char kind, size_t size)
+{
+	static const struct {
+		char format, kind;
+		size_t size;
+	} formats[] = {
+		{ 'b', 'i', sizeof(signed char) },
+		{ 'B', 'u', sizeof(unsigned char) },
+		{ 'h', 'i', sizeof(short) },
+		{ 'H', 'u', sizeof(unsigned short) },
+		{ 'i', 'i', sizeof(int) },
+		{ 'I', 'u', sizeof(unsigned int) },
+		{ 'l', 'i', sizeof(long) },
+		{ 'L', 'u', sizeof(unsigned long) },
+		{ 'q', 'i', sizeof(long long) },
+		{ 'Q', 'u', sizeof(unsigned long long) },
+		{ 'n', 'i', sizeof(Py_ssize_t) },
+		{ 'N', 'u', sizeof(size_t) },
+		{ 'f', 'f', sizeof(float) },
+		{ 'd', 'f', sizeof(double) },
+	};
+	const char *format = view->format ? view->format : "B";
+	size_t i;
+
+	if (*format == '@')
+		format++;
+
+	if (!format[0] || format[1] || view->itemsize != size)
+		return false;
+
+	for (i = 0; i < sizeof(formats) / sizeof(*formats); i++)
+		if (formats[i].format == *format)
+			return formats[i].kind == kind && formats[i].size == size;
+	return false;
+}
+
 /* my apologies */
 
 #define WIDTH 32
@@ -74,6 +117,524 @@ static maybe_unused unsigned int PyLong_AsUnsignedInt(PyObject *obj)
 #include "atomic.h"
 #undef DOUBLE
 
+/* Two cache lines, since some CPUs prefetch lines in pairs */
+#define SHARD_SIZE 128
+
+#include "sharded.h"
+
+#define DOUBLE
+#include "sharded.h"
+#undef DOUBLE
+
+#include "array.h"
+
+#define SIGNED
+#include "array.h"
+#undef SIGNED
+
+#define DOUBLE
+#include "array.h"
+#undef DOUBLE
+
+/*
+ * Buffered atomics accumulate updates in process-local memory, and only add
+ * them to the shared value every flush_every updates. Readers increment the
+ * shared generation, which asks every writer to flush on its next update.
+ * Pending updates are protected by the GIL, so threads in the same process
+ * share them.
+ */
+struct buffered {
+	_Atomic uint64_t value;
+	_Atomic uint64_t generation;
+};
+
+typedef struct {
+	PyObject_HEAD
+	Py_buffer shm;
+	size_t flush_every, events;
+	uint64_t pending, generation;
+	unsigned long forks;
+} BufferedAtomicUInt64Object;
+
+static struct buffered *buffered(BufferedAtomicUInt64Object *self)
+{
+	return self->shm.buf;
+}
+
+static void BufferedAtomicUInt64_discard(BufferedAtomicUInt64Object *self)
+{
+	self->pending = 0;
+	self->events = 0;
+	self->forks = fork_generation;
+	self->generation = atomic_load_explicit(&buffered(self)->generation,
+						memory_order_relaxed);
+}
+
+static int BufferedAtomicUInt64_flush_pending(BufferedAtomicUInt64Object *self)
+{
+	uint64_t old, dummy, pending = self->pending;
+
+	BufferedAtomicUInt64_discard(self);
+	if (!pending)
+		return 0;
+
+	old = atomic_fetch_add(&buffered(self)->value, pending);
+	if (__builtin_add_overflow(old, pending, &dummy)) {
+		PyErr_Format(PyExc_OverflowError,
+			     "%" PRIu64 " + %" PRIu64 " too large to fit in uint64_t",
+			     pending, old);
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *BufferedAtomicUInt64_do_add(BufferedAtomicUInt64Object *self,
+					     uint64_t amount, bool raise)
+{
+	struct buffered *b = buffered(self);
+
+	/* Updates inherited from our parent will be flushed by our parent */
+	if (self->forks != fork_generation)
+		BufferedAtomicUInt64_discard(self);
+
+	if (__builtin_add_overflow(self->pending, amount, &self->pending)) {
+		self->pending -= amount;
+		if (BufferedAtomicUInt64_flush_pending(self) && raise)
+			return NULL;
+		PyErr_Clear();
+		self->pending = amount;
+	}
+
+	if (++self->events >= self->flush_every ||
+	    atomic_load_explicit(&b->generation, memory_order_relaxed) !=
+	    self->generation) {
+		if (BufferedAtomicUInt64_flush_pending(self) && raise)
+			return NULL;
+		PyErr_Clear();
+	}
+
+	Py_RETURN_NONE;
+}
+
+static int BufferedAtomicUInt64_setup(BufferedAtomicUInt64Object *self)
+{
+	if (PyObject_GetSizeAttr((PyObject *)self, "flush_every",
+				 &self->flush_every))
+		return -1;
+
+	BufferedAtomicUInt64_discard(self);
+	return 0;
+}
+
+static int BufferedAtomicUInt64_init(BufferedAtomicUInt64Object *self,
+				     PyObject *args, PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return -1;
+
+	atomic_init(&buffered(self)->value, 0);
+	atomic_init(&buffered(self)->generation, 0);
+	if (BufferedAtomicUInt64_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return -1;
+	}
+	return 0;
+}
+
+static void BufferedAtomicUInt64_dealloc(BufferedAtomicUInt64Object *self)
+{
+	PyObject *type, *value, *traceback;
+
+	if (self->shm.obj && self->forks == fork_generation) {
+		PyErr_Fetch(&type, &value, &traceback);
+		if (BufferedAtomicUInt64_flush_pending(self))
+			PyErr_WriteUnraisable((PyObject *)self);
+		PyErr_Restore(type, value, traceback);
+	}
+	BufferType.tp_dealloc((PyObject *)self);
+}
+
+static PyObject *BufferedAtomicUInt64_setstate(BufferedAtomicUInt64Object *self,
+					       PyObject *args, PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return NULL;
+
+	if (BufferedAtomicUInt64_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *BufferedAtomicUInt64_flush(BufferedAtomicUInt64Object *self,
+					    PyObject *Py_UNUSED(ignored))
+{
+	if (self->forks != fork_generation)
+		BufferedAtomicUInt64_discard(self);
+	else if (BufferedAtomicUInt64_flush_pending(self))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *BufferedAtomicUInt64_get(BufferedAtomicUInt64Object *self,
+					  PyObject *Py_UNUSED(ignored))
+{
+	struct buffered *b = buffered(self);
+	PyObject *ret;
+
+	atomic_fetch_add(&b->generation, 1);
+	ret = BufferedAtomicUInt64_flush(self, NULL);
+	if (!ret)
+		return NULL;
+	Py_DECREF(ret);
+
+	return PyLong_FromUnsignedLongLong(atomic_load(&b->value));
+}
+
+static PyObject *BufferedAtomicUInt64_set(BufferedAtomicUInt64Object *self,
+					  PyObject *arg)
+{
+	uint64_t val = PyLong_AsUnsignedLongLong(arg);
+
+	if (PyErr_Occurred())
+		return NULL;
+
+	BufferedAtomicUInt64_discard(self);
+	atomic_store(&buffered(self)->value, val);
+	Py_RETURN_NONE;
+}
+
+static PyObject *BufferedAtomicUInt64_add(BufferedAtomicUInt64Object *self,
+					  PyObject *const *args,
+					  Py_ssize_t nargs, PyObject *kwnames)
+{
+	static const char *const keywords[] = {
+		"amount", "raise_on_overflow", NULL
+	};
+	PyObject *argv[2] = { NULL, NULL };
+	uint64_t amount;
+	int raise = 1;
+
+	if (nargs == 1 && !kwnames)
+		argv[0] = args[0];
+	else if (PyArg_UnpackFastcall("add", args, nargs, kwnames, keywords, 1,
+				      argv))
+		return NULL;
+
+	amount = PyLong_AsUnsignedLongLong(argv[0]);
+	if (PyErr_Occurred())
+		return NULL;
+
+	if (argv[1]) {
+		raise = PyObject_IsTrue(argv[1]);
+		if (raise < 0)
+			return NULL;
+	}
+
+	return BufferedAtomicUInt64_do_add(self, amount, raise);
+}
+
+static PyObject *BufferedAtomicUInt64_add_many(BufferedAtomicUInt64Object *self,
+					       PyObject *arg)
+{
+	uint64_t total;
+
+	if (AtomicUInt64_sum(arg, &total))
+		return NULL;
+	return BufferedAtomicUInt64_do_add(self, total, true);
+}
+
+static PyObject *BufferedAtomicUInt64_inc(BufferedAtomicUInt64Object *self,
+					  PyObject *Py_UNUSED(ignored))
+{
+	return BufferedAtomicUInt64_do_add(self, 1, true);
+}
+
+static PyMethodDef BufferedAtomicUInt64_methods[] = {
+	{
+		.ml_name = "_setstate",
+		.ml_meth = (PyCFunction)BufferedAtomicUInt64_setstate,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+	},
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)BufferedAtomicUInt64_get,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Ask all processes to flush, and get the current value",
+	},
+	{
+		.ml_name = "set",
+		.ml_meth = (PyCFunction)BufferedAtomicUInt64_set,
+		.ml_flags = METH_O,
+		.ml_doc = "Set the current value, discarding this process's pending updates",
+	},
+	{
+		.ml_name = "add",
+		.ml_meth = (PyCFunction)BufferedAtomicUInt64_add,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Add a number to this process's pending updates",
+	},
+	{
+		.ml_name = "add_many",
+		.ml_meth = (PyCFunction)BufferedAtomicUInt64_add_many,
+		.ml_flags = METH_O,
+		.ml_doc = "Add the sum of an iterable (or buffer) of numbers to this process's pending updates",
+	},
+	{
+		.ml_name = "inc",
+		.ml_meth = (PyCFunction)BufferedAtomicUInt64_inc,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Add one to this process's pending updates",
+	},
+	{
+		.ml_name = "flush",
+		.ml_meth = (PyCFunction)BufferedAtomicUInt64_flush,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Add this process's pending updates to the shared value",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject BufferedAtomicUInt64Type = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(BufferedAtomicUInt64Object),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.BufferedAtomicUInt64",
+	.tp_doc = "Buffered atomic uint64_t",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)BufferedAtomicUInt64_init,
+	.tp_dealloc = (destructor)BufferedAtomicUInt64_dealloc,
+	.tp_methods = BufferedAtomicUInt64_methods,
+};
+
+static int BufferedAtomicUInt64Type_Add(PyObject *m)
+{
+	int ret;
+
+	if (!atomic_is_lock_free((_Atomic uint64_t *)NULL)) {
+		Py_INCREF(Py_None);
+		ret = PyModule_AddObject(m, "BufferedAtomicUInt64", Py_None);
+		if (ret)
+			Py_DECREF(Py_None);
+		return ret;
+	}
+
+	if (PyType_AddSizeConstant(&BufferedAtomicUInt64Type, "size",
+				   sizeof(struct buffered)))
+		return -1;
+
+	if (PyType_AddSizeConstant(&BufferedAtomicUInt64Type, "align",
+				   alignof(struct buffered)))
+		return -1;
+
+	BufferedAtomicUInt64Type.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	ret = PyModule_AddType(m, &BufferedAtomicUInt64Type);
+	Py_DECREF(&BufferType);
+	return ret;
+}
+
+/*
+ * Fixed-point atomics hold a double as a scaled integer (see fixed.h). Unlike
+ * AtomicDouble, adding to them never has to retry, no matter how many
+ * processes are adding at once.
+ */
+typedef struct {
+	PyObject_HEAD
+	Py_buffer shm;
+	unsigned int frac_bits;
+} AtomicFixedObject;
+
+static _Atomic int64_t *fixed(AtomicFixedObject *self)
+{
+	return self->shm.buf;
+}
+
+static int AtomicFixed_setup(AtomicFixedObject *self)
+{
+	size_t frac_bits;
+
+	if (PyObject_GetSizeAttr((PyObject *)self, "frac_bits", &frac_bits))
+		return -1;
+
+	if (!frac_bits || frac_bits > FIXED_MAX_FRAC_BITS) {
+		PyErr_Format(PyExc_ValueError,
+			     "frac_bits must be between 1 and %d, not %zu",
+			     FIXED_MAX_FRAC_BITS, frac_bits);
+		return -1;
+	}
+	self->frac_bits = frac_bits;
+	return 0;
+}
+
+static int AtomicFixed_init(AtomicFixedObject *self, PyObject *args,
+			    PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return -1;
+
+	if (AtomicFixed_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return -1;
+	}
+
+	atomic_init(fixed(self), 0);
+	return 0;
+}
+
+static PyObject *AtomicFixed_setstate(AtomicFixedObject *self, PyObject *args,
+				      PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return NULL;
+
+	if (AtomicFixed_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *AtomicFixed_get(AtomicFixedObject *self,
+				 PyObject *Py_UNUSED(ignored))
+{
+	return PyFloat_FromDouble(fixed_to_double(atomic_load(fixed(self)),
+						  self->frac_bits));
+}
+
+static PyObject *AtomicFixed_set(AtomicFixedObject *self, PyObject *arg)
+{
+	double val = PyFloat_AsDouble(arg);
+
+	if (PyErr_Occurred())
+		return NULL;
+
+	atomic_store(fixed(self), fixed_from_double(val, self->frac_bits));
+	Py_RETURN_NONE;
+}
+
+static PyObject *AtomicFixed_do_add(AtomicFixedObject *self, int64_t amount)
+{
+	return PyFloat_FromDouble(fixed_to_double(atomic_fetch_add(fixed(self),
+								   amount),
+						  self->frac_bits));
+}
+
+static PyObject *AtomicFixed_add(AtomicFixedObject *self, PyObject *arg)
+{
+	double amount = PyFloat_AsDouble(arg);
+
+	if (PyErr_Occurred())
+		return NULL;
+
+	return AtomicFixed_do_add(self, fixed_from_double(amount,
+							  self->frac_bits));
+}
+
+static PyObject *AtomicFixed_add_many(AtomicFixedObject *self, PyObject *arg)
+{
+	PyObject *iter, *item;
+	int64_t total = 0;
+
+	/* Round each amount, so that this is the same as adding them in turn */
+	iter = PyObject_GetIter(arg);
+	if (!iter)
+		return NULL;
+
+	while ((item = PyIter_Next(iter))) {
+		double amount = PyFloat_AsDouble(item);
+
+		Py_DECREF(item);
+		if (amount == -1.0 && PyErr_Occurred()) {
+			Py_DECREF(iter);
+			return NULL;
+		}
+		total = fixed_add(total, fixed_from_double(amount,
+							   self->frac_bits));
+	}
+
+	Py_DECREF(iter);
+	if (PyErr_Occurred())
+		return NULL;
+	return AtomicFixed_do_add(self, total);
+}
+
+static PyMethodDef AtomicFixed_methods[] = {
+	{
+		.ml_name = "_setstate",
+		.ml_meth = (PyCFunction)AtomicFixed_setstate,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+	},
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)AtomicFixed_get,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Get the current value",
+	},
+	{
+		.ml_name = "set",
+		.ml_meth = (PyCFunction)AtomicFixed_set,
+		.ml_flags = METH_O,
+		.ml_doc = "Set the current value",
+	},
+	{
+		.ml_name = "add",
+		.ml_meth = (PyCFunction)AtomicFixed_add,
+		.ml_flags = METH_O,
+		.ml_doc = "Add a number to the value",
+	},
+	{
+		.ml_name = "add_many",
+		.ml_meth = (PyCFunction)AtomicFixed_add_many,
+		.ml_flags = METH_O,
+		.ml_doc = "Add the sum of an iterable of numbers to the value",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject AtomicFixedType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(AtomicFixedObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.AtomicFixed",
+	.tp_doc = "Atomic fixed-point number",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)AtomicFixed_init,
+	.tp_methods = AtomicFixed_methods,
+};
+
+static int AtomicFixedType_Add(PyObject *m)
+{
+	int ret;
+
+	if (!atomic_is_lock_free((_Atomic int64_t *)NULL)) {
+		Py_INCREF(Py_None);
+		ret = PyModule_AddObject(m, "AtomicFixed", Py_None);
+		if (ret)
+			Py_DECREF(Py_None);
+		return ret;
+	}
+
+	if (PyType_AddSizeConstant(&AtomicFixedType, "size", sizeof(int64_t)))
+		return -1;
+
+	if (PyType_AddSizeConstant(&AtomicFixedType, "align", alignof(int64_t)))
+		return -1;
+
+	if (PyType_AddSizeConstant(&AtomicFixedType, "max_frac_bits",
+				   FIXED_MAX_FRAC_BITS))
+		return -1;
+
+	AtomicFixedType.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	ret = PyModule_AddType(m, &AtomicFixedType);
+	Py_DECREF(&BufferType);
+	return ret;
+}
+
 int AtomicTypes_Add(PyObject *m)
 {
 	if (AtomicInt32Type_Add(m))
@@ -91,5 +652,26 @@ int AtomicTypes_Add(PyObject *m)
 	if (AtomicDoubleType_Add(m))
 		return -1;
 
+	if (ShardedAtomicUInt64Type_Add(m))
+		return -1;
+
+	if (ShardedAtomicDoubleType_Add(m))
+		return -1;
+
+	if (BufferedAtomicUInt64Type_Add(m))
+		return -1;
+
+	if (AtomicFixedType_Add(m))
+		return -1;
+
+	if (AtomicUInt64ArrayType_Add(m))
+		return -1;
+
+	if (AtomicInt64ArrayType_Add(m))
+		return -1;
+
+	if (AtomicDoubleArrayType_Add(m))
+		return -1;
+
 	return 0;
 }
@@ -9,17 +9,20 @@
 #define NAME AtomicDouble
 #define OBJECT AtomicDouble
 #define AS PyFloat_AsDouble
+#define KIND 'f'
 #define FROM PyFloat_FromDouble
 #else /* DOUBLE */
 #ifdef SIGNED
 #define FORMAT paste(PRId, WIDTH)
 #define PTYPE paste(paste(int, WIDTH), _t)
 #define NAME paste(AtomicInt, WIDTH)
+#define KIND 'i'
 #define FROM PyLong_FromLongLong
 #else /* SIGNED */
 #define PTYPE paste(paste(uint, WIDTH), _t)
 #define FORMAT paste(PRIu, WIDTH)
 #define NAME paste(AtomicUInt, WIDTH)
+#define KIND 'u'
 #define FROM PyLong_FromUnsignedLongLong
 #endif /* SIGNED */
 #define OBJECT paste(NAME, OBJECT)
@@ -69,31 +72,21 @@ static PyObject *SET(OBJECT *self, PyObject *arg)
 	Py_RETURN_NONE;
 }
 
-#define ADD paste(NAME, _add)
-static PyObject *ADD(OBJECT *self, PyObject *args, PyObject *kwds)
+#define DO_ADD paste(NAME, _do_add)
+static PyObject *DO_ADD(OBJECT *self, PTYPE amount, bool raise)
 {
-	PTYPE amount, old;
-
-	char *keywords[] = { "amount", "raise_on_overflow", NULL };
-	int raise = 1;
-	PyObject *amount_obj;
-
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|p", keywords,
-					 &amount_obj, &raise))
-		return NULL;
-
-	amount = AS(amount_obj);
-	if (PyErr_Occurred())
-		return NULL;
+	PTYPE old;
 
 #ifdef DOUBLE
 	PTYPE new;
 
-	do {
-		old = atomic_load((_Atomic PTYPE *)self->shm.buf);
+	old = atomic_load((_Atomic PTYPE *)self->shm.buf);
+	new = old + amount;
+	while (!atomic_compare_exchange_weak((_Atomic PTYPE *)self->shm.buf,
+					     &old, new)) {
+		stat_inc(STAT_CAS_RETRIES);
 		new = old + amount;
-	} while (!atomic_compare_exchange_weak((_Atomic PTYPE *)self->shm.buf,
-					       &old, new));
+	}
 #else
 	PTYPE dummy;
 
@@ -112,6 +105,72 @@ static PyObject *ADD(OBJECT *self, PyObject *args, PyObject *kwds)
 	return FROM(old);
 }
 
+#define ADD paste(NAME, _add)
+static PyObject *ADD(OBJECT *self, PyObject *const *args, Py_ssize_t nargs,
+		     PyObject *kwnames)
+{
+	static const char *const keywords[] = {
+		"amount", "raise_on_overflow", NULL
+	};
+	PyObject *argv[2] = { NULL, NULL };
+	PTYPE amount;
+	int raise = 1;
+
+	/* Skip the keyword machinery for the common add(amount) */
+	if (nargs == 1 && !kwnames)
+		argv[0] = args[0];
+	else if (PyArg_UnpackFastcall("add", args, nargs, kwnames, keywords, 1,
+				      argv))
+		return NULL;
+
+	amount = AS(argv[0]);
+	if (PyErr_Occurred())
+		return NULL;
+
+	if (argv[1]) {
+		raise = PyObject_IsTrue(argv[1]);
+		if (raise < 0)
+			return NULL;
+	}
+
+	return DO_ADD(self, amount, raise);
+}
+
+#include "sum.h"
+
+#define ADD_MANY paste(NAME, _add_many)
+static PyObject *ADD_MANY(OBJECT *self, PyObject *arg)
+{
+	PTYPE total;
+
+	if (SUM(arg, &total))
+		return NULL;
+	return DO_ADD(self, total, true);
+}
+
+#define INC paste(NAME, _inc)
+static PyObject *INC(OBJECT *self, PyObject *Py_UNUSED(ignored))
+{
+	return DO_ADD(self, 1, true);
+}
+
+#define DEC paste(NAME, _dec)
+static PyObject *DEC(OBJECT *self, PyObject *Py_UNUSED(ignored))
+{
+#if defined(DOUBLE) || defined(SIGNED)
+	return DO_ADD(self, -1, true);
+#else
+	PTYPE old = atomic_fetch_sub((_Atomic PTYPE *)self->shm.buf, 1);
+
+	if (!old) {
+		PyErr_SetString(PyExc_OverflowError,
+				"0 - 1 too small to fit in " stringify(PTYPE));
+		return NULL;
+	}
+	return FROM(old);
+#endif
+}
+
 #define METHODS paste(NAME, _methods)
 static PyMethodDef METHODS[] = {
 	{ 
@@ -129,9 +188,27 @@ static PyMethodDef METHODS[] = {
 	{
 		.ml_name = "add",
 		.ml_meth = (PyCFunction)ADD,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = "Add a number to the value",
 	},
+	{
+		.ml_name = "add_many",
+		.ml_meth = (PyCFunction)ADD_MANY,
+		.ml_flags = METH_O,
+		.ml_doc = "Add the sum of an iterable (or buffer) of numbers to the value",
+	},
+	{
+		.ml_name = "inc",
+		.ml_meth = (PyCFunction)INC,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Add one to the value",
+	},
+	{
+		.ml_name = "dec",
+		.ml_meth = (PyCFunction)DEC,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Subtract one from the value",
+	},
 	{ /* Sentinel */ },
 };
 
@@ -161,7 +238,8 @@ static int TYPE_ADD(PyObject *m)
 
 		Py_INCREF(Py_None);
 		ret = PyModule_AddObject(m, stringify(NAME), Py_None);
-		Py_DECREF(Py_None);
+		if (ret)
+			Py_DECREF(Py_None);
 		return ret;
 	}
 
@@ -202,7 +280,12 @@ static int TYPE_ADD(PyObject *m)
 #undef INIT
 #undef GET
 #undef SET
+#undef DO_ADD
 #undef ADD
+#undef SUM
+#undef ADD_MANY
+#undef INC
+#undef DEC
 #undef METHODS
 #undef TYPE
 #undef TYPE_ADD
@@ -212,4 +295,5 @@ static int TYPE_ADD(PyObject *m)
 #undef NAME
 #undef OBJECT
 #undef AS
+#undef KIND
 #undef FROM
@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+"""Benchmarks for mpmetrics.
+
+Each result is written as one line of JSON, so that results from different
+versions can be compared with standard tools. The first line describes the
+machine the benchmarks were run on.
+"""
+
+import argparse
+import functools
+import json
+import multiprocessing
+import os
+import platform
+import sys
+import time
+import timeit
+
+from prometheus_client import exposition as _exposition, registry as _registry
+
+import _mpmetrics
+from mpmetrics import Counter, ExponentialHistogram, Histogram, WindowedCounter
+from mpmetrics.atomic import FIXED_FRAC_BITS, AtomicDouble, AtomicFixed, AtomicUInt64
+from mpmetrics.exposition import generate_latest
+from mpmetrics.heap import Heap
+from mpmetrics.snapshot import Encoder
+from mpmetrics.types import Box
+
+def emit(out, benchmark, name, **results):
+    json.dump({ 'benchmark': benchmark, 'name': name, **results }, out)
+    out.write('\n')
+    out.flush()
+
+def latency(stmt, number, repeat=5):
+    """Return the best time per call, in nanoseconds"""
+    return min(timeit.repeat(stmt, number=number, repeat=repeat)) / number * 1e9
+
+def bench_latency(out, heap, registry, number):
+    a = Box[AtomicUInt64](heap)
+    d = Box[AtomicDouble](heap)
+    f = Box[AtomicFixed[FIXED_FRAC_BITS]](heap)
+    lock = Box[_mpmetrics.Lock](heap)
+    futex = Box[_mpmetrics.FutexLock](heap)
+    counter = Counter('latency_counter', 'help', registry=registry)
+    histogram = Histogram('latency_histogram', 'help', registry=registry)
+    fixed = Histogram('latency_fixed', 'help', registry=registry, fixed_sum=True)
+    exponential = ExponentialHistogram('latency_exponential', 'help', registry=registry)
+    windowed = WindowedCounter('latency_windowed', 'help', registry=registry)
+    labeled = Counter('latency_labeled', 'help', ('l',), registry=registry)
+    labeled.labels('x')
+
+    def acquire_release():
+        lock.acquire()
+        lock.release()
+
+    def futex_acquire_release():
+        futex.acquire()
+        futex.release()
+
+    benchmarks = {
+        'AtomicUInt64.add': lambda: a.add(1),
+        'AtomicDouble.add': lambda: d.add(1.0),
+        'AtomicFixed.add': lambda: f.add(1.0),
+        'Lock.acquire/release': acquire_release,
+        'FutexLock.acquire/release': futex_acquire_release,
+        'Counter.inc': counter.inc,
+        'WindowedCounter.inc': windowed.inc,
+        'Histogram.observe': lambda: histogram.observe(0.3),
+        'Histogram.observe (fixed_sum)': lambda: fixed.observe(0.3),
+        'ExponentialHistogram.observe': lambda: exponential.observe(0.3),
+        'labels': lambda: labeled.labels('x'),
+        'labels (by name)': lambda: labeled.labels(l='x'),
+    }
+
+    for name, stmt in benchmarks.items():
+        emit(out, 'latency', name, ns_per_op=latency(stmt, number))
+
+def _scaling_worker(op, barrier, times, count):
+    barrier.wait()
+    start = time.perf_counter()
+    for _ in range(count):
+        op()
+    times.put((start, time.perf_counter()))
+
+def bench_scaling(out, max_procs, count):
+    ctx = multiprocessing.get_context('fork')
+    procs = sorted({ *(1 << i for i in range(max_procs.bit_length())), max_procs })
+    variants = {
+        'Counter.inc': (Counter, {}),
+        'Counter.inc (sharded)': (Counter, { 'sharded': True }),
+        'Counter.inc (buffered)': (Counter, { 'buffered': True }),
+        'Histogram.observe': (Histogram, {}),
+        'Histogram.observe (fixed_sum)': (Histogram, { 'fixed_sum': True }),
+    }
+
+    for name, (cls, kwargs) in variants.items():
+        for n in procs:
+            registry = _registry.CollectorRegistry()
+            metric = cls('scaling', 'help', registry=registry, **kwargs)
+            op = metric.inc if cls is Counter else functools.partial(metric.observe, 0.3)
+            barrier = ctx.Barrier(n)
+            times = ctx.Queue()
+            workers = [ctx.Process(target=_scaling_worker,
+                                   args=(op, barrier, times, count))
+                       for _ in range(n)]
+            for worker in workers:
+                worker.start()
+
+            # perf_counter is system-wide, so we can compare times from each worker
+            starts, ends = zip(*(times.get() for _ in workers))
+            for worker in workers:
+                worker.join()
+            elapsed = max(ends) - min(starts)
+
+            emit(out, 'scaling', name, processes=n, ops_per_sec=n * count / elapsed)
+
+def bench_scrape(out, max_series, number):
+    series = 10
+    while series <= max_series:
+        registry = _registry.CollectorRegistry()
+        registry.heap = Heap()
+        counter = Counter('scrape_counter', 'help', ('l',), registry=registry)
+        histogram = Histogram('scrape_histogram', 'help', ('l',), registry=registry)
+        for i in range(series // 2):
+            counter.labels(str(i)).inc()
+            histogram.labels(str(i)).observe(i)
+
+        emit(out, 'scrape', 'generate_latest', series=series,
+             ms=latency(lambda: generate_latest(registry), number, 3) / 1e6)
+        emit(out, 'scrape', 'prometheus_client.generate_latest', series=series,
+             ms=latency(lambda: _exposition.generate_latest(registry), number, 3) / 1e6)
+
+        encoder = Encoder(registry.heap)
+        emit(out, 'scrape', 'Encoder.encode (full)', series=series,
+             ms=latency(lambda: encoder.encode(full=True), number, 3) / 1e6,
+             bytes=len(encoder.encode(full=True)))
+        counter.labels('0').inc()
+        emit(out, 'scrape', 'Encoder.encode (delta)', series=series,
+             ms=latency(encoder.encode, number, 3) / 1e6)
+        series *= 10
+
+BENCHMARKS = ('latency', 'scaling', 'scrape')
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('-o', '--output', type=argparse.FileType('w'), default=sys.stdout,
+                        help="file to write results to (default: stdout)")
+    parser.add_argument('-j', '--processes', type=int, default=os.cpu_count() or 1,
+                        help="maximum number of processes for scaling benchmarks")
+    parser.add_argument('-q', '--quick', action='store_true',
+                        help="run fewer iterations, for a quick sanity check")
+    parser.add_argument('benchmarks', nargs='*', metavar='BENCHMARK',
+                        help="benchmarks to run (latency, scaling, or scrape; default: all)")
+    args = parser.parse_args()
+    benchmarks = args.benchmarks or BENCHMARKS
+    for benchmark in benchmarks:
+        if benchmark not in BENCHMARKS:
+            parser.error(f"unknown benchmark {benchmark}")
+
+    divisor = 100 if args.quick else 1
+    emit(args.output, 'machine', platform.node(),
+         python=platform.python_version(), machine=platform.machine(),
+         cpus=os.cpu_count(), time=time.time())
+
+    if 'latency' in benchmarks:
+        bench_latency(args.output, Heap(), _registry.CollectorRegistry(), 100000 // divisor)
+    if 'scaling' in benchmarks:
+        bench_scaling(args.output, args.processes, 1000000 // divisor)
+    if 'scrape' in benchmarks:
+        bench_scrape(args.output, 1000 if args.quick else 10000, 1 if args.quick else 10)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <string.h>
+
+/* A growable output buffer, which is kept around between uses */
+struct buffer {
+	char *data;
+	size_t len, cap;
+};
+
+static inline int buffer_reserve(struct buffer *buf, size_t len)
+{
+	size_t cap = buf->cap ? buf->cap : 4096;
+	char *data;
+
+	if (buf->len + len <= buf->cap)
+		return 0;
+
+	while (cap < buf->len + len)
+		cap *= 2;
+
+	data = PyMem_Realloc(buf->data, cap);
+	if (!data) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	buf->data = data;
+	buf->cap = cap;
+	return 0;
+}
+
+static inline int buffer_write(struct buffer *buf, const char *data, size_t len)
+{
+	if (buffer_reserve(buf, len))
+		return -1;
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+static inline int buffer_puts(struct buffer *buf, const char *s)
+{
+	return buffer_write(buf, s, strlen(s));
+}
+
+#endif /* BUFFER_H */
@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+/*
+ * Readers for the catalog of metrics in a heap (see mpmetrics/heap.py), for
+ * code which maps the heap's file instead of going through Python objects.
+ * The catalog is a list of families, each with a list of series. Entries are
+ * only ever appended (with release stores), so it can be walked without
+ * taking any locks. Every offset is checked before it is used, since the heap
+ * is shared with (and may be corrupted by) other processes.
+ *
+ * Removed families and series are retired instead of being unlinked, and a
+ * retired series is revived (pointing at new data) if its labels are added
+ * again. The data of a retired series is freed once every Python process has
+ * stopped using it, but the exporter isn't one of them, so a series which is
+ * removed while it is being read may have garbage values.
+ *
+ * Values are read without taking snapshots. Each one is read atomically, but
+ * a histogram's buckets may be inconsistent with its count, and buffered
+ * metrics only include updates which have already been published.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fixed.h"
+#include "histogram.h"
+
+#define HEAP_MAGIC 0x63697274656d706dULL /* "mpmetric" */
+/* Must match VERSION in mpmetrics/heap.py */
+#define HEAP_VERSION 11
+
+/* These must match mpmetrics/heap.py */
+enum export_kind {
+	EXPORT_UINT64 = 1,
+	EXPORT_SHARDED_UINT64 = 2,
+	EXPORT_DOUBLE = 3,
+	EXPORT_HISTOGRAM = 4,
+};
+
+struct heap_header {
+	uint64_t magic;
+	uint64_t version;
+	uint64_t map_size;
+	uint64_t reserve;
+	_Atomic uint64_t catalog;
+};
+
+struct family {
+	_Atomic uint64_t next;
+	_Atomic uint64_t series;
+	uint64_t last;
+	_Atomic uint64_t retired;
+	uint64_t name_len, help_len, type_len;
+	char text[];
+};
+
+struct series {
+	_Atomic uint64_t next;
+	_Atomic uint64_t retired;
+	uint64_t kind, data, created, count, stride, labels_len;
+	char labels[];
+};
+
+struct catalog {
+	const char *base;
+	size_t len;
+};
+
+/* Get a pointer to size bytes at off, or NULL if they are out of bounds */
+static inline const void *catalog_deref(const struct catalog *c, uint64_t off,
+					uint64_t size)
+{
+	if (off > c->len || size > c->len - off)
+		return NULL;
+	return c->base + off;
+}
+
+/* Returns an error message if c doesn't hold a heap we understand */
+static inline const char *catalog_check(const struct catalog *c)
+{
+	const struct heap_header *hdr = catalog_deref(c, 0, sizeof(*hdr));
+
+	if (!hdr || hdr->magic != HEAP_MAGIC)
+		return "not a heap";
+	if (hdr->version != HEAP_VERSION)
+		return "unsupported heap layout version";
+	return NULL;
+}
+
+static inline uint64_t catalog_first(const struct catalog *c)
+{
+	const struct heap_header *hdr = (const void *)c->base;
+
+	return atomic_load_explicit(&hdr->catalog, memory_order_acquire);
+}
+
+/* Get the family at off, or NULL if it (or its text) is out of bounds */
+static inline const struct family *catalog_family(const struct catalog *c,
+						  uint64_t off)
+{
+	const struct family *f = catalog_deref(c, off, sizeof(*f));
+
+	if (!f || f->name_len > c->len || f->help_len > c->len ||
+	    f->type_len > c->len ||
+	    !catalog_deref(c, off + sizeof(*f),
+			   f->name_len + f->help_len + f->type_len))
+		return NULL;
+	return f;
+}
+
+static inline bool family_retired(const struct family *f)
+{
+	return atomic_load_explicit(&f->retired, memory_order_relaxed);
+}
+
+static inline uint64_t family_next(const struct family *f)
+{
+	return atomic_load_explicit(&f->next, memory_order_acquire);
+}
+
+static inline uint64_t family_first(const struct family *f)
+{
+	return atomic_load_explicit(&f->series, memory_order_acquire);
+}
+
+static inline const char *family_help(const struct family *f)
+{
+	return f->text + f->name_len;
+}
+
+static inline const char *family_type(const struct family *f)
+{
+	return f->text + f->name_len + f->help_len;
+}
+
+static inline bool family_is(const struct family *f, const char *type)
+{
+	return f->type_len == strlen(type) &&
+	       !memcmp(family_type(f), type, f->type_len);
+}
+
+/* Get the series at off, or NULL if it (or its labels) are out of bounds */
+static inline const struct series *catalog_series(const struct catalog *c,
+						  uint64_t off)
+{
+	const struct series *s = catalog_deref(c, off, sizeof(*s));
+
+	if (!s || !catalog_deref(c, off + sizeof(*s), s->labels_len))
+		return NULL;
+	return s;
+}
+
+static inline uint64_t series_next(const struct series *s)
+{
+	return atomic_load_explicit(&s->next, memory_order_acquire);
+}
+
+static inline bool series_retired(const struct series *s)
+{
+	/* Pairs with reviving the series, so we see its new data */
+	return atomic_load_explicit(&s->retired, memory_order_acquire);
+}
+
+/*
+ * Each series is read as a fixed number of values. Histograms have their
+ * buckets (not cumulative), then their count, and then their sum. Everything
+ * else has just one value. Only histogram sums and EXPORT_DOUBLE values are
+ * doubles; the rest are integers.
+ */
+static inline size_t series_values(const struct series *s)
+{
+	return s->kind == EXPORT_HISTOGRAM ? s->count + 2 : 1;
+}
+
+static inline bool series_value_is_double(const struct series *s, size_t i)
+{
+	if (s->kind == EXPORT_HISTOGRAM)
+		return i == s->count + 1;
+	return s->kind == EXPORT_DOUBLE;
+}
+
+static inline uint64_t double_bits(double d)
+{
+	uint64_t bits;
+
+	memcpy(&bits, &d, sizeof(bits));
+	return bits;
+}
+
+static inline double bits_double(uint64_t bits)
+{
+	double d;
+
+	memcpy(&d, &bits, sizeof(d));
+	return d;
+}
+
+/*
+ * Get a histogram's thresholds, or NULL if it is out of bounds (or invalid).
+ * The data halves (which together hold every observation) follow the
+ * thresholds. The saved halves are only used by snapshots, so we ignore them.
+ * For histograms, stride is the number of fractional bits in their
+ * fixed-point sums, or 0 if their sums are doubles.
+ */
+static inline const double *series_thresholds(const struct catalog *c,
+					      const struct series *s)
+{
+	if (s->kind != EXPORT_HISTOGRAM || s->count > c->len ||
+	    s->stride > FIXED_MAX_FRAC_BITS)
+		return NULL;
+	return catalog_deref(c, s->data, histogram_half_offset(s->count, 2));
+}
+
+static inline const struct histogram_half *
+series_half(const struct series *s, const double *thresholds, unsigned int i)
+{
+	return (const void *)((const char *)thresholds +
+			      histogram_half_offset(s->count, i));
+}
+
+/*
+ * Read the values of a series into values (which must have room for
+ * series_values). Doubles are stored as their bits. Returns false if the
+ * series is invalid.
+ */
+static inline bool series_read(const struct catalog *c, const struct series *s,
+			       uint64_t *values)
+{
+	const struct histogram_half *halves[2];
+	const double *thresholds;
+	const void *data;
+	uint64_t i, total = 0;
+
+	switch (s->kind) {
+	case EXPORT_UINT64:
+		if (!(data = catalog_deref(c, s->data, sizeof(uint64_t))))
+			return false;
+		values[0] = atomic_load_explicit((_Atomic uint64_t *)data,
+						 memory_order_relaxed);
+		return true;
+	case EXPORT_SHARDED_UINT64:
+		if (!s->count || s->count > c->len ||
+		    s->stride < sizeof(uint64_t) || s->stride > c->len ||
+		    !(data = catalog_deref(c, s->data, s->count * s->stride)))
+			return false;
+		for (i = 0; i < s->count; i++)
+			total += atomic_load_explicit((_Atomic uint64_t *)
+						      ((char *)data + i * s->stride),
+						      memory_order_relaxed);
+		values[0] = total;
+		return true;
+	case EXPORT_DOUBLE:
+		if (!(data = catalog_deref(c, s->data, sizeof(double))))
+			return false;
+		values[0] = double_bits(atomic_load_explicit((_Atomic double *)data,
+							     memory_order_relaxed));
+		return true;
+	case EXPORT_HISTOGRAM:
+		if (!(thresholds = series_thresholds(c, s)))
+			return false;
+
+		halves[0] = series_half(s, thresholds, 0);
+		halves[1] = series_half(s, thresholds, 1);
+		for (i = 0; i < s->count; i++)
+			values[i] = atomic_load_explicit(&halves[0]->buckets[i],
+							 memory_order_relaxed) +
+				    atomic_load_explicit(&halves[1]->buckets[i],
+							 memory_order_relaxed);
+		values[s->count] =
+			atomic_load_explicit(&halves[0]->count, memory_order_relaxed) +
+			atomic_load_explicit(&halves[1]->count, memory_order_relaxed);
+		if (s->stride)
+			values[s->count + 1] = double_bits(fixed_to_double(
+				fixed_add(atomic_load_explicit(&halves[0]->fixed_sum,
+							       memory_order_relaxed),
+					  atomic_load_explicit(&halves[1]->fixed_sum,
+							       memory_order_relaxed)),
+				s->stride));
+		else
+			values[s->count + 1] = double_bits(
+				atomic_load_explicit(&halves[0]->sum, memory_order_relaxed) +
+				atomic_load_explicit(&halves[1]->sum, memory_order_relaxed));
+		return true;
+	}
+	return false;
+}
+
+/* Get the creation time of a series, or 0 if it doesn't have one */
+static inline double series_created(const struct catalog *c,
+				    const struct series *s)
+{
+	const double *created;
+
+	if (!s->created ||
+	    !(created = catalog_deref(c, s->created, sizeof(double))))
+		return 0;
+	return *created;
+}
+
+#endif /* CATALOG_H */
@@ -0,0 +1,339 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "_mpmetrics.h"
+
+/* OpenMetrics limits the names and values of an exemplar's labels to this */
+#define EXEMPLAR_MAX_CHARS 128
+/* Enough for typical (ASCII) trace IDs, while keeping records small */
+#define EXEMPLAR_LABELS_SIZE 168
+/* Give up reading a record if it is being rewritten this many times */
+#define EXEMPLAR_READ_TRIES 100
+
+/*
+ * Each exemplar record is protected by a sequence count, which is odd while
+ * the record is being written. Writers which find the record busy drop their
+ * exemplar instead of waiting, so recording an exemplar never blocks. Readers
+ * retry if the sequence count changed while they were copying the record.
+ *
+ * Labels are stored as alternating names and values, each terminated by a
+ * NUL.
+ */
+struct exemplar {
+	_Atomic uint32_t seq;
+	uint32_t len;
+	double value;
+	double timestamp;
+	char labels[EXEMPLAR_LABELS_SIZE];
+};
+
+typedef struct {
+	PyObject_HEAD
+	Py_buffer shm;
+	Py_ssize_t count;
+	unsigned long sample_every, calls;
+} ExemplarsObject;
+
+static struct exemplar *Exemplars_lookup(ExemplarsObject *self,
+					 PyObject *index)
+{
+	Py_ssize_t i = PyNumber_AsSsize_t(index, PyExc_IndexError);
+
+	if (i == -1 && PyErr_Occurred())
+		return NULL;
+
+	if (i < 0)
+		i += self->count;
+	if (i < 0 || i >= self->count) {
+		PyErr_SetString(PyExc_IndexError, "index out of range");
+		return NULL;
+	}
+	return (struct exemplar *)self->shm.buf + i;
+}
+
+static int Exemplars_setup(ExemplarsObject *self)
+{
+	size_t count, sample_every;
+
+	if (PyObject_GetSizeAttr((PyObject *)self, "count", &count) ||
+	    PyObject_GetSizeAttr((PyObject *)self, "sample_every",
+				 &sample_every))
+		return -1;
+
+	if (!sample_every || sample_every > ULONG_MAX) {
+		PyErr_Format(PyExc_ValueError, "invalid sample_every %zu",
+			     sample_every);
+		return -1;
+	}
+
+	if ((size_t)self->shm.len / sizeof(struct exemplar) < count) {
+		PyErr_Format(PyExc_ValueError,
+			     "shared memory (%zd bytes) too small for %zu exemplars",
+			     self->shm.len, count);
+		return -1;
+	}
+
+	self->count = count;
+	self->sample_every = sample_every;
+	/* Always record the first exemplar */
+	self->calls = 0;
+	return 0;
+}
+
+static int Exemplars_init(ExemplarsObject *self, PyObject *args,
+			  PyObject *kwds)
+{
+	Py_ssize_t i;
+
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return -1;
+
+	if (Exemplars_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return -1;
+	}
+
+	for (i = 0; i < self->count; i++)
+		atomic_init(&((struct exemplar *)self->shm.buf)[i].seq, 0);
+	return 0;
+}
+
+static PyObject *Exemplars_setstate(ExemplarsObject *self, PyObject *args,
+				    PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return NULL;
+
+	if (Exemplars_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static int exemplar_labels_append(char *labels, size_t *len, Py_ssize_t *chars,
+				  PyObject *obj)
+{
+	const char *data;
+	Py_ssize_t size;
+
+	if (!PyUnicode_Check(obj)) {
+		PyErr_SetString(PyExc_TypeError,
+				"exemplar label names and values must be strings");
+		return -1;
+	}
+
+	data = PyUnicode_AsUTF8AndSize(obj, &size);
+	if (!data)
+		return -1;
+
+	*chars += PyUnicode_GET_LENGTH(obj);
+	if (*chars > EXEMPLAR_MAX_CHARS) {
+		PyErr_Format(PyExc_ValueError,
+			     "exemplar labels may have at most %d characters",
+			     EXEMPLAR_MAX_CHARS);
+		return -1;
+	}
+
+	if (memchr(data, '\0', size) ||
+	    (size_t)size + 1 > EXEMPLAR_LABELS_SIZE - *len) {
+		PyErr_SetString(PyExc_ValueError,
+				"exemplar labels too large to store");
+		return -1;
+	}
+
+	memcpy(labels + *len, data, size + 1);
+	*len += size + 1;
+	return 0;
+}
+
+static PyObject *Exemplars_record(ExemplarsObject *self,
+				  PyObject *const *args, Py_ssize_t nargs,
+				  PyObject *kwnames)
+{
+	static const char *const keywords[] = {
+		"index", "labels", "value", "timestamp", NULL
+	};
+	PyObject *argv[4] = { NULL }, *key, *val;
+	char labels[EXEMPLAR_LABELS_SIZE];
+	struct exemplar *record;
+	double value, timestamp;
+	Py_ssize_t pos = 0, chars = 0;
+	size_t len = 0;
+	uint32_t seq;
+
+	if (PyArg_UnpackFastcall("record", args, nargs, kwnames, keywords, 3,
+				 argv))
+		return NULL;
+
+	/* Skip all the work for unsampled exemplars */
+	if (self->calls++ % self->sample_every)
+		Py_RETURN_FALSE;
+
+	record = Exemplars_lookup(self, argv[0]);
+	if (!record)
+		return NULL;
+
+	if (!PyDict_Check(argv[1])) {
+		PyErr_SetString(PyExc_TypeError, "exemplar labels must be a dict");
+		return NULL;
+	}
+
+	while (PyDict_Next(argv[1], &pos, &key, &val))
+		if (exemplar_labels_append(labels, &len, &chars, key) ||
+		    exemplar_labels_append(labels, &len, &chars, val))
+			return NULL;
+
+	value = PyFloat_AsDouble(argv[2]);
+	if (value == -1.0 && PyErr_Occurred())
+		return NULL;
+
+	if (argv[3] && argv[3] != Py_None) {
+		timestamp = PyFloat_AsDouble(argv[3]);
+		if (timestamp == -1.0 && PyErr_Occurred())
+			return NULL;
+	} else {
+		struct timespec now;
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		timestamp = now.tv_sec + (double)now.tv_nsec / NSEC_PER_SEC;
+	}
+
+	seq = atomic_load_explicit(&record->seq, memory_order_relaxed);
+	if ((seq & 1) ||
+	    !atomic_compare_exchange_strong_explicit(&record->seq, &seq,
+						     seq + 1,
+						     memory_order_relaxed,
+						     memory_order_relaxed))
+		Py_RETURN_FALSE;
+
+	/* Don't let the record be written before it's marked as busy */
+	atomic_thread_fence(memory_order_release);
+	record->len = len;
+	record->value = value;
+	record->timestamp = timestamp;
+	memcpy(record->labels, labels, len);
+	atomic_store_explicit(&record->seq, seq + 2, memory_order_release);
+	Py_RETURN_TRUE;
+}
+
+static PyObject *Exemplars_get(ExemplarsObject *self, PyObject *index)
+{
+	struct exemplar *record = Exemplars_lookup(self, index);
+	struct exemplar copy;
+	PyObject *labels;
+	size_t pos = 0;
+	int tries;
+
+	if (!record)
+		return NULL;
+
+	for (tries = 0; tries < EXEMPLAR_READ_TRIES; tries++) {
+		uint32_t seq = atomic_load_explicit(&record->seq,
+						    memory_order_acquire);
+
+		if (!seq)
+			Py_RETURN_NONE;
+		if (seq & 1)
+			continue;
+
+		memcpy(&copy, record, sizeof(copy));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&record->seq, memory_order_relaxed) == seq)
+			break;
+	}
+
+	/* Either it's very busy, or its writer died */
+	if (tries == EXEMPLAR_READ_TRIES)
+		Py_RETURN_NONE;
+
+	labels = PyDict_New();
+	if (!labels)
+		return NULL;
+
+	while (pos < copy.len && copy.len <= EXEMPLAR_LABELS_SIZE) {
+		const char *name = copy.labels + pos;
+		const char *value = name + strlen(name) + 1;
+		PyObject *val;
+		int err;
+
+		pos = value - copy.labels + strlen(value) + 1;
+		val = PyUnicode_FromString(value);
+		if (!val) {
+			Py_DECREF(labels);
+			return NULL;
+		}
+
+		err = PyDict_SetItemString(labels, name, val);
+		Py_DECREF(val);
+		if (err) {
+			Py_DECREF(labels);
+			return NULL;
+		}
+	}
+
+	return Py_BuildValue("(Ndd)", labels, copy.value, copy.timestamp);
+}
+
+static PyMethodDef Exemplars_methods[] = {
+	{
+		.ml_name = "_setstate",
+		.ml_meth = (PyCFunction)Exemplars_setstate,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+	},
+	{
+		.ml_name = "record",
+		.ml_meth = (PyCFunction)Exemplars_record,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Record an exemplar (given its labels, value, and optional timestamp) at an index. Only one in sample_every calls records anything. Returns whether the exemplar was recorded.",
+	},
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)Exemplars_get,
+		.ml_flags = METH_O,
+		.ml_doc = "Get the (labels, value, timestamp) of the exemplar at an index, or None",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject ExemplarsType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(ExemplarsObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.Exemplars",
+	.tp_doc = "Fixed-size exemplar records, which may be written without blocking",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)Exemplars_init,
+	.tp_methods = Exemplars_methods,
+};
+
+int ExemplarsType_Add(PyObject *m)
+{
+	int ret;
+
+	if (PyType_AddSizeConstant(&ExemplarsType, "record_size",
+				   sizeof(struct exemplar)))
+		return -1;
+
+	if (PyType_AddSizeConstant(&ExemplarsType, "align",
+				   _Alignof(struct exemplar)))
+		return -1;
+
+	ExemplarsType.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	ret = PyModule_AddType(m, &ExemplarsType);
+	Py_DECREF(&BufferType);
+	return ret;
+}
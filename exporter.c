@@ -0,0 +1,518 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+/*
+ * Standalone exporter, which serves the metrics in a heap without involving
+ * any of the processes using it. The heap is mapped read-only, and metrics
+ * are found by walking its catalog (see catalog.h). The output matches
+ * generate_latest, except that metrics with windows or quantiles are skipped.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "format.h"
+
+#define REQUEST_SIZE 8192
+#define TIMEOUT_SEC 10
+
+struct buffer {
+	char *data;
+	size_t len, cap;
+};
+
+static void buffer_reserve(struct buffer *buf, size_t len)
+{
+	size_t cap = buf->cap ? buf->cap : 4096;
+
+	if (buf->len + len <= buf->cap)
+		return;
+
+	while (cap < buf->len + len)
+		cap *= 2;
+
+	buf->data = realloc(buf->data, cap);
+	if (!buf->data) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	buf->cap = cap;
+}
+
+static void buffer_write(struct buffer *buf, const char *data, size_t len)
+{
+	buffer_reserve(buf, len);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void buffer_puts(struct buffer *buf, const char *s)
+{
+	buffer_write(buf, s, strlen(s));
+}
+
+/* Like prometheus_client.utils.floatToGoString (see format.h) */
+static void buffer_write_double(struct buffer *buf, double d)
+{
+	char s[FORMAT_DOUBLE_SIZE];
+
+	buffer_write(buf, s, format_double(s, d));
+}
+
+/*
+ * Write a label set, given NUL-terminated name="value" strings sorted by
+ * name. If extra_name is not NULL, an extra label is inserted in sorted order
+ * (just like buffer_write_labels in exposition.c).
+ */
+static void buffer_write_labels(struct buffer *buf, const char *labels,
+				size_t labels_len, const char *extra_name,
+				double extra_value)
+{
+	const char *end = labels + labels_len;
+	bool first = true;
+
+	if (!labels_len && !extra_name)
+		return;
+
+	buffer_puts(buf, "{");
+	for (;;) {
+		const char *label = labels < end ? labels : NULL;
+		size_t len = label ? strnlen(label, end - label) : 0;
+
+		if (extra_name) {
+			size_t name_len = strlen(extra_name);
+			const char *eq = label ? memchr(label, '=', len) : NULL;
+			size_t label_len = eq ? (size_t)(eq - label) : len;
+			int cmp = label ? memcmp(label, extra_name,
+						 label_len < name_len ?
+						 label_len : name_len) : 1;
+
+			if (!cmp)
+				cmp = (label_len > name_len) - (label_len < name_len);
+
+			if (cmp > 0) {
+				if (!first)
+					buffer_puts(buf, ",");
+				buffer_puts(buf, extra_name);
+				buffer_puts(buf, "=\"");
+				buffer_write_double(buf, extra_value);
+				buffer_puts(buf, "\"");
+				extra_name = NULL;
+				first = false;
+			}
+		}
+
+		if (!label)
+			break;
+
+		if (!first)
+			buffer_puts(buf, ",");
+		buffer_write(buf, label, len);
+		first = false;
+		labels += len + 1;
+	}
+	buffer_puts(buf, "}");
+}
+
+struct heap {
+	int fd;
+	struct catalog c;
+};
+
+static int heap_remap(struct heap *heap)
+{
+	struct stat st;
+
+	if (fstat(heap->fd, &st)) {
+		perror("fstat");
+		return -1;
+	}
+
+	if ((size_t)st.st_size == heap->c.len)
+		return 0;
+
+	if (heap->c.base)
+		munmap((void *)heap->c.base, heap->c.len);
+	heap->c.base = NULL;
+	heap->c.len = 0;
+
+	heap->c.base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, heap->fd, 0);
+	if (heap->c.base == MAP_FAILED) {
+		heap->c.base = NULL;
+		perror("mmap");
+		return -1;
+	}
+	heap->c.len = st.st_size;
+	return 0;
+}
+
+static void write_sample(struct buffer *buf, const struct family *f,
+			 const char *suffix, const struct series *s,
+			 const char *extra_name, double extra_value,
+			 double value)
+{
+	buffer_write(buf, f->text, f->name_len);
+	buffer_puts(buf, suffix);
+	buffer_write_labels(buf, s->labels, s->labels_len, extra_name,
+			    extra_value);
+	buffer_puts(buf, " ");
+	buffer_write_double(buf, value);
+	buffer_puts(buf, "\n");
+}
+
+static void write_histogram(struct buffer *buf, const struct family *f,
+			    const struct series *s, const double *thresholds,
+			    const uint64_t *values, bool summary)
+{
+	uint64_t i, cumulative = 0, count = values[s->count];
+	double sum = bits_double(values[s->count + 1]);
+
+	for (i = 0; !summary && i < s->count; i++) {
+		cumulative += values[i];
+		write_sample(buf, f, "_bucket", s, "le", thresholds[i],
+			     cumulative);
+	}
+
+	if (summary) {
+		write_sample(buf, f, "_count", s, NULL, 0, count);
+		write_sample(buf, f, "_sum", s, NULL, 0, sum);
+	} else {
+		write_sample(buf, f, "_sum", s, NULL, 0, sum);
+		write_sample(buf, f, "_count", s, NULL, 0, count);
+	}
+}
+
+static void write_family(struct buffer *out, struct buffer *created,
+			 const struct catalog *c, const struct family *f)
+{
+	static uint64_t *values;
+	static size_t values_len;
+	const char *suffix = "", *type;
+	uint64_t off, limit = c->len / sizeof(struct series);
+	bool header = false;
+
+	if (family_is(f, "counter")) {
+		suffix = "_total";
+		type = "counter";
+	} else if (family_is(f, "gauge")) {
+		type = "gauge";
+	} else if (family_is(f, "histogram")) {
+		type = "histogram";
+	} else if (family_is(f, "summary")) {
+		type = "summary";
+	} else {
+		return;
+	}
+
+	created->len = 0;
+	for (off = family_first(f); off && limit; limit--) {
+		const struct series *s = catalog_series(c, off);
+		const double *thresholds = NULL;
+		double timestamp;
+
+		if (!s)
+			break;
+		off = series_next(s);
+
+		if (series_retired(s))
+			continue;
+
+		if (s->kind == EXPORT_HISTOGRAM &&
+		    !(thresholds = series_thresholds(c, s)))
+			continue;
+
+		if (series_values(s) > values_len) {
+			values_len = series_values(s);
+			values = realloc(values, values_len * sizeof(*values));
+			if (!values) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (!series_read(c, s, values))
+			continue;
+
+		if (!header) {
+			buffer_puts(out, "# HELP ");
+			buffer_write(out, f->text, f->name_len);
+			buffer_puts(out, suffix);
+			buffer_puts(out, " ");
+			buffer_write(out, family_help(f), f->help_len);
+			buffer_puts(out, "\n# TYPE ");
+			buffer_write(out, f->text, f->name_len);
+			buffer_puts(out, suffix);
+			buffer_puts(out, " ");
+			buffer_puts(out, type);
+			buffer_puts(out, "\n");
+			header = true;
+		}
+
+		if (thresholds)
+			write_histogram(out, f, s, thresholds, values,
+					family_is(f, "summary"));
+		else if (s->kind == EXPORT_DOUBLE)
+			write_sample(out, f, suffix, s, NULL, 0,
+				     bits_double(values[0]));
+		else
+			write_sample(out, f, suffix, s, NULL, 0, values[0]);
+
+		if ((timestamp = series_created(c, s)))
+			write_sample(created, f, "_created", s, NULL, 0,
+				     timestamp);
+	}
+
+	/* Creation times go in their own gauge in Prometheus format */
+	if (created->len) {
+		buffer_puts(out, "# HELP ");
+		buffer_write(out, f->text, f->name_len);
+		buffer_puts(out, "_created ");
+		buffer_write(out, family_help(f), f->help_len);
+		buffer_puts(out, "\n# TYPE ");
+		buffer_write(out, f->text, f->name_len);
+		buffer_puts(out, "_created gauge\n");
+		buffer_write(out, created->data, created->len);
+	}
+}
+
+static int expose(struct buffer *out, struct heap *heap)
+{
+	static struct buffer created;
+	const struct catalog *c = &heap->c;
+	const char *err;
+	uint64_t off, limit;
+
+	out->len = 0;
+	if (heap_remap(heap))
+		return -1;
+
+	if ((err = catalog_check(c))) {
+		fprintf(stderr, "%s\n", err);
+		return -1;
+	}
+
+	limit = c->len / sizeof(struct family);
+	for (off = catalog_first(c); off && limit; limit--) {
+		const struct family *f = catalog_family(c, off);
+
+		if (!f)
+			break;
+
+		if (!family_retired(f))
+			write_family(out, &created, c, f);
+		off = family_next(f);
+	}
+	return 0;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, data, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void respond(int fd, const char *status, const char *type,
+		    const struct buffer *body, bool head)
+{
+	char header[256];
+	int len;
+
+	len = snprintf(header, sizeof(header),
+		       "HTTP/1.0 %s\r\n"
+		       "Content-Type: %s\r\n"
+		       "Content-Length: %zu\r\n"
+		       "Connection: close\r\n\r\n",
+		       status, type, body ? body->len : 0);
+	if (write_all(fd, header, len) || head || !body)
+		return;
+	write_all(fd, body->data, body->len);
+}
+
+static void handle(int fd, struct buffer *out, struct heap *heap)
+{
+	char request[REQUEST_SIZE], *path, *end;
+	size_t len = 0;
+	bool head;
+
+	while (len < sizeof(request) - 1) {
+		ssize_t ret = read(fd, request + len, sizeof(request) - 1 - len);
+
+		if (ret <= 0)
+			return;
+		len += ret;
+		request[len] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			break;
+	}
+
+	head = !strncmp(request, "HEAD ", 5);
+	if (!head && strncmp(request, "GET ", 4)) {
+		respond(fd, "405 Method Not Allowed", "text/plain", NULL,
+			false);
+		return;
+	}
+
+	path = strchr(request, ' ') + 1;
+	end = path + strcspn(path, " ?\r\n");
+	if ((size_t)(end - path) != strlen("/metrics") ||
+	    strncmp(path, "/metrics", end - path)) {
+		respond(fd, "404 Not Found", "text/plain", NULL, head);
+		return;
+	}
+
+	if (expose(out, heap)) {
+		respond(fd, "500 Internal Server Error", "text/plain", NULL,
+			head);
+		return;
+	}
+
+	respond(fd, "200 OK", "text/plain; version=0.0.4; charset=utf-8", out,
+		head);
+}
+
+static int listen_on(const char *address, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	}, *res, *ai;
+	int err, fd = -1;
+
+	err = getaddrinfo(address, port, &hints, &res);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", address ? address : "*",
+			gai_strerror(err));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		int one = 1;
+
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 16))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	if (fd < 0)
+		perror("bind");
+	return fd;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-a ADDRESS] [-p PORT] [-o] HEAP\n"
+		"Serve the metrics in HEAP (the file backing an mpmetrics heap)\n"
+		"\n"
+		"  -a ADDRESS  address to listen on (default: all)\n"
+		"  -p PORT     port to listen on (default: 8000)\n"
+		"  -o          write the metrics to stdout once, and exit\n",
+		argv0);
+}
+
+int main(int argc, char **argv)
+{
+	const char *address = NULL, *port = "8000";
+	struct heap heap = { 0 };
+	struct buffer out = { 0 };
+	bool once = false;
+	int opt, sock;
+
+	while ((opt = getopt(argc, argv, "a:p:oh")) != -1) {
+		switch (opt) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'o':
+			once = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	heap.fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (heap.fd < 0) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (once) {
+		if (expose(&out, &heap) || write_all(STDOUT_FILENO, out.data,
+						     out.len))
+			return EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
+
+	sock = listen_on(address, port);
+	if (sock < 0)
+		return EXIT_FAILURE;
+
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		struct timeval timeout = { .tv_sec = TIMEOUT_SEC };
+		int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				perror("accept");
+			continue;
+		}
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			   sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			   sizeof(timeout));
+		handle(fd, &out, &heap);
+		close(fd);
+	}
+}
@@ -0,0 +1,759 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "_mpmetrics.h"
+#include "buffer.h"
+#include "format.h"
+
+/*
+ * Writer for the Prometheus text and OpenMetrics exposition formats. The
+ * output matches prometheus_client's generate_latest (including float
+ * formatting), but is written directly into a reusable buffer instead of
+ * going through Metric and Sample objects.
+ */
+static int buffer_write_str(struct buffer *buf, PyObject *obj)
+{
+	const char *data;
+	Py_ssize_t len;
+
+	data = PyUnicode_AsUTF8AndSize(obj, &len);
+	if (!data)
+		return -1;
+	return buffer_write(buf, data, len);
+}
+
+/* Escape backslashes and newlines (and quotes, if quote is set) */
+static int buffer_write_escaped(struct buffer *buf, PyObject *obj, bool quote)
+{
+	const char *data;
+	Py_ssize_t len, i, start = 0;
+
+	data = PyUnicode_AsUTF8AndSize(obj, &len);
+	if (!data)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		const char *escape;
+
+		if (data[i] == '\\')
+			escape = "\\\\";
+		else if (data[i] == '\n')
+			escape = "\\n";
+		else if (quote && data[i] == '"')
+			escape = "\\\"";
+		else
+			continue;
+
+		if (buffer_write(buf, data + start, i - start) ||
+		    buffer_puts(buf, escape))
+			return -1;
+		start = i + 1;
+	}
+
+	return buffer_write(buf, data + start, len - start);
+}
+
+/* Like prometheus_client.utils.floatToGoString (see format.h) */
+static int buffer_write_double(struct buffer *buf, double d)
+{
+	char s[FORMAT_DOUBLE_SIZE];
+
+	return buffer_write(buf, s, format_double(s, d));
+}
+
+static int buffer_write_value(struct buffer *buf, PyObject *value)
+{
+	double d;
+
+	if (PyFloat_CheckExact(value)) {
+		d = PyFloat_AS_DOUBLE(value);
+	} else if (PyLong_Check(value) || PyFloat_Check(value)) {
+		d = PyFloat_AsDouble(value);
+		if (d == -1.0 && PyErr_Occurred())
+			return -1;
+	} else {
+		/* Atomics and the like */
+		PyObject *obj = PyObject_CallMethod(value, "get", NULL);
+
+		if (!obj)
+			return -1;
+		d = PyFloat_AsDouble(obj);
+		Py_DECREF(obj);
+		if (d == -1.0 && PyErr_Occurred())
+			return -1;
+	}
+
+	return buffer_write_double(buf, d);
+}
+
+/*
+ * Write a label set. labels is a tuple of pre-rendered (and escaped)
+ * name="value" strings, sorted by name. If extra_name is not NULL, an extra
+ * label is inserted in sorted order.
+ */
+static int buffer_write_labels(struct buffer *buf, PyObject *labels,
+			       const char *extra_name, double extra_value)
+{
+	Py_ssize_t i, n;
+	bool first = true;
+
+	if (!PyTuple_Check(labels)) {
+		PyErr_SetString(PyExc_TypeError, "labels must be a tuple");
+		return -1;
+	}
+
+	n = PyTuple_GET_SIZE(labels);
+	if (!n && !extra_name)
+		return 0;
+
+	if (buffer_puts(buf, "{"))
+		return -1;
+
+	for (i = 0; i <= n; i++) {
+		const char *label = NULL;
+		Py_ssize_t len = 0;
+
+		if (i < n) {
+			label = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(labels, i),
+							&len);
+			if (!label)
+				return -1;
+		}
+
+		if (extra_name) {
+			size_t name_len = strlen(extra_name);
+			const char *eq = label ? memchr(label, '=', len) : NULL;
+			size_t label_len = eq ? eq - label : len;
+			int cmp = label ? memcmp(label, extra_name,
+						 label_len < name_len ?
+						 label_len : name_len) : 1;
+
+			if (!cmp)
+				cmp = (label_len > name_len) - (label_len < name_len);
+
+			if (cmp > 0) {
+				if ((!first && buffer_puts(buf, ",")) ||
+				    buffer_puts(buf, extra_name) ||
+				    buffer_puts(buf, "=\"") ||
+				    buffer_write_double(buf, extra_value) ||
+				    buffer_puts(buf, "\""))
+					return -1;
+				extra_name = NULL;
+				first = false;
+			}
+		}
+
+		if (label) {
+			if ((!first && buffer_puts(buf, ",")) ||
+			    buffer_write(buf, label, len))
+				return -1;
+			first = false;
+		}
+	}
+
+	return buffer_puts(buf, "}");
+}
+
+/* OpenMetrics-only samples, which go in their own gauges in Prometheus format */
+static const char *const deferred_suffixes[] = {
+	"_created",
+	"_gcount",
+	"_gsum",
+};
+
+#define DEFERRED_COUNT (sizeof(deferred_suffixes) / sizeof(*deferred_suffixes))
+
+typedef struct {
+	PyObject_HEAD
+	struct buffer out;
+	/* The current family's name and escaped help text */
+	struct buffer name;
+	struct buffer help;
+	struct buffer deferred[DEFERRED_COUNT];
+	Py_ssize_t exports;
+	bool openmetrics;
+	bool in_family;
+} ExpositionObject;
+
+static int Exposition_check_exports(ExpositionObject *self)
+{
+	if (self->exports) {
+		PyErr_SetString(PyExc_BufferError,
+				"cannot modify the exposition while it is being exported");
+		return -1;
+	}
+	return 0;
+}
+
+static int Exposition_end_family(ExpositionObject *self)
+{
+	size_t i;
+
+	if (!self->in_family)
+		return 0;
+
+	for (i = 0; i < DEFERRED_COUNT; i++) {
+		struct buffer *deferred = &self->deferred[i];
+
+		if (!deferred->len)
+			continue;
+
+		if (buffer_puts(&self->out, "# HELP ") ||
+		    buffer_write(&self->out, self->name.data, self->name.len) ||
+		    buffer_puts(&self->out, deferred_suffixes[i]) ||
+		    buffer_puts(&self->out, " ") ||
+		    buffer_write(&self->out, self->help.data, self->help.len) ||
+		    buffer_puts(&self->out, "\n# TYPE ") ||
+		    buffer_write(&self->out, self->name.data, self->name.len) ||
+		    buffer_puts(&self->out, deferred_suffixes[i]) ||
+		    buffer_puts(&self->out, " gauge\n") ||
+		    buffer_write(&self->out, deferred->data, deferred->len))
+			return -1;
+		deferred->len = 0;
+	}
+
+	self->in_family = false;
+	return 0;
+}
+
+static int Exposition_init(ExpositionObject *self, PyObject *args,
+			   PyObject *kwds)
+{
+	char *keywords[] = { "openmetrics", NULL };
+	int openmetrics = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", keywords,
+					 &openmetrics))
+		return -1;
+
+	if (Exposition_check_exports(self))
+		return -1;
+
+	self->openmetrics = openmetrics;
+	self->out.len = 0;
+	self->in_family = false;
+	return 0;
+}
+
+static void Exposition_dealloc(ExpositionObject *self)
+{
+	size_t i;
+
+	PyMem_Free(self->out.data);
+	PyMem_Free(self->name.data);
+	PyMem_Free(self->help.data);
+	for (i = 0; i < DEFERRED_COUNT; i++)
+		PyMem_Free(self->deferred[i].data);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Exposition_family(ExpositionObject *self,
+				   PyObject *const *args, Py_ssize_t nargs,
+				   PyObject *kwnames)
+{
+	static const char *const keywords[] = {
+		"name", "documentation", "typ", NULL
+	};
+	PyObject *argv[3], *name, *docs;
+	const char *typ, *suffix = "";
+
+	if (PyArg_UnpackFastcall("family", args, nargs, kwnames, keywords, 3,
+				 argv))
+		return NULL;
+
+	name = argv[0];
+	docs = argv[1];
+	typ = PyUnicode_AsUTF8(argv[2]);
+	if (!typ || Exposition_check_exports(self) ||
+	    Exposition_end_family(self))
+		return NULL;
+
+	self->name.len = 0;
+	self->help.len = 0;
+	if (buffer_write_str(&self->name, name) ||
+	    buffer_write_escaped(&self->help, docs, self->openmetrics))
+		return NULL;
+
+	/* Munge OpenMetrics types into Prometheus ones */
+	if (!self->openmetrics) {
+		if (!strcmp(typ, "counter")) {
+			suffix = "_total";
+		} else if (!strcmp(typ, "info")) {
+			suffix = "_info";
+			typ = "gauge";
+		} else if (!strcmp(typ, "stateset")) {
+			typ = "gauge";
+		} else if (!strcmp(typ, "gaugehistogram")) {
+			typ = "histogram";
+		} else if (!strcmp(typ, "unknown")) {
+			typ = "untyped";
+		}
+	}
+
+	if (buffer_puts(&self->out, "# HELP ") ||
+	    buffer_write(&self->out, self->name.data, self->name.len) ||
+	    buffer_puts(&self->out, suffix) ||
+	    buffer_puts(&self->out, " ") ||
+	    buffer_write(&self->out, self->help.data, self->help.len) ||
+	    buffer_puts(&self->out, "\n# TYPE ") ||
+	    buffer_write(&self->out, self->name.data, self->name.len) ||
+	    buffer_puts(&self->out, suffix) ||
+	    buffer_puts(&self->out, " ") ||
+	    buffer_puts(&self->out, typ) ||
+	    buffer_puts(&self->out, "\n"))
+		return NULL;
+
+	self->in_family = true;
+	Py_RETURN_NONE;
+}
+
+static struct buffer *Exposition_sample_buffer(ExpositionObject *self,
+					       const char *suffix)
+{
+	size_t i;
+
+	if (self->openmetrics)
+		return &self->out;
+
+	for (i = 0; i < DEFERRED_COUNT; i++)
+		if (!strcmp(suffix, deferred_suffixes[i]))
+			return &self->deferred[i];
+	return &self->out;
+}
+
+/* Write an exemplar, given a tuple of its labels, value, and timestamp */
+static int buffer_write_exemplar(struct buffer *buf, PyObject *exemplar)
+{
+	PyObject *labels, *timestamp;
+	int ret;
+
+	if (!PyTuple_Check(exemplar) || PyTuple_GET_SIZE(exemplar) != 3) {
+		PyErr_SetString(PyExc_TypeError,
+				"exemplar must be a tuple of labels, value, and timestamp");
+		return -1;
+	}
+
+	labels = PyTuple_GET_ITEM(exemplar, 0);
+	if (buffer_puts(buf, " # "))
+		return -1;
+
+	/* Unlike samples, exemplars always have braces */
+	if (PyTuple_Check(labels) && !PyTuple_GET_SIZE(labels)) {
+		if (buffer_puts(buf, "{}"))
+			return -1;
+	} else if (buffer_write_labels(buf, labels, NULL, 0)) {
+		return -1;
+	}
+
+	if (buffer_puts(buf, " ") ||
+	    buffer_write_value(buf, PyTuple_GET_ITEM(exemplar, 1)))
+		return -1;
+
+	if (PyTuple_GET_ITEM(exemplar, 2) == Py_None)
+		return 0;
+
+	timestamp = PyObject_Str(PyTuple_GET_ITEM(exemplar, 2));
+	if (!timestamp)
+		return -1;
+
+	ret = buffer_puts(buf, " ") || buffer_write_str(buf, timestamp);
+	Py_DECREF(timestamp);
+	return ret;
+}
+
+/* Exemplars are only supported by OpenMetrics, so they may be NULL or None */
+static int Exposition_write_sample(ExpositionObject *self, const char *suffix,
+				   PyObject *labels, const char *extra_name,
+				   double extra_value, PyObject *value,
+				   PyObject *exemplar)
+{
+	struct buffer *buf = Exposition_sample_buffer(self, suffix);
+
+	return buffer_write(buf, self->name.data, self->name.len) ||
+	       buffer_puts(buf, suffix) ||
+	       buffer_write_labels(buf, labels, extra_name, extra_value) ||
+	       buffer_puts(buf, " ") ||
+	       buffer_write_value(buf, value) ||
+	       (self->openmetrics && exemplar && exemplar != Py_None &&
+		buffer_write_exemplar(buf, exemplar)) ||
+	       buffer_puts(buf, "\n");
+}
+
+static int Exposition_check_family(ExpositionObject *self)
+{
+	if (!self->in_family) {
+		PyErr_SetString(PyExc_ValueError, "no family has been started");
+		return -1;
+	}
+	return Exposition_check_exports(self);
+}
+
+static PyObject *Exposition_sample(ExpositionObject *self,
+				   PyObject *const *args, Py_ssize_t nargs,
+				   PyObject *kwnames)
+{
+	static const char *const keywords[] = {
+		"suffix", "labels", "value", "exemplar", NULL
+	};
+	PyObject *argv[4] = { NULL };
+	const char *suffix;
+
+	if (nargs == 3 && !kwnames) {
+		argv[0] = args[0];
+		argv[1] = args[1];
+		argv[2] = args[2];
+	} else if (PyArg_UnpackFastcall("sample", args, nargs, kwnames,
+					keywords, 3, argv)) {
+		return NULL;
+	}
+
+	suffix = PyUnicode_AsUTF8(argv[0]);
+	if (!suffix || Exposition_check_family(self) ||
+	    Exposition_write_sample(self, suffix, argv[1], NULL, 0, argv[2],
+				    argv[3]))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+/* Write the samples for a histogram, given its thresholds and a snapshot */
+static PyObject *Exposition_histogram(ExpositionObject *self,
+				      PyObject *const *args, Py_ssize_t nargs,
+				      PyObject *kwnames)
+{
+	static const char *const keywords[] = {
+		"labels", "thresholds", "buckets", "sum", "count", "gauge",
+		"exemplars", NULL
+	};
+	PyObject *argv[7] = { NULL }, *labels, *thresholds, *buckets, *sum, *count;
+	PyObject *exemplars;
+	PyObject *cumulative = NULL;
+	Py_ssize_t i, n;
+	PyObject *ret = NULL;
+	unsigned long long total = 0;
+	int gauge = 0;
+
+	if (PyArg_UnpackFastcall("histogram", args, nargs, kwnames, keywords, 5,
+				 argv))
+		return NULL;
+
+	labels = argv[0];
+	thresholds = argv[1];
+	buckets = argv[2];
+	sum = argv[3];
+	count = argv[4];
+	exemplars = argv[6] == Py_None ? NULL : argv[6];
+
+	if (argv[5]) {
+		gauge = PyObject_IsTrue(argv[5]);
+		if (gauge < 0)
+			return NULL;
+	}
+
+	if (Exposition_check_family(self))
+		return NULL;
+
+	if (!PyTuple_Check(thresholds) || !PyTuple_Check(buckets) ||
+	    PyTuple_GET_SIZE(thresholds) != PyTuple_GET_SIZE(buckets)) {
+		PyErr_SetString(PyExc_ValueError,
+				"thresholds and buckets must be tuples of the same length");
+		return NULL;
+	}
+
+	if (exemplars &&
+	    (!PyTuple_Check(exemplars) ||
+	     PyTuple_GET_SIZE(exemplars) != PyTuple_GET_SIZE(buckets))) {
+		PyErr_SetString(PyExc_ValueError,
+				"exemplars must be a tuple with one per bucket");
+		return NULL;
+	}
+
+	n = PyTuple_GET_SIZE(buckets);
+	for (i = 0; i < n; i++) {
+		double le = PyFloat_AsDouble(PyTuple_GET_ITEM(thresholds, i));
+		PyObject *exemplar = NULL;
+		unsigned long long bucket;
+
+		if (le == -1.0 && PyErr_Occurred())
+			return NULL;
+
+		bucket = PyLong_AsUnsignedLongLong(PyTuple_GET_ITEM(buckets, i));
+		if (bucket == (unsigned long long)-1 && PyErr_Occurred())
+			return NULL;
+		total += bucket;
+
+		cumulative = PyLong_FromUnsignedLongLong(total);
+		if (!cumulative)
+			return NULL;
+
+		if (exemplars)
+			exemplar = PyTuple_GET_ITEM(exemplars, i);
+
+		if (Exposition_write_sample(self, "_bucket", labels, "le", le,
+					    cumulative, exemplar))
+			goto out;
+		Py_CLEAR(cumulative);
+	}
+
+	/* Gauge histograms have their own names for these */
+	if (Exposition_write_sample(self, gauge ? "_gsum" : "_sum", labels,
+				    NULL, 0, sum, NULL) ||
+	    Exposition_write_sample(self, gauge ? "_gcount" : "_count", labels,
+				    NULL, 0, count, NULL))
+		goto out;
+
+	ret = Py_None;
+	Py_INCREF(ret);
+out:
+	Py_XDECREF(cumulative);
+	return ret;
+}
+
+/* Write the samples for a summary, given its quantiles and their estimates */
+static PyObject *Exposition_summary(ExpositionObject *self,
+				    PyObject *const *args, Py_ssize_t nargs,
+				    PyObject *kwnames)
+{
+	static const char *const keywords[] = {
+		"labels", "quantiles", "values", "sum", "count", NULL
+	};
+	PyObject *argv[5], *labels, *quantiles, *values;
+	Py_ssize_t i, n;
+
+	if (PyArg_UnpackFastcall("summary", args, nargs, kwnames, keywords, 5,
+				 argv))
+		return NULL;
+
+	labels = argv[0];
+	quantiles = argv[1];
+	values = argv[2];
+
+	if (Exposition_check_family(self))
+		return NULL;
+
+	if (!PyTuple_Check(quantiles) || !PyTuple_Check(values) ||
+	    PyTuple_GET_SIZE(quantiles) != PyTuple_GET_SIZE(values)) {
+		PyErr_SetString(PyExc_ValueError,
+				"quantiles and values must be tuples of the same length");
+		return NULL;
+	}
+
+	n = PyTuple_GET_SIZE(values);
+	for (i = 0; i < n; i++) {
+		double quantile = PyFloat_AsDouble(PyTuple_GET_ITEM(quantiles, i));
+
+		if (quantile == -1.0 && PyErr_Occurred())
+			return NULL;
+
+		if (Exposition_write_sample(self, "", labels, "quantile",
+					    quantile,
+					    PyTuple_GET_ITEM(values, i), NULL))
+			return NULL;
+	}
+
+	if (Exposition_write_sample(self, "_count", labels, NULL, 0, argv[4],
+				    NULL) ||
+	    Exposition_write_sample(self, "_sum", labels, NULL, 0, argv[3],
+				    NULL))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Exposition_eof(ExpositionObject *self,
+				PyObject *Py_UNUSED(ignored))
+{
+	if (Exposition_check_exports(self) || Exposition_end_family(self))
+		return NULL;
+
+	if (self->openmetrics && buffer_puts(&self->out, "# EOF\n"))
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *Exposition_clear(ExpositionObject *self,
+				  PyObject *Py_UNUSED(ignored))
+{
+	size_t i;
+
+	if (Exposition_check_exports(self))
+		return NULL;
+
+	self->out.len = 0;
+	for (i = 0; i < DEFERRED_COUNT; i++)
+		self->deferred[i].len = 0;
+	self->in_family = false;
+	Py_RETURN_NONE;
+}
+
+static PyObject *Exposition_getvalue(ExpositionObject *self,
+				     PyObject *const *args, Py_ssize_t nargs,
+				     PyObject *kwnames)
+{
+	static const char *const keywords[] = { "start", NULL };
+	PyObject *argv[1] = { NULL };
+	Py_ssize_t start = 0;
+
+	if (PyArg_UnpackFastcall("getvalue", args, nargs, kwnames, keywords, 0,
+				 argv))
+		return NULL;
+
+	if (argv[0]) {
+		start = PyLong_AsSsize_t(argv[0]);
+		if (start == -1 && PyErr_Occurred())
+			return NULL;
+		if (start < 0 || (size_t)start > self->out.len) {
+			PyErr_SetString(PyExc_ValueError, "start out of range");
+			return NULL;
+		}
+	}
+
+	return PyBytes_FromStringAndSize(self->out.data + start,
+					 self->out.len - start);
+}
+
+static PyObject *Exposition_tell(ExpositionObject *self,
+				 PyObject *Py_UNUSED(ignored))
+{
+	return PyLong_FromSize_t(self->out.len);
+}
+
+/* Write text from an earlier getvalue, such as a series which didn't change */
+static PyObject *Exposition_write(ExpositionObject *self, PyObject *arg)
+{
+	Py_buffer text;
+	int ret;
+
+	if (Exposition_check_family(self) ||
+	    PyObject_GetBuffer(arg, &text, PyBUF_SIMPLE))
+		return NULL;
+
+	ret = buffer_write(&self->out, text.buf, text.len);
+	PyBuffer_Release(&text);
+	if (ret)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *Exposition_get_openmetrics(ExpositionObject *self,
+					    void *closure)
+{
+	return PyBool_FromLong(self->openmetrics);
+}
+
+static PyGetSetDef Exposition_getsetters[] = {
+	{
+		.name = "openmetrics",
+		.get = (getter)Exposition_get_openmetrics,
+		.doc = "Whether the output is in OpenMetrics format",
+	},
+	{ /* Sentinel */ },
+};
+
+static int Exposition_getbuffer(ExpositionObject *self, Py_buffer *view,
+				int flags)
+{
+	if (PyBuffer_FillInfo(view, (PyObject *)self, self->out.data,
+			      self->out.len, 1, flags))
+		return -1;
+
+	self->exports++;
+	return 0;
+}
+
+static void Exposition_releasebuffer(ExpositionObject *self, Py_buffer *view)
+{
+	self->exports--;
+}
+
+static PyBufferProcs Exposition_buffer = {
+	.bf_getbuffer = (getbufferproc)Exposition_getbuffer,
+	.bf_releasebuffer = (releasebufferproc)Exposition_releasebuffer,
+};
+
+static PyMethodDef Exposition_methods[] = {
+	{
+		.ml_name = "family",
+		.ml_meth = (PyCFunction)Exposition_family,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Start a new metric family, given its name, documentation, and type",
+	},
+	{
+		.ml_name = "sample",
+		.ml_meth = (PyCFunction)Exposition_sample,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Write a sample, given its suffix, labels, value, and optional exemplar",
+	},
+	{
+		.ml_name = "histogram",
+		.ml_meth = (PyCFunction)Exposition_histogram,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Write histogram samples, given labels, thresholds, buckets, sum, count, whether it is a gauge histogram, and optional exemplars for each bucket",
+	},
+	{
+		.ml_name = "summary",
+		.ml_meth = (PyCFunction)Exposition_summary,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Write summary samples, given labels, quantiles, their values, sum, and count",
+	},
+	{
+		.ml_name = "eof",
+		.ml_meth = (PyCFunction)Exposition_eof,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Finish the exposition",
+	},
+	{
+		.ml_name = "clear",
+		.ml_meth = (PyCFunction)Exposition_clear,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Discard the current output, keeping the buffer for reuse",
+	},
+	{
+		.ml_name = "getvalue",
+		.ml_meth = (PyCFunction)Exposition_getvalue,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Get a copy of the current output, optionally starting at an offset from tell",
+	},
+	{
+		.ml_name = "tell",
+		.ml_meth = (PyCFunction)Exposition_tell,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Get the length of the current output",
+	},
+	{
+		.ml_name = "write",
+		.ml_meth = (PyCFunction)Exposition_write,
+		.ml_flags = METH_O,
+		.ml_doc = "Write samples rendered earlier (from getvalue) for the current family",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject ExpositionType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(ExpositionObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.Exposition",
+	.tp_doc = "Prometheus text (or OpenMetrics) exposition writer",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)Exposition_init,
+	.tp_dealloc = (destructor)Exposition_dealloc,
+	.tp_methods = Exposition_methods,
+	.tp_getset = Exposition_getsetters,
+	.tp_as_buffer = &Exposition_buffer,
+};
+
+int ExpositionType_Add(PyObject *m)
+{
+	return PyModule_AddType(m, &ExpositionType);
+}
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <math.h>
+#include <stdint.h>
+
+/*
+ * Fixed-point numbers are int64_ts scaled by 2^frac_bits. They can be added
+ * with a single atomic_fetch_add, instead of the compare-and-swap loop needed
+ * for doubles. Each amount is rounded to the nearest multiple of 2^-frac_bits,
+ * and the total must stay within +/- 2^(63 - frac_bits); larger totals wrap
+ * around. Amounts too large to fit saturate, and NaNs are treated as 0.
+ */
+#define FIXED_MAX_FRAC_BITS 62
+
+static inline int64_t fixed_from_double(double amount, unsigned int frac_bits)
+{
+	double scaled = ldexp(amount, frac_bits);
+
+	if (!(scaled == scaled))
+		return 0;
+	/* 2^63 is exactly representable, but INT64_MAX isn't */
+	if (scaled >= 0x1p63)
+		return INT64_MAX;
+	if (scaled < -0x1p63)
+		return INT64_MIN;
+	return llrint(scaled);
+}
+
+static inline double fixed_to_double(int64_t fixed, unsigned int frac_bits)
+{
+	return ldexp((double)fixed, -(int)frac_bits);
+}
+
+/* Add fixed-point numbers, wrapping around instead of overflowing */
+static inline int64_t fixed_add(int64_t a, int64_t b)
+{
+	return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+
+#endif /* FIXED_H */
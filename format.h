@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Doubles are formatted like prometheus_client.utils.floatToGoString. Both
+ * the in-process exposition and mpmetrics-exporter use this (and the exporter
+ * can't use Python), so scrapers see the same series either way.
+ */
+
+/* Large enough for anything written by format_double (including the NUL) */
+#define FORMAT_DOUBLE_SIZE 40
+
+/* Like repr, which uses the shortest digits which round-trip */
+static inline void format_repr(char *out, size_t size, double d)
+{
+	char sci[32], digits[20];
+	int prec, exp, n = 0;
+	const char *p;
+
+	/* Integers (like most counters) are exact, so skip the search */
+	if (fabs(d) < 0x1p53 && d == rint(d) && !(d == 0 && signbit(d))) {
+		snprintf(out, size, "%.0f.0", d);
+		return;
+	}
+
+	for (prec = 1; prec < 17; prec++) {
+		snprintf(sci, sizeof(sci), "%.*e", prec - 1, d);
+		if (strtod(sci, NULL) == d)
+			break;
+	}
+	snprintf(sci, sizeof(sci), "%.*e", prec - 1, d);
+
+	for (p = sci; *p != 'e'; p++)
+		if (*p >= '0' && *p <= '9')
+			digits[n++] = *p;
+	exp = atoi(p + 1);
+	while (n > 1 && digits[n - 1] == '0')
+		n--;
+	digits[n] = '\0';
+
+	p = signbit(d) ? "-" : "";
+	if (exp < -4 || exp >= 16) {
+		snprintf(out, size, "%s%c%s%.*se%c%02d", p, digits[0],
+			 n > 1 ? "." : "", n - 1, digits + 1,
+			 exp < 0 ? '-' : '+', abs(exp));
+	} else if (exp < 0) {
+		snprintf(out, size, "%s0.%0*d%s", p, -exp - 1, 0, digits);
+		if (exp == -1)
+			snprintf(out, size, "%s0.%s", p, digits);
+	} else if (exp + 1 >= n) {
+		snprintf(out, size, "%s%s%0*d.0", p, digits, exp + 1 - n, 0);
+		if (exp + 1 == n)
+			snprintf(out, size, "%s%s.0", p, digits);
+	} else {
+		snprintf(out, size, "%s%.*s.%s", p, exp + 1, digits,
+			 digits + exp + 1);
+	}
+}
+
+/*
+ * Format d into out, which must have room for FORMAT_DOUBLE_SIZE bytes, and
+ * return its length
+ */
+static inline size_t format_double(char *out, double d)
+{
+	char s[FORMAT_DOUBLE_SIZE], *dot;
+	size_t len;
+
+	if (isinf(d)) {
+		strcpy(out, d > 0 ? "+Inf" : "-Inf");
+		return 4;
+	}
+	if (isnan(d)) {
+		strcpy(out, "NaN");
+		return 3;
+	}
+
+	format_repr(s, sizeof(s), d);
+
+	/* Go switches to exponents sooner than Python */
+	dot = strchr(s, '.');
+	if (d > 0 && dot && dot - s > 6) {
+		int exp = dot - s - 1;
+
+		len = snprintf(out, FORMAT_DOUBLE_SIZE, "%c.%.*s%s", s[0], exp,
+			       s + 1, dot + 1);
+		while (len && (out[len - 1] == '0' || out[len - 1] == '.'))
+			len--;
+		return len + snprintf(out + len, FORMAT_DOUBLE_SIZE - len,
+				      "e+0%d", exp);
+	}
+
+	len = strlen(s);
+	memcpy(out, s, len + 1);
+	return len;
+}
+
+#endif /* FORMAT_H */
@@ -0,0 +1,442 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "_mpmetrics.h"
+
+/*
+ * Hash table layout in shared memory:
+ *
+ * An open-addressing (linear probing) table of slots, followed by an arena
+ * of records. Each slot holds the offset of a record in the arena (plus one,
+ * so that empty slots are zero). Records are appended to the arena in
+ * the order they were added to the table, and are never moved. Deleting a
+ * record just marks it as deleted, and leaves its slot in place so that
+ * probing continues past it. Overwriting a record with a value of a different
+ * length marks the old record as deleted and points its slot at a new one.
+ *
+ * Each record also has a sequence number supplied by the caller. Overwriting
+ * a record keeps its sequence number, so the caller can use them to iterate
+ * in the order keys were first inserted (like a dict), even if the records
+ * themselves were added in a different order.
+ *
+ * The table never grows; set() returns False once it runs out of room, and
+ * it's up to the caller to allocate a bigger table and copy the items over.
+ * Accesses must be serialized by the caller.
+ */
+struct hashtable {
+	uint64_t prev_start;
+	uint64_t prev_size;
+	uint32_t slots;
+	uint32_t occupied;
+	uint32_t live;
+	uint32_t arena_len;
+	uint32_t slot[];
+	/* char arena[]; */
+};
+
+struct record {
+	uint64_t hash;
+	uint64_t seq;
+	uint32_t key_len;
+	uint32_t value_len;
+	char data[];
+};
+
+#define RECORD_DELETED (UINT32_C(1) << 31)
+
+typedef BufferObject HashTableObject;
+
+static struct hashtable *hashtable(HashTableObject *self)
+{
+	return self->shm.buf;
+}
+
+static size_t hashtable_arena_start(uint32_t slots)
+{
+	size_t start = sizeof(struct hashtable) + slots * sizeof(uint32_t);
+
+	return (start + alignof(struct record) - 1) &
+	       ~(alignof(struct record) - 1);
+}
+
+static char *hashtable_arena(HashTableObject *self)
+{
+	return (char *)self->shm.buf + hashtable_arena_start(hashtable(self)->slots);
+}
+
+static size_t hashtable_arena_size(HashTableObject *self)
+{
+	return self->shm.len - hashtable_arena_start(hashtable(self)->slots);
+}
+
+static struct record *hashtable_record(HashTableObject *self, uint32_t off)
+{
+	return (void *)(hashtable_arena(self) + off);
+}
+
+static size_t record_size(size_t key_len, size_t value_len)
+{
+	size_t size = sizeof(struct record) + key_len + value_len;
+
+	return (size + alignof(struct record) - 1) &
+	       ~(alignof(struct record) - 1);
+}
+
+static bool record_deleted(const struct record *r)
+{
+	return r->value_len & RECORD_DELETED;
+}
+
+/* FNV-1a; Python's hash() is randomized per-process, so we can't use it */
+static uint64_t hash_bytes(const char *data, size_t len)
+{
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
+/*
+ * Find the slot for key. If the key is present (and not deleted), *record is
+ * set to its record. Otherwise, *record is NULL and the returned slot is the
+ * empty slot where the key should be inserted.
+ */
+static uint32_t *hashtable_find(HashTableObject *self, const char *key,
+				size_t key_len, uint64_t hash,
+				struct record **record)
+{
+	struct hashtable *h = hashtable(self);
+	uint32_t mask = h->slots - 1;
+	uint32_t i = hash & mask;
+
+	for (;; i = (i + 1) & mask) {
+		uint32_t *slot = &h->slot[i];
+		struct record *r;
+
+		if (!*slot) {
+			*record = NULL;
+			return slot;
+		}
+
+		r = hashtable_record(self, *slot - 1);
+		if (r->hash == hash && r->key_len == key_len &&
+		    !record_deleted(r) && !memcmp(r->data, key, key_len)) {
+			*record = r;
+			return slot;
+		}
+	}
+}
+
+static int HashTable_init(HashTableObject *self, PyObject *args,
+			  PyObject *kwds)
+{
+	struct hashtable *h;
+	size_t max_slots;
+	uint32_t slots;
+
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return -1;
+
+	/* Use about an eighth of the space for slots, and the rest for records */
+	max_slots = (self->shm.len - sizeof(struct hashtable)) / 8 /
+		    sizeof(uint32_t);
+	if (max_slots > UINT32_C(1) << 30)
+		max_slots = UINT32_C(1) << 30;
+	for (slots = 1; slots * 2 <= max_slots; slots *= 2)
+		;
+
+	h = hashtable(self);
+	memset(h, 0, hashtable_arena_start(slots));
+	h->slots = slots;
+	return 0;
+}
+
+static PyObject *HashTable_setstate(HashTableObject *self, PyObject *args,
+				    PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static int get_bytes(PyObject *obj, const char *name, char **data,
+		     Py_ssize_t *len)
+{
+	if (!PyBytes_Check(obj)) {
+		PyErr_Format(PyExc_TypeError, "%s must be bytes, not %.100s",
+			     name, Py_TYPE(obj)->tp_name);
+		return -1;
+	}
+
+	return PyBytes_AsStringAndSize(obj, data, len);
+}
+
+static PyObject *HashTable_get(HashTableObject *self, PyObject *arg)
+{
+	struct record *r;
+	Py_ssize_t len;
+	char *key;
+
+	if (get_bytes(arg, "key", &key, &len))
+		return NULL;
+
+	hashtable_find(self, key, len, hash_bytes(key, len), &r);
+	if (!r)
+		Py_RETURN_NONE;
+	return PyBytes_FromStringAndSize(r->data + r->key_len, r->value_len);
+}
+
+static PyObject *HashTable_set(HashTableObject *self, PyObject *const *args,
+			       Py_ssize_t nargs)
+{
+	struct hashtable *h = hashtable(self);
+	Py_ssize_t key_len, value_len;
+	char *key, *value;
+	struct record *r, *new;
+	uint32_t *slot;
+	uint64_t hash, seq;
+	size_t size;
+
+	if (nargs != 3) {
+		PyErr_Format(PyExc_TypeError,
+			     "set() takes exactly 3 arguments (%zd given)",
+			     nargs);
+		return NULL;
+	}
+
+	if (get_bytes(args[0], "key", &key, &key_len) ||
+	    get_bytes(args[1], "value", &value, &value_len))
+		return NULL;
+
+	seq = PyLong_AsUnsignedLongLong(args[2]);
+	if (PyErr_Occurred())
+		return NULL;
+
+	hash = hash_bytes(key, key_len);
+	slot = hashtable_find(self, key, key_len, hash, &r);
+	if (r && r->value_len == value_len) {
+		memcpy(r->data + key_len, value, value_len);
+		Py_RETURN_TRUE;
+	}
+
+	/* Keep the load factor under 3/4 */
+	if (!r && (h->occupied + 1) * UINT64_C(4) > h->slots * UINT64_C(3))
+		Py_RETURN_FALSE;
+
+	size = record_size(key_len, value_len);
+	if (key_len >= RECORD_DELETED || value_len >= RECORD_DELETED ||
+	    size > hashtable_arena_size(self) - h->arena_len)
+		Py_RETURN_FALSE;
+
+	new = hashtable_record(self, h->arena_len);
+	new->hash = hash;
+	new->seq = r ? r->seq : seq;
+	new->key_len = key_len;
+	new->value_len = value_len;
+	memcpy(new->data, key, key_len);
+	memcpy(new->data + key_len, value, value_len);
+
+	if (r) {
+		r->value_len |= RECORD_DELETED;
+	} else {
+		h->occupied++;
+		h->live++;
+	}
+	*slot = h->arena_len + 1;
+	h->arena_len += size;
+	Py_RETURN_TRUE;
+}
+
+static PyObject *HashTable_pop(HashTableObject *self, PyObject *arg)
+{
+	struct record *r;
+	Py_ssize_t len;
+	char *key;
+
+	if (get_bytes(arg, "key", &key, &len))
+		return NULL;
+
+	hashtable_find(self, key, len, hash_bytes(key, len), &r);
+	if (!r)
+		Py_RETURN_NONE;
+
+	r->value_len |= RECORD_DELETED;
+	hashtable(self)->live--;
+	return PyLong_FromUnsignedLongLong(r->seq);
+}
+
+static PyObject *HashTable_items(HashTableObject *self,
+				 PyObject *Py_UNUSED(ignored))
+{
+	struct hashtable *h = hashtable(self);
+	PyObject *items;
+	uint32_t off;
+
+	items = PyList_New(0);
+	if (!items)
+		return NULL;
+
+	for (off = 0; off < h->arena_len;) {
+		struct record *r = hashtable_record(self, off);
+		uint32_t value_len = r->value_len & ~RECORD_DELETED;
+		PyObject *item;
+
+		off += record_size(r->key_len, value_len);
+		if (record_deleted(r))
+			continue;
+
+		item = Py_BuildValue("(y#y#K)", r->data, (Py_ssize_t)r->key_len,
+				     r->data + r->key_len,
+				     (Py_ssize_t)value_len,
+				     (unsigned long long)r->seq);
+		if (!item || PyList_Append(items, item)) {
+			Py_XDECREF(item);
+			Py_DECREF(items);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
+
+	return items;
+}
+
+static Py_ssize_t HashTable_len(HashTableObject *self)
+{
+	return hashtable(self)->live;
+}
+
+static PyObject *HashTable_get_prev(HashTableObject *self, void *closure)
+{
+	struct hashtable *h = hashtable(self);
+
+	if (!h->prev_size)
+		Py_RETURN_NONE;
+	return Py_BuildValue("(KK)", (unsigned long long)h->prev_start,
+			     (unsigned long long)h->prev_size);
+}
+
+static int HashTable_set_prev(HashTableObject *self, PyObject *value,
+			      void *closure)
+{
+	struct hashtable *h = hashtable(self);
+	unsigned long long start = 0, size = 0;
+
+	if (!value) {
+		PyErr_SetString(PyExc_AttributeError, "can't delete prev");
+		return -1;
+	}
+
+	if (value != Py_None && !PyArg_ParseTuple(value, "KK", &start, &size))
+		return -1;
+
+	h->prev_start = start;
+	h->prev_size = size;
+	return 0;
+}
+
+static PyObject *HashTable_get_deleted(HashTableObject *self, void *closure)
+{
+	struct hashtable *h = hashtable(self);
+
+	return PyLong_FromUnsignedLong(h->occupied - h->live);
+}
+
+static PyGetSetDef HashTable_getset[] = {
+	{
+		.name = "prev",
+		.get = (getter)HashTable_get_prev,
+		.set = (setter)HashTable_set_prev,
+		.doc = "The (start, size) of the previous table in a chain, or None",
+	},
+	{
+		.name = "deleted",
+		.get = (getter)HashTable_get_deleted,
+		.doc = "The number of slots occupied by deleted items",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyMethodDef HashTable_methods[] = {
+	{
+		.ml_name = "_setstate",
+		.ml_meth = (PyCFunction)HashTable_setstate,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+	},
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)HashTable_get,
+		.ml_flags = METH_O,
+		.ml_doc = "Get the value for a key, or None if it is not present",
+	},
+	{
+		.ml_name = "set",
+		.ml_meth = (PyCFunction)HashTable_set,
+		.ml_flags = METH_FASTCALL,
+		.ml_doc = "Set the value (and sequence number, if new) for a key. Returns False if there is no room.",
+	},
+	{
+		.ml_name = "pop",
+		.ml_meth = (PyCFunction)HashTable_pop,
+		.ml_flags = METH_O,
+		.ml_doc = "Delete a key, returning its sequence number, or None if it was not present",
+	},
+	{
+		.ml_name = "items",
+		.ml_meth = (PyCFunction)HashTable_items,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Get a list of (key, value, seq) tuples",
+	},
+	{ /* Sentinel */ },
+};
+
+static PySequenceMethods HashTable_sequence = {
+	.sq_length = (lenfunc)HashTable_len,
+};
+
+static PyTypeObject HashTableType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(HashTableObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.HashTable",
+	.tp_doc = "Shared memory hash table mapping bytes to bytes",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)HashTable_init,
+	.tp_methods = HashTable_methods,
+	.tp_getset = HashTable_getset,
+	.tp_as_sequence = &HashTable_sequence,
+};
+
+int HashTableType_Add(PyObject *m)
+{
+	int ret;
+
+	/* Large enough for one slot and a small record */
+	if (PyType_AddSizeConstant(&HashTableType, "size",
+				   hashtable_arena_start(1) + record_size(8, 8)))
+		return -1;
+
+	if (PyType_AddSizeConstant(&HashTableType, "align",
+				   alignof(struct hashtable)))
+		return -1;
+
+	HashTableType.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	ret = PyModule_AddType(m, &HashTableType);
+	Py_DECREF(&BufferType);
+	return ret;
+}
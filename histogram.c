@@ -0,0 +1,972 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <math.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "_mpmetrics.h"
+#include "fixed.h"
+#include "histogram.h"
+#include "stats.h"
+
+/*
+ * The top bit of count selects which half of data is "hot," and the rest
+ * counts every observation ever made. Observers increment count, and then
+ * update the half it selected. The halves are never reset, so each one holds
+ * the cumulative totals of the observations made while it was hot.
+ *
+ * To take a snapshot, we flip the top bit and wait for the (now cold) half to
+ * quiesce. Its count will be however many observations there were in total,
+ * less the observations made in the other half (which we saved the last time
+ * it went cold). Then we save a copy of the cold half; the snapshot is the sum
+ * of both saved halves. Observers never touch the saved halves, so a snapshot
+ * doesn't write to any cache lines the observers are using.
+ *
+ * If count is the same as the total of the saved halves, then nothing has been
+ * observed since the last snapshot. It is still current, so we skip flipping
+ * the top bit (and invalidating the observers' copies of count).
+ *
+ * try_snapshot returns instead of waiting for the cold half. The snapshot is
+ * then pending (in this object) until try_snapshot or snapshot is called again
+ * and finds the cold half quiescent. Snapshots are serialized by the caller,
+ * so nothing else can flip the top bit in the meantime.
+ */
+#define COUNT_HOT (UINT64_C(1) << 63)
+
+typedef struct {
+	PyObject_HEAD
+	Py_buffer shm;
+	size_t bucket_count;
+	/* For fixed-point sums */
+	bool fixed;
+	unsigned int frac_bits;
+	/* For exponential histograms */
+	bool exponential;
+	int schema;
+	long min_key;
+	/* For pending snapshots, count from when the top bit was flipped */
+	bool pending;
+	uint64_t pending_count;
+} HistogramDataObject;
+
+static double *histogram_thresholds(HistogramDataObject *self)
+{
+	return self->shm.buf;
+}
+
+static _Atomic uint64_t *histogram_count(HistogramDataObject *self)
+{
+	return (void *)((char *)self->shm.buf +
+			histogram_count_offset(self->bucket_count));
+}
+
+static struct histogram_half *histogram_half(HistogramDataObject *self,
+					     unsigned int i)
+{
+	return (void *)((char *)self->shm.buf +
+			histogram_half_offset(self->bucket_count, i));
+}
+
+static struct histogram_half *histogram_saved(HistogramDataObject *self,
+					      unsigned int i)
+{
+	return histogram_half(self, 2 + i);
+}
+
+/*
+ * Find the first bucket whose threshold is not less than amount, like
+ * bisect.bisect_left. Thresholds are sorted, so this is the same as counting
+ * the thresholds which are less than amount. This is branchless, and for the
+ * bucket counts we care about (a few dozen) it beats a binary search. NaNs
+ * compare false, so they end up in the first bucket just like with bisect.
+ */
+static size_t histogram_search(const double *thresholds, size_t n,
+			       double amount)
+{
+	size_t i = 0, ret = 0;
+
+#if defined(__AVX__)
+	__m256d v4 = _mm256_set1_pd(amount);
+
+	for (; i + 4 <= n; i += 4) {
+		__m256d t = _mm256_loadu_pd(&thresholds[i]);
+
+		ret += __builtin_popcount(_mm256_movemask_pd(
+				_mm256_cmp_pd(t, v4, _CMP_LT_OQ)));
+	}
+#endif
+#if defined(__SSE2__)
+	__m128d v2 = _mm_set1_pd(amount);
+
+	for (; i + 2 <= n; i += 2) {
+		__m128d t = _mm_loadu_pd(&thresholds[i]);
+
+		ret += __builtin_popcount(_mm_movemask_pd(_mm_cmplt_pd(t, v2)));
+	}
+#endif
+	for (; i < n; i++)
+		ret += thresholds[i] < amount;
+	return ret;
+}
+
+static long div_ceil(long n, long d)
+{
+	return n / d + (n % d > 0);
+}
+
+/*
+ * Find the bucket for an amount in an exponential histogram, like
+ * histogram_search. These use the same layout as Prometheus native
+ * histograms: the bucket with key k holds amounts in (base^(k-1), base^k],
+ * where base is 2^(2^-schema). Bucket i holds key min_key + i, except for the
+ * first and last buckets, which also hold everything below and above the
+ * other buckets. We calculate the key from the exponent (plus the logarithm of
+ * the mantissa, for positive schemas), and then correct any rounding error by
+ * comparing with the neighboring thresholds.
+ */
+static size_t histogram_exponential(HistogramDataObject *self, double amount)
+{
+	const double *thresholds = histogram_thresholds(self);
+	size_t i, last = self->bucket_count - 1;
+	double frac;
+	long key;
+	int exp;
+
+	if (!(amount > thresholds[0]))
+		return 0;
+	if (amount > thresholds[last - 1])
+		return last;
+
+	frac = frexp(amount, &exp);
+	if (self->schema > 0)
+		key = (long)ceil(log2(frac) * (1 << self->schema)) +
+		      ((long)exp << self->schema);
+	else
+		key = div_ceil(exp - (frac == 0.5), 1L << -self->schema);
+
+	if (key - self->min_key < 1)
+		i = 1;
+	else if ((size_t)(key - self->min_key) > last - 1)
+		i = last - 1;
+	else
+		i = key - self->min_key;
+
+	while (i > 1 && !(thresholds[i - 1] < amount))
+		i--;
+	while (thresholds[i] < amount)
+		i++;
+	return i;
+}
+
+static size_t histogram_bucket(HistogramDataObject *self, double amount)
+{
+	if (self->exponential)
+		return histogram_exponential(self, amount);
+	return histogram_search(histogram_thresholds(self),
+				self->bucket_count, amount);
+}
+
+static void histogram_add_sum(struct histogram_half *half, double amount)
+{
+	double old, new;
+
+	old = atomic_load(&half->sum);
+	new = old + amount;
+	while (!atomic_compare_exchange_weak(&half->sum, &old, new)) {
+		stat_inc(STAT_CAS_RETRIES);
+		new = old + amount;
+	}
+}
+
+static void histogram_observe(HistogramDataObject *self, double amount)
+{
+	struct histogram_half *half;
+
+	half = histogram_half(self,
+			      atomic_fetch_add(histogram_count(self), 1) >> 63);
+	if (self->bucket_count)
+		atomic_fetch_add(&half->buckets[histogram_bucket(self, amount)],
+				 1);
+	if (self->fixed)
+		atomic_fetch_add(&half->fixed_sum,
+				 fixed_from_double(amount, self->frac_bits));
+	else
+		histogram_add_sum(half, amount);
+	atomic_fetch_add(&half->count, 1);
+}
+
+/*
+ * Bin observations locally, and then publish them all at once. This is
+ * equivalent to observing each amount in turn, since snapshots only care that
+ * counts match once the half goes cold.
+ */
+struct histogram_batch {
+	uint64_t *buckets;
+	uint64_t count;
+	double sum;
+	int64_t fixed_sum;
+};
+
+static void histogram_batch_add(HistogramDataObject *self,
+				struct histogram_batch *batch, double amount)
+{
+	if (self->bucket_count)
+		batch->buckets[histogram_bucket(self, amount)]++;
+	if (self->fixed)
+		batch->fixed_sum = fixed_add(batch->fixed_sum,
+					     fixed_from_double(amount,
+							       self->frac_bits));
+	else
+		batch->sum += amount;
+	batch->count++;
+}
+
+static void histogram_publish(HistogramDataObject *self,
+			      struct histogram_batch *batch)
+{
+	struct histogram_half *half;
+	size_t i;
+
+	if (!batch->count)
+		return;
+
+	half = histogram_half(self,
+			      atomic_fetch_add(histogram_count(self),
+					       batch->count) >> 63);
+	for (i = 0; i < self->bucket_count; i++)
+		if (batch->buckets[i])
+			atomic_fetch_add(&half->buckets[i], batch->buckets[i]);
+	if (self->fixed)
+		atomic_fetch_add(&half->fixed_sum, batch->fixed_sum);
+	else
+		histogram_add_sum(half, batch->sum);
+	atomic_fetch_add(&half->count, batch->count);
+}
+
+/* Fast path for buffers of doubles (or floats) */
+static int histogram_batch_buffer(HistogramDataObject *self,
+				  struct histogram_batch *batch,
+				  Py_buffer *view)
+{
+	const char *format = view->format ? view->format : "B";
+	Py_ssize_t i, n;
+
+	if (*format == '@' || *format == '=')
+		format++;
+
+	if (!strcmp(format, "d") && view->itemsize == sizeof(double)) {
+		const double *amounts = view->buf;
+
+		n = view->len / sizeof(double);
+		Py_BEGIN_ALLOW_THREADS
+		for (i = 0; i < n; i++)
+			histogram_batch_add(self, batch, amounts[i]);
+		Py_END_ALLOW_THREADS
+		return 1;
+	}
+
+	if (!strcmp(format, "f") && view->itemsize == sizeof(float)) {
+		const float *amounts = view->buf;
+
+		n = view->len / sizeof(float);
+		Py_BEGIN_ALLOW_THREADS
+		for (i = 0; i < n; i++)
+			histogram_batch_add(self, batch, amounts[i]);
+		Py_END_ALLOW_THREADS
+		return 1;
+	}
+
+	return 0;
+}
+
+static int histogram_batch_iter(HistogramDataObject *self,
+				struct histogram_batch *batch,
+				PyObject *amounts)
+{
+	PyObject *iter, *item;
+
+	iter = PyObject_GetIter(amounts);
+	if (!iter)
+		return -1;
+
+	while ((item = PyIter_Next(iter))) {
+		double amount = PyFloat_AsDouble(item);
+
+		Py_DECREF(item);
+		if (amount == -1.0 && PyErr_Occurred()) {
+			Py_DECREF(iter);
+			return -1;
+		}
+		histogram_batch_add(self, batch, amount);
+	}
+
+	Py_DECREF(iter);
+	return PyErr_Occurred() ? -1 : 0;
+}
+
+static int HistogramData_setup(HistogramDataObject *self)
+{
+	size_t frac_bits;
+	long schema;
+
+	if (PyObject_GetSizeAttr((PyObject *)self, "bucket_count",
+				 &self->bucket_count))
+		return -1;
+
+	/* Sums are fixed-point if we have frac_bits */
+	self->fixed = PyObject_HasAttrString((PyObject *)self, "frac_bits");
+	if (self->fixed) {
+		if (PyObject_GetSizeAttr((PyObject *)self, "frac_bits",
+					 &frac_bits))
+			return -1;
+
+		if (!frac_bits || frac_bits > FIXED_MAX_FRAC_BITS) {
+			PyErr_Format(PyExc_ValueError,
+				     "frac_bits must be between 1 and %d, not %zu",
+				     FIXED_MAX_FRAC_BITS, frac_bits);
+			return -1;
+		}
+		self->frac_bits = frac_bits;
+	}
+
+	/* Exponential histograms have a schema */
+	self->exponential = PyObject_HasAttrString((PyObject *)self, "schema");
+	if (!self->exponential)
+		return 0;
+
+	if (PyObject_GetLongAttr((PyObject *)self, "schema", &schema) ||
+	    PyObject_GetLongAttr((PyObject *)self, "min_key", &self->min_key))
+		return -1;
+
+	if (schema < -4 || schema > 8 || self->bucket_count < 3) {
+		PyErr_Format(PyExc_ValueError,
+			     "invalid exponential histogram (schema %ld with %zu buckets)",
+			     schema, self->bucket_count);
+		return -1;
+	}
+	self->schema = schema;
+	return 0;
+}
+
+static int HistogramData_init(HistogramDataObject *self, PyObject *args,
+			      PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return -1;
+
+	if (HistogramData_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return -1;
+	}
+
+	memset(self->shm.buf, 0, self->shm.len);
+	return 0;
+}
+
+static PyObject *HistogramData_setstate(HistogramDataObject *self,
+					PyObject *args, PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return NULL;
+
+	if (HistogramData_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *HistogramData_observe(HistogramDataObject *self,
+				       PyObject *arg)
+{
+	double amount = PyFloat_AsDouble(arg);
+
+	if (PyErr_Occurred())
+		return NULL;
+
+	histogram_observe(self, amount);
+	Py_RETURN_NONE;
+}
+
+static PyObject *HistogramData_observe_many(HistogramDataObject *self,
+					    PyObject *arg)
+{
+	struct histogram_batch batch = { 0 };
+	int ret = 0;
+
+	if (self->bucket_count) {
+		batch.buckets = PyMem_Calloc(self->bucket_count,
+					     sizeof(*batch.buckets));
+		if (!batch.buckets)
+			return PyErr_NoMemory();
+	}
+
+	if (PyObject_CheckBuffer(arg)) {
+		Py_buffer view;
+
+		if (PyObject_GetBuffer(arg, &view,
+				       PyBUF_FORMAT | PyBUF_ANY_CONTIGUOUS)) {
+			/* Probably not contiguous; just iterate over it */
+			PyErr_Clear();
+		} else {
+			ret = histogram_batch_buffer(self, &batch, &view);
+			PyBuffer_Release(&view);
+		}
+	}
+
+	if (!ret)
+		ret = histogram_batch_iter(self, &batch, arg);
+
+	if (ret >= 0)
+		histogram_publish(self, &batch);
+
+	PyMem_Free(batch.buckets);
+	if (ret < 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+/* Sum the saved halves */
+static PyObject *histogram_saved_sum(HistogramDataObject *self, uint64_t count)
+{
+	struct histogram_half *saved0 = histogram_saved(self, 0);
+	struct histogram_half *saved1 = histogram_saved(self, 1);
+	PyObject *buckets;
+	double sum;
+	size_t i;
+
+	buckets = PyTuple_New(self->bucket_count);
+	if (!buckets)
+		return NULL;
+
+	for (i = 0; i < self->bucket_count; i++) {
+		uint64_t bucket =
+			atomic_load_explicit(&saved0->buckets[i],
+					     memory_order_relaxed) +
+			atomic_load_explicit(&saved1->buckets[i],
+					     memory_order_relaxed);
+		PyObject *obj = PyLong_FromUnsignedLongLong(bucket);
+
+		if (!obj) {
+			Py_DECREF(buckets);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(buckets, i, obj);
+	}
+
+	if (self->fixed)
+		sum = fixed_to_double(fixed_add(atomic_load_explicit(&saved0->fixed_sum,
+								     memory_order_relaxed),
+						atomic_load_explicit(&saved1->fixed_sum,
+								     memory_order_relaxed)),
+				      self->frac_bits);
+	else
+		sum = atomic_load_explicit(&saved0->sum, memory_order_relaxed) +
+		      atomic_load_explicit(&saved1->sum, memory_order_relaxed);
+	return Py_BuildValue("(NdK)", buckets, sum, (unsigned long long)count);
+}
+
+static PyObject *histogram_snapshot(HistogramDataObject *self, bool block)
+{
+	struct histogram_half *cold, *saved_cold, *saved_hot;
+	uint64_t count, expected;
+	unsigned int c;
+	size_t i;
+
+	if (!self->pending) {
+		count = atomic_load(histogram_count(self)) & ~COUNT_HOT;
+		if (count == atomic_load_explicit(&histogram_saved(self, 0)->count,
+						  memory_order_relaxed) +
+			     atomic_load_explicit(&histogram_saved(self, 1)->count,
+						  memory_order_relaxed))
+			return histogram_saved_sum(self, count);
+
+		self->pending_count = atomic_fetch_add(histogram_count(self),
+						       COUNT_HOT);
+		self->pending = true;
+	}
+
+	count = self->pending_count;
+	c = count >> 63;
+	cold = histogram_half(self, c);
+	saved_cold = histogram_saved(self, c);
+	saved_hot = histogram_saved(self, !c);
+	count &= ~COUNT_HOT;
+	expected = count - atomic_load_explicit(&saved_hot->count,
+						memory_order_relaxed);
+
+	/* Wait for any observers still using the cold half */
+	if (atomic_load(&cold->count) != expected) {
+		if (!block)
+			Py_RETURN_NONE;
+
+		Py_BEGIN_ALLOW_THREADS
+		while (atomic_load(&cold->count) != expected) {
+			stat_inc(STAT_SNAPSHOT_YIELDS);
+			sched_yield();
+		}
+		Py_END_ALLOW_THREADS
+	}
+
+	for (i = 0; i < self->bucket_count; i++)
+		atomic_store_explicit(&saved_cold->buckets[i],
+				      atomic_load_explicit(&cold->buckets[i],
+							   memory_order_relaxed),
+				      memory_order_relaxed);
+	/* Copy the sum's bits, whether it's fixed-point or not */
+	atomic_store_explicit(&saved_cold->fixed_sum,
+			      atomic_load_explicit(&cold->fixed_sum,
+						   memory_order_relaxed),
+			      memory_order_relaxed);
+	atomic_store_explicit(&saved_cold->count, expected,
+			      memory_order_relaxed);
+
+	self->pending = false;
+	return histogram_saved_sum(self, count);
+}
+
+static PyObject *HistogramData_snapshot(HistogramDataObject *self,
+					PyObject *Py_UNUSED(ignored))
+{
+	return histogram_snapshot(self, true);
+}
+
+static PyObject *HistogramData_try_snapshot(HistogramDataObject *self,
+					    PyObject *Py_UNUSED(ignored))
+{
+	return histogram_snapshot(self, false);
+}
+
+static PyObject *HistogramData_saved(HistogramDataObject *self,
+				     PyObject *Py_UNUSED(ignored))
+{
+	uint64_t count =
+		atomic_load_explicit(&histogram_saved(self, 0)->count,
+				     memory_order_relaxed) +
+		atomic_load_explicit(&histogram_saved(self, 1)->count,
+				     memory_order_relaxed);
+
+	return histogram_saved_sum(self, count);
+}
+
+static PyObject *HistogramData_get_thresholds(HistogramDataObject *self,
+					      void *closure)
+{
+	const double *h = histogram_thresholds(self);
+	PyObject *thresholds;
+	size_t i;
+
+	thresholds = PyTuple_New(self->bucket_count);
+	if (!thresholds)
+		return NULL;
+
+	for (i = 0; i < self->bucket_count; i++) {
+		PyObject *obj = PyFloat_FromDouble(h[i]);
+
+		if (!obj) {
+			Py_DECREF(thresholds);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(thresholds, i, obj);
+	}
+
+	return thresholds;
+}
+
+static int HistogramData_set_thresholds(HistogramDataObject *self,
+					PyObject *value, void *closure)
+{
+	double *h = histogram_thresholds(self);
+	PyObject *seq;
+	double *thresholds;
+	size_t i;
+	int ret = -1;
+
+	if (!value) {
+		PyErr_SetString(PyExc_AttributeError,
+				"can't delete thresholds");
+		return -1;
+	}
+
+	seq = PySequence_Fast(value, "thresholds must be a sequence");
+	if (!seq)
+		return -1;
+
+	if ((size_t)PySequence_Fast_GET_SIZE(seq) != self->bucket_count) {
+		PyErr_Format(PyExc_ValueError, "expected %zu thresholds",
+			     self->bucket_count);
+		goto out;
+	}
+
+	thresholds = PyMem_Calloc(self->bucket_count, sizeof(*thresholds));
+	if (self->bucket_count && !thresholds) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	for (i = 0; i < self->bucket_count; i++) {
+		thresholds[i] =
+			PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+		if (PyErr_Occurred())
+			goto free;
+
+		if (i && !(thresholds[i - 1] <= thresholds[i])) {
+			PyErr_SetString(PyExc_ValueError,
+					"thresholds not in sorted order");
+			goto free;
+		}
+	}
+
+	/* Ensure every amount (other than NaN) has a bucket */
+	if (self->bucket_count && thresholds[self->bucket_count - 1] != INFINITY) {
+		PyErr_SetString(PyExc_ValueError,
+				"the last threshold must be inf");
+		goto free;
+	}
+
+	memcpy(h, thresholds,
+	       self->bucket_count * sizeof(*thresholds));
+	ret = 0;
+
+free:
+	PyMem_Free(thresholds);
+out:
+	Py_DECREF(seq);
+	return ret;
+}
+
+static PyGetSetDef HistogramData_getset[] = {
+	{
+		.name = "thresholds",
+		.get = (getter)HistogramData_get_thresholds,
+		.set = (setter)HistogramData_set_thresholds,
+		.doc = "Upper bounds of the buckets",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyObject *HistogramData_size_of(PyObject *cls, PyObject *arg)
+{
+	size_t bucket_count = PyLong_AsSize_t(arg);
+
+	if (bucket_count == (size_t)-1 && PyErr_Occurred())
+		return NULL;
+	return PyLong_FromSize_t(histogram_size(bucket_count));
+}
+
+static PyMethodDef HistogramData_methods[] = {
+	{
+		.ml_name = "size_of",
+		.ml_meth = (PyCFunction)HistogramData_size_of,
+		.ml_flags = METH_O | METH_CLASS,
+		.ml_doc = "Get the size of the data for a number of buckets",
+	},
+	{
+		.ml_name = "_setstate",
+		.ml_meth = (PyCFunction)HistogramData_setstate,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+	},
+	{
+		.ml_name = "observe",
+		.ml_meth = (PyCFunction)HistogramData_observe,
+		.ml_flags = METH_O,
+		.ml_doc = "Record an observation",
+	},
+	{
+		.ml_name = "observe_many",
+		.ml_meth = (PyCFunction)HistogramData_observe_many,
+		.ml_flags = METH_O,
+		.ml_doc = "Record an iterable (or buffer of doubles) of observations. If an error occurs, no observations are recorded.",
+	},
+	{
+		.ml_name = "snapshot",
+		.ml_meth = (PyCFunction)HistogramData_snapshot,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Get the bucket counts, sum, and count. Snapshots must be serialized.",
+	},
+	{
+		.ml_name = "try_snapshot",
+		.ml_meth = (PyCFunction)HistogramData_try_snapshot,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Like snapshot, but return None instead of waiting for observers. The snapshot stays pending until this (or snapshot) is called again.",
+	},
+	{
+		.ml_name = "saved",
+		.ml_meth = (PyCFunction)HistogramData_saved,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Get the bucket counts, sum, and count as of the last snapshot. This must not run concurrently with snapshot.",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject HistogramDataType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(HistogramDataObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.HistogramData",
+	.tp_doc = "Atomic histogram data",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)HistogramData_init,
+	.tp_methods = HistogramData_methods,
+	.tp_getset = HistogramData_getset,
+};
+
+/*
+ * Buffered histograms bin observations in process-local memory, and only
+ * publish them every flush_every observations. Snapshots increment the
+ * generation (stored after the saved halves), which asks every observer to
+ * publish on its next observation. Pending observations are protected by the
+ * GIL.
+ */
+typedef struct {
+	HistogramDataObject data;
+	struct histogram_batch batch;
+	size_t flush_every;
+	uint64_t generation;
+	unsigned long forks;
+} BufferedHistogramDataObject;
+
+static _Atomic uint64_t *histogram_generation(BufferedHistogramDataObject *self)
+{
+	return (void *)histogram_half(&self->data, 4);
+}
+
+static void BufferedHistogramData_discard(BufferedHistogramDataObject *self)
+{
+	if (self->data.bucket_count)
+		memset(self->batch.buckets, 0,
+		       self->data.bucket_count * sizeof(*self->batch.buckets));
+	self->batch.count = 0;
+	self->batch.sum = 0;
+	self->batch.fixed_sum = 0;
+	self->forks = fork_generation;
+	self->generation = atomic_load_explicit(histogram_generation(self),
+						memory_order_relaxed);
+}
+
+static void BufferedHistogramData_flush_pending(BufferedHistogramDataObject *self)
+{
+	/* Observations inherited from our parent will be published by it */
+	if (self->forks == fork_generation)
+		histogram_publish(&self->data, &self->batch);
+	BufferedHistogramData_discard(self);
+}
+
+static int BufferedHistogramData_setup(BufferedHistogramDataObject *self)
+{
+	size_t bucket_count;
+
+	if (HistogramData_setup(&self->data))
+		return -1;
+
+	if (PyObject_GetSizeAttr((PyObject *)self, "flush_every",
+				 &self->flush_every))
+		return -1;
+
+	bucket_count = self->data.bucket_count;
+	PyMem_Free(self->batch.buckets);
+	self->batch.buckets = PyMem_Calloc(bucket_count ? bucket_count : 1,
+					   sizeof(*self->batch.buckets));
+	if (!self->batch.buckets) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	BufferedHistogramData_discard(self);
+	return 0;
+}
+
+static int BufferedHistogramData_init(BufferedHistogramDataObject *self,
+				      PyObject *args, PyObject *kwds)
+{
+	if (HistogramData_init(&self->data, args, kwds))
+		return -1;
+
+	if (BufferedHistogramData_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return -1;
+	}
+	return 0;
+}
+
+static void BufferedHistogramData_dealloc(BufferedHistogramDataObject *self)
+{
+	if (self->data.shm.obj && self->batch.buckets)
+		BufferedHistogramData_flush_pending(self);
+	PyMem_Free(self->batch.buckets);
+	BufferType.tp_dealloc((PyObject *)self);
+}
+
+static PyObject *BufferedHistogramData_setstate(BufferedHistogramDataObject *self,
+						PyObject *args, PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return NULL;
+
+	if (BufferedHistogramData_setup(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *BufferedHistogramData_observe(BufferedHistogramDataObject *self,
+					       PyObject *arg)
+{
+	double amount = PyFloat_AsDouble(arg);
+
+	if (PyErr_Occurred())
+		return NULL;
+
+	if (self->forks != fork_generation)
+		BufferedHistogramData_discard(self);
+
+	histogram_batch_add(&self->data, &self->batch, amount);
+	if (self->batch.count >= self->flush_every ||
+	    atomic_load_explicit(histogram_generation(self),
+				 memory_order_relaxed) != self->generation)
+		BufferedHistogramData_flush_pending(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *BufferedHistogramData_flush(BufferedHistogramDataObject *self,
+					     PyObject *Py_UNUSED(ignored))
+{
+	BufferedHistogramData_flush_pending(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *buffered_histogram_snapshot(BufferedHistogramDataObject *self,
+					     bool block)
+{
+	/* Resuming a pending snapshot; everyone has already been asked */
+	if (!self->data.pending) {
+		atomic_fetch_add(histogram_generation(self), 1);
+		BufferedHistogramData_flush_pending(self);
+	}
+	return histogram_snapshot(&self->data, block);
+}
+
+static PyObject *BufferedHistogramData_snapshot(BufferedHistogramDataObject *self,
+						PyObject *Py_UNUSED(ignored))
+{
+	return buffered_histogram_snapshot(self, true);
+}
+
+static PyObject *BufferedHistogramData_try_snapshot(BufferedHistogramDataObject *self,
+						    PyObject *Py_UNUSED(ignored))
+{
+	return buffered_histogram_snapshot(self, false);
+}
+
+static PyObject *BufferedHistogramData_size_of(PyObject *cls, PyObject *arg)
+{
+	size_t bucket_count = PyLong_AsSize_t(arg);
+
+	if (bucket_count == (size_t)-1 && PyErr_Occurred())
+		return NULL;
+	/* Plus the generation */
+	return PyLong_FromSize_t(histogram_size(bucket_count) +
+				 sizeof(uint64_t));
+}
+
+static PyMethodDef BufferedHistogramData_methods[] = {
+	{
+		.ml_name = "size_of",
+		.ml_meth = (PyCFunction)BufferedHistogramData_size_of,
+		.ml_flags = METH_O | METH_CLASS,
+		.ml_doc = "Get the size of the data for a number of buckets",
+	},
+	{
+		.ml_name = "_setstate",
+		.ml_meth = (PyCFunction)BufferedHistogramData_setstate,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+	},
+	{
+		.ml_name = "observe",
+		.ml_meth = (PyCFunction)BufferedHistogramData_observe,
+		.ml_flags = METH_O,
+		.ml_doc = "Add an observation to this process's pending observations",
+	},
+	{
+		.ml_name = "flush",
+		.ml_meth = (PyCFunction)BufferedHistogramData_flush,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Publish this process's pending observations",
+	},
+	{
+		.ml_name = "snapshot",
+		.ml_meth = (PyCFunction)BufferedHistogramData_snapshot,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Ask all processes to flush, and get the bucket counts, sum, and count. Snapshots must be serialized.",
+	},
+	{
+		.ml_name = "try_snapshot",
+		.ml_meth = (PyCFunction)BufferedHistogramData_try_snapshot,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Like snapshot, but return None instead of waiting for observers. The snapshot stays pending until this (or snapshot) is called again.",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject BufferedHistogramDataType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(BufferedHistogramDataObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.BufferedHistogramData",
+	.tp_doc = "Buffered atomic histogram data",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)BufferedHistogramData_init,
+	.tp_dealloc = (destructor)BufferedHistogramData_dealloc,
+	.tp_methods = BufferedHistogramData_methods,
+};
+
+int HistogramTypes_Add(PyObject *m)
+{
+	int ret;
+
+	if (!atomic_is_lock_free((_Atomic uint64_t *)NULL) ||
+	    !atomic_is_lock_free((_Atomic double *)NULL)) {
+		Py_INCREF(Py_None);
+		ret = PyModule_AddObject(m, "HistogramData", Py_None);
+		if (ret) {
+			Py_DECREF(Py_None);
+			return ret;
+		}
+
+		Py_INCREF(Py_None);
+		ret = PyModule_AddObject(m, "BufferedHistogramData", Py_None);
+		if (ret)
+			Py_DECREF(Py_None);
+		return ret;
+	}
+
+	if (PyType_AddSizeConstant(&HistogramDataType, "align",
+				   HISTOGRAM_LINE_SIZE))
+		return -1;
+
+	HistogramDataType.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	ret = PyModule_AddType(m, &HistogramDataType);
+	Py_DECREF(&BufferType);
+	if (ret)
+		return ret;
+
+	BufferedHistogramDataType.tp_base = &HistogramDataType;
+	return PyModule_AddType(m, &BufferedHistogramDataType);
+}
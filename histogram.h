@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Histogram layout in shared memory (see histogram.c for how it's used):
+ *
+ *	double thresholds[bucket_count];
+ *	(padding to a cache line)
+ *	_Atomic uint64_t count;
+ *	struct histogram_half data[2];
+ *	(padding to a cache line)
+ *	struct histogram_half saved[2];
+ *
+ * Observers write count and the hot half, but only read the thresholds, so
+ * they are kept on separate cache lines. This way, every CPU can keep its own
+ * copy of the thresholds. Snapshots write the saved halves, which are also
+ * kept away from the lines observers write.
+ */
+struct histogram_half {
+	_Atomic uint64_t count;
+	/* Histograms with frac_bits have fixed-point sums (see fixed.h) */
+	union {
+		_Atomic double sum;
+		_Atomic int64_t fixed_sum;
+	};
+	_Atomic uint64_t buckets[];
+};
+
+#define HISTOGRAM_LINE_SIZE 64
+
+static inline size_t histogram_line_align(size_t size)
+{
+	return (size + HISTOGRAM_LINE_SIZE - 1) & ~(size_t)(HISTOGRAM_LINE_SIZE - 1);
+}
+
+static inline size_t histogram_count_offset(size_t bucket_count)
+{
+	return histogram_line_align(bucket_count * sizeof(double));
+}
+
+static inline size_t histogram_half_size(size_t bucket_count)
+{
+	return sizeof(struct histogram_half) + bucket_count * sizeof(uint64_t);
+}
+
+/* Halves 0 and 1 are data, 2 and 3 are saved, and 4 is the end */
+static inline size_t histogram_half_offset(size_t bucket_count, unsigned int i)
+{
+	size_t data = histogram_count_offset(bucket_count) + sizeof(uint64_t);
+	size_t half_size = histogram_half_size(bucket_count);
+
+	if (i < 2)
+		return data + i * half_size;
+	return histogram_line_align(data + 2 * half_size) + (i - 2) * half_size;
+}
+
+static inline size_t histogram_size(size_t bucket_count)
+{
+	return histogram_half_offset(bucket_count, 4);
+}
+
+#endif /* HISTOGRAM_H */
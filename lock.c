@@ -6,12 +6,19 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <linux/futex.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "_mpmetrics.h"
+#include "stats.h"
 
 static pthread_mutexattr_t mutexattr;
 
@@ -47,12 +54,17 @@ static PyObject *Lock_do_acquire(LockObject *self, bool block,
 	int err;
 
 	Py_BEGIN_ALLOW_THREADS
-	if (!block)
-		err = pthread_mutex_trylock(self->shm.buf);
-	else if (deadline)
-		err = pthread_mutex_timedlock(self->shm.buf, deadline);
-	else
-		err = pthread_mutex_lock(self->shm.buf);
+	/* Try first, so that we know whether we had to wait */
+	err = pthread_mutex_trylock(self->shm.buf);
+	if (err == EBUSY && block) {
+		uint64_t start = stat_wait_start();
+
+		if (deadline)
+			err = pthread_mutex_timedlock(self->shm.buf, deadline);
+		else
+			err = pthread_mutex_lock(self->shm.buf);
+		stat_wait(start);
+	}
 	Py_END_ALLOW_THREADS
 
 	if (!err)
@@ -61,15 +73,18 @@ static PyObject *Lock_do_acquire(LockObject *self, bool block,
 	if (err == EBUSY || err == ETIMEDOUT)
 		Py_RETURN_FALSE;
 
-	errno = err;
-	PyErr_SetFromErrno(PyExc_OSError);
-
 	/*
-	 * We can't recover here, so just break the mutex and let the
-	 * error propegate
+	 * We can't recover the state the mutex protects, so just let the error
+	 * propegate. Mark the mutex as consistent first, since otherwise it
+	 * would be unusable forever (even after reopening a persistent heap).
 	 */
-	if (err == EOWNERDEAD)
+	if (err == EOWNERDEAD) {
+		pthread_mutex_consistent(self->shm.buf);
 		pthread_mutex_unlock(self->shm.buf);
+	}
+
+	errno = err;
+	PyErr_SetFromErrno(PyExc_OSError);
 	return NULL;
 }
 
@@ -103,15 +118,30 @@ static int convert_timeout(PyObject *obj, struct optional_timespec *deadline)
 	return 1;
 }
 
-static PyObject *Lock_acquire(LockObject *self, PyObject *args, PyObject *kwds)
+static PyObject *Lock_acquire(LockObject *self, PyObject *const *args,
+			      Py_ssize_t nargs, PyObject *kwnames)
 {
-	char *keywords[] = { "block", "timeout", NULL };
+	static const char *const keywords[] = { "block", "timeout", NULL };
+	PyObject *argv[2];
 	int block = true;
 	struct optional_timespec deadline;
 
+	/* Skip the keyword machinery for the common acquire() */
+	if (!nargs && !kwnames)
+		return Lock_do_acquire(self, true, NULL);
+
+	if (PyArg_UnpackFastcall("acquire", args, nargs, kwnames, keywords, 0,
+				 argv))
+		return NULL;
+
+	if (argv[0]) {
+		block = PyObject_IsTrue(argv[0]);
+		if (block < 0)
+			return NULL;
+	}
+
 	deadline.valid = false;
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pO&", keywords, &block,
-					 convert_timeout, &deadline))
+	if (argv[1] && !convert_timeout(argv[1], &deadline))
 		return NULL;
 
 	return Lock_do_acquire(self, block,
@@ -152,7 +182,7 @@ static PyMethodDef Lock_methods[] = {
 	{
 		.ml_name = "acquire",
 		.ml_meth = (PyCFunction)Lock_acquire,
-		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
 		.ml_doc = "Acquire the lock",
 	},
 	{
@@ -224,3 +254,823 @@ error:
 	Py_DECREF(&BufferType);
 	return err;
 }
+
+/*
+ * Futex locks are a lighter alternative to Lock. The lock word holds the
+ * thread ID of the owner (or 0 when unlocked), plus FUTEX_WAITERS when other
+ * threads may be sleeping on it. Uncontended operations never make a system
+ * call or release the GIL. Contended acquires spin for a little while before
+ * sleeping. Sleepers periodically check whether the owner still exists, so
+ * locks held by dead processes are detected like with robust mutexes.
+ */
+#define FUTEX_SPINS 100
+#define FUTEX_POLL_NSEC 10000000
+
+typedef BufferObject FutexLockObject;
+
+static uint32_t current_tid(void)
+{
+	static _Thread_local uint32_t tid;
+	static _Thread_local unsigned long generation;
+
+	/* The thread calling fork has a new ID in the child */
+	if (!tid || generation != fork_generation) {
+		tid = syscall(SYS_gettid);
+		generation = fork_generation;
+	}
+	return tid;
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static long futex(_Atomic uint32_t *word, int op, uint32_t val,
+		  const struct timespec *timeout)
+{
+	return syscall(SYS_futex, word, op, val, timeout, NULL,
+		       FUTEX_BITSET_MATCH_ANY);
+}
+
+/* Zombies can still be signalled, so death is only noticed once the owner is reaped */
+static bool futex_owner_dead(uint32_t word)
+{
+	pid_t owner = word & FUTEX_TID_MASK;
+
+	return owner && kill(owner, 0) && errno == ESRCH;
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+/*
+ * Sleep while word is val (or until deadline), waking up every so often to
+ * let the caller check on the owner. Returns true if we timed out, and sets
+ * *last if we have reached the deadline.
+ */
+static bool futex_sleep(_Atomic uint32_t *word, uint32_t val,
+			const struct timespec *deadline, bool *last)
+{
+	struct timespec until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_nsec += FUTEX_POLL_NSEC;
+	until.tv_sec += until.tv_nsec / NSEC_PER_SEC;
+	until.tv_nsec %= NSEC_PER_SEC;
+
+	*last = false;
+	if (deadline && !timespec_before(&until, deadline)) {
+		until = *deadline;
+		*last = true;
+	}
+
+	return futex(word, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME, val,
+		     &until) && errno == ETIMEDOUT;
+}
+
+/*
+ * Release a lock whose owner has died. Like Lock, nothing can be done about
+ * the state it protects, so just report the error to whoever noticed.
+ */
+static int futex_break(_Atomic uint32_t *word, uint32_t old)
+{
+	if (atomic_compare_exchange_strong(word, &old, 0)) {
+		if (old & FUTEX_WAITERS)
+			futex(word, FUTEX_WAKE, INT_MAX, NULL);
+		errno = EOWNERDEAD;
+		return -1;
+	}
+	return 1;
+}
+
+/* Returns 0 if we got the lock, 1 if we didn't, and -1 on error (in errno) */
+static int futex_trylock(_Atomic uint32_t *word, uint32_t tid, bool spin)
+{
+	uint32_t old = 0;
+	int i;
+
+	if (atomic_compare_exchange_strong(word, &old, tid))
+		return 0;
+
+	if ((old & FUTEX_TID_MASK) == tid) {
+		errno = EDEADLK;
+		return -1;
+	}
+
+	for (i = 0; spin && i < FUTEX_SPINS; i++) {
+		cpu_relax();
+		old = atomic_load_explicit(word, memory_order_relaxed);
+		if (!old && atomic_compare_exchange_weak(word, &old, tid))
+			return 0;
+	}
+
+	if (futex_owner_dead(old))
+		return futex_break(word, old);
+	return 1;
+}
+
+/* Sleep until we get the lock. This may be called without the GIL. */
+static int futex_lock(_Atomic uint32_t *word, uint32_t tid,
+		      const struct timespec *deadline)
+{
+	uint32_t old = atomic_load(word);
+
+	for (;;) {
+		bool last;
+
+		if (!old) {
+			/* Other threads may still be waiting, so keep FUTEX_WAITERS */
+			if (atomic_compare_exchange_weak(word, &old,
+							 tid | FUTEX_WAITERS))
+				return 0;
+			continue;
+		}
+
+		if (!(old & FUTEX_WAITERS) &&
+		    !atomic_compare_exchange_weak(word, &old,
+						  old | FUTEX_WAITERS))
+			continue;
+		old |= FUTEX_WAITERS;
+
+		if (futex_sleep(word, old, deadline, &last)) {
+			uint32_t cur = atomic_load(word);
+
+			if ((cur & FUTEX_TID_MASK) == (old & FUTEX_TID_MASK) &&
+			    futex_owner_dead(cur)) {
+				int ret = futex_break(word, cur);
+
+				if (ret <= 0)
+					return ret;
+			}
+
+			if (last)
+				return 1;
+		}
+
+		old = atomic_load(word);
+	}
+}
+
+static PyObject *FutexLock_do_acquire(FutexLockObject *self, bool block,
+				      struct timespec *deadline)
+{
+	uint32_t tid = current_tid();
+	int ret;
+
+	ret = futex_trylock(self->shm.buf, tid, block);
+	if (ret == 1 && block) {
+		Py_BEGIN_ALLOW_THREADS
+		uint64_t start = stat_wait_start();
+
+		ret = futex_lock(self->shm.buf, tid, deadline);
+		stat_wait(start);
+		Py_END_ALLOW_THREADS
+	}
+
+	if (!ret)
+		Py_RETURN_TRUE;
+	if (ret == 1)
+		Py_RETURN_FALSE;
+
+	PyErr_SetFromErrno(PyExc_OSError);
+	return NULL;
+}
+
+static int FutexLock_init(FutexLockObject *self, PyObject *args,
+			  PyObject *kwds)
+{
+	int err;
+
+	err = BufferType.tp_init((PyObject *)self, args, kwds);
+	if (err)
+		return err;
+
+	atomic_init((_Atomic uint32_t *)self->shm.buf, 0);
+	return 0;
+}
+
+static PyObject *FutexLock_acquire(FutexLockObject *self,
+				   PyObject *const *args, Py_ssize_t nargs,
+				   PyObject *kwnames)
+{
+	static const char *const keywords[] = { "block", "timeout", NULL };
+	PyObject *argv[2];
+	int block = true;
+	struct optional_timespec deadline;
+
+	/* Skip the keyword machinery for the common acquire() */
+	if (!nargs && !kwnames)
+		return FutexLock_do_acquire(self, true, NULL);
+
+	if (PyArg_UnpackFastcall("acquire", args, nargs, kwnames, keywords, 0,
+				 argv))
+		return NULL;
+
+	if (argv[0]) {
+		block = PyObject_IsTrue(argv[0]);
+		if (block < 0)
+			return NULL;
+	}
+
+	deadline.valid = false;
+	if (argv[1] && !convert_timeout(argv[1], &deadline))
+		return NULL;
+
+	return FutexLock_do_acquire(self, block,
+				    deadline.valid ? &deadline.ts : NULL);
+}
+
+static PyObject *FutexLock_release(FutexLockObject *self,
+				   PyObject *Py_UNUSED(ignored))
+{
+	_Atomic uint32_t *word = self->shm.buf;
+	uint32_t old = atomic_load(word);
+
+	if ((old & FUTEX_TID_MASK) != current_tid()) {
+		errno = EPERM;
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
+	}
+
+	/* Nobody else can clear FUTEX_WAITERS, so this can't race */
+	old = atomic_exchange(word, 0);
+	if (old & FUTEX_WAITERS)
+		futex(word, FUTEX_WAKE, 1, NULL);
+	Py_RETURN_NONE;
+}
+
+static PyObject *FutexLock_enter(FutexLockObject *self,
+				 PyObject *Py_UNUSED(ignored))
+{
+	return FutexLock_do_acquire(self, true, NULL);
+}
+
+static PyObject *FutexLock_exit(FutexLockObject *self, PyObject *const *args,
+				Py_ssize_t nargs)
+{
+	return FutexLock_release(self, NULL);
+}
+
+static PyMethodDef FutexLock_methods[] = {
+	{
+		.ml_name = "acquire",
+		.ml_meth = (PyCFunction)FutexLock_acquire,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Acquire the lock",
+	},
+	{
+		.ml_name = "release",
+		.ml_meth = (PyCFunction)FutexLock_release,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Release the lock",
+	},
+	{
+		.ml_name = "__enter__",
+		.ml_meth = (PyCFunction)FutexLock_enter,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Enter a critical section",
+	},
+	{
+		.ml_name = "__exit__",
+		.ml_meth = (PyCFunction)FutexLock_exit,
+		.ml_flags = METH_FASTCALL,
+		.ml_doc = "Exit a critical section",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject FutexLockType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(FutexLockObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.FutexLock",
+	.tp_doc = "Shared memory lock which spins before sleeping on a futex",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)FutexLock_init,
+	.tp_methods = FutexLock_methods,
+};
+
+int FutexLockType_Add(PyObject *m)
+{
+	int err;
+
+	if (PyType_AddSizeConstant(&FutexLockType, "size", sizeof(uint32_t)))
+		return -1;
+
+	if (PyType_AddSizeConstant(&FutexLockType, "align", alignof(uint32_t)))
+		return -1;
+
+	FutexLockType.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	err = PyModule_AddType(m, &FutexLockType);
+	Py_DECREF(&BufferType);
+	return err;
+}
+
+/*
+ * Reader-writer locks may be held by any number of readers, or by one
+ * writer. The lock word holds the thread ID of the writer (or 0), plus
+ * RWLOCK_WAITERS. The writer takes the lock and records its ID with the same
+ * CAS, so a writer which dies at any point can be detected. Thread IDs fit in
+ * FUTEX_TID_MASK (pid_max is at most 2^22), leaving room for RWLOCK_WAITERS.
+ * Each reader records its thread ID in a slot, so a writer can tell which
+ * readers have died and forget them. Readers are preferred, so a writer
+ * waits until every slot is empty, and backs off if a reader shows up while
+ * it is taking the lock. If every slot is taken, more readers wait for one
+ * to be released. Like FutexLock, waiters check whether the writer has died.
+ */
+#define RWLOCK_WRITER	FUTEX_TID_MASK
+#define RWLOCK_WAITERS	(UINT32_C(1) << 30)
+/* Enough to fill a cache line */
+#define RWLOCK_SLOTS	15
+
+struct rwlock {
+	_Atomic uint32_t word;
+	/* Thread IDs of the readers (or 0 for free slots) */
+	_Atomic uint32_t readers[RWLOCK_SLOTS];
+};
+
+typedef BufferObject RWLockObject;
+
+typedef struct {
+	PyObject_HEAD
+	RWLockObject *lock;
+} RWLockReaderObject;
+
+/* Returns the slot held by tid, or -1 if it doesn't hold one */
+static int rwlock_slot(struct rwlock *l, uint32_t tid)
+{
+	int i;
+
+	for (i = 0; i < RWLOCK_SLOTS; i++)
+		if (atomic_load(&l->readers[i]) == tid)
+			return i;
+	return -1;
+}
+
+static bool rwlock_has_readers(struct rwlock *l)
+{
+	int i;
+
+	for (i = 0; i < RWLOCK_SLOTS; i++)
+		if (atomic_load(&l->readers[i]))
+			return true;
+	return false;
+}
+
+static bool rwlock_busy(struct rwlock *l, uint32_t word, bool write)
+{
+	if (word & RWLOCK_WRITER)
+		return true;
+	/* Readers only have to wait for a free slot */
+	if (write)
+		return rwlock_has_readers(l);
+	return rwlock_slot(l, 0) < 0;
+}
+
+/* Wake up everyone waiting for the lock to become less busy */
+static void rwlock_wake(struct rwlock *l)
+{
+	if (atomic_fetch_and(&l->word, ~RWLOCK_WAITERS) & RWLOCK_WAITERS)
+		futex(&l->word, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/*
+ * Free the slots of readers which have died. Readers never modify what the
+ * lock protects, so unlike for writers there is no error to report. Returns
+ * true if any slots were freed.
+ */
+static bool rwlock_reap(struct rwlock *l)
+{
+	bool reaped = false;
+	int i;
+
+	for (i = 0; i < RWLOCK_SLOTS; i++) {
+		uint32_t reader = atomic_load(&l->readers[i]);
+
+		if (futex_owner_dead(reader) &&
+		    atomic_compare_exchange_strong(&l->readers[i], &reader, 0))
+			reaped = true;
+	}
+
+	if (reaped)
+		rwlock_wake(l);
+	return reaped;
+}
+
+/* Release a lock whose writer has died, like futex_break */
+static int rwlock_break(struct rwlock *l)
+{
+	uint32_t old = atomic_load(&l->word);
+
+	/* Only waiters can change the word, and they only set RWLOCK_WAITERS */
+	do {
+		if (!futex_owner_dead(old & RWLOCK_WRITER))
+			return 1;
+	} while (!atomic_compare_exchange_weak(&l->word, &old, 0));
+
+	if (old & RWLOCK_WAITERS)
+		futex(&l->word, FUTEX_WAKE, INT_MAX, NULL);
+	errno = EOWNERDEAD;
+	return -1;
+}
+
+/* Returns 0 if we got the lock, 1 if we didn't, and -1 on error (in errno) */
+static int rwlock_try(struct rwlock *l, uint32_t tid, bool write)
+{
+	uint32_t old = atomic_load(&l->word);
+	int i, slot;
+
+	if (write) {
+		do {
+			if (rwlock_busy(l, old, true))
+				return 1;
+		} while (!atomic_compare_exchange_weak(&l->word, &old,
+						       old | tid));
+
+		/* A reader might have taken a slot before seeing us */
+		if (rwlock_has_readers(l)) {
+			old = atomic_fetch_and(&l->word,
+					       ~(RWLOCK_WRITER | RWLOCK_WAITERS));
+			if (old & RWLOCK_WAITERS)
+				futex(&l->word, FUTEX_WAKE, INT_MAX, NULL);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (old & RWLOCK_WRITER)
+		return 1;
+
+	/* Spread readers out, so they usually get a slot on the first try */
+	for (i = 0; i < RWLOCK_SLOTS; i++) {
+		uint32_t free = 0;
+
+		slot = (tid + i) % RWLOCK_SLOTS;
+		if (atomic_compare_exchange_strong(&l->readers[slot], &free,
+						   tid))
+			break;
+	}
+	if (i == RWLOCK_SLOTS)
+		return 1;
+
+	/* Let the writer have the lock if it got there first */
+	if (atomic_load(&l->word) & RWLOCK_WRITER) {
+		atomic_store(&l->readers[slot], 0);
+		return 1;
+	}
+	return 0;
+}
+
+static int rwlock_trylock(struct rwlock *l, uint32_t tid, bool write,
+			  bool spin)
+{
+	int i, ret;
+
+	if ((atomic_load(&l->word) & RWLOCK_WRITER) == tid) {
+		errno = EDEADLK;
+		return -1;
+	}
+
+	/* We'd wait for ourselves forever */
+	if (write && rwlock_slot(l, tid) >= 0) {
+		if (!spin)
+			return 1;
+		errno = EDEADLK;
+		return -1;
+	}
+
+	ret = rwlock_try(l, tid, write);
+	for (i = 0; ret == 1 && spin && i < FUTEX_SPINS; i++) {
+		cpu_relax();
+		ret = rwlock_try(l, tid, write);
+	}
+
+	if (ret == 1 && rwlock_reap(l))
+		ret = rwlock_try(l, tid, write);
+	if (ret == 1 && (atomic_load(&l->word) & RWLOCK_WRITER))
+		return rwlock_break(l);
+	return ret;
+}
+
+/* Sleep until we get the lock. This may be called without the GIL. */
+static int rwlock_lock(struct rwlock *l, uint32_t tid, bool write,
+		       const struct timespec *deadline)
+{
+	for (;;) {
+		uint32_t old;
+		bool last;
+		int ret;
+
+		ret = rwlock_try(l, tid, write);
+		if (ret <= 0)
+			return ret;
+
+		old = atomic_load(&l->word);
+		if (!(old & RWLOCK_WAITERS) &&
+		    !atomic_compare_exchange_weak(&l->word, &old,
+						  old | RWLOCK_WAITERS))
+			continue;
+
+		/*
+		 * Whoever makes the lock less busy clears RWLOCK_WAITERS, so
+		 * check again now that it's set, or we might miss the wakeup.
+		 */
+		if (!rwlock_busy(l, old, write))
+			continue;
+
+		if (futex_sleep(&l->word, old | RWLOCK_WAITERS, deadline,
+				&last)) {
+			if (rwlock_reap(l))
+				continue;
+
+			if ((atomic_load(&l->word) & RWLOCK_WRITER)) {
+				ret = rwlock_break(l);
+				if (ret <= 0)
+					return ret;
+			}
+
+			if (last)
+				return 1;
+		}
+	}
+}
+
+static PyObject *RWLock_do_acquire(RWLockObject *self, bool write, bool block,
+				   struct timespec *deadline)
+{
+	uint32_t tid = current_tid();
+	int ret;
+
+	ret = rwlock_trylock(self->shm.buf, tid, write, block);
+	if (ret == 1 && block) {
+		Py_BEGIN_ALLOW_THREADS
+		uint64_t start = stat_wait_start();
+
+		ret = rwlock_lock(self->shm.buf, tid, write, deadline);
+		stat_wait(start);
+		Py_END_ALLOW_THREADS
+	}
+
+	if (!ret)
+		Py_RETURN_TRUE;
+	if (ret == 1)
+		Py_RETURN_FALSE;
+
+	PyErr_SetFromErrno(PyExc_OSError);
+	return NULL;
+}
+
+static PyObject *RWLock_acquire_common(RWLockObject *self, bool write,
+				       const char *fname, PyObject *const *args,
+				       Py_ssize_t nargs, PyObject *kwnames)
+{
+	static const char *const keywords[] = { "block", "timeout", NULL };
+	PyObject *argv[2];
+	int block = true;
+	struct optional_timespec deadline;
+
+	/* Skip the keyword machinery for the common acquire() */
+	if (!nargs && !kwnames)
+		return RWLock_do_acquire(self, write, true, NULL);
+
+	if (PyArg_UnpackFastcall(fname, args, nargs, kwnames, keywords, 0,
+				 argv))
+		return NULL;
+
+	if (argv[0]) {
+		block = PyObject_IsTrue(argv[0]);
+		if (block < 0)
+			return NULL;
+	}
+
+	deadline.valid = false;
+	if (argv[1] && !convert_timeout(argv[1], &deadline))
+		return NULL;
+
+	return RWLock_do_acquire(self, write, block,
+				 deadline.valid ? &deadline.ts : NULL);
+}
+
+static int RWLock_init(RWLockObject *self, PyObject *args, PyObject *kwds)
+{
+	struct rwlock *l;
+	int err, i;
+
+	err = BufferType.tp_init((PyObject *)self, args, kwds);
+	if (err)
+		return err;
+
+	l = self->shm.buf;
+	atomic_init(&l->word, 0);
+	for (i = 0; i < RWLOCK_SLOTS; i++)
+		atomic_init(&l->readers[i], 0);
+	return 0;
+}
+
+static PyObject *RWLock_acquire(RWLockObject *self, PyObject *const *args,
+				Py_ssize_t nargs, PyObject *kwnames)
+{
+	return RWLock_acquire_common(self, true, "acquire", args, nargs,
+				     kwnames);
+}
+
+static PyObject *RWLock_acquire_read(RWLockObject *self, PyObject *const *args,
+				     Py_ssize_t nargs, PyObject *kwnames)
+{
+	return RWLock_acquire_common(self, false, "acquire_read", args, nargs,
+				     kwnames);
+}
+
+static PyObject *RWLock_release(RWLockObject *self,
+				PyObject *Py_UNUSED(ignored))
+{
+	struct rwlock *l = self->shm.buf;
+	uint32_t old;
+
+	if ((atomic_load(&l->word) & RWLOCK_WRITER) != current_tid()) {
+		errno = EPERM;
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
+	}
+
+	old = atomic_fetch_and(&l->word, ~(RWLOCK_WRITER | RWLOCK_WAITERS));
+	if (old & RWLOCK_WAITERS)
+		futex(&l->word, FUTEX_WAKE, INT_MAX, NULL);
+	Py_RETURN_NONE;
+}
+
+static PyObject *RWLock_release_read(RWLockObject *self,
+				     PyObject *Py_UNUSED(ignored))
+{
+	struct rwlock *l = self->shm.buf;
+	int slot = rwlock_slot(l, current_tid());
+
+	if (slot < 0) {
+		errno = EPERM;
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
+	}
+
+	atomic_store(&l->readers[slot], 0);
+	rwlock_wake(l);
+	Py_RETURN_NONE;
+}
+
+static PyTypeObject RWLockReaderType;
+
+static PyObject *RWLock_reader(RWLockObject *self,
+			       PyObject *Py_UNUSED(ignored))
+{
+	RWLockReaderObject *reader;
+
+	reader = PyObject_New(RWLockReaderObject, &RWLockReaderType);
+	if (!reader)
+		return NULL;
+
+	Py_INCREF(self);
+	reader->lock = self;
+	return (PyObject *)reader;
+}
+
+static PyObject *RWLock_enter(RWLockObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return RWLock_do_acquire(self, true, true, NULL);
+}
+
+static PyObject *RWLock_exit(RWLockObject *self, PyObject *const *args,
+			     Py_ssize_t nargs)
+{
+	return RWLock_release(self, NULL);
+}
+
+static PyMethodDef RWLock_methods[] = {
+	{
+		.ml_name = "acquire",
+		.ml_meth = (PyCFunction)RWLock_acquire,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Acquire the lock for writing",
+	},
+	{
+		.ml_name = "release",
+		.ml_meth = (PyCFunction)RWLock_release,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Release the lock after writing",
+	},
+	{
+		.ml_name = "acquire_read",
+		.ml_meth = (PyCFunction)RWLock_acquire_read,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Acquire the lock for reading",
+	},
+	{
+		.ml_name = "release_read",
+		.ml_meth = (PyCFunction)RWLock_release_read,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Release the lock after reading",
+	},
+	{
+		.ml_name = "reader",
+		.ml_meth = (PyCFunction)RWLock_reader,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Get a context manager which holds the lock for reading",
+	},
+	{
+		.ml_name = "__enter__",
+		.ml_meth = (PyCFunction)RWLock_enter,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Enter a critical section for writing",
+	},
+	{
+		.ml_name = "__exit__",
+		.ml_meth = (PyCFunction)RWLock_exit,
+		.ml_flags = METH_FASTCALL,
+		.ml_doc = "Exit a critical section for writing",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject RWLockType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(RWLockObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.RWLock",
+	.tp_doc = "Shared memory reader-writer lock",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)RWLock_init,
+	.tp_methods = RWLock_methods,
+};
+
+static void RWLockReader_dealloc(RWLockReaderObject *self)
+{
+	Py_DECREF(self->lock);
+	PyObject_Free(self);
+}
+
+static PyObject *RWLockReader_enter(RWLockReaderObject *self,
+				    PyObject *Py_UNUSED(ignored))
+{
+	return RWLock_do_acquire(self->lock, false, true, NULL);
+}
+
+static PyObject *RWLockReader_exit(RWLockReaderObject *self,
+				   PyObject *const *args, Py_ssize_t nargs)
+{
+	return RWLock_release_read(self->lock, NULL);
+}
+
+static PyMethodDef RWLockReader_methods[] = {
+	{
+		.ml_name = "__enter__",
+		.ml_meth = (PyCFunction)RWLockReader_enter,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Enter a critical section for reading",
+	},
+	{
+		.ml_name = "__exit__",
+		.ml_meth = (PyCFunction)RWLockReader_exit,
+		.ml_flags = METH_FASTCALL,
+		.ml_doc = "Exit a critical section for reading",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject RWLockReaderType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(RWLockReaderObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_name = "_mpmetrics.RWLockReader",
+	.tp_doc = "Read side of a reader-writer lock",
+	.tp_dealloc = (destructor)RWLockReader_dealloc,
+	.tp_methods = RWLockReader_methods,
+};
+
+int RWLockType_Add(PyObject *m)
+{
+	int err;
+
+	if (PyType_Ready(&RWLockReaderType))
+		return -1;
+
+	if (PyType_AddSizeConstant(&RWLockType, "size", sizeof(struct rwlock)))
+		return -1;
+
+	if (PyType_AddSizeConstant(&RWLockType, "align",
+				   alignof(struct rwlock)))
+		return -1;
+
+	RWLockType.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	err = PyModule_AddType(m, &RWLockType);
+	Py_DECREF(&BufferType);
+	return err;
+}
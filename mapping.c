@@ -0,0 +1,378 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <linux/mempolicy.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "_mpmetrics.h"
+
+#define MAX_NUMNODES 1024
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+struct mempolicy {
+	int mode;
+	unsigned long nodemask[MAX_NUMNODES / BITS_PER_LONG];
+};
+
+/*
+ * A mapping reserves a range of address space up front, and then maps more of
+ * a file into it as the file grows. Since the mapping never moves, offsets
+ * into the file can be turned into pointers with plain arithmetic, and
+ * objects may span any number of pages.
+ */
+typedef struct {
+	PyObject_HEAD
+	char *base;
+	size_t reserved, mapped;
+	int fd;
+	struct mempolicy policy;
+} MappingObject;
+
+static int mempolicy_parse(struct mempolicy *policy, int mode,
+			   PyObject *nodes)
+{
+	PyObject *iter, *item;
+
+	memset(policy, 0, sizeof(*policy));
+	policy->mode = mode;
+	if (nodes == Py_None)
+		return 0;
+
+	iter = PyObject_GetIter(nodes);
+	if (!iter)
+		return -1;
+
+	while ((item = PyIter_Next(iter))) {
+		size_t node = PyLong_AsSize_t(item);
+
+		Py_DECREF(item);
+		if (node == (size_t)-1 && PyErr_Occurred())
+			break;
+
+		if (node >= MAX_NUMNODES) {
+			PyErr_Format(PyExc_ValueError, "invalid NUMA node %zu",
+				     node);
+			break;
+		}
+		policy->nodemask[node / BITS_PER_LONG] |=
+			1UL << (node % BITS_PER_LONG);
+	}
+
+	Py_DECREF(iter);
+	return PyErr_Occurred() ? -1 : 0;
+}
+
+/* Apply a memory policy to a range, which must start on a page boundary */
+static int mempolicy_apply(const struct mempolicy *policy, void *addr,
+			   size_t len)
+{
+	if (policy->mode == MPOL_DEFAULT || !len)
+		return 0;
+
+	/* glibc doesn't wrap mbind, and we don't want to depend on libnuma */
+	if (syscall(SYS_mbind, addr, len, policy->mode, policy->nodemask,
+		    MAX_NUMNODES + 1, 0)) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+	return 0;
+}
+
+/* Map as much of the file as we can, and ensure at least size bytes are mapped */
+static int Mapping_grow(MappingObject *self, size_t size)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	size_t end;
+
+	if (size <= self->mapped)
+		return 0;
+
+	if (fstat(self->fd, &st)) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+
+	end = (size_t)st.st_size & ~(pagesize - 1);
+	if (end > self->reserved)
+		end = self->reserved;
+
+	if (end > self->mapped) {
+		if (mmap(self->base + self->mapped, end - self->mapped,
+			 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+			 self->fd, self->mapped) == MAP_FAILED) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
+		}
+
+		if (mempolicy_apply(&self->policy, self->base + self->mapped,
+				    end - self->mapped)) {
+			/* Put back the reservation */
+			mmap(self->base + self->mapped, end - self->mapped,
+			     PROT_NONE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+			     -1, 0);
+			return -1;
+		}
+		self->mapped = end;
+	}
+
+	if (size > self->mapped) {
+		PyErr_Format(PyExc_ValueError,
+			     "offset %zu is past the end of the mapping (%zu bytes)",
+			     size, self->mapped);
+		return -1;
+	}
+	return 0;
+}
+
+static int Mapping_init(MappingObject *self, PyObject *args, PyObject *kwds)
+{
+	char *keywords[] = {
+		"fd", "reserve", "alignment", "mode", "nodes", NULL
+	};
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	Py_ssize_t reserve, alignment = 0;
+	PyObject *nodes = Py_None;
+	char *base, *aligned;
+	int fd, mode = MPOL_DEFAULT;
+
+	if (self->base) {
+		PyErr_SetString(PyExc_RuntimeError, "mapping already initialized");
+		return -1;
+	}
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "in|niO", keywords, &fd,
+					 &reserve, &alignment, &mode, &nodes))
+		return -1;
+
+	if (reserve <= 0 || reserve % pagesize) {
+		PyErr_Format(PyExc_ValueError,
+			     "reserve must be a positive multiple of %zu", pagesize);
+		return -1;
+	}
+
+	if (alignment < (Py_ssize_t)pagesize)
+		alignment = pagesize;
+	if (alignment & (alignment - 1)) {
+		PyErr_SetString(PyExc_ValueError,
+				"alignment must be a power of two");
+		return -1;
+	}
+
+	if (mempolicy_parse(&self->policy, mode, nodes))
+		return -1;
+
+	/* Huge pages must be mapped at aligned addresses, so trim the excess */
+	base = mmap(NULL, reserve + alignment - pagesize, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+
+	aligned = (char *)(((uintptr_t)base + alignment - 1) &
+			   ~(uintptr_t)(alignment - 1));
+	if (aligned != base)
+		munmap(base, aligned - base);
+	if (alignment - pagesize != (size_t)(aligned - base))
+		munmap(aligned + reserve,
+		       alignment - pagesize - (aligned - base));
+	base = aligned;
+
+	/* Keep our own reference to the file, in case our creator closes it */
+	self->fd = dup(fd);
+	if (self->fd < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		munmap(base, reserve);
+		return -1;
+	}
+
+	self->base = base;
+	self->reserved = reserve;
+	self->mapped = 0;
+	return Mapping_grow(self, 0);
+}
+
+static void Mapping_dealloc(MappingObject *self)
+{
+	if (self->base) {
+		munmap(self->base, self->reserved);
+		close(self->fd);
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Mapping_deref(MappingObject *self, PyObject *const *args,
+			       Py_ssize_t nargs, PyObject *kwnames)
+{
+	static const char *const keywords[] = { "start", "size", NULL };
+	PyObject *argv[2], *view, *ret;
+	size_t start, size, end;
+
+	if (PyArg_UnpackFastcall("deref", args, nargs, kwnames, keywords, 2,
+				 argv))
+		return NULL;
+
+	start = PyLong_AsSize_t(argv[0]);
+	if (start == (size_t)-1 && PyErr_Occurred())
+		return NULL;
+
+	size = PyLong_AsSize_t(argv[1]);
+	if (size == (size_t)-1 && PyErr_Occurred())
+		return NULL;
+
+	if (__builtin_add_overflow(start, size, &end) || end > PY_SSIZE_T_MAX) {
+		PyErr_SetString(PyExc_OverflowError, "block too large");
+		return NULL;
+	}
+
+	if (Mapping_grow(self, end))
+		return NULL;
+
+	view = PyMemoryView_FromObject((PyObject *)self);
+	if (!view)
+		return NULL;
+
+	ret = PySequence_GetSlice(view, start, end);
+	Py_DECREF(view);
+	return ret;
+}
+
+static PyObject *Mapping_mbind(PyObject *Py_UNUSED(cls), PyObject *const *args,
+			       Py_ssize_t nargs, PyObject *kwnames)
+{
+	static const char *const keywords[] = { "buffer", "mode", "nodes", NULL };
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	struct mempolicy policy;
+	PyObject *argv[3];
+	uintptr_t start, end;
+	Py_buffer view;
+	long mode;
+	int ret;
+
+	if (PyArg_UnpackFastcall("mbind", args, nargs, kwnames, keywords, 2,
+				 argv))
+		return NULL;
+
+	mode = PyLong_AsLong(argv[1]);
+	if (mode == -1 && PyErr_Occurred())
+		return NULL;
+
+	if (mode < 0 || mode > INT_MAX) {
+		PyErr_Format(PyExc_ValueError, "invalid mode %ld", mode);
+		return NULL;
+	}
+
+	if (mempolicy_parse(&policy, mode, argv[2] ? argv[2] : Py_None))
+		return NULL;
+
+	if (PyObject_GetBuffer(argv[0], &view, PyBUF_SIMPLE))
+		return NULL;
+
+	start = (uintptr_t)view.buf & ~(uintptr_t)(pagesize - 1);
+	end = (uintptr_t)view.buf + view.len;
+	ret = mempolicy_apply(&policy, (void *)start, end - start);
+	PyBuffer_Release(&view);
+	if (ret)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *Mapping_get_mapped(MappingObject *self, void *closure)
+{
+	return PyLong_FromSize_t(self->mapped);
+}
+
+static PyObject *Mapping_get_reserved(MappingObject *self, void *closure)
+{
+	return PyLong_FromSize_t(self->reserved);
+}
+
+static int Mapping_getbuffer(MappingObject *self, Py_buffer *view, int flags)
+{
+	if (!self->base) {
+		PyErr_SetString(PyExc_BufferError, "mapping not initialized");
+		view->obj = NULL;
+		return -1;
+	}
+
+	return PyBuffer_FillInfo(view, (PyObject *)self, self->base,
+				 self->mapped, 0, flags);
+}
+
+static PyBufferProcs Mapping_buffer = {
+	.bf_getbuffer = (getbufferproc)Mapping_getbuffer,
+};
+
+static PyGetSetDef Mapping_getset[] = {
+	{
+		.name = "mapped",
+		.get = (getter)Mapping_get_mapped,
+		.doc = "Number of bytes of the file which are currently mapped",
+	},
+	{
+		.name = "reserved",
+		.get = (getter)Mapping_get_reserved,
+		.doc = "Number of bytes of address space reserved for the file",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyMethodDef Mapping_methods[] = {
+	{
+		.ml_name = "deref",
+		.ml_meth = (PyCFunction)Mapping_deref,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Get a memoryview of size bytes at start, mapping more of the file if necessary",
+	},
+	{
+		.ml_name = "mbind",
+		.ml_meth = (PyCFunction)Mapping_mbind,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS | METH_STATIC,
+		.ml_doc = "Apply a NUMA memory policy (mode and nodes) to the pages of a buffer",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject MappingType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(MappingObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.Mapping",
+	.tp_doc = "Contiguous shared mapping of a growing file",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)Mapping_init,
+	.tp_dealloc = (destructor)Mapping_dealloc,
+	.tp_methods = Mapping_methods,
+	.tp_getset = Mapping_getset,
+	.tp_as_buffer = &Mapping_buffer,
+};
+
+int MappingType_Add(PyObject *m)
+{
+	if (PyType_AddLLConstant(&MappingType, "MPOL_DEFAULT", MPOL_DEFAULT))
+		return -1;
+
+	if (PyType_AddLLConstant(&MappingType, "MPOL_PREFERRED",
+				 MPOL_PREFERRED))
+		return -1;
+
+	if (PyType_AddLLConstant(&MappingType, "MPOL_BIND", MPOL_BIND))
+		return -1;
+
+	if (PyType_AddLLConstant(&MappingType, "MPOL_INTERLEAVE",
+				 MPOL_INTERLEAVE))
+		return -1;
+
+	return PyModule_AddType(m, &MappingType);
+}
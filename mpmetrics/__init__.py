@@ -1,6 +1,8 @@
 # SPDX-License-Identifier: LGPL-3.0-only
 # Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
 
-from .metrics import Counter, Gauge, Summary, Histogram
+from .metrics import Counter, Gauge, Summary, Histogram, ExponentialHistogram, \
+                     WindowedCounter, WindowedHistogram, WindowedSummary
 
-__all__ = ('Counter', 'Gauge', 'Summary', 'Histogram')
+__all__ = ('Counter', 'Gauge', 'Summary', 'Histogram', 'ExponentialHistogram',
+           'WindowedCounter', 'WindowedHistogram', 'WindowedSummary')
@@ -0,0 +1,68 @@
+# SPDX-License-Identifier: LGPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+"""Helpers for waiting on mpmetrics' locks (and snapshots) from an asyncio
+event loop. Instead of blocking the thread running the loop, they poll with
+an exponential backoff, so other tasks keep running in the meantime."""
+
+import asyncio
+import contextlib
+import errno
+import time
+
+# Polling starts out by just yielding to the event loop, and then sleeps for
+# between MIN_DELAY and MAX_DELAY seconds
+MIN_DELAY = 50e-6
+MAX_DELAY = 10e-3
+
+async def poll(func, timeout=None):
+    """Call func until it returns something true, and return that. If timeout
+    (in seconds) is not None and expires first, return None instead."""
+    if result := func():
+        return result
+
+    deadline = None if timeout is None else time.monotonic() + timeout
+    delay = 0
+    while True:
+        if deadline is not None:
+            if (remaining := deadline - time.monotonic()) <= 0:
+                return None
+            delay = min(delay, remaining)
+
+        await asyncio.sleep(delay)
+        if result := func():
+            return result
+        delay = min(max(delay * 2, MIN_DELAY), MAX_DELAY)
+
+def try_acquire(lock, read=False):
+    """Try to acquire lock (for reading, if read is true) without blocking.
+    lock may be any of the locks in _mpmetrics, or a threading.Lock. Return
+    whether the lock was acquired."""
+    try:
+        return (lock.acquire_read if read else lock.acquire)(False)
+    except OSError as e:
+        # Locks are owned by threads, not tasks, so this is (most likely)
+        # another task on our thread holding the lock
+        if e.errno != errno.EDEADLK:
+            raise
+        return False
+
+async def acquire(lock, timeout=None, read=False):
+    """Like lock.acquire(timeout=timeout) (or lock.acquire_read, if read is
+    true), but awaitable. Return whether the lock was acquired."""
+    return bool(await poll(lambda: try_acquire(lock, read), timeout))
+
+@contextlib.asynccontextmanager
+async def locked(lock, read=False):
+    """An asynchronous context manager which holds lock (for reading, if read
+    is true). Avoid awaiting while holding a lock which synchronous code on
+    the same thread might also take, since it would block the event loop
+    until the lock is released (which can then never happen)."""
+    await acquire(lock, read=read)
+    try:
+        yield lock
+    finally:
+        if read:
+            lock.release_read()
+        else:
+            lock.release()
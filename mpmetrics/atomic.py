@@ -1,8 +1,14 @@
 # SPDX-License-Identifier: LGPL-3.0-only
 # Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
 
+import bisect
+import math
+import multiprocessing.util
+import weakref
+
 import _mpmetrics
-from .types import Double, Int64, UInt64, Struct
+from .generics import IntType, ObjectType, ProductType
+from .types import Array, Double, Int64, UInt64, Struct
 
 # TODO: Rewrite this in C if anyone cares about performance on arches without 64-bit atomics?
 
@@ -27,6 +33,15 @@ class _Locking(Struct):
                 raise OverflowError(f"{old} + {amount} too large to fit")
             return old
 
+    def add_many(self, amounts):
+        return self.add(sum(amounts))
+
+    def inc(self):
+        return self.add(1)
+
+    def dec(self):
+        return self.add(-1)
+
 class LockingDouble(_Locking):
     _fields_ = _Locking._fields_ | {
         '_value': Double,
@@ -45,3 +60,301 @@ class LockingUInt64(_Locking):
 AtomicDouble = _mpmetrics.AtomicDouble or LockingDouble
 AtomicInt64 = _mpmetrics.AtomicInt64 or LockingInt64
 AtomicUInt64 = _mpmetrics.AtomicUInt64 or LockingUInt64
+
+def _Sharded(base, fallback):
+    def sharded(__name__, shards):
+        if not base:
+            return fallback
+        ns = {
+            'shards': shards,
+            'size': shards * base.shard_size,
+        }
+        return type(__name__, (base,), ns)
+    return sharded
+
+ShardedAtomicDouble = IntType('ShardedAtomicDouble',
+                              _Sharded(_mpmetrics.ShardedAtomicDouble, AtomicDouble))
+ShardedAtomicUInt64 = IntType('ShardedAtomicUInt64',
+                              _Sharded(_mpmetrics.ShardedAtomicUInt64, AtomicUInt64))
+
+# Fixed-point numbers have this many fractional bits by default. This gives a
+# resolution of about 2.3e-10, and a range of about +/- 2.1e9.
+FIXED_FRAC_BITS = 32
+
+def _AtomicFixed(__name__, frac_bits):
+    """A double stored as a fixed-point number with frac_bits fractional bits.
+    Adding to it is a single atomic instruction, but amounts are rounded to the
+    nearest 2^-frac_bits and the value must stay within +/- 2^(63 - frac_bits)
+    (or it will wrap around)."""
+    base = _mpmetrics.AtomicFixed
+    if not base:
+        return AtomicDouble
+    if not 1 <= frac_bits <= base.max_frac_bits:
+        raise ValueError(f"frac_bits must be between 1 and {base.max_frac_bits}")
+    return type(__name__, (base,), { 'frac_bits': frac_bits })
+
+AtomicFixed = IntType('AtomicFixed', _AtomicFixed)
+
+def _LockingArray(__name__, ctype, length):
+    _fields_ = _Locking._fields_ | {
+        '_values': Array[ctype, length],
+    }
+
+    def __len__(self):
+        return length
+
+    def __getitem__(self, index):
+        return self.get(index)
+
+    def get(self, index):
+        with self._lock:
+            return self._values[index].value
+
+    def set(self, index, value):
+        with self._lock:
+            self._values[index].value = value
+
+    def add(self, index, amount, raise_on_overflow=True):
+        elem = self._values[index]
+        with self._lock:
+            old = elem.value
+            elem.value = old + amount
+            if raise_on_overflow and elem.value != old + amount:
+                raise OverflowError(f"{old} + {amount} too large to fit")
+            return old
+
+    def inc(self, index):
+        return self.add(index, 1)
+
+    def snapshot(self):
+        with self._lock:
+            return tuple(elem.value for elem in self._values)
+
+    ns = locals()
+    del ns['ctype']
+    del ns['length']
+    return type(__name__, (Struct,), ns)
+
+def _AtomicArray(base, ctype):
+    def array(__name__, length):
+        if length < 1:
+            raise ValueError("length must be strictly positive")
+        if not base:
+            return _LockingArray(__name__, ctype, length)
+        ns = {
+            'length': length,
+            'size': length * base.item_size,
+        }
+        return type(__name__, (base,), ns)
+    return array
+
+AtomicDoubleArray = IntType('AtomicDoubleArray',
+                            _AtomicArray(_mpmetrics.AtomicDoubleArray, Double))
+AtomicInt64Array = IntType('AtomicInt64Array',
+                           _AtomicArray(_mpmetrics.AtomicInt64Array, Int64))
+AtomicUInt64Array = IntType('AtomicUInt64Array',
+                            _AtomicArray(_mpmetrics.AtomicUInt64Array, UInt64))
+
+_buffered = weakref.WeakSet()
+
+def flush():
+    """Publish the pending updates of every buffered atomic in this process"""
+    for atomic in list(_buffered):
+        atomic.flush()
+
+def _register_flush(buffered=None):
+    # multiprocessing exits children with os._exit, so atexit isn't enough
+    multiprocessing.util.Finalize(None, flush, exitpriority=0)
+
+_register_flush()
+multiprocessing.util.register_after_fork(_buffered, _register_flush)
+
+def _buffered_ns(base, flush_every):
+    def __init__(self, mem, heap=None):
+        base.__init__(self, mem)
+        _buffered.add(self)
+
+    def _setstate(self, mem, heap=None):
+        base._setstate(self, mem)
+        _buffered.add(self)
+
+    return {
+        'flush_every': flush_every,
+        '__init__': __init__,
+        '_setstate': _setstate,
+    }
+
+def _BufferedAtomicUInt64(__name__, flush_every):
+    base = _mpmetrics.BufferedAtomicUInt64
+    if not base:
+        return AtomicUInt64
+    return type(__name__, (base,), _buffered_ns(base, flush_every))
+
+BufferedAtomicUInt64 = IntType('BufferedAtomicUInt64', _BufferedAtomicUInt64)
+
+def _LockingHistogramData(__name__, bucket_count):
+    _fields_ = _Locking._fields_ | {
+        '_thresholds': Array[Double, bucket_count],
+        '_buckets': Array[UInt64, bucket_count],
+        '_sum': Double,
+        '_count': UInt64,
+    }
+
+    @property
+    def thresholds(self):
+        return tuple(threshold.value for threshold in self._thresholds)
+
+    @thresholds.setter
+    def thresholds(self, thresholds):
+        thresholds = tuple(float(threshold) for threshold in thresholds)
+        if len(thresholds) != bucket_count:
+            raise ValueError(f"expected {bucket_count} thresholds")
+        if list(thresholds) != sorted(thresholds):
+            raise ValueError('thresholds not in sorted order')
+        if thresholds and thresholds[-1] != float('inf'):
+            raise ValueError('the last threshold must be inf')
+        for threshold, value in zip(self._thresholds, thresholds):
+            threshold.value = value
+
+    def observe(self, amount):
+        amount = float(amount)
+        thresholds = self.thresholds
+        with self._lock:
+            if bucket_count:
+                self._buckets[bisect.bisect_left(thresholds, amount)].value += 1
+            self._sum.value += amount
+            self._count.value += 1
+
+    def observe_many(self, amounts):
+        amounts = [float(amount) for amount in amounts]
+        thresholds = self.thresholds
+        buckets = [0] * bucket_count
+        if bucket_count:
+            for amount in amounts:
+                buckets[bisect.bisect_left(thresholds, amount)] += 1
+
+        with self._lock:
+            for bucket, count in zip(self._buckets, buckets):
+                bucket.value += count
+            self._sum.value += sum(amounts)
+            self._count.value += len(amounts)
+
+    def snapshot(self):
+        with self._lock:
+            buckets = tuple(bucket.value for bucket in self._buckets)
+            return buckets, self._sum.value, self._count.value
+
+    # Snapshots don't need to be serialized, so there's no need to save them
+    saved = snapshot
+    try_snapshot = snapshot
+
+    ns = locals()
+    del ns['bucket_count']
+    return type(__name__, (Struct,), ns)
+
+LockingHistogramData = IntType('LockingHistogramData', _LockingHistogramData)
+
+def _HistogramData(__name__, bucket_count):
+    base = _mpmetrics.HistogramData
+    ns = {
+        'bucket_count': bucket_count,
+        'size': base.size_of(bucket_count),
+    }
+    return type(__name__, (base,), ns)
+
+if _mpmetrics.HistogramData:
+    HistogramData = IntType('HistogramData', _HistogramData)
+else:
+    HistogramData = LockingHistogramData
+
+def _BufferedHistogramData(__name__, bucket_count, flush_every):
+    base = _mpmetrics.BufferedHistogramData
+    if not base:
+        return HistogramData[bucket_count]
+
+    ns = _buffered_ns(base, flush_every)
+    ns['bucket_count'] = bucket_count
+    ns['size'] = base.size_of(bucket_count)
+    return type(__name__, (base,), ns)
+
+BufferedHistogramData = ProductType('BufferedHistogramData', _BufferedHistogramData,
+                                    (IntType, IntType))
+
+def exponential_bound(key, schema):
+    """Return the upper bound of the bucket with key in an exponential histogram
+    with schema. This matches Prometheus native histograms."""
+    if schema <= 0:
+        return math.ldexp(1, key << -schema)
+    frac = 2 ** ((key & ((1 << schema) - 1)) / (1 << schema)) / 2
+    return math.ldexp(frac, (key >> schema) + 1)
+
+def exponential_key(amount, schema):
+    """Return the key of the bucket holding amount (which must be positive and
+    finite) in an exponential histogram with schema"""
+    key = math.ceil(math.log2(amount) * 2 ** schema)
+    while exponential_bound(key - 1, schema) >= amount:
+        key -= 1
+    while exponential_bound(key, schema) < amount:
+        key += 1
+    return key
+
+def _ExponentialHistogramData(__name__, schema, min_key, max_key):
+    """Histogram data for an exponential histogram with buckets from min_key to
+    max_key (plus a final bucket for larger amounts). The bucket for an amount
+    is calculated directly, instead of searching the thresholds."""
+    bucket_count = max_key - min_key + 2
+    base = _mpmetrics.HistogramData
+    if not base:
+        return LockingHistogramData[bucket_count]
+
+    ns = {
+        'bucket_count': bucket_count,
+        'size': base.size_of(bucket_count),
+        'schema': schema,
+        'min_key': min_key,
+    }
+    return type(__name__, (base,), ns)
+
+ExponentialHistogramData = ProductType('ExponentialHistogramData', _ExponentialHistogramData,
+                                       (IntType, IntType, IntType))
+
+def _BufferedExponentialHistogramData(__name__, schema, min_key, max_key, flush_every):
+    bucket_count = max_key - min_key + 2
+    base = _mpmetrics.BufferedHistogramData
+    if not base:
+        return ExponentialHistogramData[schema, min_key, max_key]
+
+    ns = _buffered_ns(base, flush_every)
+    ns['bucket_count'] = bucket_count
+    ns['size'] = base.size_of(bucket_count)
+    ns['schema'] = schema
+    ns['min_key'] = min_key
+    return type(__name__, (base,), ns)
+
+BufferedExponentialHistogramData = ProductType('BufferedExponentialHistogramData',
+                                               _BufferedExponentialHistogramData,
+                                               (IntType, IntType, IntType, IntType))
+
+def _FixedSum(__name__, cls, frac_bits):
+    """Keep the sum of the histogram data cls in fixed point (like
+    AtomicFixed), so that observing never has to retry"""
+    base = _mpmetrics.AtomicFixed
+    if not base or not _mpmetrics.HistogramData or \
+       not issubclass(cls, _mpmetrics.HistogramData):
+        return cls
+    if not 1 <= frac_bits <= base.max_frac_bits:
+        raise ValueError(f"frac_bits must be between 1 and {base.max_frac_bits}")
+    return type(__name__, (cls,), { 'frac_bits': frac_bits })
+
+FixedSum = ProductType('FixedSum', _FixedSum, (ObjectType, IntType))
+
+def _Exemplars(__name__, count, sample_every):
+    base = _mpmetrics.Exemplars
+    ns = {
+        'count': count,
+        'sample_every': sample_every,
+        'size': count * base.record_size,
+    }
+    return type(__name__, (base,), ns)
+
+Exemplars = ProductType('Exemplars', _Exemplars, (IntType, IntType))
@@ -0,0 +1,103 @@
+# SPDX-License-Identifier: LGPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+import asyncio
+import threading
+
+from prometheus_client import registry as _registry
+
+import _mpmetrics
+from . import aio
+
+CONTENT_TYPE_LATEST = 'text/plain; version=0.0.4; charset=utf-8'
+CONTENT_TYPE_OPENMETRICS = 'application/openmetrics-text; version=0.0.1; charset=utf-8'
+
+def render_labels(labels):
+    """Render a dict of labels into the form expected by _mpmetrics.Exposition"""
+    return tuple('{}="{}"'.format(name, value.replace('\\', r'\\').replace('\n', r'\n')
+                                  .replace('"', r'\"'))
+                 for name, value in sorted(labels.items()))
+
+def _expose_metric(writer, metric):
+    writer.family(metric.name, metric.documentation, metric.type)
+    for sample in metric.samples:
+        suffix = sample.name.removeprefix(metric.name)
+        if exemplar := sample.exemplar:
+            exemplar = render_labels(exemplar.labels), exemplar.value, exemplar.timestamp
+        writer.sample(suffix, render_labels(sample.labels), sample.value, exemplar)
+
+def _collectors(registry):
+    # prometheus_client doesn't provide a public way to get the collectors
+    with registry._lock:
+        return list(registry._collector_to_names)
+
+async def _collectors_async(registry):
+    async with aio.locked(registry._lock):
+        return list(registry._collector_to_names)
+
+def write(writer, registry=_registry.REGISTRY):
+    """Write all the metrics in registry to writer (an _mpmetrics.Exposition).
+
+    Collectors from mpmetrics write their samples directly. Other collectors
+    are collected as usual, and their samples are written afterwards.
+    """
+    if getattr(registry, '_target_info', None):
+        _expose_metric(writer, registry._target_info_metric())
+
+    for collector in _collectors(registry):
+        if expose := getattr(collector, '_expose', None):
+            expose(writer)
+        else:
+            for metric in collector.collect():
+                _expose_metric(writer, metric)
+    writer.eof()
+
+async def write_async(writer, registry=_registry.REGISTRY):
+    """Like write, but awaitable. Waiting for locks (or for observers to
+    finish with histograms) doesn't block the event loop, and we yield to it
+    after each collector. Collectors from other libraries are still collected
+    synchronously."""
+    if getattr(registry, '_target_info', None):
+        _expose_metric(writer, registry._target_info_metric())
+
+    for collector in await _collectors_async(registry):
+        if expose := getattr(collector, '_expose_async', None):
+            await expose(writer)
+        elif expose := getattr(collector, '_expose', None):
+            expose(writer)
+        else:
+            for metric in collector.collect():
+                _expose_metric(writer, metric)
+        await asyncio.sleep(0)
+    writer.eof()
+
+_writers = threading.local()
+
+def generate_latest(registry=_registry.REGISTRY, openmetrics=False):
+    """Like prometheus_client.generate_latest, but faster for mpmetrics
+    collectors. The output buffer is reused between calls (from the same
+    thread)."""
+    attr = 'openmetrics' if openmetrics else 'prometheus'
+    if not (writer := getattr(_writers, attr, None)):
+        writer = _mpmetrics.Exposition(openmetrics=openmetrics)
+        setattr(_writers, attr, writer)
+
+    writer.clear()
+    write(writer, registry)
+    return writer.getvalue()
+
+async def generate_latest_async(registry=_registry.REGISTRY, openmetrics=False):
+    """Like generate_latest, but awaitable (see write_async). Concurrent calls
+    each use their own output buffer."""
+    attr = 'async_openmetrics' if openmetrics else 'async_prometheus'
+    if not (writers := getattr(_writers, attr, None)):
+        writers = []
+        setattr(_writers, attr, writers)
+
+    writer = writers.pop() if writers else _mpmetrics.Exposition(openmetrics=openmetrics)
+    try:
+        writer.clear()
+        await write_async(writer, registry)
+        return writer.getvalue()
+    finally:
+        writers.append(writer)
@@ -1,36 +1,183 @@
 # SPDX-License-Identifier: LGPL-3.0-only
 # Copyright (C) 2021-22 Sean Anderson <seanga2@gmail.com>
 
+import fcntl
 import itertools
 import mmap
 import os
+import sys
 from tempfile import NamedTemporaryFile
 import threading
 from weakref import WeakValueDictionary
 
 import _mpmetrics
-from .types import Size_t, Struct
-from .util import align, _align_check
-
-SC_LEVEL1_DCACHE_LINESIZE = 190
-if (CACHELINESIZE := os.sysconf(SC_LEVEL1_DCACHE_LINESIZE)) < 0:
-    CACHELINESIZE = 64 # Assume 64-byte cache lines
+from .atomic import AtomicUInt64
+from .types import Array, Dict, Size_t, Struct, UInt64
+from .util import CACHELINESIZE, align, _align_check
 
 PAGESIZE = 64 * 1024
 
+def _hugepagesize():
+    with open('/proc/meminfo') as meminfo:
+        for line in meminfo:
+            if line.startswith('Hugepagesize:'):
+                return int(line.split()[1]) * 1024
+    raise OSError("huge pages are not supported")
+
+def _pid_namespace():
+    """Return the device and inode of our PID namespace, or zeros if they are
+    unknown. Locks record their owners' thread IDs, which only mean the same
+    thing to processes in the same PID namespace."""
+    try:
+        ns = os.stat('/proc/self/ns/pid')
+    except OSError:
+        return 0, 0
+    return ns.st_dev, ns.st_ino
+
+_NUMA_MODES = {
+    'bind': _mpmetrics.Mapping.MPOL_BIND,
+    'interleave': _mpmetrics.Mapping.MPOL_INTERLEAVE,
+    'preferred': _mpmetrics.Mapping.MPOL_PREFERRED,
+}
+
+# Blocks are allocated in size classes, eight for each power of two, so
+# rounding up wastes at most an eighth of a block. Freed blocks are kept on a
+# per-class free list, and the first word of each free block holds the offset
+# of the next one (or 0, which is always the heap header). There are enough
+# classes for any address space, while still fitting the heap header in a page.
+CLASS_BITS = 3
+MIN_SIZE = 16
+NR_CLASSES = 48 << CLASS_BITS
+
+def _size_class(size):
+    """Return the class of size, and the size of the blocks in that class"""
+    n = max(size, MIN_SIZE) - 1
+    shift = max(n.bit_length() - CLASS_BITS - 1, 0)
+    q = n >> shift
+    return (shift << CLASS_BITS) + q - (1 << CLASS_BITS), (q + 1) << shift
+
+# Heaps start with this magic number and the layout version. Bump the version
+# whenever the layout of the heap (or of anything stored in it) changes, so
+# that persistent heaps from older versions aren't misinterpreted. This
+# includes the protocol used to pickle Dict keys (types.PICKLE_PROTOCOL).
+MAGIC = int.from_bytes(b'mpmetric', 'little')
+VERSION = 11
+
+# The catalog describes each metric (and each of its series) in a form which
+# can be read without Python, and is used by mpmetrics-exporter. Families and
+# series are kept in singly-linked lists, which are only appended to (removed
+# entries are retired instead, and retired series are revived if their labels
+# are added again). The layouts (and these kinds) must match catalog.h.
+EXPORT_UINT64 = 1
+EXPORT_SHARDED_UINT64 = 2
+EXPORT_DOUBLE = 3
+EXPORT_HISTOGRAM = 4
+
+class _Family(Struct):
+    _fields_ = {
+        '_next': AtomicUInt64,
+        '_series': AtomicUInt64,
+        '_last': Size_t,
+        '_retired': AtomicUInt64,
+        '_name_len': Size_t,
+        '_help_len': Size_t,
+        '_type_len': Size_t,
+        # Followed by the name, (escaped) help, and type
+    }
+
+class _Series(Struct):
+    _fields_ = {
+        '_next': AtomicUInt64,
+        '_retired': AtomicUInt64,
+        '_kind': Size_t,
+        '_data': Size_t,
+        '_created': Size_t,
+        '_count': Size_t,
+        '_stride': Size_t,
+        '_labels_len': Size_t,
+        # Followed by the rendered labels, each terminated by a NUL
+    }
+
+def _grew():
+    if _mpmetrics.Stats:
+        _mpmetrics.Stats.record(_mpmetrics.Stats.HEAP_GROWS)
+
+def _is(cls, base):
+    return base is not None and issubclass(cls, base)
+
+def _export_field(field):
+    """Return the (kind, count, stride) the exporter should read field with"""
+    if _is(field, _mpmetrics.ShardedAtomicUInt64):
+        return EXPORT_SHARDED_UINT64, field.shards, field.shard_size
+    if _is(field, _mpmetrics.AtomicUInt64) or _is(field, _mpmetrics.BufferedAtomicUInt64):
+        return EXPORT_UINT64, 0, 0
+    if _is(field, _mpmetrics.AtomicDouble):
+        return EXPORT_DOUBLE, 0, 0
+    if _is(field, _mpmetrics.HistogramData):
+        # The stride of a histogram is the precision of its fixed-point sum
+        return EXPORT_HISTOGRAM, field.bucket_count, getattr(field, 'frac_bits', 0)
+    return None, 0, 0
+
 class Heap(Struct):
+    """Shared memory heap, backed by a temporary file.
+
+    By default, the file is mapped one map_size page at a time, and
+    allocations cannot be larger than a page. If reserve is given, that much
+    address space is reserved instead, and the whole file is mapped
+    contiguously. Allocations may then be as large as the reservation, and
+    dereferencing a block doesn't need to take a lock.
+
+    By default, the file is created in the default temporary directory. Set
+    backing to a directory (such as /dev/shm or a hugetlbfs mount) to create
+    it there instead, or to 'memfd' or 'hugetlb' to use an anonymous memfd
+    (backed by huge pages, for 'hugetlb'). With huge pages, map_size must be
+    a multiple of the huge page size.
+
+    Set numa to 'bind', 'interleave', or 'preferred' to apply that NUMA
+    memory policy (with the given nodes) to the heap.
+
+    If path is given, the heap is persistent. It is stored in a file at path,
+    which is kept after every process using it has exited. Metrics created
+    with a persistent heap are recorded in its directory, and opening the heap
+    again (e.g. after a restart) reattaches each metric to its old values
+    instead of creating a new one. The heap must be reopened with the same
+    map_size and reserve. If no other process has the heap open, any locks
+    left held by the processes which last used it are reset.
+
+    Every process using a heap must be in the same PID namespace, since locks
+    check whether their owners are still alive by thread ID. Opening (or
+    unpickling) a heap which was created in another PID namespace raises
+    ValueError, unless it is persistent and nobody else has it open.
+    """
     _fields_ = {
-        '_shared_lock': _mpmetrics.Lock,
+        '_magic': UInt64,
+        '_version': UInt64,
+        '_map_size': Size_t,
+        '_reserve': Size_t,
+        '_catalog': AtomicUInt64,
+        '_shared_lock': _mpmetrics.FutexLock,
         '_base': Size_t,
+        '_free': Array[Size_t, NR_CLASSES],
+        # Maps the names of metrics to their (signature, class, start, family)
+        '_directory_lock': _mpmetrics.FutexLock,
+        '_directory': Dict,
+        '_catalog_lock': _mpmetrics.FutexLock,
+        '_catalog_last': Size_t,
+        # The PID namespace of the processes using the heap
+        '_pid_ns_dev': UInt64,
+        '_pid_ns_ino': UInt64,
     }
 
     # Only create one heap per process to avoid duplicate mappings
     _heaps_lock = threading.Lock()
     _heaps = WeakValueDictionary()
 
-    def __new__(cls, map_size=PAGESIZE, filename=None):
+    def __new__(cls, map_size=PAGESIZE, filename=None, reserve=None, backing=None, numa=None,
+                nodes=None, path=None):
         cls._heaps_lock.acquire()
         try:
+            if path is not None:
+                filename = os.path.realpath(path)
             if filename:
                 if heap := cls._heaps.get(filename, None):
                     return heap
@@ -41,59 +188,309 @@ class Heap(Struct):
             raise
 
     # Must be called with Heap._heaps_lock held; it will be released
-    def __init__(self, map_size=PAGESIZE, filename=None):
+    def __init__(self, map_size=PAGESIZE, filename=None, reserve=None, backing=None, numa=None,
+                 nodes=None, path=None):
         try:
-            if filename:
+            if filename or hasattr(self, '_file'):
                 return
 
             if map_size % mmap.ALLOCATIONGRANULARITY:
                 raise ValueError("size must be a multiple of {}".format(mmap.ALLOCATIONGRANULARITY))
             _align_check(map_size)
+            if reserve is not None and (reserve < map_size or reserve % map_size):
+                raise ValueError("reserve must be a multiple of map_size")
+            if backing == 'hugetlb' and map_size % _hugepagesize():
+                raise ValueError("size must be a multiple of the huge page size")
+            if numa is not None:
+                if numa not in _NUMA_MODES:
+                    raise ValueError(f"unknown NUMA policy {numa}")
+                if not nodes:
+                    raise ValueError("no NUMA nodes specified")
+                nodes = tuple(nodes)
             self.map_size = map_size
+            self.reserve = reserve
+            self.numa = numa
+            self.nodes = nodes
+            self.persistent = path is not None
 
             # File backing our shared memory
-            self._file = NamedTemporaryFile()
-            self._fd = self._file.fileno()
+            if self.persistent:
+                self._file = open(path, 'a+b')
+                self._fd = self._file.fileno()
+                self._filename = os.path.realpath(path)
+                if self._open():
+                    self._heaps[self._filename] = self
+                    return
+            elif backing in ('memfd', 'hugetlb'):
+                flags = os.MFD_CLOEXEC
+                if backing == 'hugetlb':
+                    flags |= os.MFD_HUGETLB
+                self._file = os.fdopen(os.memfd_create('mpmetrics', flags), 'r+b')
+                self._fd = self._file.fileno()
+                # Other processes can open our memfd (as long as we're alive)
+                self._filename = f'/proc/{os.getpid()}/fd/{self._fd}'
+            else:
+                self._file = NamedTemporaryFile(dir=backing)
+                self._fd = self._file.fileno()
+                self._filename = self._file.name
             # Allocate a page to start with
             os.truncate(self._fd, map_size)
 
-            # Process-local shared memory maps
-            self._maps = [mmap.mmap(self._fd, map_size)]
-            # Lock for _maps
-            self._lock = threading.Lock()
-
-            super().__init__(memoryview(self._maps[0])[:self.size])
+            super().__init__(self._map()[:self.size], heap=self)
+            self._version.value = VERSION
+            self._map_size.value = map_size
+            self._reserve.value = reserve or 0
             self._base.value = self.size
+            self._pid_ns_dev.value, self._pid_ns_ino.value = _pid_namespace()
+            # Write this last, so a heap is never half-initialized
+            self._magic.value = MAGIC
+            if self.persistent:
+                fcntl.flock(self._fd, fcntl.LOCK_SH)
 
             # Add ourself to the list of heaps
-            self._heaps[self._file.name] = self
+            self._heaps[self._filename] = self
         finally:
             self._heaps_lock.release()
 
+    # Every process using a persistent heap holds a shared lock on its file.
+    # Whoever initializes (or recovers) the heap holds an exclusive lock
+    # instead, so nobody can use the heap until it is ready.
+    def _open(self):
+        """Lock our persistent file, and attach to the heap in it. Returns
+        False if the heap needs to be initialized (with the lock held)."""
+        while True:
+            try:
+                fcntl.flock(self._fd, fcntl.LOCK_EX | fcntl.LOCK_NB)
+            except BlockingIOError:
+                fcntl.flock(self._fd, fcntl.LOCK_SH)
+                if self._attach():
+                    return True
+                # Whoever was initializing the heap died, so try again
+                fcntl.flock(self._fd, fcntl.LOCK_UN)
+                continue
+
+            if not self._attach(exclusive=True):
+                return False
+            self._recover()
+            fcntl.flock(self._fd, fcntl.LOCK_SH)
+            return True
+
+    def _attach(self, exclusive=False):
+        """Attach to the existing heap in our file, if there is one. Unless we
+        have it to ourselves, it must be from our PID namespace."""
+        # Check the header before mapping anything, in case we have the
+        # wrong map_size
+        header = object.__new__(Heap)
+        mem = bytearray(os.pread(self._fd, self.size, 0).ljust(self.size, b'\0'))
+        Struct._setstate(header, memoryview(mem))
+        if not header._magic.value:
+            return False
+        if header._magic.value != MAGIC:
+            raise ValueError(f"{self._filename} is not a heap")
+        if header._version.value != VERSION:
+            raise ValueError(f"{self._filename} has layout version {header._version.value}, "
+                             f"but expected {VERSION}")
+        if header._map_size.value != self.map_size or \
+           header._reserve.value != (self.reserve or 0):
+            raise ValueError(f"{self._filename} has map_size {header._map_size.value} and "
+                             f"reserve {header._reserve.value or None}")
+        if not exclusive:
+            self._check_namespace(header)
+
+        super()._setstate(self._map()[:self.size], heap=self)
+        return True
+
+    def _check_namespace(self, header):
+        if (header._pid_ns_dev.value, header._pid_ns_ino.value) != _pid_namespace():
+            raise ValueError(f"{self._filename} is in use from another PID namespace")
+
+    def _recover(self):
+        """Reset the locks in the heap. Nobody else may be using it."""
+        # The locks are reset, so nothing refers to the old namespace
+        self._pid_ns_dev.value, self._pid_ns_ino.value = _pid_namespace()
+        self._reinit('_shared_lock')
+        self._reinit('_directory_lock')
+        self._reinit('_catalog_lock')
+        for signature, cls, start, family in self._directory.values():
+            if hasattr(cls, '_recover'):
+                obj = cls.__new__(cls)
+                obj.__setstate__(self.Block(self, start, cls.size))
+                obj._recover()
+
+    def _reattach(self, name, signature, create):
+        """Return the object recorded in the directory under name, as long as
+        it was recorded with the same signature. Otherwise, create a new
+        object and its catalog family with create() and record that instead.
+        Also returns whether the object already existed."""
+        with self._directory_lock:
+            entry = self._directory.get(name)
+            if entry and entry[0] == signature:
+                _, cls, start, family = entry
+                obj = cls.__new__(cls)
+                obj.__setstate__(self.Block(self, start, cls.size))
+                return obj, True
+
+            # The old object might still be in use, so don't free it
+            if entry:
+                self._retire_family(entry[3])
+            obj, family = create()
+            self._directory[name] = signature, type(obj), obj.__getstate__().start, family
+            return obj, False
+
+    def _view(self, cls, start):
+        obj = cls.__new__(cls)
+        obj._setstate(self.Block(self, start, cls.size).deref(), heap=self)
+        return obj
+
+    def _add_family(self, name, docs, typ):
+        """Add a family to the catalog, and return its start (or 0 if the
+        catalog isn't supported)"""
+        if not _mpmetrics.AtomicUInt64:
+            return 0
+
+        docs = docs.replace('\\', r'\\').replace('\n', r'\n')
+        text = [part.encode() for part in (name, docs, typ)]
+        block = self.malloc(_Family.size + sum(len(part) for part in text))
+        mem = block.deref()
+        family = _Family(mem)
+        family._name_len.value, family._help_len.value, family._type_len.value = \
+            (len(part) for part in text)
+        mem[_Family.size:] = b''.join(text)
+
+        with self._catalog_lock:
+            if last := self._catalog_last.value:
+                self._view(_Family, last)._next.set(block.start)
+            else:
+                self._catalog.set(block.start)
+            self._catalog_last.value = block.start
+        return block.start
+
+    def _add_series(self, family, labels, metric):
+        """Add a series for metric (a Box) to a family in the catalog, given
+        its rendered labels, and return its start. Metrics which the exporter
+        can't read (because they have no _export) are skipped, and 0 is
+        returned instead."""
+        if not family or not (fields := self._series_fields(metric)):
+            return 0
+
+        text = b''.join(label.encode() + b'\0' for label in labels)
+        block = self.malloc(_Series.size + len(text))
+        mem = block.deref()
+        series = _Series(mem)
+        self._set_series(series, fields)
+        series._labels_len.value = len(text)
+        mem[_Series.size:] = text
+
+        family = self._view(_Family, family)
+        with self._catalog_lock:
+            if last := family._last.value:
+                self._view(_Series, last)._next.set(block.start)
+            else:
+                family._series.set(block.start)
+            family._last.value = block.start
+        return block.start
+
+    @staticmethod
+    def _series_fields(metric):
+        """Return the (kind, data, created, count, stride) of the series for
+        metric, or None if the exporter can't read it"""
+        export = getattr(metric, '_export', None)
+        if not export:
+            return None
+
+        value, created = export()
+        layout = type(metric)._layout()
+        field, off = layout[value]
+        kind, count, stride = _export_field(field)
+        if not kind:
+            return None
+
+        start = metric.__getstate__().start
+        created = start + layout[created][1] if created else 0
+        return kind, start + off, created, count, stride
+
+    @staticmethod
+    def _set_series(series, fields):
+        series._kind.value, series._data.value, series._created.value, \
+            series._count.value, series._stride.value = fields
+
+    def _retire_series(self, series):
+        """Stop exporting a series"""
+        if series:
+            self._view(_Series, series)._retired.set(1)
+
+    def _revive_series(self, series, metric):
+        """Export a retired series again, now for metric (which must be the
+        same type as the series' old metric). This saves adding a new series
+        whenever removed labels come back."""
+        fields = self._series_fields(metric)
+        series = self._view(_Series, series)
+        with self._catalog_lock:
+            self._set_series(series, fields)
+            series._retired.set(0)
+
+    def _retire_family(self, family):
+        """Stop exporting a family"""
+        if family:
+            self._view(_Family, family)._retired.set(1)
+
+    @property
+    def filename(self):
+        """The name of the file backing the heap, for mpmetrics-exporter"""
+        return self._filename
+
+    def _map(self):
+        mode = _NUMA_MODES[self.numa] if self.numa else _mpmetrics.Mapping.MPOL_DEFAULT
+        if self.reserve:
+            self._mapping = _mpmetrics.Mapping(self._fd, self.reserve, self.map_size, mode,
+                                               self.nodes)
+            return self._mapping.deref(0, self.map_size)
+
+        self._mapping = None
+        self._mode = mode
+        # Process-local shared memory maps
+        self._maps = [self._mmap(0)]
+        # Lock for _maps
+        self._lock = threading.Lock()
+        return memoryview(self._maps[0])
+
+    def _mmap(self, offset):
+        map = mmap.mmap(self._fd, self.map_size, offset=offset)
+        if self._mode != _mpmetrics.Mapping.MPOL_DEFAULT:
+            _mpmetrics.Mapping.mbind(map, self._mode, self.nodes)
+        return map
+
+    @property
+    def max_size(self):
+        """The size of the largest possible allocation"""
+        if self.reserve:
+            return 1 << (self.reserve.bit_length() - 2)
+        return self.map_size
+
     def __getnewargs__(self):
-        return self.map_size, self._file.name
+        return self.map_size, self._filename
 
     def __getstate__(self):
-        return self.map_size, self._file.name
+        return self.map_size, self._filename, self.reserve, self.numa, self.nodes, \
+               self.persistent
 
     def __setstate__(self, state):
         try:
             if hasattr(self, '_file'):
                 return
 
-            self.map_size, filename = state
-            self._file = open(filename, 'a+b')
+            self.map_size, self._filename, self.reserve, self.numa, self.nodes, \
+                self.persistent = state
+            self._file = open(self._filename, 'a+b')
             self._fd = self._file.fileno()
+            if self.persistent:
+                fcntl.flock(self._fd, fcntl.LOCK_SH)
 
-            # Process-local shared memory maps
-            self._maps = [mmap.mmap(self._fd, self.map_size)]
-            # Lock for _maps
-            self._lock = threading.Lock()
-
-            super()._setstate(memoryview(self._maps[0])[:self.size])
+            super()._setstate(self._map()[:self.size], heap=self)
+            self._check_namespace(self)
 
             # Add ourself to the list of heaps
-            self._heaps[self._file.name] = self
+            self._heaps[self._filename] = self
         finally:
             self._heaps_lock.release()
 
@@ -109,6 +506,9 @@ class Heap(Struct):
 
         def deref(self):
             heap = self.heap
+            if heap._mapping:
+                return heap._mapping.deref(self.start, self.size)
+
             page = int(self.start / heap.map_size)
             page_off = page * heap.map_size
             off = self.start - page_off
@@ -116,28 +516,57 @@ class Heap(Struct):
                 if len(heap._maps) <= page:
                     heap._maps.extend(itertools.repeat(None, page - len(heap._maps) + 1))
                 if not self.heap._maps[page]:
-                    heap._maps[page] = mmap.mmap(heap._fd, heap.map_size, offset=page_off)
+                    heap._maps[page] = heap._mmap(page_off)
                 map = heap._maps[page]
 
             return memoryview(map)[off:off+self.size]
 
         def free(self):
-            pass
+            heap = self.heap
+            head = heap._free[_size_class(self.size)[0]]
+            link = heap.Block(heap, self.start, Size_t.size).deref()
+            with heap._shared_lock:
+                link[:] = head.value.to_bytes(Size_t.size, sys.byteorder)
+                head.value = self.start
 
     def malloc(self, size, alignment=CACHELINESIZE):
         if size <= 0:
             raise ValueError("size must be strictly positive")
-        elif size > self.map_size:
-            raise ValueError("size must be less than {}".format(self.map_size))
+        elif size > self.max_size:
+            raise ValueError("size must be less than {}".format(self.max_size))
         _align_check(alignment)
 
+        # Round up so that freed blocks can be reused by anything in their class
+        size_class, class_size = _size_class(size)
+        if not self.reserve:
+            class_size = min(class_size, self.map_size)
+        head = self._free[size_class]
+
         with self._shared_lock:
+            # Only the head of the free list is considered; if it's not
+            # aligned well enough, fall back to allocating a new block.
+            if head.value and not head.value % alignment:
+                block = self.Block(self, head.value, size)
+                mem = self.Block(self, head.value, class_size).deref()
+                head.value = int.from_bytes(mem[:Size_t.size], sys.byteorder)
+                mem[:] = bytes(class_size)
+                return block
+
             total = align(self._base.value, self.map_size)
             self._base.value = align(self._base.value, alignment)
-            if self._base.value + size >= total:
+            if self.reserve:
+                # Blocks may straddle pages, so just grow the file to fit
+                end = self._base.value + class_size
+                if end > self.reserve:
+                    raise MemoryError("heap exhausted")
+                if end > total:
+                    os.ftruncate(self._fd, align(end, self.map_size))
+                    _grew()
+            elif self._base.value + class_size >= total:
                 os.ftruncate(self._fd, total + self.map_size)
+                _grew()
                 self._base.value = total
             start = self._base.value
-            self._base.value += size
+            self._base.value += class_size
 
         return self.Block(self, start, size)
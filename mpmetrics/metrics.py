@@ -5,19 +5,30 @@
 
 import bisect
 from contextlib import contextmanager
+import functools
 import itertools
+import math
+import os
 import sys
 import threading
 import time
+import weakref
 
 from prometheus_client import metrics_core, registry
+from prometheus_client.samples import Exemplar
 
 import _mpmetrics
-from .atomic import AtomicUInt64, AtomicDouble
-from .generics import IntType
+from . import aio
+from .atomic import AtomicUInt64, AtomicDouble, AtomicDoubleArray, AtomicUInt64Array, \
+                    BufferedAtomicUInt64, BufferedExponentialHistogramData, \
+                    BufferedHistogramData, Exemplars, ExponentialHistogramData, HistogramData, \
+                    ShardedAtomicUInt64, FIXED_FRAC_BITS, FixedSum, exponential_bound, \
+                    exponential_key
+from .exposition import render_labels
+from .generics import IntType, ObjectType, ProductType
 from .heap import Heap
-from .types import Box, Dict, Double, Array, Struct
-from .util import classproperty, genmask
+from .types import Array, Box, Dict, Double, ReadMostly, Size_t, Struct
+from .util import classproperty
 
 @contextmanager
 def Timer(callback):
@@ -26,12 +37,10 @@ def Timer(callback):
     callback(max(time.perf_counter() - now, 0))
 
 class Collector:
-    def __init__(self, metric, name, docs, registry, heap, kwargs):
+    def __init__(self, metric, name, docs):
         self._name = name
         self._docs = docs
-        self._metric = metric(heap, **kwargs)
-        
-        registry.register(self)
+        self._metric = metric
 
     def __getattr__(self, name):
         return getattr(self.__dict__['_metric'], name)
@@ -44,25 +53,62 @@ class Collector:
 
     def collect(self):
         family = self._family()
-        def add_sample(suffix, value, labels={}):
-            family.add_sample(self._name + suffix, labels, value)
+        def add_sample(suffix, value, labels={}, exemplar=None):
+            family.add_sample(self._name + suffix, labels, value, exemplar=exemplar)
         self._metric._sample(add_sample)
         yield family
 
+    def _expose(self, writer):
+        writer.family(self._name, self._docs, self._metric.typ)
+        self._metric._expose(writer, ())
+
+    async def _expose_async(self, writer):
+        writer.family(self._name, self._docs, self._metric.typ)
+        await _expose_series(self._metric, writer, ())
+
 class LabeledCollector(Struct):
     _fields_ = {
-        '_shared_lock': _mpmetrics.Lock,
+        '_shared_lock': _mpmetrics.RWLock,
         '_metrics': Dict,
+        # Incremented whenever a child is added, so that we only need to look
+        # at _metrics when something changed
+        '_generation': AtomicUInt64,
+        # Incremented whenever a child is removed, which invalidates every
+        # process's cached children
+        '_epoch': AtomicUInt64,
+        # Our family in the heap's catalog
+        '_catalog_family': Size_t,
+        # The (tid, start time) of each thread using us, by the start of the
+        # AtomicUInt64 where it acknowledges the latest epoch it has seen
+        '_acks': Dict,
+        # The (size, starts) of the children removed in each epoch. They may
+        # still be in use by other threads, so they are only freed once every
+        # thread has acknowledged that epoch.
+        '_quarantine': Dict,
+        # The catalog series of removed children, by label values, so that
+        # they can be revived if the same label values come back
+        '_retired': Dict,
     }
 
-    def __init__(self, mem, metric, name, docs, labelnames, registry, kwargs, heap):
+    # The label values of the child shared by new label values once there are
+    # max_series children
+    OVERFLOW = '__overflow__'
+
+    def __init__(self, mem, metric, name, docs, labelnames, kwargs, heap, max_series=None):
         super().__init__(mem, heap=heap)
+        self._attach(metric, name, docs, labelnames, kwargs, heap, max_series)
+
+    # Set up everything which isn't stored in shared memory
+    def _attach(self, metric, name, docs, labelnames, kwargs, heap, max_series=None):
+        if max_series is not None and max_series < 1:
+            raise ValueError("max_series must be strictly positive")
 
         self._metric = metric
         self._name = name
         self._docs = docs
         self._kwargs = kwargs
         self._heap = heap
+        self._max_series = max_series
 
         self._labelnames = tuple(labelnames)
         for label in self._labelnames:
@@ -77,7 +123,104 @@ class LabeledCollector(Struct):
 
         self._lock = threading.Lock()
         self._cache = dict()
-        registry.register(self)
+        self._rendered = dict()
+        self._cls = None
+        self._overflow = (self.OVERFLOW,) * len(self._labelnames)
+        self._cache_epoch = self._epoch.get()
+        # Every child (in the order they were added), as of _children_gen
+        self._children_gen = None
+        self._children_seq = 0
+        self._children_cache = {}
+        self._local = _Acknowledged()
+        _labeled.add(self)
+
+    def _forget(self):
+        """Forget everything our parent process cached, and register
+        ourselves again before we use any children"""
+        self._lock = threading.Lock()
+        self._cache_epoch = None
+        self._local = _Acknowledged()
+
+    def _check_epoch(self, block=True):
+        """Forget our cached children if any were removed, and acknowledge the
+        current epoch for this thread. Must be called with _lock held. Returns
+        False (without doing anything) if we need to register in _acks, but
+        block is false and _shared_lock is busy."""
+        local = self._local
+        if not local.ack and not self._register(block):
+            return False
+
+        epoch = self._epoch.get()
+        if epoch != self._cache_epoch:
+            self._cache = dict()
+            self._rendered = dict()
+            self._children_gen = None
+            self._children_seq = 0
+            self._children_cache = {}
+            self._cache_epoch = epoch
+        if epoch != local.epoch:
+            local.ack.set(epoch)
+            local.epoch = epoch
+        return True
+
+    def _acked(self, start):
+        ack = Box[AtomicUInt64].__new__(Box[AtomicUInt64])
+        ack.__setstate__(self._heap.Block(self._heap, start, AtomicUInt64.size))
+        return ack
+
+    def _register(self, block=True):
+        if block:
+            self._shared_lock.acquire()
+        elif not aio.try_acquire(self._shared_lock):
+            return False
+
+        try:
+            # Make room for ourselves, so _acks only grows with the number of
+            # live threads
+            self._prune()
+            # We start out acknowledging epoch 0, which keeps everything in
+            # quarantine until we have forgotten our cached children
+            ack = Box[AtomicUInt64](self._heap)
+            tid = threading.get_native_id()
+            self._acks[ack.__getstate__().start] = tid, _start_time(tid)
+        finally:
+            self._shared_lock.release()
+        self._local.ack = ack
+        return True
+
+    def _prune(self):
+        """Forget threads which have exited, and return the oldest epoch
+        acknowledged by the rest. Must be called with _shared_lock held for
+        writing."""
+        oldest = self._epoch.get()
+        for start, (tid, started) in self._acks._items():
+            if _start_time(tid) == started:
+                oldest = min(oldest, self._acked(start).get())
+            else:
+                del self._acks[start]
+                self._heap.Block(self._heap, start, AtomicUInt64.size).free()
+        return oldest
+
+    def _recover(self):
+        self._reinit('_shared_lock')
+        heap = self.__getstate__().heap
+        # Nobody else is using the heap, so nothing needs to stay in quarantine
+        for start, thread in self._acks._items():
+            heap.Block(heap, start, AtomicUInt64.size).free()
+        self._acks.clear()
+        for epoch, (size, starts) in self._quarantine._items():
+            for start in starts:
+                heap.Block(heap, start, size).free()
+        self._quarantine.clear()
+
+        if not (cls := self._metrics.get(None)) or not hasattr(cls, '_recover'):
+            return
+
+        for labelvalues, value in self._metrics._items():
+            if labelvalues is not None:
+                metric = cls.__new__(cls)
+                metric.__setstate__(heap.Block(heap, value[0], cls.size))
+                metric._recover()
 
     def _label_values(self, values, labels):
         if values and labels:
@@ -92,38 +235,252 @@ class LabeledCollector(Struct):
                 raise ValueError("incorrect label count")
         return tuple(sys.intern(str(label)) for label in values)
 
+    # Children are stored in _metrics as the start of their block and of their
+    # series in the catalog. Their class is the same for every child, so we
+    # store it once (under None).
+    def _child_cls(self):
+        if not self._cls:
+            self._cls = self._metrics[None]
+        return self._cls
+
+    def _child(self, start):
+        cls = self._child_cls()
+        metric = cls.__new__(cls)
+        metric.__setstate__(self._heap.Block(self._heap, start, cls.size))
+        return metric
+
+    # These must be called with _shared_lock held for writing
+    def _add_child(self, values):
+        if self._max_series:
+            count = len(self._metrics) - (None in self._metrics) - \
+                    (self._overflow in self._metrics)
+            if count >= self._max_series:
+                values = self._overflow
+                if (entry := self._metrics.get(values)) is not None:
+                    return self._child(entry[0])
+
+        self._reclaim()
+        metric = self._metric(self._heap, **self._kwargs)
+        if None not in self._metrics:
+            self._metrics[None] = type(metric)
+        if (series := self._retired.get(values)) is not None:
+            del self._retired[values]
+            self._heap._revive_series(series, metric)
+        else:
+            labels = render_labels(dict(zip(self._labelnames, values)))
+            series = self._heap._add_series(self._catalog_family.value, labels, metric)
+        self._metrics[values] = metric.__getstate__().start, series
+        self._generation.inc()
+        return metric
+
+    def _free_children(self, items):
+        """Free the children in items (pairs of label values and entries),
+        which have already been deleted from _metrics"""
+        self._epoch.inc()
+        for values, (start, series) in items:
+            if series:
+                self._heap._retire_series(series)
+                self._retired[values] = series
+        starts = tuple(start for values, (start, series) in items)
+        self._quarantine[self._epoch.get()] = self._child_cls().size, starts
+        self._reclaim()
+
+    def _reclaim(self):
+        """Free the children in quarantine which no thread can still be
+        using"""
+        if not self._quarantine:
+            return
+
+        oldest = self._prune()
+        for epoch, (size, starts) in self._quarantine._items():
+            if epoch <= oldest:
+                del self._quarantine[epoch]
+                for start in starts:
+                    self._heap.Block(self._heap, start, size).free()
+
     def labels(self, *values, **labels):
-        values = self._label_values(values, labels)
+        """Return the child with the given label values. Children are only
+        replaced after they are removed (see remove), so the child may be kept
+        and used directly instead of calling this again. Looking up an existing child
+        by passing label values as strings doesn't take any locks.
+
+        If max_series was given and there are already that many children, new
+        label values share one overflow child instead, whose label values are
+        all OVERFLOW."""
+        if not labels and self._local.epoch == self._epoch.get() and \
+           (metric := self._cache.get(values)):
+            return metric
 
+        values = self._label_values(values, labels)
         with self._lock:
+            self._check_epoch()
             metric = self._cache.get(values)
             if not metric:
-                with self._shared_lock:
-                    metric = self._metrics.get(values)
-                    if not metric:
-                        metric = self._metric(self._heap, **self._kwargs)
-                        self._metrics[values] = metric
+                # Most lookups find an existing child, so only take the
+                # write lock when we might have to insert one.
+                with self._shared_lock.reader():
+                    entry = self._metrics.get(values)
+                if entry is None:
+                    with self._shared_lock:
+                        entry = self._metrics.get(values)
+                        if entry is None:
+                            metric = self._add_child(values)
+                if not metric:
+                    metric = self._child(entry[0])
                 self._cache[values] = metric
             return metric
 
+    def remove(self, *values):
+        """Remove the child with the given label values, if there is one, and
+        every process will create it again the next time it is looked up.
+
+        Other threads (in any process) may still be using the child, so its
+        memory is only returned to the heap once every thread which has used
+        this collector has noticed the removal (which happens the next time it
+        looks up or collects a child). Children which were kept (including
+        buffered children with unpublished updates) must not be used by a
+        thread after it has noticed, since their memory may have been
+        reused."""
+        values = self._label_values(values, {})
+        with self._lock:
+            with self._shared_lock:
+                entry = self._metrics.get(values)
+                if entry is not None:
+                    del self._metrics[values]
+                    self._free_children(((values, entry),))
+            self._check_epoch()
+
+    def clear(self):
+        """Remove every child (see remove)"""
+        with self._lock:
+            with self._shared_lock:
+                items = [(labelvalues, entry) for labelvalues, entry in self._metrics._items()
+                         if labelvalues is not None]
+                if items:
+                    self._free_children(items)
+                self._metrics.clear()
+            self._check_epoch()
+
     def _family(self):
         return metrics_core.Metric(self._name, self._docs, self._metric.typ)
 
     def describe(self):
         yield self._family()
 
-    def collect(self):
-        family = self._family()
+    def _children(self):
+        """Return a dict of every child, by label values. It must not be
+        modified."""
+        generation = self._generation.get()
         with self._lock:
-            metrics = self._cache = dict(self._metrics)
+            self._check_epoch()
+            if generation == self._children_gen:
+                return self._children_cache
+
+            # Only unpickle the children added since we last looked
+            with self._shared_lock.reader():
+                items = self._children_items()
+            return self._add_children(generation, items)
+
+    async def _children_async(self):
+        """Like _children, but awaitable. We don't hold _lock while waiting,
+        since synchronous code on the same thread may be trying to take it."""
+        generation = self._generation.get()
+
+        def try_children():
+            if not self._lock.acquire(False):
+                return None
+            try:
+                if not self._check_epoch(block=False):
+                    return None
+                if generation == self._children_gen:
+                    return self._children_cache,
+
+                if not aio.try_acquire(self._shared_lock, read=True):
+                    return None
+                try:
+                    items = self._children_items()
+                finally:
+                    self._shared_lock.release_read()
+                return self._add_children(generation, items),
+            finally:
+                self._lock.release()
+
+        children, = await aio.poll(try_children)
+        return children
+
+    # These must be called with _lock held (and _children_items with
+    # _shared_lock held for reading)
+    def _children_items(self):
+        items = self._metrics._items(since=self._children_seq)
+        self._children_seq = self._metrics._seq.value
+        return items
+
+    def _add_children(self, generation, items):
+        metrics = self._children_cache.copy()
+        for labelvalues, entry in items:
+            if labelvalues is None:
+                continue
+            if not (metric := self._cache.get(labelvalues)):
+                metric = self._cache[labelvalues] = self._child(entry[0])
+            metrics[labelvalues] = metric
+        self._children_cache = metrics
+        self._children_gen = generation
+        return metrics
 
-        for labelvalues, metric in metrics.items():
+    def collect(self):
+        family = self._family()
+        for labelvalues, metric in self._children().items():
             metric_labels = dict(zip(self._labelnames, labelvalues))
-            def add_sample(suffix, value, labels={}):
-                family.add_sample(self._name + suffix, metric_labels | labels, value)
+            def add_sample(suffix, value, labels={}, exemplar=None):
+                family.add_sample(self._name + suffix, metric_labels | labels, value,
+                                  exemplar=exemplar)
             metric._sample(add_sample)
         yield family
 
+    def _labels(self, labelvalues):
+        if not (labels := self._rendered.get(labelvalues)):
+            labels = render_labels(dict(zip(self._labelnames, labelvalues)))
+            self._rendered[labelvalues] = labels
+        return labels
+
+    def _expose(self, writer):
+        writer.family(self._name, self._docs, self._metric.typ)
+        for labelvalues, metric in self._children().items():
+            metric._expose(writer, self._labels(labelvalues))
+
+    async def _expose_async(self, writer):
+        writer.family(self._name, self._docs, self._metric.typ)
+        for labelvalues, metric in (await self._children_async()).items():
+            await _expose_series(metric, writer, self._labels(labelvalues))
+
+def _start_time(tid):
+    """Return when the thread tid started (in clock ticks since boot), or None
+    if it has exited. Together with tid, this identifies a thread even if its
+    tid is reused later."""
+    try:
+        with open(f'/proc/{tid}/stat', 'rb') as stat:
+            stat = stat.read()
+    except FileNotFoundError:
+        return None
+    # Skip the command, which may contain spaces
+    return int(stat[stat.rindex(b')') + 2:].split()[19])
+
+class _Acknowledged(threading.local):
+    """Where each thread acknowledges epochs for a LabeledCollector, once it
+    has registered, and the latest epoch it acknowledged"""
+    ack = None
+    epoch = None
+
+# Forked children have to forget what their parent cached, since they haven't
+# acknowledged any epochs yet
+_labeled = weakref.WeakSet()
+
+def _forget_labeled():
+    for collector in _labeled:
+        collector._forget()
+
+os.register_at_fork(after_in_child=_forget_labeled)
+
 class CollectorFactory:
     _heap_lock = threading.Lock()
 
@@ -141,7 +498,8 @@ class CollectorFactory:
         return getattr(self.__dict__['_metric'], name)
 
     def __call__(self, name, documentation, labelnames=(), namespace="",
-                 subsystem="", unit="", registry=registry.REGISTRY, **kwargs):
+                 subsystem="", unit="", registry=registry.REGISTRY, max_series=None,
+                 **kwargs):
 
         parts = []
         if namespace:
@@ -161,19 +519,125 @@ class CollectorFactory:
         name = '_'.join(parts)
         if not metrics_core.METRIC_NAME_RE.match(name):
             raise ValueError(f"invalid metric name {name}")
+        if max_series is not None and not labelnames:
+            raise ValueError("max_series requires labelnames")
 
         heap = getattr(registry, 'heap', self.heap)
 
+        def create():
+            if labelnames:
+                metric = Box[LabeledCollector](heap, self._metric, name, documentation,
+                                               labelnames, kwargs, max_series=max_series)
+            else:
+                metric = self._metric(heap, **kwargs)
+
+            family = heap._add_family(name, documentation, self._metric.typ)
+            if labelnames:
+                metric._catalog_family.value = family
+            else:
+                heap._add_series(family, (), metric)
+            return metric, family
+
+        if heap.persistent:
+            # Reattach to the metric from the last time the heap was used,
+            # unless it was created differently
+            kind = self._metric if isinstance(self._metric, type) else type(self._metric)
+            signature = kind.__qualname__, tuple(labelnames), tuple(sorted(kwargs.items()))
+            metric, attached = heap._reattach(name, signature, create)
+        else:
+            metric, _ = create()
+            attached = False
+
         if labelnames:
-            return Box[LabeledCollector](heap, self._metric, name, documentation, labelnames,
-                                         registry, kwargs)
-        return Collector(self._metric, name, documentation, registry, heap, kwargs)
+            collector = metric
+            if attached:
+                collector._attach(self._metric, name, documentation, labelnames, kwargs, heap,
+                                  max_series)
+        else:
+            collector = Collector(metric, name, documentation)
+
+        registry.register(collector)
+        return collector
 
-class Counter(Struct):
+class _NoExemplars:
+    """Metrics which support exemplars, once they are enabled with _Exemplary"""
+    def _record_exemplar(self, index, labels, value):
+        raise ValueError("exemplars are not enabled for this metric")
+
+    def _exemplar(self, index):
+        return None
+
+    def _rendered_exemplar(self, index):
+        return None
+
+    def _rendered_exemplars(self):
+        return None
+
+def _Exemplary(__name__, cls, sample_every):
+    """Add an exemplar for each bucket (or just one, for metrics without
+    buckets) to cls. Only one in sample_every exemplars is recorded by each
+    process."""
+    _fields_ = cls._fields_ | {
+        '_exemplars': Exemplars[getattr(cls, 'bucket_count', 1), sample_every],
+    }
+
+    def _record_exemplar(self, index, labels, value):
+        self._exemplars.record(index, labels, value)
+
+    def _exemplar(self, index):
+        if exemplar := self._exemplars.get(index):
+            return Exemplar(*exemplar)
+
+    def _rendered_exemplar(self, index):
+        if exemplar := self._exemplars.get(index):
+            labels, value, timestamp = exemplar
+            return render_labels(labels), value, timestamp
+
+    def _rendered_exemplars(self):
+        return tuple(self._rendered_exemplar(i) for i in range(self._exemplars.count))
+
+    ns = locals()
+    del ns['cls']
+    del ns['sample_every']
+    return type(__name__, (cls,), ns)
+
+_Exemplary = ProductType('_Exemplary', _Exemplary, (ObjectType, IntType))
+
+def _exemplar_every(exemplars):
+    sample_every = 1 if exemplars is True else exemplars
+    if sample_every < 1:
+        raise ValueError("must sample at least one in every exemplars")
+    return sample_every
+
+def _FixedSum(__name__, cls, frac_bits):
+    """Keep the sum of cls (a histogram or summary) in fixed point with
+    frac_bits fractional bits. Observations never have to retry, but the sum is
+    rounded and has a limited range (see mpmetrics.atomic.AtomicFixed)."""
+    _fields_ = cls._fields_ | {
+        '_data': FixedSum[cls._fields_['_data'], frac_bits],
+    }
+
+    return type(__name__, (cls,), { '_fields_': _fields_ })
+
+_FixedSum = ProductType('_FixedSum', _FixedSum, (ObjectType, IntType))
+
+def _fixed_frac_bits(fixed_sum):
+    return FIXED_FRAC_BITS if fixed_sum is True else fixed_sum
+
+def _unsigned(amounts):
+    """Whether amounts is a buffer of unsigned integers (which needn't be checked
+    for negative amounts)"""
+    try:
+        with memoryview(amounts) as view:
+            return view.format.lstrip('@=<>!') in ('B', 'H', 'I', 'L', 'Q', 'N')
+    except TypeError:
+        return False
+
+class Counter(_NoExemplars, Struct):
     typ = 'counter'
     _fields_ = {
         '_total': AtomicUInt64,
-        '_created': Double,
+        '_created': ReadMostly[Double],
     }
 
     def __init__(self, mem, **kwargs):
@@ -185,14 +649,35 @@ class Counter(Struct):
             raise ValueError("amount must be positive")
 
         if exemplar is not None:
-            raise NotImplementedError("exemplars are not yet supported")
-   
-        self._total.add(amount)
+            self._record_exemplar(0, exemplar, amount)
+
+        if amount == 1:
+            self._total.inc()
+        else:
+            self._total.add(amount)
+
+    def inc_many(self, amounts):
+        """Increment by each of amounts (an iterable or buffer of non-negative
+        integers). This is faster than calling inc in a loop, since the total
+        is published with one atomic update."""
+        if not _unsigned(amounts):
+            amounts = tuple(amounts)
+            if any(amount < 0 for amount in amounts):
+                raise ValueError("amount must be positive")
+        self._total.add_many(amounts)
 
     def _sample(self, add_sample):
-        add_sample('_total', self._total.get())
+        add_sample('_total', self._total.get(), exemplar=self._exemplar(0))
         add_sample('_created', self._created.value)
 
+    def _expose(self, writer, labels):
+        writer.sample('_total', labels, self._total, self._rendered_exemplar(0))
+        writer.sample('_created', labels, self._created.value)
+
+    # The fields holding the value and creation time, for the exporter
+    def _export(self):
+        return '_total', '_created'
+
     @contextmanager
     def count_exceptions(self, exception=Exception):
         try:
@@ -200,22 +685,91 @@ class Counter(Struct):
         except exception:
             self.inc()
 
-Counter = CollectorFactory(Box[Counter])
+def _ShardedCounter(__name__, shards, Counter=Counter):
+    _fields_ = Counter._fields_ | {
+        '_total': ShardedAtomicUInt64[shards],
+    }
+
+    ns = locals()
+    del ns['shards']
+    del ns['Counter']
+    return type(__name__, (Counter,), ns)
+
+_ShardedCounter = IntType('_ShardedCounter', _ShardedCounter)
+
+def _BufferedCounter(__name__, flush_every, Counter=Counter):
+    _fields_ = Counter._fields_ | {
+        '_total': BufferedAtomicUInt64[flush_every],
+    }
+
+    ns = locals()
+    del ns['flush_every']
+    del ns['Counter']
+    return type(__name__, (Counter,), ns)
+
+_BufferedCounter = IntType('_BufferedCounter', _BufferedCounter)
+
+# Default number of updates buffered before they are published
+FLUSH_EVERY = 1000
+
+class _CounterFactory:
+    typ = 'counter'
+    counter = Box[Counter]
+    exemplary = _Exemplary[Counter]
+    # Leave room for the rest of the counter in a 64 KiB page
+    MAX_SHARDS = 256
+
+    def __call__(self, heap, sharded=False, buffered=False, exemplars=False, **kwargs):
+        if buffered:
+            if sharded:
+                raise ValueError("counters cannot be both sharded and buffered")
+            flush_every = FLUSH_EVERY if buffered is True else buffered
+            if flush_every < 1:
+                raise ValueError("must buffer at least one update")
+            counter = _BufferedCounter[flush_every]
+        elif sharded:
+            if sharded is True:
+                shards = min(os.cpu_count() or 1, self.MAX_SHARDS)
+            else:
+                shards = sharded
+            if shards < 1:
+                raise ValueError("must have at least one shard")
+            if shards > self.MAX_SHARDS:
+                raise ValueError(f"can't have more than {self.MAX_SHARDS} shards")
+            counter = _ShardedCounter[shards]
+        elif exemplars:
+            return Box[self.exemplary[_exemplar_every(exemplars)]](heap, **kwargs)
+        else:
+            return self.counter(heap, **kwargs)
+
+        if exemplars:
+            counter = _Exemplary[counter, _exemplar_every(exemplars)]
+        return Box[counter](heap, **kwargs)
+
+Counter = CollectorFactory(_CounterFactory())
 
 class Gauge(Struct):
     typ = 'gauge'
     _fields_ = {
         '_value': AtomicDouble,
     }
+    # Gauges are small, and usually updated less often than counters
+    _packed_ = True
 
     def __init__(self, mem, **kwargs):
         super().__init__(mem)
 
     def inc(self, amount=1):
-        self._value.add(amount)
+        if amount == 1:
+            self._value.inc()
+        else:
+            self._value.add(amount)
 
     def dec(self, amount=1):
-        self._value.add(-amount)
+        if amount == 1:
+            self._value.dec()
+        else:
+            self._value.add(-amount)
 
     def set(self, amount):
         self._value.set(amount)
@@ -223,6 +777,12 @@ class Gauge(Struct):
     def _sample(self, add_sample):
         add_sample('', self._value.get())
 
+    def _expose(self, writer, labels):
+        writer.sample('', labels, self._value)
+
+    def _export(self):
+        return '_value', None
+
     def set_to_current_time(self):
         self.set(time.time())
 
@@ -239,146 +799,347 @@ class Gauge(Struct):
 
 Gauge = CollectorFactory(Box[Gauge])
 
-class _SummaryData(Struct):
-    _fields_ = {
-        'sum': AtomicDouble,
-        'count': AtomicUInt64,
-    }
+def _snapshot(lock, data):
+    """Take a snapshot of data (a HistogramData). Only one scraper may take a
+    snapshot at once, but any others can share its result."""
+    if lock.acquire(block=False):
+        try:
+            return data.snapshot()
+        finally:
+            lock.release()
+
+    with lock.reader():
+        return data.saved()
+
+async def _snapshot_async(lock, data):
+    """Like _snapshot, but awaitable. Instead of blocking the event loop, we
+    poll for observers to finish with the cold half."""
+    if aio.try_acquire(lock):
+        snapshot = None
+        try:
+            snapshot = await aio.poll(data.try_snapshot)
+        finally:
+            # If we were cancelled, finish the pending snapshot before letting
+            # anyone else start another
+            if not snapshot:
+                data.snapshot()
+            lock.release()
+        return snapshot
+
+    async with aio.locked(lock, read=True):
+        return data.saved()
+
+async def _expose_series(metric, writer, labels):
+    """Expose metric, awaiting anything which might block"""
+    if expose := getattr(metric, '_expose_async', None):
+        await expose(writer, labels)
+    else:
+        metric._expose(writer, labels)
+
+def _expose_cached(metric, writer, key, expose):
+    """Write a series' samples with expose(), unless key (which must determine
+    everything expose writes) is the same as the last time. Then the text from
+    last time is reused instead. The cache is per-process."""
+    key = writer.openmetrics, key
+    if (cached := getattr(metric, '_exposed', None)) and cached[0] == key:
+        writer.write(cached[1])
+    else:
+        start = writer.tell()
+        expose()
+        metric._exposed = key, writer.getvalue(start)
 
 class Summary(Struct):
     typ = 'summary'
     reserved_labels = ('quantile',)
+    # Only scrapers take the lock
     _fields_ = {
-        '_lock': _mpmetrics.Lock,
-        '_data': Array[_SummaryData, 2],
-        '_count': AtomicUInt64,
-        '_created': Double,
+        '_lock': ReadMostly[_mpmetrics.RWLock],
+        '_data': HistogramData[0],
+        '_created': ReadMostly[Double],
     }
+    quantiles = ()
 
     def __init__(self, mem, **kwargs):
         super().__init__(mem)
         self._created.value = time.time()
 
     def observe(self, amount):
-        data = self._data[self._count.add(1) >> 63]
-        data.sum.add(amount)
-        data.count.add(1)
+        self._data.observe(amount)
 
-    def _sample(self, add_sample):
-        with self._lock:
-            count = self._count.add(1 << 63, raise_on_overflow=False)
-            hot = self._data[~count >> 63]
-            cold = self._data[count >> 63]
-            count &= genmask(62, 0)
+    def observe_many(self, amounts):
+        """Observe each of amounts (an iterable or buffer of numbers)"""
+        self._data.observe_many(amounts)
 
-            while cold.count.get() != count:
-                time.sleep(0)
+    def _estimate(self, buckets):
+        return ()
 
-            sum = cold.sum.get()
-            hot.count.add(count)
-            hot.sum.add(sum)
-            cold.count.set(0)
-            cold.sum.set(0)
+    def _sample(self, add_sample):
+        buckets, sum, count = _snapshot(self._lock, self._data)
 
+        for quantile, value in zip(self.quantiles, self._estimate(buckets)):
+            add_sample('', value, { 'quantile': str(quantile) })
         add_sample('_count', count)
         add_sample('_sum', sum)
         add_sample('_created', self._created.value)
 
+    def _expose(self, writer, labels):
+        self._expose_snapshot(writer, labels, _snapshot(self._lock, self._data))
+
+    async def _expose_async(self, writer, labels):
+        self._expose_snapshot(writer, labels, await _snapshot_async(self._lock, self._data))
+
+    def _expose_snapshot(self, writer, labels, snapshot):
+        buckets, sum, count = snapshot
+
+        # The buckets can't change unless count does
+        _expose_cached(self, writer, (labels, sum, count),
+                       lambda: writer.summary(labels, self.quantiles, self._estimate(buckets),
+                                              sum, count))
+        writer.sample('_created', labels, self._created.value)
+
+    def _export(self):
+        return '_data', '_created'
+
+    def _recover(self):
+        self._reinit('_lock')
+
     def time(self):
         return Timer(self.observe)
 
-Summary = CollectorFactory(Box[Summary])
-
-def _HistogramData(__name__, bucket_count):
-    _fields_ = {
-        'buckets': Array[AtomicUInt64, bucket_count],
-        'sum': AtomicDouble,
-        'count': AtomicUInt64,
+def _positive(amounts):
+    """Return amounts (as a sequence, if it was an iterator), or raise
+    ValueError if any of them aren't positive"""
+    try:
+        with memoryview(amounts) as view:
+            values = view.tolist()
+    except TypeError:
+        values = amounts = tuple(amounts)
+    if not all(amount > 0 for amount in values):
+        raise ValueError("summaries with quantiles can only observe positive amounts")
+    return amounts
+
+def _QuantileSummary(__name__, quantile_count, schema, min_key, max_key, Summary=Summary):
+    _fields_ = Summary._fields_ | {
+        '_data': ExponentialHistogramData[schema, min_key, max_key],
+        '_quantiles': ReadMostly[Array[Double, quantile_count]],
     }
 
-    ns = locals()
-    del ns['bucket_count']
-    return type(__name__, (Struct,), ns)
+    def __init__(self, mem, quantiles, thresholds, **kwargs):
+        Summary.__init__(self, mem)
+        self._data.thresholds = thresholds
+        for quantile, value in zip(self._quantiles, quantiles):
+            quantile.value = value
 
-_HistogramData = IntType('_HistogramData', _HistogramData)
+    quantiles = functools.cached_property(lambda self: tuple(q.value for q in self._quantiles))
+    thresholds = functools.cached_property(lambda self: self._data.thresholds)
+
+    # Everything below lowest shares a bucket, whose estimate is positive. So
+    # zero and negative amounts (which have no logarithm) would be estimated
+    # as positive too.
+    def observe(self, amount):
+        if not amount > 0:
+            raise ValueError("summaries with quantiles can only observe positive amounts")
+        self._data.observe(amount)
+
+    def observe_many(self, amounts):
+        self._data.observe_many(_positive(amounts))
+
+    def _estimate(self, buckets):
+        """Estimate the quantiles from a snapshot of the buckets, using the
+        DDSketch estimate for the bucket holding each quantile's rank"""
+        cumulative = tuple(itertools.accumulate(buckets))
+        total = cumulative[-1]
+        if not total:
+            return (math.nan,) * quantile_count
+
+        values = []
+        for quantile in self.quantiles:
+            i = bisect.bisect_right(cumulative, quantile * (total - 1))
+            # Observations above highest can only be bounded from below
+            if i == len(cumulative) - 1:
+                values.append(self.thresholds[-2])
+            else:
+                values.append(2 * self.thresholds[i] / (gamma + 1))
+        return tuple(values)
+
+    # The exporter can't estimate quantiles
+    _export = None
+
+    gamma = 2 ** 2.0 ** -schema
+    ns = locals()
+    del ns['quantile_count']
+    del ns['schema']
+    del ns['min_key']
+    del ns['max_key']
+    del ns['gamma']
+    del ns['Summary']
+    return type(__name__, (Summary,), ns)
+
+_QuantileSummary = ProductType('_QuantileSummary', _QuantileSummary,
+                               (IntType, IntType, IntType, IntType))
+
+class _SummaryFactory:
+    """Summaries, optionally with quantiles. Quantiles are estimated with a
+    DDSketch: observations from lowest to highest are counted in exponential
+    buckets (like ExponentialHistogram) fine enough that each estimate is
+    within relative_accuracy of the true quantile. Observing is as cheap as for
+    a histogram, memory use is fixed, and sketches with the same parameters can
+    be merged by adding their buckets.
+
+    Memory use is proportional to log(highest / lowest) / relative_accuracy.
+    With the defaults, each series takes about 11 KiB, and halving
+    relative_accuracy roughly doubles that.
+
+    Summaries with quantiles can only observe positive amounts; observing zero
+    or a negative amount raises ValueError. Positive amounts below lowest are
+    estimated as about lowest."""
+    typ = 'summary'
+    reserved_labels = ('quantile',)
+    # Summary is about to be replaced by a factory, so look up these types (by
+    # name) while we still can
+    struct = Summary
+    summary = Box[Summary]
+    # Generic types are unpickled by looking up their arguments by name, and
+    # these lookups are cached. Resolve Summary for _FixedSum too, so fixed-sum
+    # summaries (with any frac_bits) still unpickle once the name refers to
+    # the factory.
+    fixed_summary = _FixedSum[Summary, FIXED_FRAC_BITS]
+
+    @staticmethod
+    def _sketch(quantiles, relative_accuracy, lowest, highest):
+        quantiles = tuple(float(quantile) for quantile in quantiles)
+        if not all(0 <= quantile <= 1 for quantile in quantiles):
+            raise ValueError("quantiles must be between 0 and 1")
+        if not 0 < lowest < highest < float('inf'):
+            raise ValueError("must have 0 < lowest < highest < inf")
+
+        # Use the coarsest buckets which are accurate enough
+        for schema in range(-4, 9):
+            gamma = 2 ** 2.0 ** -schema
+            if (gamma - 1) / (gamma + 1) <= relative_accuracy:
+                break
+        else:
+            raise ValueError(f"relative accuracy must be at least {(gamma - 1) / (gamma + 1)}")
+
+        min_key = exponential_key(lowest, schema)
+        max_key = max(exponential_key(highest, schema), min_key + 1)
+        thresholds = tuple(exponential_bound(key, schema) for key in range(min_key, max_key + 1))
+        return quantiles, schema, min_key, max_key, thresholds + (float('inf'),)
+
+    @staticmethod
+    def _check_size(heap, summary):
+        if summary.size > heap.max_size:
+            raise ValueError(f"quantiles from lowest to highest with this relative_accuracy "
+                             f"need {summary.size} bytes per series, but the heap can only "
+                             f"allocate {heap.max_size}; increase relative_accuracy or narrow "
+                             f"lowest and highest")
+
+    def __call__(self, heap, quantiles=(), relative_accuracy=0.05, lowest=1e-6, highest=1e4,
+                 fixed_sum=False, **kwargs):
+        if not quantiles:
+            if fixed_sum is True:
+                return Box[self.fixed_summary](heap, **kwargs)
+            if fixed_sum:
+                summary = _FixedSum[self.struct, _fixed_frac_bits(fixed_sum)]
+                return Box[summary](heap, **kwargs)
+            return self.summary(heap, **kwargs)
+
+        quantiles, schema, min_key, max_key, thresholds = \
+            self._sketch(quantiles, relative_accuracy, lowest, highest)
+        summary = _QuantileSummary[len(quantiles), schema, min_key, max_key]
+        if fixed_sum:
+            summary = _FixedSum[summary, _fixed_frac_bits(fixed_sum)]
+        self._check_size(heap, summary)
+        return Box[summary](heap, quantiles=quantiles, thresholds=thresholds, **kwargs)
+
+Summary = CollectorFactory(_SummaryFactory())
 
 def _Histogram(__name__, bucket_count):
     typ = 'histogram'
     _fields_ = {
-        '_thresholds': Array[Double, bucket_count],
-        '_lock': _mpmetrics.Lock,
-        '_data': Array[_HistogramData[bucket_count], 2],
-        '_count': AtomicUInt64,
-        '_created': Double,
+        '_lock': ReadMostly[_mpmetrics.RWLock],
+        '_data': HistogramData[bucket_count],
+        '_created': ReadMostly[Double],
     }
 
     def __init__(self, mem, thresholds, **kwargs):
         Struct.__init__(self, mem)
         assert len(thresholds) == bucket_count
         self.thresholds = thresholds
-        for threshold, initial in zip(self._thresholds, thresholds):
-            threshold.value = initial
+        self._data.thresholds = thresholds
         self._created.value = time.time()
 
-    def _setstate(self, mem, heap):
-        Struct._setstate(self, mem)
-        self.thresholds = tuple(threshold.value for threshold in self._thresholds)
+    # Reading the thresholds is relatively slow, so defer it until we need them
+    thresholds = functools.cached_property(lambda self: self._data.thresholds)
 
     def observe(self, amount, exemplar=None):
         if exemplar is not None:
-            raise NotImplementedError("exemplars are not yet supported")
+            self._record_exemplar(bisect.bisect_left(self.thresholds, amount), exemplar, amount)
 
-        i = bisect.bisect_left(self.thresholds, amount)
+        self._data.observe(amount)
 
-        data = self._data[self._count.add(1) >> 63]
-        data.buckets[i].add(1)
-        data.sum.add(amount)
-        data.count.add(1)
+    def observe_many(self, amounts):
+        """Observe each of amounts (an iterable or buffer of numbers). This is
+        faster than calling observe in a loop, since the observations are
+        binned locally and each bucket is published with one atomic update."""
+        self._data.observe_many(amounts)
 
     def _sample(self, add_sample):
-        with self._lock:
-            count = self._count.add(1 << 63, raise_on_overflow=False)
-            hot = self._data[~count >> 63]
-            cold = self._data[count >> 63]
-            count &= genmask(62, 0)
+        buckets, sum, count = _snapshot(self._lock, self._data)
 
-            while cold.count.get() != count:
-                time.sleep(0)
+        for i, (val, le) in enumerate(zip(itertools.accumulate(buckets), self.thresholds)):
+            add_sample('_bucket', val, { 'le': str(le) }, exemplar=self._exemplar(i))
+        add_sample('_sum', sum)
+        add_sample('_count', count)
+        add_sample('_created', self._created.value)
 
-            buckets = [bucket.get() for bucket in cold.buckets]
-            sum = cold.sum.get()
+    def _expose(self, writer, labels):
+        self._expose_snapshot(writer, labels, _snapshot(self._lock, self._data))
 
-            for i, bucket in enumerate(buckets):
-                hot.buckets[i].add(bucket)
-            hot.sum.add(sum)
-            hot.count.add(count)
+    async def _expose_async(self, writer, labels):
+        self._expose_snapshot(writer, labels, await _snapshot_async(self._lock, self._data))
 
-            for bucket in cold.buckets:
-                bucket.set(0)
-            cold.sum.set(0)
-            cold.count.set(0)
+    def _expose_snapshot(self, writer, labels, snapshot):
+        buckets, sum, count = snapshot
+        exemplars = self._rendered_exemplars()
 
-        for val, le in zip(itertools.accumulate(buckets), self.thresholds):
-            add_sample('_bucket', val, { 'le': str(le) })
-        add_sample('_sum', sum)
-        add_sample('_count', count)
-        add_sample('_created', self._created.value)
+        # The buckets can't change unless count does
+        _expose_cached(self, writer, (labels, sum, count, exemplars),
+                       lambda: writer.histogram(labels, self.thresholds, buckets, sum, count,
+                                                exemplars=exemplars))
+        writer.sample('_created', labels, self._created.value)
+
+    def _export(self):
+        return '_data', '_created'
+
+    def _recover(self):
+        self._reinit('_lock')
 
     ns = locals()
     ns['time'] = lambda self: Timer(self.observe)
-    del ns['bucket_count']
 
-    return type(__name__, (Struct,), ns)
+    return type(__name__, (_NoExemplars, Struct), ns)
 
 _Histogram = IntType('_Histogram', _Histogram)
 
+def _BufferedHistogram(__name__, bucket_count, flush_every):
+    Histogram = _Histogram[bucket_count]
+    _fields_ = Histogram._fields_ | {
+        '_data': BufferedHistogramData[bucket_count, flush_every],
+    }
+
+    return type(__name__, (Histogram,), { '_fields_': _fields_ })
+
+_BufferedHistogram = ProductType('_BufferedHistogram', _BufferedHistogram, (IntType, IntType))
+
 class _HistogramFactory:
     typ = 'histogram'
     reserved_labels = ('le',)
     DEFAULT_BUCKETS = (.005, .01, .025, .05, .075, .1, .25, .5, .75, 1.0, 2.5, 5.0, 7.5, 10.0,
                        float('inf'))
 
-    def __call__(self, heap, buckets=DEFAULT_BUCKETS, **kwargs):
+    @staticmethod
+    def _thresholds(buckets):
         thresholds = [float(b) for b in buckets]
         if thresholds != sorted(thresholds):
             raise ValueError('thresholds not in sorted order')
@@ -386,9 +1147,400 @@ class _HistogramFactory:
             thresholds.append(float('inf'))
         if len(thresholds) < 2:
             raise ValueError('must have at least two thresholds')
-        thresholds = tuple(thresholds)
+        return tuple(thresholds)
+
+    def __call__(self, heap, buckets=DEFAULT_BUCKETS, buffered=False, exemplars=False,
+                 fixed_sum=False, **kwargs):
+        thresholds = self._thresholds(buckets)
+
+        if buffered:
+            flush_every = FLUSH_EVERY if buffered is True else buffered
+            if flush_every < 1:
+                raise ValueError("must buffer at least one observation")
+            histogram = _BufferedHistogram[len(thresholds), flush_every]
+        else:
+            histogram = _Histogram[len(thresholds)]
 
-        histogram = Box[_Histogram[len(thresholds)]]
-        return histogram(heap, thresholds=thresholds, **kwargs)
+        if fixed_sum:
+            histogram = _FixedSum[histogram, _fixed_frac_bits(fixed_sum)]
+        if exemplars:
+            histogram = _Exemplary[histogram, _exemplar_every(exemplars)]
+        return Box[histogram](heap, thresholds=thresholds, **kwargs)
 
 Histogram = CollectorFactory(_HistogramFactory())
+
+def _ExponentialHistogram(__name__, schema, min_key, max_key):
+    Histogram = _Histogram[max_key - min_key + 2]
+    _fields_ = Histogram._fields_ | {
+        '_data': ExponentialHistogramData[schema, min_key, max_key],
+    }
+
+    return type(__name__, (Histogram,), { '_fields_': _fields_, 'schema': schema })
+
+_ExponentialHistogram = ProductType('_ExponentialHistogram', _ExponentialHistogram,
+                                    (IntType, IntType, IntType))
+
+def _BufferedExponentialHistogram(__name__, schema, min_key, max_key, flush_every):
+    Histogram = _ExponentialHistogram[schema, min_key, max_key]
+    _fields_ = Histogram._fields_ | {
+        '_data': BufferedExponentialHistogramData[schema, min_key, max_key, flush_every],
+    }
+
+    return type(__name__, (Histogram,), { '_fields_': _fields_ })
+
+_BufferedExponentialHistogram = ProductType('_BufferedExponentialHistogram',
+                                            _BufferedExponentialHistogram,
+                                            (IntType, IntType, IntType, IntType))
+
+class _ExponentialHistogramFactory:
+    """Histograms with exponential buckets, like Prometheus native histograms.
+    Each power of two is split into 2^schema buckets, from lowest to highest
+    (plus a bucket for everything below lowest, and one for everything above
+    highest). If that would need more than max_buckets buckets, the schema is
+    reduced until it fits."""
+    typ = 'histogram'
+    reserved_labels = ('le',)
+
+    def __call__(self, heap, schema=3, lowest=1e-6, highest=1e4, max_buckets=160,
+                 buffered=False, exemplars=False, fixed_sum=False, **kwargs):
+        if not -4 <= schema <= 8:
+            raise ValueError("schema must be between -4 and 8")
+        if not 0 < lowest < highest < float('inf'):
+            raise ValueError("must have 0 < lowest < highest < inf")
+
+        while True:
+            min_key = exponential_key(lowest, schema)
+            max_key = max(exponential_key(highest, schema), min_key + 1)
+            if max_key - min_key + 2 <= max_buckets:
+                break
+            if schema == -4:
+                raise ValueError(f"can't fit {lowest} to {highest} in {max_buckets} buckets")
+            schema -= 1
+
+        thresholds = tuple(exponential_bound(key, schema) for key in range(min_key, max_key + 1))
+        if buffered:
+            flush_every = FLUSH_EVERY if buffered is True else buffered
+            if flush_every < 1:
+                raise ValueError("must buffer at least one observation")
+            histogram = _BufferedExponentialHistogram[schema, min_key, max_key, flush_every]
+        else:
+            histogram = _ExponentialHistogram[schema, min_key, max_key]
+        if fixed_sum:
+            histogram = _FixedSum[histogram, _fixed_frac_bits(fixed_sum)]
+        if exemplars:
+            histogram = _Exemplary[histogram, _exemplar_every(exemplars)]
+        return Box[histogram](heap, thresholds=thresholds + (float('inf'),), **kwargs)
+
+ExponentialHistogram = CollectorFactory(_ExponentialHistogramFactory())
+
+def _Window(__name__, slices, length):
+    """The values of some data (length integers and a sum) at the start of each
+    of the last few time slices. Subtracting the values at the start of the
+    oldest slice from the current values gives the change over the window.
+    Slices are numbered from the monotonic clock, which all processes share.
+    The ring is only written once per slice, by whoever first notices that a
+    new slice has started, so updating the data itself stays lock-free. If the
+    clock restarts (such as when a persistent heap is reopened after a
+    reboot), the ring starts over."""
+    _fields_ = {
+        '_lock': _mpmetrics.FutexLock,
+        '_width': ReadMostly[Double],
+        '_epoch': AtomicUInt64,
+        '_epochs': AtomicUInt64Array[slices],
+        '_values': AtomicUInt64Array[slices * length],
+        '_sums': AtomicDoubleArray[slices],
+    }
+
+    def start(self, width):
+        self._width.value = width
+        epoch = self.epoch()
+        self._epoch.set(epoch)
+        self._epochs.set(epoch % slices, epoch)
+
+    width = functools.cached_property(lambda self: self._width.value)
+
+    # Slices are numbered from slices, rather than from 0, so that the ring
+    # can always be filled with slices before the current one
+    def epoch(self):
+        return int(time.monotonic() // self.width) + slices
+
+    def update(self, read):
+        """Record the values returned by read if a new slice has started. This
+        must be called before updating the data."""
+        # This is called for every update, so only convert to int if we rotate
+        if time.monotonic() // self.width + slices != self._epoch.get():
+            with self._lock:
+                self._rotate(read)
+
+    def _rotate(self, read):
+        """Bring the ring up to date, and return the current slice. Must be
+        called with _lock held."""
+        # Read the clock with the lock held, so that nobody can have rotated
+        # past us. Then we only go backwards if the clock restarted.
+        epoch = self.epoch()
+        last = self._epoch.get()
+        if epoch == last:
+            return epoch
+        elif epoch < last:
+            # Start over, as if nothing had been updated for a whole window
+            last = epoch - slices
+
+        # Nothing was updated during any slices we skipped, so they all start
+        # with the same values
+        values, sum = read()
+        for e in range(max(last + 1, epoch - slices + 1), epoch + 1):
+            i = e % slices
+            for j, value in enumerate(values):
+                self._values.set(i * length + j, value)
+            self._sums.set(i, sum)
+            self._epochs.set(i, e)
+        self._epoch.set(epoch)
+        return epoch
+
+    def read(self, read):
+        """Return the current values (from read) and the values at the start
+        of the window. Data which is older than the ring (or created during the
+        window) starts from zero."""
+        with self._lock:
+            epoch = self._rotate(read)
+            current = read()
+            oldest = epoch - slices + 1
+            i = oldest % slices
+            if self._epochs.get(i) != oldest:
+                return current, ((0,) * length, 0.0)
+            values = tuple(self._values.get(i * length + j) for j in range(length))
+            return current, (values, self._sums.get(i))
+
+    def _recover(self):
+        self._reinit('_lock')
+
+    ns = locals()
+    del ns['slices']
+    del ns['length']
+    return type(__name__, (Struct,), ns)
+
+_Window = ProductType('_Window', _Window, (IntType, IntType))
+
+def _WindowedCounter(__name__, slices):
+    typ = 'gauge'
+    _fields_ = {
+        '_total': AtomicUInt64,
+        '_window': _Window[slices, 1],
+    }
+
+    def __init__(self, mem, window, **kwargs):
+        Struct.__init__(self, mem)
+        self._window.start(window / slices)
+
+    def _read(self):
+        return (self._total.get(),), 0.0
+
+    def inc(self, amount=1):
+        if amount < 0:
+            raise ValueError("amount must be positive")
+
+        self._window.update(self._read)
+        if amount == 1:
+            self._total.inc()
+        else:
+            self._total.add(amount)
+
+    def _increase(self):
+        ((total,), _), ((start,), _) = self._window.read(self._read)
+        return total - start
+
+    def _sample(self, add_sample):
+        add_sample('', self._increase())
+
+    def _expose(self, writer, labels):
+        writer.sample('', labels, self._increase())
+
+    def _recover(self):
+        self._window._recover()
+
+    ns = locals()
+    del ns['slices']
+    return type(__name__, (Struct,), ns)
+
+_WindowedCounter = IntType('_WindowedCounter', _WindowedCounter)
+
+def _WindowedHistogram(__name__, slices, bucket_count):
+    Histogram = _Histogram[bucket_count]
+    typ = 'gaugehistogram'
+    _fields_ = {
+        '_data': HistogramData[bucket_count],
+        '_window': _Window[slices, bucket_count + 1],
+    }
+
+    def __init__(self, mem, thresholds, window, **kwargs):
+        Struct.__init__(self, mem)
+        self.thresholds = thresholds
+        self._data.thresholds = thresholds
+        self._window.start(window / slices)
+
+    def _read(self):
+        buckets, sum, count = self._data.snapshot()
+        return buckets + (count,), sum
+
+    def observe(self, amount, exemplar=None):
+        self._window.update(self._read)
+        Histogram.observe(self, amount, exemplar)
+
+    def observe_many(self, amounts):
+        self._window.update(self._read)
+        self._data.observe_many(amounts)
+
+    def _delta(self):
+        (values, sum), (start, start_sum) = self._window.read(self._read)
+        values = tuple(value - old for value, old in zip(values, start))
+        return values[:-1], sum - start_sum, values[-1]
+
+    def _sample(self, add_sample):
+        buckets, sum, count = self._delta()
+
+        for val, le in zip(itertools.accumulate(buckets), self.thresholds):
+            add_sample('_bucket', val, { 'le': str(le) })
+        add_sample('_gsum', sum)
+        add_sample('_gcount', count)
+
+    def _expose(self, writer, labels):
+        buckets, sum, count = self._delta()
+        writer.histogram(labels, self.thresholds, buckets, sum, count, gauge=True)
+
+    # Windows don't take snapshots with _snapshot
+    _expose_async = None
+
+    # The exporter can't read windows
+    _export = None
+
+    def _recover(self):
+        self._window._recover()
+
+    ns = locals()
+    del ns['slices']
+    del ns['bucket_count']
+    del ns['Histogram']
+    return type(__name__, (Histogram,), ns)
+
+_WindowedHistogram = ProductType('_WindowedHistogram', _WindowedHistogram, (IntType, IntType))
+
+def _WindowedSummary(__name__, slices, quantile_count, schema, min_key, max_key):
+    Summary = _QuantileSummary[quantile_count, schema, min_key, max_key]
+    _fields_ = {
+        '_data': ExponentialHistogramData[schema, min_key, max_key],
+        '_quantiles': ReadMostly[Array[Double, quantile_count]],
+        '_window': _Window[slices, max_key - min_key + 2],
+        '_created': Double,
+    }
+
+    def __init__(self, mem, quantiles, thresholds, window, **kwargs):
+        Summary.__init__(self, mem, quantiles, thresholds)
+        self._window.start(window / slices)
+
+    def _read(self):
+        buckets, sum, count = self._data.snapshot()
+        return buckets, sum
+
+    def observe(self, amount):
+        if not amount > 0:
+            raise ValueError("summaries with quantiles can only observe positive amounts")
+        self._window.update(self._read)
+        self._data.observe(amount)
+
+    def observe_many(self, amounts):
+        amounts = _positive(amounts)
+        self._window.update(self._read)
+        self._data.observe_many(amounts)
+
+    # Like Prometheus, only the quantiles are windowed, so _sum and _count can
+    # still be used with rate()
+    def _snapshot(self):
+        (buckets, total), (start, _) = self._window.read(self._read)
+        window = tuple(bucket - old for bucket, old in zip(buckets, start))
+        return self._estimate(window), total, sum(buckets)
+
+    def _sample(self, add_sample):
+        values, total, count = self._snapshot()
+
+        for quantile, value in zip(self.quantiles, values):
+            add_sample('', value, { 'quantile': str(quantile) })
+        add_sample('_count', count)
+        add_sample('_sum', total)
+        add_sample('_created', self._created.value)
+
+    def _expose(self, writer, labels):
+        values, total, count = self._snapshot()
+
+        writer.summary(labels, self.quantiles, values, total, count)
+        writer.sample('_created', labels, self._created.value)
+
+    _expose_async = None
+
+    def _recover(self):
+        self._window._recover()
+
+    ns = locals()
+    del ns['slices']
+    del ns['quantile_count']
+    del ns['schema']
+    del ns['min_key']
+    del ns['max_key']
+    del ns['Summary']
+    return type(__name__, (Summary,), ns)
+
+_WindowedSummary = ProductType('_WindowedSummary', _WindowedSummary,
+                               (IntType, IntType, IntType, IntType, IntType))
+
+def _check_window(window, slices):
+    if not 0 < window < float('inf'):
+        raise ValueError("window must be positive")
+    if slices < 1:
+        raise ValueError("must have at least one slice")
+
+class _WindowedCounterFactory:
+    """Counters which report how much they were incremented by during the last
+    window seconds. The window is divided into slices, and moves forward one
+    slice at a time, so it covers between window * (slices - 1) / slices and
+    window seconds."""
+    typ = 'gauge'
+
+    def __call__(self, heap, window=60, slices=6, **kwargs):
+        _check_window(window, slices)
+        return Box[_WindowedCounter[slices]](heap, window=window, **kwargs)
+
+WindowedCounter = CollectorFactory(_WindowedCounterFactory())
+
+class _WindowedHistogramFactory(_HistogramFactory):
+    """Gauge histograms of the observations during the last window seconds.
+    The window moves like WindowedCounter's."""
+    typ = 'gaugehistogram'
+
+    def __call__(self, heap, buckets=_HistogramFactory.DEFAULT_BUCKETS, window=60, slices=6,
+                 **kwargs):
+        _check_window(window, slices)
+        thresholds = self._thresholds(buckets)
+        histogram = Box[_WindowedHistogram[slices, len(thresholds)]]
+        return histogram(heap, thresholds=thresholds, window=window, **kwargs)
+
+WindowedHistogram = CollectorFactory(_WindowedHistogramFactory())
+
+class _WindowedSummaryFactory(_SummaryFactory):
+    """Summaries whose quantiles are estimated from the observations during
+    the last window seconds. The window moves like WindowedCounter's. The sum
+    and count cover all observations. Each slice needs a copy of the buckets,
+    so with the defaults each series takes about 24 KiB."""
+
+    def __call__(self, heap, quantiles=(0.5, 0.9, 0.99), relative_accuracy=0.05, lowest=1e-6,
+                 highest=1e4, window=60, slices=6, **kwargs):
+        if not quantiles:
+            raise ValueError("must have at least one quantile")
+        _check_window(window, slices)
+
+        quantiles, schema, min_key, max_key, thresholds = \
+            self._sketch(quantiles, relative_accuracy, lowest, highest)
+        summary = _WindowedSummary[slices, len(quantiles), schema, min_key, max_key]
+        self._check_size(heap, summary)
+        return Box[summary](heap, quantiles=quantiles, thresholds=thresholds, window=window,
+                            **kwargs)
+
+WindowedSummary = CollectorFactory(_WindowedSummaryFactory())
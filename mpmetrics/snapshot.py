@@ -0,0 +1,207 @@
+# SPDX-License-Identifier: LGPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+"""Compact binary snapshots of the metrics in a heap, for shipping them
+somewhere else. An Encoder reads the heap's catalog directly (like
+mpmetrics-exporter), and each snapshot only has what changed since the last
+one. A Decoder applies snapshots in order, and can be registered as a collector
+to export them again. See snapshot.c for the format."""
+
+import itertools
+import mmap
+import os
+import re
+import struct
+
+from prometheus_client import metrics_core
+from prometheus_client.utils import floatToGoString
+
+import _mpmetrics
+from .heap import EXPORT_DOUBLE, EXPORT_HISTOGRAM
+
+MAGIC = b'mpmsnap\x02'
+
+class Encoder:
+    """Encode snapshots of the metrics in heap. Only metrics supported by
+    mpmetrics-exporter are included."""
+
+    def __init__(self, heap):
+        self._fd = os.open(heap.filename, os.O_RDONLY | os.O_CLOEXEC)
+        self._map = None
+        self._encoder = _mpmetrics.SnapshotEncoder()
+
+    def __del__(self):
+        if self._map:
+            self._map.close()
+        os.close(self._fd)
+
+    def encode(self, full=False):
+        """Encode a snapshot relative to the last one, or a full snapshot
+        if full is true (or this is the first snapshot)"""
+        size = os.fstat(self._fd).st_size
+        if not self._map or len(self._map) != size:
+            if self._map:
+                self._map.close()
+            self._map = mmap.mmap(self._fd, size, prot=mmap.PROT_READ)
+        return self._encoder.encode(self._map, full)
+
+    @property
+    def sequence(self):
+        """The sequence number of the last snapshot"""
+        return self._encoder.sequence
+
+class _Reader:
+    def __init__(self, data):
+        self.data = memoryview(data)
+        self.pos = 0
+
+    def varint(self):
+        val = shift = 0
+        while True:
+            byte = self.data[self.pos]
+            self.pos += 1
+            val |= (byte & 0x7f) << shift
+            if byte < 0x80:
+                return val
+            shift += 7
+
+    def signed(self):
+        val = self.varint()
+        return (val >> 1) ^ -(val & 1)
+
+    def bytes(self, size):
+        if self.pos + size > len(self.data):
+            raise IndexError("snapshot truncated")
+        data = self.data[self.pos:self.pos + size]
+        self.pos += size
+        return data
+
+    def string(self):
+        return str(self.bytes(self.varint()), 'utf-8')
+
+_label = re.compile(r'([^=]*)="(.*)"', re.DOTALL)
+_escape = re.compile(r'\\(.)')
+
+def _parse_labels(data):
+    labels = {}
+    for label in str(data, 'utf-8').split('\0')[:-1]:
+        name, value = _label.fullmatch(label).groups()
+        labels[name] = _escape.sub(lambda m: '\n' if m[1] == 'n' else m[1], value)
+    return labels
+
+def _double(bits):
+    return struct.unpack('<d', bits.to_bytes(8, 'little'))[0]
+
+class _Series:
+    def __init__(self, family, kind, thresholds, labels):
+        self.family = family
+        self.kind = kind
+        self.thresholds = thresholds
+        self.labels = labels
+        count = len(thresholds) + 2 if kind == EXPORT_HISTOGRAM else 1
+        # Values (with doubles as their bits), followed by the creation time
+        self.values = [0] * (count + 1)
+        self.doubles = set((count - 1, count) if kind in (EXPORT_HISTOGRAM, EXPORT_DOUBLE)
+                           else (count,))
+
+class Decoder:
+    """Decode snapshots from an Encoder. Snapshots must be decoded in the
+    order they were encoded, starting with a full snapshot. Decoders are
+    collectors, and their metrics are the same as the encoded heap's."""
+
+    def __init__(self):
+        self.sequence = 0
+        self._families = {}
+        self._series = {}
+
+    def decode(self, data):
+        """Apply a snapshot. Raises ValueError if it isn't relative to the last
+        snapshot decoded. If that happens, a full snapshot is needed."""
+        if bytes(data[:len(MAGIC)]) != MAGIC:
+            raise ValueError("not a snapshot")
+
+        reader = _Reader(data)
+        reader.pos = len(MAGIC)
+        sequence = reader.varint()
+        base = reader.varint()
+        if base != self.sequence and base:
+            raise ValueError(f"snapshot {sequence} is relative to {base}, "
+                             f"but the last snapshot was {self.sequence}")
+
+        try:
+            self._apply(reader, base)
+        except (AttributeError, IndexError, KeyError, UnicodeDecodeError, struct.error) as e:
+            # We may have applied part of it, so we need a full snapshot
+            self.sequence = 0
+            raise ValueError("invalid snapshot") from e
+        self.sequence = sequence
+
+    def _apply(self, reader, base):
+        families = {} if not base else self._families
+        series = {} if not base else self._series
+
+        for _ in range(reader.varint()):
+            family = families.pop(reader.varint())
+            for id in family[3]:
+                del series[id]
+
+        for _ in range(reader.varint()):
+            id = reader.varint()
+            del families[series.pop(id).family][3][id]
+
+        for _ in range(reader.varint()):
+            id = reader.varint()
+            # The IDs of the family's series are kept (in order) as a dict
+            families[id] = (reader.string(), reader.string(), reader.string(), {})
+
+        for _ in range(reader.varint()):
+            id = reader.varint()
+            family, kind, count = reader.varint(), reader.varint(), reader.varint()
+            thresholds = struct.unpack(f'<{count}d', reader.bytes(count * 8))
+            labels = _parse_labels(reader.bytes(reader.varint()))
+            series[id] = _Series(family, kind, thresholds, labels)
+            families[family][3][id] = None
+
+        id = 0
+        for _ in range(reader.varint()):
+            id += reader.signed()
+            s = series[id]
+            values = s.values
+            for i in range(len(values)):
+                if i in s.doubles:
+                    values[i] ^= reader.varint()
+                else:
+                    values[i] = (values[i] + reader.signed()) & 0xffffffffffffffff
+
+        self._families = families
+        self._series = series
+
+    def collect(self):
+        for name, docs, typ, ids in self._families.values():
+            if not ids:
+                continue
+
+            family = metrics_core.Metric(name, docs, typ)
+            for id in ids:
+                s = self._series[id]
+                *values, created = s.values
+                if s.kind == EXPORT_HISTOGRAM:
+                    *buckets, count, sum = values
+                    sum = _double(sum)
+                    if typ == 'summary':
+                        family.add_sample(name + '_count', s.labels, count)
+                        family.add_sample(name + '_sum', s.labels, sum)
+                    else:
+                        for val, le in zip(itertools.accumulate(buckets), s.thresholds):
+                            family.add_sample(name + '_bucket', s.labels | { 'le': floatToGoString(le) },
+                                              val)
+                        family.add_sample(name + '_sum', s.labels, sum)
+                        family.add_sample(name + '_count', s.labels, count)
+                else:
+                    value = _double(values[0]) if s.kind == EXPORT_DOUBLE else values[0]
+                    family.add_sample(name + ('_total' if typ == 'counter' else ''), s.labels,
+                                      value)
+
+                if created:
+                    family.add_sample(name + '_created', s.labels, _double(created))
+            yield family
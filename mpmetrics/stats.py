@@ -0,0 +1,60 @@
+# SPDX-License-Identifier: LGPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+"""Metrics for mpmetrics itself. These count how often its slow paths are
+taken (mostly due to contention), which shows whether metrics should be
+sharded or buffered. They are only available if the C extension was built
+with MPMETRICS_STATS=1; otherwise nothing is counted (and nothing is spent
+counting)."""
+
+from prometheus_client import metrics_core, registry as _registry
+
+import _mpmetrics
+from .metrics import CollectorFactory
+from .types import Box
+
+# Name, documentation, and scale of each stat
+_STATS = (
+    ('mpmetrics_cas_retries', "Retried compare-and-swaps while adding to doubles", 1),
+    ('mpmetrics_lock_waits', "Lock acquisitions which had to wait", 1),
+    ('mpmetrics_lock_wait_seconds', "Time spent waiting for locks", 1e-9),
+    ('mpmetrics_snapshot_yields', "Times a histogram snapshot yielded to wait for observers", 1),
+    ('mpmetrics_heap_grows', "Times a heap's file was grown", 1),
+)
+
+class StatsCollector:
+    """A collector for the stats of this process, and of every process forked
+    from it after the collector was created."""
+
+    def __init__(self, heap):
+        self._stats = Box[_mpmetrics.Stats](heap)
+        self._stats.enable()
+
+    def _samples(self):
+        for (name, docs, scale), value in zip(_STATS, self._stats.get()):
+            yield name, docs, value * scale if scale != 1 else value
+
+    def describe(self):
+        for name, docs, value in self._samples():
+            yield metrics_core.Metric(name, docs, 'counter')
+
+    def collect(self):
+        for name, docs, value in self._samples():
+            metric = metrics_core.Metric(name, docs, 'counter')
+            metric.add_sample(name + '_total', {}, value)
+            yield metric
+
+    def _expose(self, writer):
+        for name, docs, value in self._samples():
+            writer.family(name, docs, 'counter')
+            writer.sample('_total', (), value)
+
+def register(registry=_registry.REGISTRY):
+    """Start counting, and register a StatsCollector with registry (which is
+    returned). Only one StatsCollector counts at a time."""
+    if not _mpmetrics.Stats:
+        raise ValueError("mpmetrics was built without MPMETRICS_STATS")
+
+    collector = StatsCollector(getattr(registry, 'heap', CollectorFactory.heap))
+    registry.register(collector)
+    return collector
@@ -2,10 +2,13 @@
 # Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
 
 import ctypes
+import io
+import itertools
 import pickle
 
+import _mpmetrics
 from .generics import IntType, ObjectType, ProductType
-from .util import align, classproperty
+from .util import CACHELINESIZE, align, classproperty
 
 def _wrap_ctype(__name__, ctype):
     size = ctypes.sizeof(ctype)
@@ -40,15 +43,51 @@ Size_t = _wrap_ctype('Size_t', ctypes.c_size_t)
 Int64 = _wrap_ctype('Int64', ctypes.c_int64)
 UInt64 = _wrap_ctype('UInt64', ctypes.c_uint64)
 
+def _own_line(__name__, cls):
+    ns = {
+        '__slots__': (),
+        'align': max(cls.align, CACHELINESIZE),
+        'size': align(cls.size, CACHELINESIZE),
+    }
+    return type(__name__, (cls,), ns)
+
+# A (write-contended) field with its own cache lines. Nothing else is placed
+# on them, so writing it doesn't slow down readers of other fields.
+OwnLine = ObjectType('OwnLine', _own_line)
+
+def _read_mostly(__name__, cls):
+    return type(__name__, (cls,), { '__slots__': (), 'read_mostly': True })
+
+# A field which is rarely written (or only written when scraping). Structs
+# place these fields before any others, so that they share cache lines with
+# each other instead of with the fields being updated.
+ReadMostly = ObjectType('ReadMostly', _read_mostly)
+
 class Struct:
+    """A structure in shared memory, with fields given by _fields_. Fields are
+    laid out in order at their natural alignment, except that ReadMostly
+    fields come first. Boxes start on a new cache line, unless _packed_ is set
+    (for small structs which don't need their own line)."""
+
+    _packed_ = False
+
     @classmethod
     def _fields_iter(cls):
+        fields = sorted(cls._fields_.items(),
+                        key=lambda item: not getattr(item[1], 'read_mostly', False))
         off = 0
-        for name, field in cls._fields_.items():
+        for name, field in fields:
             off = align(off, field.align)
             yield name, field, off
             off += field.size
 
+    @classmethod
+    def _layout(cls):
+        # Cache each class's field offsets, since _fields_iter is slow
+        if '_layout_' not in cls.__dict__:
+            cls._layout_ = { name: (field, off) for name, field, off in cls._fields_iter() }
+        return cls._layout_
+
     @classproperty
     def size(cls):
         for name, field, off in cls._fields_iter():
@@ -64,12 +103,30 @@ class Struct:
         for name, field, off in self._fields_iter():
             setattr(self, name, field(mem[off:off + field.size], heap=heap))
 
+    # Fields are only created when they are first accessed (in __getattr__),
+    # since unpickling a large number of structs is otherwise quite slow.
     def _setstate(self, mem, heap=None):
         self._mem = mem
-        for name, field, off in self._fields_iter():
-            field = field.__new__(field)
-            field._setstate(self._mem[off:off + field.size], heap=heap)
-            setattr(self, name, field)
+        self.__heap = heap
+
+    def __getattr__(self, name):
+        try:
+            field, off = self._layout()[name]
+            mem = self.__dict__['_mem']
+        except KeyError:
+            raise AttributeError(f"{type(self).__name__!r} object has no attribute {name!r}") \
+                from None
+
+        value = field.__new__(field)
+        value._setstate(mem[off:off + field.size], heap=self.__dict__.get('_Struct__heap'))
+        setattr(self, name, value)
+        return value
+
+    def _reinit(self, name):
+        """Initialize a field again, discarding its contents"""
+        field, off = self._layout()[name]
+        value = field(self._mem[off:off + field.size], heap=self.__dict__.get('_Struct__heap'))
+        setattr(self, name, value)
 
 def Array(__name__, cls, n):
     if n < 1:
@@ -85,26 +142,33 @@ def Array(__name__, cls, n):
             off = i * member_size
             self._vals.append(cls(self._mem[off:off + member_size], heap=heap))
 
+    # Like Struct, members are created lazily
     def _setstate(self, mem, heap=None):
         self._mem = mem
-        self._vals = []
-        for i in range(n):
-            off = i * member_size
-            val = cls.__new__(cls)
-            val._setstate(self._mem[off:off + member_size], heap=heap)
-            self._vals.append(val)
+        self._heap = heap
+        self._vals = [None] * n
 
     def __len__(self):
         return n
 
     def __getitem__(self, key):
-        return self._vals[key]
+        if isinstance(key, slice):
+            return [self[i] for i in range(n)[key]]
+
+        val = self._vals[key]
+        if val is None:
+            off = range(n)[key] * member_size
+            val = cls.__new__(cls)
+            val._setstate(self._mem[off:off + member_size], heap=self._heap)
+            self._vals[key] = val
+        return val
 
     def __setitem__(self, key, value):
         self._vals[key] = value
 
     def __iter__(self):
-        return iter(self._vals)
+        for i in range(n):
+            yield self[i]
 
     ns = locals()
     ns['align'] = cls.align
@@ -118,7 +182,10 @@ Array = ProductType('Array', Array, (ObjectType, IntType))
 
 class _Box:
     def __init__(self, heap, *args, **kwargs):
-        block = heap.malloc(self.size)
+        cls = type(self)
+        alignment = cls.align if getattr(cls, '_packed_', False) else \
+            max(cls.align, CACHELINESIZE)
+        block = heap.malloc(cls.size, alignment)
         super().__init__(block.deref(), *args, heap=heap, **kwargs)
         self.__block = block
 
@@ -131,69 +198,179 @@ class _Box:
 
 Box = ObjectType('Box', lambda name, cls: type(name, (_Box, cls), {}))
 
+# Dict keys are looked up by their pickled bytes, which depend on the protocol.
+# Pin it, so that a newer Python (with a newer default) finds the same keys in
+# a persistent heap. Changing this changes the heap layout (see heap.VERSION).
+PICKLE_PROTOCOL = 4
+
+def _dumps(obj):
+    # Disable the memo, so that equal objects always pickle to the same bytes
+    f = io.BytesIO()
+    pickler = pickle.Pickler(f, protocol=PICKLE_PROTOCOL)
+    pickler.fast = True
+    pickler.dump(obj)
+    return f.getvalue()
+
 class Dict(Struct):
+    """A dictionary in shared memory. Keys and values are pickled, and keys
+    are looked up by their pickled representation. Accesses must be
+    serialized.
+
+    Items are stored in a chain of _mpmetrics.HashTables. The newest table is
+    doubled in size (and the old one freed) whenever it fills up. Once it
+    reaches the heap's map size, a new table is started instead, and older
+    tables are searched after newer ones.
+    """
+
     _fields_ = {
         '_start': Size_t,
         '_size': Size_t,
         '_len': Size_t,
+        # Incremented whenever the chain of tables changes
+        '_gen': Size_t,
+        # Inserting a new key assigns it the next sequence number
+        '_seq': Size_t,
     }
 
+    INITIAL_SIZE = 1024
+
     def __init__(self, mem, heap):
         if not heap:
             raise ValueError("heap must be provided")
         super().__init__(mem)
         self._heap = heap
+        self._tables_gen = None
 
     def _setstate(self, mem, heap):
         super()._setstate(mem, heap)
         self._heap = heap
+        self._tables_gen = None
 
     @property
-    def _block(self):
-        if self._size.value:
-            return self._heap.Block(self._heap, self._start.value, self._size.value)
-
-    @_block.setter
-    def _block(self, block):
+    def _tables(self):
+        """A list of (block, table) tuples, newest first"""
+        if self._tables_gen != self._gen.value:
+            heap = self._heap
+            tables = []
+            start, size = self._start.value, self._size.value
+            while size:
+                block = heap.Block(heap, start, size)
+                table = _mpmetrics.HashTable.__new__(_mpmetrics.HashTable)
+                table._setstate(block.deref())
+                tables.append((block, table))
+                start, size = table.prev or (0, 0)
+            self.__tables = tables
+            self._tables_gen = self._gen.value
+        return self.__tables
+
+    def _find(self, key):
+        for block, table in self._tables:
+            value = table.get(key)
+            if value is not None:
+                return table, value
+        return None, None
+
+    def _insert(self, key, value, seq):
+        tables = self._tables
+        if tables and tables[0][1].set(key, value, seq):
+            return
+
+        heap = self._heap
+        old = None
+        items = ()
+        prev = None
+        size = self.INITIAL_SIZE
+        if tables:
+            block, table = tables[0]
+            if block.size < heap.max_size or table.deleted >= len(table):
+                # Rehash into a bigger (or at least compacted) table
+                old, items, prev = block, table.items(), table.prev
+                size = block.size * 2
+            else:
+                prev = block.start, block.size
+
+        while True:
+            block = heap.malloc(min(size, heap.max_size))
+            table = _mpmetrics.HashTable(block.deref())
+            table.prev = prev
+            if all(table.set(*item) for item in items) and table.set(key, value, seq):
+                break
+            block.free()
+
+            if size < heap.max_size:
+                size *= 2
+            elif old:
+                # Everything won't fit in one table, so start a new one
+                old, items, prev = None, (), (old.start, old.size)
+            else:
+                raise ValueError("item too large to fit in the heap")
+
+        if old:
+            old.free()
         self._start.value = block.start
         self._size.value = block.size
+        self._gen.value += 1
+
+    def _pop(self, table, key):
+        seq = table.pop(key)
+        if len(table):
+            return seq
+
+        # Unlink empty tables (other than the newest one) from the chain
+        tables = self._tables
+        for i, (block, t) in enumerate(tables):
+            if i and t is table:
+                tables[i - 1][1].prev = table.prev
+                block.free()
+                self._gen.value += 1
+                break
+        return seq
+
+    def _items(self, since=0):
+        """Return the items inserted since the sequence number since, in the
+        order they were inserted. Older items aren't unpickled."""
+        items = itertools.chain.from_iterable(table.items() for block, table in self._tables)
+        items = sorted((item for item in items if item[2] >= since), key=lambda item: item[2])
+        return [(pickle.loads(key), pickle.loads(value)) for key, value, seq in items]
 
     @property
     def _dict(self):
-        if self._len.value:
-            return pickle.loads(self._block.deref()[:self._len.value])
-        return {}
-
-    @_dict.setter
-    def _dict(self, d):
-        ds = pickle.dumps(d)
-        new_length = len(ds)
-        self._len.value = new_length
-        if self._len.value > self._size.value:
-            if self._size.value:
-                self._block.free()
-            # Scale by a lot to minimize allocations; Heap doesn't free backing memory
-            self._block = self._heap.malloc(4 * new_length)
-        self._block.deref()[:self._len.value] = ds
+        return dict(self._items())
 
     def __repr__(self):
         return f"{self.__class__.__qualname__}({repr(self._dict)})"
 
     def __len__(self):
-        return len(self._dict)
+        return self._len.value
 
     def __getitem__(self, key):
-        return self._dict[key]
+        table, value = self._find(_dumps(key))
+        if table is None:
+            raise KeyError(key)
+        return pickle.loads(value)
 
     def __setitem__(self, key, value):
-        d = self._dict
-        d[key] = value
-        self._dict = d
+        key = _dumps(key)
+        value = _dumps(value)
+        table, _ = self._find(key)
+        if table is None:
+            seq = self._seq.value
+            self._seq.value += 1
+            self._len.value += 1
+        elif table.set(key, value, 0):
+            return
+        else:
+            # No room in an old table; move the item to the newest one
+            seq = self._pop(table, key)
+        self._insert(key, value, seq)
 
     def __delitem__(self, key):
-        d = self._dict
-        del d[key]
-        self._dict = d
+        key_bytes = _dumps(key)
+        table, _ = self._find(key_bytes)
+        if table is None:
+            raise KeyError(key)
+        self._pop(table, key_bytes)
+        self._len.value -= 1
 
     def __iter__(self):
         return iter(self._dict)
@@ -202,23 +379,31 @@ class Dict(Struct):
         return reversed(self._dict)
 
     def __contains__(self, item):
-        return item in self._dict
+        return self._find(_dumps(item))[0] is not None
 
     def __or__(self, other):
         return self._dict | other
 
     def __ior__(self, other):
-        self._dict = self._dict | other
+        self.update(other)
         return self
 
     def clear(self):
+        for block, table in self._tables:
+            block.free()
+        self._start.value = 0
+        self._size.value = 0
         self._len.value = 0
+        self._gen.value += 1
 
     def copy(self):
         return self._dict
 
     def get(self, key, default=None):
-        return self._dict.get(key, default)
+        table, value = self._find(_dumps(key))
+        if table is None:
+            return default
+        return pickle.loads(value)
 
     def items(self):
         return self._dict.items()
@@ -230,6 +415,5 @@ class Dict(Struct):
         return self._dict.values()
 
     def update(self, other=()):
-        d = self._dict
-        d.update(other)
-        self._dict = d
+        for key, value in dict(other).items():
+            self[key] = value
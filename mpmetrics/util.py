@@ -1,6 +1,12 @@
 # SPDX-License-Identifier: LGPL-3.0-only
 # Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
 
+import os
+
+SC_LEVEL1_DCACHE_LINESIZE = 190
+if (CACHELINESIZE := os.sysconf(SC_LEVEL1_DCACHE_LINESIZE)) < 0:
+    CACHELINESIZE = 64 # Assume 64-byte cache lines
+
 def _align_mask(x, mask):
     return (x + mask) & ~mask
 
@@ -19,10 +19,14 @@ setuptools.setup(
     ext_modules = [
         setuptools.Extension(
             '_mpmetrics',
-            ['_mpmetrics.c', 'atomic.c', 'lock.c'],
+            ['_mpmetrics.c', 'atomic.c', 'exemplar.c', 'exposition.c', 'hashtable.c',
+             'histogram.c', 'lock.c', 'mapping.c', 'snapshot.c', 'stats.c'],
             extra_compile_args = [
                 '-Wno-missing-braces',
             ],
+            # Set MPMETRICS_STATS=1 to count the library's own slow paths
+            define_macros = [('MPMETRICS_STATS', None)] if os.environ.get('MPMETRICS_STATS') == '1'
+                            else [],
         ),
     ],
     license = 'LGPL-3.0-only',
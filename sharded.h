@@ -0,0 +1,320 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+/*
+ * Sharded atomics split their value across several slots, each on its own
+ * pair of cache lines (to also defeat adjacent-line prefetching). Writers add
+ * to the slot for the CPU they are running on, so updates from different
+ * CPUs never contend. Readers sum all the slots.
+ *
+ * Unlike the plain atomics, add, add_many, and inc return None and not the
+ * previous value, since that would require reading every slot. Use get if
+ * you need the total.
+ */
+
+#ifdef DOUBLE
+#define PTYPE double
+#define NAME ShardedAtomicDouble
+#define AS PyFloat_AsDouble
+#define KIND 'f'
+#define FROM PyFloat_FromDouble
+#else /* DOUBLE */
+#define PTYPE uint64_t
+#define FORMAT PRIu64
+#define NAME ShardedAtomicUInt64
+#define AS PyLong_AsUnsignedLongLong
+#define KIND 'u'
+#define FROM PyLong_FromUnsignedLongLong
+#endif /* DOUBLE */
+#define OBJECT paste(NAME, Object)
+
+typedef struct {
+	PyObject_HEAD
+	Py_buffer shm;
+	unsigned int shards;
+} OBJECT;
+
+#define SLOT paste(NAME, _slot)
+static _Atomic PTYPE *SLOT(OBJECT *self, unsigned int shard)
+{
+	return (void *)((char *)self->shm.buf + shard * SHARD_SIZE);
+}
+
+#define LOCAL paste(NAME, _local)
+static _Atomic PTYPE *LOCAL(OBJECT *self)
+{
+	int cpu = sched_getcpu();
+
+	if (cpu < 0)
+		cpu = 0;
+	return SLOT(self, (unsigned int)cpu % self->shards);
+}
+
+#define SETUP paste(NAME, _setup)
+static int SETUP(OBJECT *self)
+{
+	size_t shards;
+
+	if (PyObject_GetSizeAttr((PyObject *)self, "shards", &shards))
+		return -1;
+
+	if (!shards || shards > UINT_MAX) {
+		PyErr_Format(PyExc_ValueError, "invalid number of shards %zu",
+			     shards);
+		return -1;
+	}
+
+	self->shards = shards;
+	return 0;
+}
+
+#define INIT paste(NAME, _init)
+static int INIT(OBJECT *self, PyObject *args, PyObject *kwds)
+{
+	unsigned int i;
+
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return -1;
+
+	if (SETUP(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return -1;
+	}
+
+	for (i = 0; i < self->shards; i++)
+		atomic_init(SLOT(self, i), 0);
+	return 0;
+}
+
+#define SETSTATE paste(NAME, _setstate)
+static PyObject *SETSTATE(OBJECT *self, PyObject *args, PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return NULL;
+
+	if (SETUP(self)) {
+		BufferType.tp_clear((PyObject *)self);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+#define GET paste(NAME, _get)
+static PyObject *GET(OBJECT *self, PyObject *Py_UNUSED(ignored))
+{
+	PTYPE ret = 0;
+	unsigned int i;
+
+	for (i = 0; i < self->shards; i++) {
+		PTYPE val = atomic_load(SLOT(self, i));
+#ifdef DOUBLE
+		ret += val;
+#else
+		if (__builtin_add_overflow(ret, val, &ret)) {
+			PyErr_SetString(PyExc_OverflowError,
+					"sum too large to fit in " stringify(PTYPE));
+			return NULL;
+		}
+#endif
+	}
+
+	return FROM(ret);
+}
+
+#define SET paste(NAME, _set)
+static PyObject *SET(OBJECT *self, PyObject *arg)
+{
+	PTYPE val = AS(arg);
+	unsigned int i;
+
+	if (PyErr_Occurred())
+		return NULL;
+
+	atomic_store(SLOT(self, 0), val);
+	for (i = 1; i < self->shards; i++)
+		atomic_store(SLOT(self, i), 0);
+
+	Py_RETURN_NONE;
+}
+
+#define DO_ADD paste(NAME, _do_add)
+static PyObject *DO_ADD(OBJECT *self, PTYPE amount, bool raise)
+{
+	_Atomic PTYPE *slot = LOCAL(self);
+
+#ifdef DOUBLE
+	PTYPE old, new;
+
+	old = atomic_load(slot);
+	new = old + amount;
+	while (!atomic_compare_exchange_weak(slot, &old, new)) {
+		stat_inc(STAT_CAS_RETRIES);
+		new = old + amount;
+	}
+#else
+	PTYPE old, dummy;
+
+	old = atomic_fetch_add(slot, amount);
+	if (raise && __builtin_add_overflow(old, amount, &dummy)) {
+		PyErr_Format(PyExc_OverflowError,
+			     "%" FORMAT " + %" FORMAT " too large to fit in " stringify(PTYPE),
+			     amount, old);
+		return NULL;
+	}
+#endif
+	Py_RETURN_NONE;
+}
+
+#define ADD paste(NAME, _add)
+static PyObject *ADD(OBJECT *self, PyObject *const *args, Py_ssize_t nargs,
+		     PyObject *kwnames)
+{
+	static const char *const keywords[] = {
+		"amount", "raise_on_overflow", NULL
+	};
+	PyObject *argv[2] = { NULL, NULL };
+	PTYPE amount;
+	int raise = 1;
+
+	if (nargs == 1 && !kwnames)
+		argv[0] = args[0];
+	else if (PyArg_UnpackFastcall("add", args, nargs, kwnames, keywords, 1,
+				      argv))
+		return NULL;
+
+	amount = AS(argv[0]);
+	if (PyErr_Occurred())
+		return NULL;
+
+	if (argv[1]) {
+		raise = PyObject_IsTrue(argv[1]);
+		if (raise < 0)
+			return NULL;
+	}
+
+	return DO_ADD(self, amount, raise);
+}
+
+#include "sum.h"
+
+#define ADD_MANY paste(NAME, _add_many)
+static PyObject *ADD_MANY(OBJECT *self, PyObject *arg)
+{
+	PTYPE total;
+
+	if (SUM(arg, &total))
+		return NULL;
+	return DO_ADD(self, total, true);
+}
+
+#define INC paste(NAME, _inc)
+static PyObject *INC(OBJECT *self, PyObject *Py_UNUSED(ignored))
+{
+	return DO_ADD(self, 1, true);
+}
+
+#define METHODS paste(NAME, _methods)
+static PyMethodDef METHODS[] = {
+	{
+		.ml_name = "_setstate",
+		.ml_meth = (PyCFunction)SETSTATE,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+	},
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)GET,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Get the current value (the sum of all shards)",
+	},
+	{
+		.ml_name = "set",
+		.ml_meth = (PyCFunction)SET,
+		.ml_flags = METH_O,
+		.ml_doc = "Set the current value. This is not atomic with respect to add.",
+	},
+	{
+		.ml_name = "add",
+		.ml_meth = (PyCFunction)ADD,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Add a number to the current CPU's shard. Returns None.",
+	},
+	{
+		.ml_name = "add_many",
+		.ml_meth = (PyCFunction)ADD_MANY,
+		.ml_flags = METH_O,
+		.ml_doc = "Add the sum of an iterable (or buffer) of numbers to the "
+			  "current CPU's shard. Returns None.",
+	},
+	{
+		.ml_name = "inc",
+		.ml_meth = (PyCFunction)INC,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Add one to the current CPU's shard. Returns None.",
+	},
+	{ /* Sentinel */ },
+};
+
+#define TYPE paste(NAME, Type)
+static PyTypeObject TYPE = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(OBJECT),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics." stringify(NAME),
+	.tp_doc = "Sharded atomic " stringify(PTYPE),
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)INIT,
+	.tp_methods = METHODS,
+};
+
+#define TYPE_ADD paste(TYPE, _Add)
+static int TYPE_ADD(PyObject *m)
+{
+	int ret;
+
+	if (!atomic_is_lock_free((_Atomic PTYPE *)NULL)) {
+		Py_INCREF(Py_None);
+		ret = PyModule_AddObject(m, stringify(NAME), Py_None);
+		if (ret)
+			Py_DECREF(Py_None);
+		return ret;
+	}
+
+	if (PyType_AddSizeConstant(&TYPE, "shard_size", SHARD_SIZE))
+		return -1;
+
+	if (PyType_AddSizeConstant(&TYPE, "align", sizeof(PTYPE)))
+		return -1;
+
+	TYPE.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	ret = PyModule_AddType(m, &TYPE);
+	Py_DECREF(&BufferType);
+	return ret;
+}
+
+#undef SLOT
+#undef LOCAL
+#undef SETUP
+#undef INIT
+#undef SETSTATE
+#undef GET
+#undef SET
+#undef DO_ADD
+#undef ADD
+#undef SUM
+#undef ADD_MANY
+#undef INC
+#undef METHODS
+#undef TYPE
+#undef TYPE_ADD
+
+#undef PTYPE
+#undef FORMAT
+#undef NAME
+#undef OBJECT
+#undef AS
+#undef KIND
+#undef FROM
@@ -0,0 +1,526 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <endian.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "_mpmetrics.h"
+#include "buffer.h"
+#include "catalog.h"
+
+/*
+ * Encoder for binary snapshots of the catalog in a heap (see catalog.h), which
+ * are decoded by mpmetrics.snapshot. Each snapshot is relative to the previous
+ * one, and only has the families and series which were added, and the values
+ * which changed. A snapshot looks like
+ *
+ *	magic ("mpmsnap" and a version byte)
+ *	sequence
+ *	base (the sequence this snapshot is relative to, or 0 for a full one)
+ *	count, removed family IDs...
+ *	count, removed series IDs...
+ *	count, new families: ID, name, help, type...
+ *	count, new series: ID, family ID, kind, count, thresholds, labels...
+ *	count, updated series: ID (relative to the previous one), values...
+ *
+ * Integers are LEB128 varints, strings (and labels) are a length followed by
+ * their contents, and thresholds are little-endian doubles. Histograms have
+ * count thresholds; other series have none. Labels are rendered (as for
+ * Exposition), and each is terminated by a NUL.
+ *
+ * Each series has the values from series_read, followed by its creation time.
+ * Integer values are written as the (zigzag-encoded) difference from their
+ * old value, and doubles are XORed with their old value (like Gorilla). IDs
+ * are assigned in the order families and series are seen, and are reused
+ * only after a full snapshot. Series are removed when they are retired, and
+ * (along with their family) when their family is.
+ */
+
+#define SNAPSHOT_MAGIC "mpmsnap\x02"
+
+struct snapshot_family {
+	uint64_t off, id, generation;
+};
+
+struct snapshot_series {
+	uint64_t off, id;
+	size_t value, values;
+};
+
+/* The parts of a snapshot, which are written in one pass over the catalog */
+enum {
+	SECTION_REMOVED,
+	SECTION_REMOVED_SERIES,
+	SECTION_FAMILIES,
+	SECTION_SERIES,
+	SECTION_UPDATES,
+	SECTIONS,
+};
+
+typedef struct {
+	PyObject_HEAD
+	struct buffer out;
+	struct buffer section[SECTIONS];
+	uint64_t count[SECTIONS];
+	/* Sorted by offset */
+	struct snapshot_family *families;
+	size_t family_count, family_cap;
+	struct snapshot_series *series;
+	size_t series_count, series_cap;
+	/* The old values of every series */
+	uint64_t *values;
+	size_t value_count, value_cap;
+	/* Scratch space for the new values of a series */
+	uint64_t *scratch;
+	size_t scratch_cap;
+	uint64_t next_family, next_series;
+	uint64_t sequence, generation;
+} SnapshotEncoderObject;
+
+static int buffer_write_varint(struct buffer *buf, uint64_t val)
+{
+	char bytes[10];
+	size_t len = 0;
+
+	do {
+		bytes[len++] = (val & 0x7f) | (val > 0x7f ? 0x80 : 0);
+		val >>= 7;
+	} while (val);
+	return buffer_write(buf, bytes, len);
+}
+
+static uint64_t zigzag(int64_t val)
+{
+	return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static int buffer_write_string(struct buffer *buf, const char *data,
+			       size_t len)
+{
+	return buffer_write_varint(buf, len) || buffer_write(buf, data, len);
+}
+
+static int grow(void **array, size_t *cap, size_t count, size_t size)
+{
+	size_t new_cap = *cap ? *cap * 2 : 64;
+	void *new;
+
+	if (count < *cap)
+		return 0;
+
+	while (new_cap <= count)
+		new_cap *= 2;
+
+	new = PyMem_Realloc(*array, new_cap * size);
+	if (!new) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	*array = new;
+	*cap = new_cap;
+	return 0;
+}
+
+/*
+ * Find the index of the first entry with an offset of at least off. The
+ * catalog is usually allocated in order, so check the end first.
+ */
+#define LOWER_BOUND(entries, count, off) ({ \
+	size_t lo = 0, hi = (count); \
+	if (hi && (entries)[hi - 1].off < (off)) \
+		lo = hi; \
+	while (lo < hi) { \
+		size_t mid = lo + (hi - lo) / 2; \
+		if ((entries)[mid].off < (off)) \
+			lo = mid + 1; \
+		else \
+			hi = mid; \
+	} \
+	lo; \
+})
+
+static struct snapshot_family *
+SnapshotEncoder_family(SnapshotEncoderObject *self, const struct family *f,
+		       uint64_t off)
+{
+	struct buffer *buf = &self->section[SECTION_FAMILIES];
+	size_t i = LOWER_BOUND(self->families, self->family_count, off);
+	struct snapshot_family *family = &self->families[i];
+
+	if (i < self->family_count && family->off == off)
+		return family;
+
+	if (grow((void **)&self->families, &self->family_cap,
+		 self->family_count, sizeof(*self->families)))
+		return NULL;
+
+	family = &self->families[i];
+	memmove(family + 1, family,
+		(self->family_count++ - i) * sizeof(*family));
+	family->off = off;
+	family->id = self->next_family++;
+
+	if (buffer_write_varint(buf, family->id) ||
+	    buffer_write_string(buf, f->text, f->name_len) ||
+	    buffer_write_string(buf, family_help(f), f->help_len) ||
+	    buffer_write_string(buf, family_type(f), f->type_len))
+		return NULL;
+	self->count[SECTION_FAMILIES]++;
+	return family;
+}
+
+static struct snapshot_series *
+SnapshotEncoder_series(SnapshotEncoderObject *self, const struct catalog *c,
+		       const struct series *s, uint64_t off, uint64_t family)
+{
+	struct buffer *buf = &self->section[SECTION_SERIES];
+	size_t i = LOWER_BOUND(self->series, self->series_count, off);
+	struct snapshot_series *series = &self->series[i];
+	size_t values = series_values(s) + 1;
+	const double *thresholds = NULL;
+	uint64_t j;
+
+	if (i < self->series_count && series->off == off)
+		return series;
+
+	if (s->kind == EXPORT_HISTOGRAM && !(thresholds = series_thresholds(c, s)))
+		return NULL;
+
+	if (grow((void **)&self->series, &self->series_cap,
+		 self->series_count, sizeof(*self->series)) ||
+	    grow((void **)&self->values, &self->value_cap,
+		 self->value_count + values - 1, sizeof(*self->values)))
+		return NULL;
+
+	if (buffer_write_varint(buf, self->next_series) ||
+	    buffer_write_varint(buf, family) ||
+	    buffer_write_varint(buf, s->kind) ||
+	    buffer_write_varint(buf, thresholds ? s->count : 0))
+		return NULL;
+
+	for (j = 0; thresholds && j < s->count; j++) {
+		uint64_t le = htole64(double_bits(thresholds[j]));
+
+		if (buffer_write(buf, (const char *)&le, sizeof(le)))
+			return NULL;
+	}
+
+	if (buffer_write_string(buf, s->labels, s->labels_len))
+		return NULL;
+	self->count[SECTION_SERIES]++;
+
+	series = &self->series[i];
+	memmove(series + 1, series,
+		(self->series_count++ - i) * sizeof(*series));
+	series->off = off;
+	series->id = self->next_series++;
+	series->value = self->value_count;
+	series->values = values;
+	memset(&self->values[self->value_count], 0, values * sizeof(uint64_t));
+	self->value_count += values;
+	return series;
+}
+
+/* Forget a retired series, if we have seen it */
+static int SnapshotEncoder_remove_series(SnapshotEncoderObject *self,
+					 uint64_t off)
+{
+	size_t i = LOWER_BOUND(self->series, self->series_count, off);
+	struct snapshot_series *series = &self->series[i];
+
+	if (i == self->series_count || series->off != off)
+		return 0;
+
+	if (buffer_write_varint(&self->section[SECTION_REMOVED_SERIES],
+				series->id))
+		return -1;
+	self->count[SECTION_REMOVED_SERIES]++;
+
+	/* Its values are only reclaimed by the next full snapshot */
+	memmove(series, series + 1,
+		(--self->series_count - i) * sizeof(*series));
+	return 0;
+}
+
+static int SnapshotEncoder_update(SnapshotEncoderObject *self,
+				  const struct series *s,
+				  const struct snapshot_series *series,
+				  uint64_t *last_id)
+{
+	struct buffer *buf = &self->section[SECTION_UPDATES];
+	uint64_t *old = &self->values[series->value];
+	size_t i;
+
+	if (!memcmp(old, self->scratch, series->values * sizeof(*old)))
+		return 0;
+
+	if (buffer_write_varint(buf, zigzag((int64_t)(series->id - *last_id))))
+		return -1;
+	*last_id = series->id;
+
+	for (i = 0; i < series->values; i++) {
+		/* The creation time is always last */
+		bool is_double = i == series->values - 1 ||
+				 series_value_is_double(s, i);
+		uint64_t delta = is_double ? self->scratch[i] ^ old[i] :
+				 zigzag((int64_t)(self->scratch[i] - old[i]));
+
+		if (buffer_write_varint(buf, delta))
+			return -1;
+		old[i] = self->scratch[i];
+	}
+
+	self->count[SECTION_UPDATES]++;
+	return 0;
+}
+
+static int SnapshotEncoder_walk_family(SnapshotEncoderObject *self,
+				       const struct catalog *c,
+				       const struct family *f,
+				       const struct snapshot_family *family,
+				       uint64_t *last_id)
+{
+	uint64_t off, limit = c->len / sizeof(struct series);
+
+	for (off = family_first(f); off && limit; limit--) {
+		const struct series *s = catalog_series(c, off);
+		struct snapshot_series *series;
+		size_t values;
+
+		if (!s)
+			break;
+
+		if (series_retired(s)) {
+			if (SnapshotEncoder_remove_series(self, off))
+				return -1;
+			goto next;
+		}
+
+		values = series_values(s) + 1;
+		if (s->kind == EXPORT_HISTOGRAM && s->count > c->len)
+			goto next;
+
+		if (grow((void **)&self->scratch, &self->scratch_cap,
+			 values - 1, sizeof(*self->scratch)))
+			return -1;
+
+		if (!series_read(c, s, self->scratch))
+			goto next;
+		self->scratch[values - 1] = double_bits(series_created(c, s));
+
+		series = SnapshotEncoder_series(self, c, s, off, family->id);
+		if (!series) {
+			if (PyErr_Occurred())
+				return -1;
+			goto next;
+		}
+
+		/* Someone scribbled over the series */
+		if (series->values != values)
+			goto next;
+
+		if (SnapshotEncoder_update(self, s, series, last_id))
+			return -1;
+
+next:
+		off = series_next(s);
+	}
+	return 0;
+}
+
+static void SnapshotEncoder_reset(SnapshotEncoderObject *self)
+{
+	self->family_count = 0;
+	self->series_count = 0;
+	self->value_count = 0;
+	self->next_family = 0;
+	self->next_series = 0;
+}
+
+static int SnapshotEncoder_walk(SnapshotEncoderObject *self,
+				const struct catalog *c)
+{
+	uint64_t off, limit = c->len / sizeof(struct family), last_id = 0;
+	size_t i, j;
+
+	self->generation++;
+	for (off = catalog_first(c); off && limit; limit--) {
+		const struct family *f = catalog_family(c, off);
+		struct snapshot_family *family;
+
+		if (!f)
+			break;
+
+		if (!family_retired(f)) {
+			family = SnapshotEncoder_family(self, f, off);
+			if (!family)
+				return -1;
+
+			family->generation = self->generation;
+			if (SnapshotEncoder_walk_family(self, c, f, family,
+							&last_id))
+				return -1;
+		}
+		off = family_next(f);
+	}
+
+	/* Drop the families we didn't see. Their series are never seen again. */
+	for (i = 0, j = 0; i < self->family_count; i++) {
+		struct snapshot_family *family = &self->families[i];
+
+		if (family->generation == self->generation) {
+			self->families[j++] = *family;
+			continue;
+		}
+
+		if (buffer_write_varint(&self->section[SECTION_REMOVED],
+					family->id))
+			return -1;
+		self->count[SECTION_REMOVED]++;
+	}
+	self->family_count = j;
+	return 0;
+}
+
+static int SnapshotEncoder_init(SnapshotEncoderObject *self, PyObject *args,
+				PyObject *kwds)
+{
+	char *keywords[] = { NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", keywords))
+		return -1;
+
+	SnapshotEncoder_reset(self);
+	self->sequence = 0;
+	return 0;
+}
+
+static void SnapshotEncoder_dealloc(SnapshotEncoderObject *self)
+{
+	size_t i;
+
+	PyMem_Free(self->out.data);
+	for (i = 0; i < SECTIONS; i++)
+		PyMem_Free(self->section[i].data);
+	PyMem_Free(self->families);
+	PyMem_Free(self->series);
+	PyMem_Free(self->values);
+	PyMem_Free(self->scratch);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *SnapshotEncoder_encode(SnapshotEncoderObject *self,
+					PyObject *const *args, Py_ssize_t nargs,
+					PyObject *kwnames)
+{
+	static const char *const keywords[] = { "heap", "full", NULL };
+	PyObject *argv[2] = { NULL };
+	struct catalog c;
+	const char *err;
+	Py_buffer heap;
+	uint64_t base;
+	int full = 0;
+	size_t i;
+
+	if (PyArg_UnpackFastcall("encode", args, nargs, kwnames, keywords, 1,
+				 argv))
+		return NULL;
+
+	if (argv[1] && (full = PyObject_IsTrue(argv[1])) < 0)
+		return NULL;
+
+	if (PyObject_GetBuffer(argv[0], &heap, PyBUF_SIMPLE))
+		return NULL;
+
+	c.base = heap.buf;
+	c.len = heap.len;
+	if ((err = catalog_check(&c))) {
+		PyErr_SetString(PyExc_ValueError, err);
+		goto err;
+	}
+
+	base = full ? 0 : self->sequence;
+	if (!base)
+		SnapshotEncoder_reset(self);
+
+	for (i = 0; i < SECTIONS; i++) {
+		self->section[i].len = 0;
+		self->count[i] = 0;
+	}
+
+	if (SnapshotEncoder_walk(self, &c))
+		goto err;
+	PyBuffer_Release(&heap);
+
+	self->out.len = 0;
+	if (buffer_write(&self->out, SNAPSHOT_MAGIC, 8) ||
+	    buffer_write_varint(&self->out, ++self->sequence) ||
+	    buffer_write_varint(&self->out, base))
+		goto fail;
+
+	for (i = 0; i < SECTIONS; i++)
+		if (buffer_write_varint(&self->out, self->count[i]) ||
+		    buffer_write(&self->out, self->section[i].data,
+				 self->section[i].len))
+			goto fail;
+
+	return PyBytes_FromStringAndSize(self->out.data, self->out.len);
+
+err:
+	PyBuffer_Release(&heap);
+fail:
+	/* We may have forgotten some values, so start over next time */
+	self->sequence = 0;
+	return NULL;
+}
+
+static PyObject *SnapshotEncoder_get_sequence(SnapshotEncoderObject *self,
+					      void *closure)
+{
+	return PyLong_FromUnsignedLongLong(self->sequence);
+}
+
+static PyGetSetDef SnapshotEncoder_getsetters[] = {
+	{
+		.name = "sequence",
+		.get = (getter)SnapshotEncoder_get_sequence,
+		.doc = "The sequence number of the last snapshot, or 0 if the next one will be full",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyMethodDef SnapshotEncoder_methods[] = {
+	{
+		.ml_name = "encode",
+		.ml_meth = (PyCFunction)SnapshotEncoder_encode,
+		.ml_flags = METH_FASTCALL | METH_KEYWORDS,
+		.ml_doc = "Encode a snapshot of a heap (a buffer of its whole file) relative to the last one, or a full snapshot if full is true",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject SnapshotEncoderType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(SnapshotEncoderObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.SnapshotEncoder",
+	.tp_doc = "Binary snapshot encoder, which remembers the last snapshot",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)SnapshotEncoder_init,
+	.tp_dealloc = (destructor)SnapshotEncoder_dealloc,
+	.tp_methods = SnapshotEncoder_methods,
+	.tp_getset = SnapshotEncoder_getsetters,
+};
+
+int SnapshotEncoderType_Add(PyObject *m)
+{
+	return PyModule_AddType(m, &SnapshotEncoderType);
+}
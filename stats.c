@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "_mpmetrics.h"
+#include "stats.h"
+
+#ifdef MPMETRICS_STATS
+typedef BufferObject StatsObject;
+
+_Atomic(_Atomic uint64_t *) stats;
+/* The Stats being counted into, which keeps its memory mapped */
+static PyObject *enabled;
+
+static const char *const stat_names[STATS] = {
+	[STAT_CAS_RETRIES] = "CAS_RETRIES",
+	[STAT_LOCK_WAITS] = "LOCK_WAITS",
+	[STAT_LOCK_WAIT_NS] = "LOCK_WAIT_NS",
+	[STAT_SNAPSHOT_YIELDS] = "SNAPSHOT_YIELDS",
+	[STAT_HEAP_GROWS] = "HEAP_GROWS",
+};
+
+static int Stats_init(StatsObject *self, PyObject *args, PyObject *kwds)
+{
+	if (BufferType.tp_init((PyObject *)self, args, kwds))
+		return -1;
+
+	memset(self->shm.buf, 0, STATS * sizeof(uint64_t));
+	return 0;
+}
+
+static PyObject *Stats_enable(StatsObject *self, PyObject *Py_UNUSED(ignored))
+{
+	Py_INCREF(self);
+	atomic_store(&stats, (_Atomic uint64_t *)self->shm.buf);
+	Py_XSETREF(enabled, (PyObject *)self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *Stats_get(StatsObject *self, PyObject *Py_UNUSED(ignored))
+{
+	_Atomic uint64_t *s = self->shm.buf;
+	PyObject *values = PyTuple_New(STATS);
+	int i;
+
+	if (!values)
+		return NULL;
+
+	for (i = 0; i < STATS; i++) {
+		PyObject *value =
+			PyLong_FromUnsignedLongLong(atomic_load_explicit(&s[i],
+									 memory_order_relaxed));
+
+		if (!value) {
+			Py_DECREF(values);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(values, i, value);
+	}
+	return values;
+}
+
+static PyObject *Stats_record(PyObject *Py_UNUSED(cls), PyObject *args)
+{
+	unsigned long long amount = 1;
+	unsigned int stat;
+
+	if (!PyArg_ParseTuple(args, "I|K", &stat, &amount))
+		return NULL;
+
+	if (stat >= STATS) {
+		PyErr_SetString(PyExc_ValueError, "unknown stat");
+		return NULL;
+	}
+
+	stat_add(stat, amount);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef Stats_methods[] = {
+	{
+		.ml_name = "enable",
+		.ml_meth = (PyCFunction)Stats_enable,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Count into these stats (in this process and any forked from it)",
+	},
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)Stats_get,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = "Get a tuple of every stat",
+	},
+	{
+		.ml_name = "record",
+		.ml_meth = (PyCFunction)Stats_record,
+		.ml_flags = METH_VARARGS | METH_STATIC,
+		.ml_doc = "Add an amount (default 1) to a stat in the enabled stats, if there are any",
+	},
+	{ /* Sentinel */ },
+};
+
+static PyTypeObject StatsType = {
+	PyObject_HEAD_INIT(NULL)
+	.tp_basicsize = sizeof(StatsObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_name = "_mpmetrics.Stats",
+	.tp_doc = "Counters for the slow paths of mpmetrics itself",
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)Stats_init,
+	.tp_methods = Stats_methods,
+};
+
+int StatsType_Add(PyObject *m)
+{
+	int i, ret;
+
+	if (PyType_AddSizeConstant(&StatsType, "size", STATS * sizeof(uint64_t)) ||
+	    PyType_AddSizeConstant(&StatsType, "align", sizeof(uint64_t)))
+		return -1;
+
+	for (i = 0; i < STATS; i++)
+		if (PyType_AddSizeConstant(&StatsType, stat_names[i], i))
+			return -1;
+
+	StatsType.tp_base = &BufferType;
+	Py_INCREF(&BufferType);
+	ret = PyModule_AddType(m, &StatsType);
+	Py_DECREF(&BufferType);
+	return ret;
+}
+#else /* MPMETRICS_STATS */
+int StatsType_Add(PyObject *m)
+{
+	int ret;
+
+	Py_INCREF(Py_None);
+	ret = PyModule_AddObject(m, "Stats", Py_None);
+	if (ret)
+		Py_DECREF(Py_None);
+	return ret;
+}
+#endif /* MPMETRICS_STATS */
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "_mpmetrics.h"
+
+/*
+ * Counters for the slow paths of mpmetrics itself, which tell whether a metric
+ * would benefit from being sharded or buffered. They are only compiled in
+ * with -DMPMETRICS_STATS; otherwise these functions do nothing. The counters
+ * are kept in shared memory (see mpmetrics/stats.py), and nothing is counted
+ * until they have been enabled. These must match the names in stats.c.
+ */
+enum stat_id {
+	/* Retried compare-and-swaps when adding to doubles */
+	STAT_CAS_RETRIES,
+	/* Lock acquisitions which had to wait, and how long they waited */
+	STAT_LOCK_WAITS,
+	STAT_LOCK_WAIT_NS,
+	/* Times a histogram snapshot yielded waiting for observers */
+	STAT_SNAPSHOT_YIELDS,
+	/* Times a heap's file was grown (counted from Python) */
+	STAT_HEAP_GROWS,
+	STATS,
+};
+
+#ifdef MPMETRICS_STATS
+extern _Atomic(_Atomic uint64_t *) stats;
+
+static inline void stat_add(enum stat_id stat, uint64_t amount)
+{
+	_Atomic uint64_t *s = atomic_load_explicit(&stats, memory_order_relaxed);
+
+	if (s)
+		atomic_fetch_add_explicit(&s[stat], amount,
+					  memory_order_relaxed);
+}
+
+/* Start timing a wait; pass the result to stat_wait once it's over */
+static inline uint64_t stat_wait_start(void)
+{
+	struct timespec now;
+
+	if (!atomic_load_explicit(&stats, memory_order_relaxed))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * (uint64_t)NSEC_PER_SEC + now.tv_nsec;
+}
+
+static inline void stat_wait(uint64_t start)
+{
+	uint64_t end = stat_wait_start();
+
+	if (start && end)
+		stat_add(STAT_LOCK_WAIT_NS, end - start);
+	stat_add(STAT_LOCK_WAITS, 1);
+}
+#else /* MPMETRICS_STATS */
+static inline void stat_add(enum stat_id stat, uint64_t amount) { }
+static inline uint64_t stat_wait_start(void) { return 0; }
+static inline void stat_wait(uint64_t start) { }
+#endif /* MPMETRICS_STATS */
+
+static inline void stat_inc(enum stat_id stat)
+{
+	stat_add(stat, 1);
+}
+
+#endif /* STATS_H */
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: LGPL-3.0-only
+/*
+ * Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+ */
+
+/*
+ * Sum an iterable (or a buffer of native numbers) of amounts for add_many.
+ * Included by the atomic templates, which define PTYPE, NAME, AS, KIND, and
+ * (for floating-point atomics) DOUBLE. Integer sums which overflow PTYPE
+ * raise OverflowError.
+ */
+
+#define SUM paste(NAME, _sum)
+static int SUM(PyObject *amounts, PTYPE *total)
+{
+	PyObject *iter, *item;
+
+	*total = 0;
+	if (PyObject_CheckBuffer(amounts)) {
+		Py_buffer view;
+		bool matches;
+
+		if (PyObject_GetBuffer(amounts, &view,
+				       PyBUF_FORMAT | PyBUF_ANY_CONTIGUOUS)) {
+			PyErr_Clear();
+		} else {
+			matches = buffer_matches(&view, KIND, sizeof(PTYPE));
+			if (matches) {
+				const PTYPE *vals = view.buf;
+				Py_ssize_t i, n = view.len / sizeof(PTYPE);
+
+				for (i = 0; i < n; i++) {
+#ifdef DOUBLE
+					*total += vals[i];
+#else
+					if (__builtin_add_overflow(*total, vals[i],
+								   total)) {
+						PyBuffer_Release(&view);
+						goto overflow;
+					}
+#endif
+				}
+			}
+			PyBuffer_Release(&view);
+			if (matches)
+				return 0;
+		}
+	}
+
+	iter = PyObject_GetIter(amounts);
+	if (!iter)
+		return -1;
+
+	while ((item = PyIter_Next(iter))) {
+		PTYPE amount = AS(item);
+
+		Py_DECREF(item);
+		if (PyErr_Occurred()) {
+			Py_DECREF(iter);
+			return -1;
+		}
+
+#ifdef DOUBLE
+		*total += amount;
+#else
+		if (__builtin_add_overflow(*total, amount, total)) {
+			Py_DECREF(iter);
+			goto overflow;
+		}
+#endif
+	}
+
+	Py_DECREF(iter);
+	return PyErr_Occurred() ? -1 : 0;
+
+#ifndef DOUBLE
+overflow:
+	PyErr_SetString(PyExc_OverflowError,
+			"sum of amounts too large to fit in " stringify(PTYPE));
+	return -1;
+#endif
+}
@@ -1,14 +1,18 @@
 # SPDX-License-Identifier: GPL-3.0-only
 # Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
 
+import array
 from contextlib import nullcontext
 import math
+import multiprocessing
 
 from hypothesis import given, strategies as st
 import pytest
 
 from mpmetrics.types import Box, Double
-from mpmetrics.atomic import AtomicInt64, AtomicUInt64, AtomicDouble
+from mpmetrics.atomic import AtomicInt64, AtomicUInt64, AtomicDouble, AtomicFixed, BufferedAtomicUInt64, \
+                            ShardedAtomicUInt64, ShardedAtomicDouble, AtomicInt64Array, \
+                            AtomicUInt64Array, AtomicDoubleArray, Exemplars
 
 from .common import heap, parallel, parallels, ParallelLoop
 
@@ -20,6 +24,14 @@ def atomic(request):
 def integer(request):
     return Box[request.param]
 
+@pytest.fixture(scope='module', params=(ShardedAtomicUInt64, ShardedAtomicDouble))
+def sharded(request):
+    return Box[request.param[4]]
+
+@pytest.fixture(scope='module', params=(AtomicInt64Array, AtomicUInt64Array, AtomicDoubleArray))
+def atomic_array(request):
+    return Box[request.param[4]]
+
 @given(st.integers())
 def test_iset(heap, integer, x):
     a = integer(heap)
@@ -73,6 +85,69 @@ def test_dadd(heap, x, y):
     else:
         assert a.get() == x + y
 
+@given(x=st.integers(-1 << 40, 1 << 40), y=st.integers(-1 << 40, 1 << 40))
+def test_fadd(heap, x, y):
+    a = Box[AtomicFixed[16]](heap)
+    a.set(x / 2 ** 16)
+    assert a.add(y / 2 ** 16) == x / 2 ** 16
+    # Amounts are rounded to the nearest 2^-16
+    a.add(2 ** -18)
+    assert a.get() == (x + y) / 2 ** 16
+    a.add_many([x / 2 ** 16, -y / 2 ** 16, 2 ** -18])
+    assert a.get() == 2 * x / 2 ** 16
+
+def test_fixed_range(heap):
+    a = Box[AtomicFixed[62]](heap)
+    # Amounts which are too large saturate
+    a.set(3)
+    assert a.get() == 2
+    a.set(math.nan)
+    assert a.get() == 0
+    # and sums wrap around
+    a.set(1.5)
+    a.add(1)
+    assert a.get() == -1.5
+
+    with pytest.raises(ValueError):
+        AtomicFixed[63]
+
+def test_inc_dec(heap, atomic):
+    a = atomic(heap)
+    a.set(5)
+    assert a.inc() == 5
+    assert a.dec() == 6
+    assert a.dec() == 5
+    assert a.get() == 4
+
+def test_add_args(heap, atomic):
+    a = atomic(heap)
+    a.add(amount=1)
+    a.add(2, raise_on_overflow=False)
+    a.add(3, False)
+    assert a.get() == 6
+
+    with pytest.raises(TypeError):
+        a.add()
+    with pytest.raises(TypeError):
+        a.add(1, True, 2)
+    with pytest.raises(TypeError):
+        a.add(1, amount=1)
+    with pytest.raises(TypeError):
+        a.add(1, foo=True)
+
+def test_add_many(heap, atomic):
+    a = atomic(heap)
+    assert a.add_many([1, 2, 3]) == 0
+    assert a.add_many(x for x in range(4)) == 6
+    assert a.add_many(array.array('B', [1, 2])) == 12
+    assert a.get() == 15
+
+    with pytest.raises(TypeError):
+        a.add_many(None)
+    with pytest.raises(TypeError):
+        a.add_many([1, None])
+    assert a.get() == 15
+
 def test_ordering(heap, atomic, parallel):
     class Test(ParallelLoop):
         def __init__(self):
@@ -95,6 +170,177 @@ def test_ordering(heap, atomic, parallel):
 
     Test().run()
 
+@given(st.lists(st.integers(0, 1 << 32)))
+def test_sharded_add(heap, sharded, xs):
+    a = sharded(heap)
+    a.set(7)
+    for x in xs:
+        a.add(x)
+    assert a.get() == 7 + sum(xs)
+    a.add_many(xs)
+    assert a.get() == 7 + 2 * sum(xs)
+
+def test_sharded_returns_none(heap, sharded):
+    a = sharded(heap)
+    if not hasattr(a, 'shard_size'):
+        pytest.skip("sharded atomics not supported")
+
+    # The previous value would require reading every shard
+    assert a.add(1) is None
+    assert a.add(2, raise_on_overflow=False) is None
+    assert a.add_many((3, 4)) is None
+    assert a.inc() is None
+    assert a.get() == 11
+
+def test_array(heap, atomic_array):
+    a = atomic_array(heap)
+    assert len(a) == 4
+    assert a.snapshot() == (0, 0, 0, 0)
+    assert a.add(1, 2) == 0
+    assert a.inc(1) == 2
+    assert a.inc(-1) == 0
+    a.set(0, 5)
+    assert a.get(0) == 5
+    assert a.get(-3) == 3
+    assert list(a) == [5, 3, 0, 1]
+    assert a.add(index=2, amount=1, raise_on_overflow=False) == 0
+    assert a.snapshot() == (5, 3, 1, 1)
+
+    for index in (4, -5):
+        with pytest.raises(IndexError):
+            a.get(index)
+        with pytest.raises(IndexError):
+            a.inc(index)
+    with pytest.raises(TypeError):
+        a.set(0)
+    with pytest.raises(TypeError):
+        a.add(0)
+    with pytest.raises(TypeError):
+        a.add(0, None)
+    assert a.snapshot() == (5, 3, 1, 1)
+
+def test_array_overflow(heap):
+    a = Box[AtomicUInt64Array[2]](heap)
+    a.set(1, AtomicUInt64.max)
+    with pytest.raises(OverflowError):
+        a.inc(1)
+    assert a.get(0) == 0
+
+def test_array_concurrent(heap, atomic_array, parallel):
+    class Test(ParallelLoop):
+        def __init__(self):
+            super().__init__(parallel)
+            self.value = atomic_array(heap)
+
+        def loop(self, n):
+            self.value.inc(n % 4)
+            self.value.add(3, 1)
+
+        def final(self):
+            assert self.value.snapshot() == tuple(self.total // 4 + self.total * (i == 3)
+                                                  for i in range(4))
+
+    Test().run()
+
+def test_exemplars(heap):
+    e = Box[Exemplars[2, 1]](heap)
+    assert e.get(0) is None
+    assert e.record(0, {'trace_id': 'abc', 'span': '\u2603'}, 1.5, 10)
+    assert e.get(0) == ({'trace_id': 'abc', 'span': '\u2603'}, 1.5, 10)
+    assert e.get(-1) is None
+
+    assert e.record(1, {}, 2)
+    labels, value, timestamp = e.get(1)
+    assert labels == {}
+    assert value == 2
+    assert timestamp > 0
+
+    with pytest.raises(IndexError):
+        e.record(2, {}, 1)
+    with pytest.raises(ValueError):
+        e.record(0, {'a': 'x' * 128}, 1)
+    with pytest.raises(TypeError):
+        e.record(0, {'a': 1}, 1)
+    assert e.get(0)[0] == {'trace_id': 'abc', 'span': '\u2603'}
+
+def test_exemplars_sampling(heap):
+    e = Box[Exemplars[1, 3]](heap)
+    recorded = [e.record(0, {'n': str(n)}, n) for n in range(7)]
+    assert recorded == [True, False, False, True, False, False, True]
+    assert e.get(0)[1] == 6
+
+def test_exemplars_concurrent(heap, parallel):
+    class Test(ParallelLoop):
+        def __init__(self):
+            super().__init__(parallel)
+            self.exemplars = Box[Exemplars[1, 1]](heap)
+
+        def loop(self, n):
+            self.exemplars.record(0, {'n': str(n) * (n % 8)}, n)
+
+        def check(self):
+            if exemplar := self.exemplars.get(0):
+                labels, value, _ = exemplar
+                assert labels == {'n': str(int(value)) * (int(value) % 8)}
+
+    Test().run()
+
+def test_sharded_concurrent(heap, sharded, parallel):
+    class Test(ParallelLoop):
+        def __init__(self):
+            super().__init__(parallel)
+            self.value = sharded(heap)
+
+        def loop(self, n):
+            self.value.add(1)
+
+        def final(self):
+            assert self.value.get() == self.total
+
+    Test().run()
+
+@pytest.fixture
+def buffered(heap):
+    cls = BufferedAtomicUInt64[3]
+    if cls is AtomicUInt64:
+        pytest.skip("buffered atomics not supported")
+
+    mem = heap.malloc(cls.size).deref()
+    value = AtomicUInt64.__new__(AtomicUInt64)
+    value._setstate(mem[:AtomicUInt64.size])
+    return cls(mem), value, mem
+
+def test_buffered(buffered):
+    a, value, mem = buffered
+    a.inc()
+    a.add(2)
+    assert value.get() == 0
+    a.add_many([3])
+    assert value.get() == 6
+    a.inc()
+    a.flush()
+    assert value.get() == 7
+
+    # Readers ask writers to flush
+    reader = type(a).__new__(type(a))
+    reader._setstate(mem)
+    a.inc()
+    assert reader.get() == 7
+    a.inc()
+    assert value.get() == 9
+
+def test_buffered_fork(buffered):
+    a, value, mem = buffered
+    a.inc()
+
+    # The child must not publish our pending update, but should publish its own on exit
+    p = multiprocessing.get_context('fork').Process(target=a.inc)
+    p.start()
+    p.join()
+    assert value.get() == 1
+    a.flush()
+    assert value.get() == 2
+
 def test_racy(heap):
     class Test(ParallelLoop):
         def __init__(self):
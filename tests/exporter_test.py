@@ -0,0 +1,62 @@
+# SPDX-License-Identifier: GPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+import os
+import subprocess
+
+import pytest
+from prometheus_client.registry import CollectorRegistry
+
+import _mpmetrics
+from mpmetrics import Counter, Gauge, Histogram, Summary, WindowedCounter
+from mpmetrics.exposition import generate_latest
+from mpmetrics.heap import Heap
+
+EXPORTER = os.path.join(os.path.dirname(_mpmetrics.__file__), 'mpmetrics-exporter')
+
+pytestmark = pytest.mark.skipif(not os.path.exists(EXPORTER) or not _mpmetrics.AtomicUInt64,
+                                reason="mpmetrics-exporter not built")
+
+def export(heap):
+    return subprocess.run((EXPORTER, '-o', heap.filename), check=True,
+                          stdout=subprocess.PIPE).stdout
+
+def test_exporter(tmp_path):
+    registry = CollectorRegistry()
+    registry.heap = Heap(path=tmp_path / 'metrics')
+    assert export(registry.heap) == b''
+
+    Counter('c', "help", registry=registry).inc(3)
+    Counter('s', "sharded", registry=registry, sharded=True).inc(1000000)
+    c = Counter('l', "labeled\nhelp \\", ('a', 'b'), registry=registry)
+    c.labels('x', 'y').inc()
+    c.labels('"', '\n').inc(12345678901)
+    c.labels('removed', 'child').inc()
+    c.remove('removed', 'child')
+    g = Gauge('g', "help", ('l',), registry=registry)
+    for value in (-0.125, 2.5e20, 1e-5, 1234567.5, float('inf'), float('nan')):
+        g.labels(str(value)).set(value)
+    h = Histogram('h', "help", ('z',), registry=registry, buckets=(0.1, 1, 1e7))
+    h.labels('x').observe(1)
+    h.labels('x').observe(1e8)
+    Histogram('f', "fixed", registry=registry, fixed_sum=True).observe(0.1)
+    Summary('su', "help", registry=registry).observe(1 / 3)
+    assert export(registry.heap) == generate_latest(registry)
+
+def test_unexported(tmp_path):
+    registry = CollectorRegistry()
+    registry.heap = Heap(path=tmp_path / 'metrics')
+    Counter('c', "help", registry=registry).inc()
+    WindowedCounter('w', "help", registry=registry).inc()
+    Summary('q', "help", registry=registry, quantiles=(0.5,)).observe(1)
+    # Labeled metrics are exported once they have a child
+    Gauge('g', "help", ('l',), registry=registry)
+
+    names = set(line.split()[0] for line in export(registry.heap).decode().splitlines()
+                if not line.startswith('#'))
+    assert names == { 'c_total', 'c_created' }
+
+def test_bad_heap(tmp_path):
+    path = tmp_path / 'metrics'
+    path.write_bytes(b'A' * 4096)
+    assert subprocess.run((EXPORTER, '-o', path), stderr=subprocess.DEVNULL).returncode
@@ -0,0 +1,155 @@
+# SPDX-License-Identifier: GPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+import asyncio
+import math
+import re
+import threading
+
+from hypothesis import given, strategies as st
+from prometheus_client import exposition, registry as _registry
+import pytest
+
+import _mpmetrics
+from mpmetrics import Counter, Gauge, Summary, Histogram
+from mpmetrics.exposition import generate_latest, generate_latest_async, render_labels
+
+@pytest.fixture
+def registry():
+    return _registry.CollectorRegistry()
+
+def populate(registry):
+    c = Counter('c', 'A "counter"\nwith \\escapes', registry=registry, labelnames=('a', 'm'))
+    c.labels('x', 'y').inc()
+    c.labels('a\\b', 'q"\n').inc(2)
+    g = Gauge('g', 'help', registry=registry)
+    g.set(1234567.5)
+    s = Summary('s', 'help', registry=registry)
+    s.observe(3)
+    s = Summary('q', 'help', registry=registry, labelnames=('a',), quantiles=(0.5, 0.99))
+    s.labels('x').observe(3)
+    h = Histogram('h', 'help', registry=registry, labelnames=('a', 'm'), buckets=(1, 2))
+    h.labels('1', '2').observe(1.5)
+    h = Histogram('h2', 'help', registry=registry)
+    h.observe(-1)
+
+def test_prometheus(registry):
+    populate(registry)
+    expected = exposition.generate_latest(registry).replace(b'le="inf"', b'le="+Inf"')
+    assert generate_latest(registry) == expected
+
+def test_openmetrics(registry):
+    populate(registry)
+    output = generate_latest(registry, openmetrics=True)
+    assert output.endswith(b'# EOF\n')
+    assert b'# TYPE c counter\n' in output
+    assert b'# HELP c A \\"counter\\"\\nwith \\\\escapes\n' in output
+    assert b'c_created{a="x",m="y"} ' in output
+    assert b'h_bucket{a="1",le="+Inf",m="2"} 1.0\n' in output
+
+def test_exemplars(registry):
+    c = Counter('c', 'help', registry=registry, exemplars=True)
+    c.inc(exemplar={'trace_id': 'a"b'})
+    h = Histogram('h', 'help', registry=registry, labelnames=('a',), buckets=(1,),
+                  exemplars=True)
+    h.labels('x').observe(2, exemplar={})
+
+    output = generate_latest(registry, openmetrics=True).decode()
+    assert re.search(r'^c_total 1\.0 # {trace_id="a\\"b"} 1\.0 [0-9.]+$', output, re.M)
+    assert re.search(r'^h_bucket{a="x",le="\+Inf"} 1\.0 # {} 2\.0 [0-9.]+$', output, re.M)
+    assert 'h_bucket{a="x",le="1.0"} 0.0\n' in output
+
+    # The Prometheus format doesn't have exemplars
+    assert '#' not in generate_latest(registry).decode().replace('# HELP', '').replace('# TYPE', '')
+
+    writer = _mpmetrics.Exposition(openmetrics=True)
+    writer.family('f', '', 'counter')
+    writer.sample('_total', (), 1, (render_labels({'l': 'v'}), 2, None))
+    assert writer.getvalue().endswith(b'f_total 1.0 # {l="v"} 2.0\n')
+
+def test_unchanged(registry):
+    populate(registry)
+    h = Histogram('h3', 'help', registry=registry, labelnames=('a',), buckets=(1,),
+                  exemplars=True)
+    h.labels('x').observe(2)
+    for openmetrics in (False, True):
+        assert generate_latest(registry, openmetrics) == generate_latest(registry, openmetrics)
+
+    # Series which changed are written again
+    h.labels('x').observe(0, exemplar={'a': 'b'})
+    assert 'h3_bucket{a="x",le="1.0"} 1.0 # {a="b"} 0.0' in \
+        generate_latest(registry, openmetrics=True).decode()
+    expected = exposition.generate_latest(registry).replace(b'le="inf"', b'le="+Inf"')
+    assert generate_latest(registry) == expected
+
+    writer = _mpmetrics.Exposition()
+    writer.family('f', '', 'gauge')
+    start = writer.tell()
+    writer.sample('', (), 1)
+    text = writer.getvalue(start)
+    assert text == b'f 1.0\n'
+    writer.write(text)
+    assert writer.getvalue().endswith(b'f 1.0\nf 1.0\n')
+    with pytest.raises(ValueError):
+        writer.getvalue(writer.tell() + 1)
+
+def test_async(registry):
+    populate(registry)
+    c = Counter('c2', 'help', registry=registry, labelnames=('a',))
+    c.labels('x').inc()
+
+    async def scrape():
+        return await asyncio.gather(generate_latest_async(registry),
+                                    generate_latest_async(registry, openmetrics=True))
+
+    assert asyncio.run(scrape()) == [generate_latest(registry),
+                                     generate_latest(registry, openmetrics=True)]
+
+    # Scraping waits for the lock without blocking the event loop
+    held = threading.Event()
+    release = threading.Event()
+
+    def hold():
+        with c._shared_lock:
+            held.set()
+            release.wait()
+
+    async def main():
+        scrape = asyncio.create_task(generate_latest_async(registry))
+        await asyncio.sleep(0.005)
+        assert not scrape.done()
+        release.set()
+        return await scrape
+
+    t = threading.Thread(target=hold)
+    t.start()
+    try:
+        held.wait()
+        # Make the scrape look for new children
+        c._generation.inc()
+        assert asyncio.run(main()) == generate_latest(registry)
+    finally:
+        release.set()
+        t.join()
+
+@given(st.floats())
+def test_float(x):
+    writer = _mpmetrics.Exposition()
+    writer.family('f', '', 'gauge')
+    writer.sample('', (), x)
+    value = writer.getvalue().decode().splitlines()[-1].split(' ')[1]
+    assert value == exposition.floatToGoString(x)
+
+def test_buffer():
+    writer = _mpmetrics.Exposition()
+    writer.family('f', '', 'gauge')
+    writer.sample('', render_labels({'l': 'v'}), 1)
+    with memoryview(writer) as view:
+        assert bytes(view) == writer.getvalue()
+        with pytest.raises(BufferError):
+            writer.clear()
+    writer.clear()
+    assert writer.getvalue() == b''
+
+    with pytest.raises(ValueError):
+        writer.sample('', (), 1)
@@ -3,11 +3,17 @@
 
 import math
 import mmap
+import multiprocessing
+import os
+import pickle
+import unittest.mock
 
 import pytest
 from hypothesis import given, settings, strategies as st
+from prometheus_client.registry import CollectorRegistry
 
-from mpmetrics.heap import Heap
+from mpmetrics.heap import PAGESIZE, Heap, _hugepagesize
+from mpmetrics.metrics import Counter, Histogram
 from mpmetrics.util import align
 
 from .common import parallel
@@ -35,8 +41,12 @@ def test_bad_align(alignment):
 @st.composite
 def allocs(draw):
     size = mmap.ALLOCATIONGRANULARITY << draw(st.integers(0, 8))
-    heap = Heap(map_size=size)
-    sizes = st.integers(1, size)
+    if draw(st.booleans()):
+        heap = Heap(map_size=size, reserve=size << 12)
+        sizes = st.integers(1, 2 * size)
+    else:
+        heap = Heap(map_size=size)
+        sizes = st.integers(1, size)
     aligns = st.integers(0, 12).map(lambda n: 1 << n)
     return heap, draw(st.lists(st.tuples(sizes, aligns), min_size=3))
 
@@ -62,6 +72,96 @@ def test_malloc(alloc):
             prev = blocks[i - 1]
             assert prev.start + prev.size <= blocks[i].start
 
+def test_free():
+    h = Heap()
+    a = h.malloc(100)
+    b = h.malloc(100)
+    a.deref()[:] = b'A' * 100
+    a.free()
+
+    c = h.malloc(104)
+    assert c.start == a.start
+    assert not any(c.deref())
+
+    # Different size classes don't share blocks
+    b.free()
+    d = h.malloc(200)
+    assert d.start != b.start
+    e = h.malloc(97)
+    assert e.start == b.start
+
+    # Insufficiently-aligned blocks aren't reused
+    e.free()
+    f = h.malloc(100, alignment=mmap.PAGESIZE)
+    assert f.start != e.start
+    assert f.start == align(f.start, mmap.PAGESIZE)
+
+    # Blocks are rounded up to the nearest eighth of a power of two
+    g = h.malloc(800)
+    i = h.malloc(800)
+    assert i.start - g.start == 832
+
+def test_reserve(parallel):
+    with pytest.raises(ValueError):
+        Heap(map_size=mmap.PAGESIZE, reserve=mmap.PAGESIZE + 1)
+
+    h = Heap(map_size=mmap.PAGESIZE, reserve=1 << 30)
+    a = h.malloc(1)
+    # Blocks may be larger than a page, and straddle page boundaries
+    big = h.malloc(3 * mmap.PAGESIZE + 1, alignment=1)
+    assert big.start // mmap.PAGESIZE != (big.start + big.size - 1) // mmap.PAGESIZE
+    big.deref()[:] = b'B' * big.size
+    assert not any(a.deref())
+
+    with pytest.raises(ValueError):
+        h.malloc(h.max_size + 1)
+
+    def check(block):
+        assert block.deref() == b'B' * block.size
+        block.deref()[0] = 0
+
+    p = parallel.spawn(target=check, args=(big,))
+    p.start()
+    p.join()
+    assert big.deref()[0] == 0
+
+def setone(block):
+    block.deref()[0] = 1
+
+@pytest.mark.parametrize('backing', ('memfd', '/dev/shm'))
+def test_backing(backing):
+    if not os.path.isdir(backing) and backing.startswith('/'):
+        pytest.skip(f"{backing} does not exist")
+
+    block = Heap(backing=backing).malloc(1)
+    # Make sure other processes can open the heap by name
+    p = multiprocessing.get_context('spawn').Process(target=setone, args=(block,))
+    p.start()
+    p.join()
+    assert block.deref()[0] == 1
+
+def test_hugetlb():
+    with pytest.raises(ValueError):
+        Heap(map_size=mmap.PAGESIZE, backing='hugetlb')
+
+    try:
+        h = Heap(map_size=_hugepagesize(), backing='hugetlb')
+        setone(h.malloc(1))
+    except OSError:
+        pytest.skip("huge pages not available")
+
+@pytest.mark.parametrize('reserve', (None, 1 << 24))
+def test_numa(reserve):
+    with pytest.raises(ValueError):
+        Heap(numa='bind')
+    with pytest.raises(ValueError):
+        Heap(numa='local', nodes=(0,))
+
+    h = Heap(reserve=reserve, numa='interleave', nodes=(0,))
+    block = h.malloc(2 * h.map_size if reserve else 1)
+    setone(block)
+    assert block.deref()[0] == 1
+
 def test_prefork(parallel):
     mem = Heap().malloc(1).deref()
     assert mem[0] == 0
@@ -89,3 +189,86 @@ def test_postfork(parallel):
     q.put(block)
     p.join()
     assert block.deref()[0] == 2
+
+def persistent_registry(path, **kwargs):
+    registry = CollectorRegistry()
+    registry.heap = Heap(path=path, **kwargs)
+    return registry
+
+def use_metrics(path):
+    registry = persistent_registry(path)
+    Counter('c', "help", registry=registry).inc(3)
+    Histogram('h', "help", ('l',), registry=registry).labels('x').observe(1)
+
+def die_reading(path):
+    h = Histogram('h', "help", ('l',), registry=persistent_registry(path))
+    h.labels('x')._lock.acquire()
+    h._shared_lock.acquire_read()
+    os._exit(0)
+
+def test_persistent(tmp_path):
+    path = tmp_path / 'metrics'
+    ctx = multiprocessing.get_context('spawn')
+    for target in (use_metrics, use_metrics, die_reading):
+        p = ctx.Process(target=target, args=(path,))
+        p.start()
+        p.join()
+        assert p.exitcode == 0
+
+    registry = persistent_registry(path)
+    Counter('c', "help", registry=registry)
+    h = Histogram('h', "help", ('l',), registry=registry)
+    assert registry.get_sample_value('c_total') == 6
+    assert registry.get_sample_value('h_count', { 'l': 'x' }) == 2
+    # The locks left held by die_reading were reset
+    h.labels('y').observe(1)
+    assert registry.get_sample_value('h_count', { 'l': 'y' }) == 1
+
+    # Metrics created with different arguments start over
+    other = CollectorRegistry()
+    other.heap = registry.heap
+    Counter('c', "help", registry=other, sharded=True)
+    assert other.get_sample_value('c_total') == 0
+
+def test_persistent_invalid(tmp_path):
+    path = tmp_path / 'metrics'
+    path.write_bytes(b'A' * mmap.PAGESIZE)
+    with pytest.raises(ValueError):
+        Heap(path=path)
+
+    path = tmp_path / 'metrics2'
+    ctx = multiprocessing.get_context('spawn')
+    p = ctx.Process(target=use_metrics, args=(path,))
+    p.start()
+    p.join()
+    with pytest.raises(ValueError):
+        Heap(path=path, map_size=2 * PAGESIZE)
+
+def use_elsewhere(path):
+    with unittest.mock.patch('mpmetrics.heap._pid_namespace', return_value=(1, 2)):
+        use_metrics(path)
+
+def open_elsewhere(path, heap):
+    with unittest.mock.patch('mpmetrics.heap._pid_namespace', return_value=(1, 2)):
+        with pytest.raises(ValueError, match="namespace"):
+            Heap(path=path)
+        with pytest.raises(ValueError, match="namespace"):
+            pickle.loads(heap)
+
+def test_pid_namespace(tmp_path):
+    path = tmp_path / 'metrics'
+    ctx = multiprocessing.get_context('spawn')
+    p = ctx.Process(target=use_elsewhere, args=(path,))
+    p.start()
+    p.join()
+    assert p.exitcode == 0
+
+    # Nobody else has the heap open, so it moves to our namespace
+    registry = persistent_registry(path)
+    Counter('c', "help", registry=registry)
+    assert registry.get_sample_value('c_total') == 3
+
+    p = ctx.Process(target=open_elsewhere, args=(path, pickle.dumps(registry.heap)))
+    p.start()
+    p.join()
+    assert p.exitcode == 0
@@ -0,0 +1,227 @@
+# SPDX-License-Identifier: GPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+import array
+import bisect
+import math
+import sys
+
+from hypothesis import given, strategies as st
+import pytest
+
+from mpmetrics.atomic import BufferedHistogramData, ExponentialHistogramData, FixedSum, \
+                            HistogramData, LockingHistogramData, exponential_bound, \
+                            exponential_key
+from mpmetrics.generics import IntType
+from mpmetrics.types import Box
+
+from .common import heap, parallel, ParallelLoop
+
+BufferedHistogramData5 = IntType('BufferedHistogramData5',
+                                 lambda name, n: BufferedHistogramData[n, 5])
+
+@pytest.fixture(scope='module', params=(HistogramData, LockingHistogramData,
+                                        BufferedHistogramData5))
+def data(request):
+    return request.param
+
+@st.composite
+def thresholds(draw):
+    thresholds = draw(st.lists(st.floats(allow_nan=False, allow_infinity=False), max_size=40))
+    return tuple(sorted(thresholds)) + (math.inf,)
+
+@given(thresholds(), st.lists(st.floats()))
+def test_observe(heap, data, thresholds, amounts):
+    h = Box[data[len(thresholds)]](heap)
+    h.thresholds = thresholds
+    assert h.thresholds == thresholds
+
+    expected = [0] * len(thresholds)
+    for amount in amounts:
+        h.observe(amount)
+        expected[bisect.bisect_left(thresholds, amount)] += 1
+
+    buckets, sum, count = h.snapshot()
+    assert list(buckets) == expected
+    assert count == len(amounts)
+
+@given(st.integers(-4, 8), st.integers(-20, 20), st.integers(1, 40),
+       st.lists(st.floats() | st.sampled_from((0.5, 1.0, 2.0, 3.0))))
+def test_exponential(heap, schema, octave, n, amounts):
+    min_key = octave << max(schema, 0)
+    max_key = min_key + n
+    h = Box[ExponentialHistogramData[schema, min_key, max_key]](heap)
+    thresholds = tuple(exponential_bound(key, schema) for key in range(min_key, max_key + 1))
+    h.thresholds = thresholds + (math.inf,)
+
+    expected = [0] * len(h.thresholds)
+    for amount in amounts:
+        h.observe(amount)
+        expected[bisect.bisect_left(h.thresholds, amount)] += 1
+    assert list(h.snapshot()[0]) == expected
+
+    h.observe_many(amounts)
+    assert list(h.snapshot()[0]) == [2 * e for e in expected]
+
+@given(st.integers(-4, 8), st.floats(min_value=0, exclude_min=True, allow_infinity=False))
+def test_exponential_key(schema, amount):
+    key = exponential_key(amount, schema)
+    assert exponential_bound(key - 1, schema) < amount <= exponential_bound(key, schema)
+
+def test_exponential_bound():
+    # From the Prometheus native histogram documentation
+    assert exponential_bound(1, 0) == 2
+    assert exponential_bound(1, 3) == 2 ** (1 / 8)
+    assert exponential_bound(-1, -1) == 1 / 4
+    assert exponential_bound(8, 3) == 2
+
+def test_unchanged(heap):
+    h = Box[HistogramData[2]](heap)
+    h.thresholds = (1, math.inf)
+    count = h.__getstate__().deref()[64:72]
+    hot = lambda: int.from_bytes(count, sys.byteorder) >> 63
+
+    h.observe(2)
+    assert h.snapshot() == ((0, 1), 2, 1)
+    was_hot = hot()
+    # Nothing changed, so the halves aren't swapped
+    assert h.snapshot() == ((0, 1), 2, 1)
+    assert hot() == was_hot
+    h.observe(0)
+    assert h.snapshot() == ((1, 1), 2, 2)
+    assert hot() != was_hot
+
+def test_try_snapshot(heap):
+    h = Box[HistogramData[2]](heap)
+    h.thresholds = (1, math.inf)
+    mem = h.__getstate__().deref()
+
+    def add(off, n=1):
+        value = int.from_bytes(mem[off:off + 8], sys.byteorder) + n
+        mem[off:off + 8] = value.to_bytes(8, sys.byteorder)
+
+    h.observe(2)
+    # Start observing 0 in the first half, but don't finish
+    add(64)
+    assert h.try_snapshot() is None
+    assert h.try_snapshot() is None
+    # Observations made in the meantime go to the other half
+    h.observe(2)
+    # Finish the first observation
+    add(72)
+    add(88)
+    assert h.try_snapshot() == ((1, 1), 2, 2)
+    assert h.snapshot() == ((1, 2), 4, 3)
+
+@given(st.lists(st.lists(st.integers(0, 2))))
+def test_snapshots(heap, data, batches):
+    h = Box[data[3]](heap)
+    h.thresholds = (0, 1, math.inf)
+
+    expected = [0] * 3
+    for batch in batches:
+        for amount in batch:
+            h.observe(amount)
+            expected[amount] += 1
+
+        buckets, total, count = h.snapshot()
+        assert list(buckets) == expected
+        assert total == sum(i * n for i, n in enumerate(expected))
+        assert count == sum(expected)
+
+@given(thresholds(), st.lists(st.floats(allow_nan=False)))
+def test_observe_many(heap, data, thresholds, amounts):
+    h = Box[data[len(thresholds)]](heap)
+    h.thresholds = thresholds
+    expected = Box[data[len(thresholds)]](heap)
+    expected.thresholds = thresholds
+    for amount in amounts:
+        expected.observe(amount)
+
+    h.observe_many(amounts)
+    h.observe_many(array.array('d', amounts))
+    h.observe_many(amount for amount in amounts)
+    h.observe_many(array.array('f', []))
+
+    buckets, sum_, count = h.snapshot()
+    expected_buckets, expected_sum, expected_count = expected.snapshot()
+    assert buckets == tuple(3 * bucket for bucket in expected_buckets)
+    assert count == 3 * expected_count
+    assert math.isclose(sum_, 3 * expected_sum) or not math.isfinite(expected_sum)
+
+    with pytest.raises(TypeError):
+        h.observe_many([1, None])
+    with pytest.raises(TypeError):
+        h.observe_many(1)
+    assert h.snapshot()[2] == count
+
+@given(st.lists(st.integers(-1 << 20, 1 << 20)), st.integers(1, 16))
+def test_fixed_sum(heap, amounts, frac_bits):
+    h = Box[FixedSum[HistogramData[2], 24]](heap)
+    b = Box[FixedSum[BufferedHistogramData[2, 5], 24]](heap)
+    for x in (h, b):
+        x.thresholds = (0, math.inf)
+        # Amounts are rounded to the nearest 2^-24
+        for amount in amounts:
+            x.observe(amount + 2 ** -(24 + frac_bits))
+        x.observe_many(amount / 2 ** frac_bits for amount in amounts)
+
+        _, sum_, count = x.snapshot()
+        assert sum_ == sum(amounts) + sum(amount / 2 ** frac_bits for amount in amounts)
+        assert count == 2 * len(amounts)
+
+def test_bad_fixed_sum(heap):
+    for frac_bits in (0, 63):
+        with pytest.raises(ValueError):
+            FixedSum[HistogramData[2], frac_bits]
+
+def test_bad_thresholds(heap, data):
+    h = Box[data[3]](heap)
+    for thresholds in ((1, 2), (1, 2, 3, math.inf), (2, 1, math.inf), (1, 2, 3)):
+        with pytest.raises(ValueError):
+            h.thresholds = thresholds
+
+def test_concurrent(heap, data, parallel):
+    class Test(ParallelLoop):
+        def __init__(self):
+            super().__init__(parallel)
+            self.h = Box[data[3]](heap)
+            self.h.thresholds = (1, 2, math.inf)
+
+        def loop(self, n):
+            self.h.observe(n % 3)
+
+        def check(self):
+            buckets, total, count = self.h.snapshot()
+            assert sum(buckets) == count
+
+        def final(self):
+            buckets, total, count = self.h.snapshot()
+            assert count == self.total
+            assert sum(buckets) == self.total
+
+    Test().run()
+
+def test_buffered(heap):
+    h = Box[BufferedHistogramData[2, 3]](heap)
+    if not hasattr(h, 'flush'):
+        pytest.skip("buffered histograms not supported")
+    h.thresholds = (0, math.inf)
+    reader = type(h).__new__(type(h))
+    reader.__setstate__(h.__getstate__())
+
+    h.observe(1)
+    h.observe(-1)
+    assert reader.snapshot() == ((0, 0), 0, 0)
+    # The snapshot asked us to flush
+    h.observe(2)
+    assert reader.snapshot() == ((1, 2), 2, 3)
+
+    h.flush()
+    for amount in range(3):
+        h.observe(amount)
+    h.observe(3)
+    buckets, total, count = reader.snapshot()
+    assert count == 6
+    h.flush()
+    assert reader.snapshot() == ((2, 5), 8, 7)
@@ -1,18 +1,27 @@
 # SPDX-License-Identifier: GPL-3.0-only
 # Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
 
+import asyncio
 from copy import copy
+import errno
+import multiprocessing
+import threading
 import time
 
 import pytest
 
-from mpmetrics.types import Box
-from _mpmetrics import Lock
+from mpmetrics import aio
+from mpmetrics.types import Box, UInt64
+from _mpmetrics import FutexLock, Lock, RWLock
 
-from .common import heap, parallel
+from .common import heap, parallel, ParallelLoop
 
-def test_basics(heap):
-    l1 = Box[Lock](heap)
+@pytest.fixture(scope='module', params=(Lock, FutexLock, RWLock))
+def lock(request):
+    return request.param
+
+def test_basics(heap, lock):
+    l1 = Box[lock](heap)
 
     assert l1.acquire()
     with pytest.raises(OSError):
@@ -36,13 +45,13 @@ def test_basics(heap):
     assert l1.acquire(timeout=1)
     l1.release()
 
-def test_acquire(heap, parallel):
+def test_acquire(heap, lock, parallel):
     def hold(l, b):
         with l:
             b.wait()
             b.wait()
 
-    l = Box[Lock](heap)
+    l = Box[lock](heap)
     b = parallel.barrier(2)
     p = parallel.spawn(target=hold, args=(l, b))
     p.start()
@@ -61,3 +70,161 @@ def test_acquire(heap, parallel):
         raise
     finally:
         p.join()
+
+def test_exclusion(heap, lock, parallel):
+    class Test(ParallelLoop):
+        def __init__(self):
+            super().__init__(parallel, count=10000)
+            self.lock = Box[lock](heap)
+            self.value = Box[UInt64](heap)
+
+        def loop(self, n):
+            with self.lock:
+                self.value.value += 1
+
+        def final(self):
+            assert self.value.value == self.total
+
+    Test().run()
+
+def test_owner_dead(heap, lock):
+    l = Box[lock](heap)
+    p = multiprocessing.get_context('fork').Process(target=l.acquire)
+    p.start()
+    p.join()
+
+    with pytest.raises(OSError) as excinfo:
+        l.acquire(timeout=1)
+    assert excinfo.value.errno == errno.EOWNERDEAD
+
+    # The lock is usable again once the error has been reported
+    with l:
+        pass
+
+def test_acquire_async(heap, lock):
+    l = Box[lock](heap)
+    held = threading.Event()
+    release = threading.Event()
+
+    def hold():
+        with l:
+            held.set()
+            release.wait()
+
+    async def main():
+        assert not await aio.acquire(l, timeout=0.001)
+        acquire = asyncio.create_task(aio.acquire(l))
+        # The event loop keeps running while we wait
+        await asyncio.sleep(0.005)
+        assert not acquire.done()
+        release.set()
+        assert await acquire
+        l.release()
+
+        # Other tasks on the same thread wait too
+        async with aio.locked(l):
+            assert not await aio.acquire(l, timeout=0.001)
+
+    t = threading.Thread(target=hold)
+    t.start()
+    try:
+        held.wait()
+        asyncio.run(main())
+    finally:
+        release.set()
+        t.join()
+
+def test_rwlock(heap, parallel):
+    def hold(l, b):
+        with l.reader():
+            b.wait()
+            b.wait()
+
+    l = Box[RWLock](heap)
+    b = parallel.barrier(2)
+    p = parallel.spawn(target=hold, args=(l, b))
+    p.start()
+
+    try:
+        b.wait()
+        with l.reader():
+            assert l.acquire_read(block=False)
+            l.release_read()
+        assert not l.acquire(block=False)
+        assert not l.acquire(timeout=0.001)
+        b.wait()
+        with l:
+            pass
+    except:
+        b.abort()
+        raise
+    finally:
+        p.join()
+
+    with pytest.raises(PermissionError):
+        l.release_read()
+    with l:
+        with pytest.raises(OSError):
+            l.acquire_read()
+        with pytest.raises(PermissionError):
+            l.release_read()
+
+def test_reader_dead(heap):
+    l = Box[RWLock](heap)
+    p = multiprocessing.get_context('fork').Process(target=l.acquire_read)
+    p.start()
+    p.join()
+
+    # Readers don't modify anything, so their slots are just reclaimed
+    assert l.acquire(block=False)
+    l.release()
+
+    p = multiprocessing.get_context('fork').Process(target=l.acquire_read)
+    p.start()
+    p.join()
+    assert l.acquire(timeout=1)
+    l.release()
+
+def test_writer_dead_waiting(heap):
+    l = Box[RWLock](heap)
+    ctx = multiprocessing.get_context('fork')
+    held = ctx.Event()
+
+    def hold():
+        l.acquire()
+        held.set()
+        time.sleep(0.1)
+
+    p = ctx.Process(target=hold)
+    p.start()
+    # The writer is only noticed to be dead once it is reaped
+    reaper = threading.Thread(target=p.join)
+    reaper.start()
+    try:
+        held.wait()
+        with pytest.raises(OSError) as excinfo:
+            l.acquire(timeout=5)
+        assert excinfo.value.errno == errno.EOWNERDEAD
+    finally:
+        reaper.join()
+
+    with l:
+        pass
+
+def test_rwlock_readers(heap, parallel):
+    def hold(l, b):
+        b.wait()
+        with l.reader():
+            time.sleep(0.01)
+
+    # Readers which don't fit in a slot wait for one to be freed
+    l = Box[RWLock](heap)
+    b = parallel.barrier(20)
+    ps = [parallel.spawn(target=hold, args=(l, b)) for _ in range(20)]
+    for p in ps:
+        p.start()
+    for p in ps:
+        p.join()
+
+    with l:
+        pass
@@ -3,16 +3,20 @@
 # Copyright 2015 The Prometheus Authors
 # Portions of this file are adapted from prometheus_client
 
+import array
 from contextlib import nullcontext
+import math
 import pickle
 import random
 import time
+import unittest.mock
 
 from hypothesis import given, strategies as st
 from prometheus_client.registry import CollectorRegistry
 import pytest
 
-from mpmetrics.metrics import Counter, Gauge, Summary, Histogram
+from mpmetrics.metrics import Counter, Gauge, Summary, Histogram, ExponentialHistogram, \
+                             WindowedCounter, WindowedHistogram, WindowedSummary
 from mpmetrics.atomic import AtomicUInt64
 
 from .common import heap, parallel, parallels, ParallelLoop
@@ -47,6 +51,19 @@ class TestCounter:
         with pytest.raises(OverflowError):
             counter.inc(AtomicUInt64.max)
 
+    def test_inc_many(self, counter):
+        counter.inc_many(range(5))
+        assert get_sample_value(counter, 'c_total') == 10
+        counter.inc_many(array.array('Q', (1, 2)))
+        assert get_sample_value(counter, 'c_total') == 13
+        with pytest.raises(ValueError, match="amount must be positive"):
+            counter.inc_many((3, -2))
+        with pytest.raises(ValueError, match="amount must be positive"):
+            counter.inc_many(array.array('q', (3, -2)))
+        with pytest.raises(ValueError, match="amount must be positive"):
+            counter.inc_many(iter((3, -2)))
+        assert get_sample_value(counter, 'c_total') == 13
+
     @given(st.integers(max_value=-1))
     def test_negative_increment_raises(self, registry, amount):
         counter = Counter('c_total', "help", registry=registry)
@@ -85,6 +102,45 @@ class TestCounter:
 
         Test().run()
 
+    @pytest.mark.parametrize('sharded', (True, 1, 3))
+    def test_sharded(self, registry, parallel, sharded):
+        counter = Counter('c_total', "help", sharded=sharded, registry=registry)
+
+        class Test(ParallelLoop):
+            def loop(self, n):
+                counter.inc(2)
+
+            def final(self):
+                assert get_sample_value(counter, 'c_total') == 2 * self.total
+
+        Test(parallel).run()
+
+        with pytest.raises(ValueError):
+            Counter('c_total', "help", sharded=-1, registry=registry)
+        with pytest.raises(ValueError, match="shards"):
+            Counter('c_total', "help", sharded=1024, registry=registry)
+
+    @pytest.mark.parametrize('buffered', (True, 1, 3))
+    def test_buffered(self, registry, parallel, buffered):
+        counter = Counter('c_total', "help", buffered=buffered, registry=registry)
+
+        class Test(ParallelLoop):
+            def loop(self, n):
+                counter.inc(2)
+
+            def check(self):
+                assert get_sample_value(counter, 'c_total') <= 2 * self.total
+
+            def final(self):
+                assert get_sample_value(counter, 'c_total') == 2 * self.total
+
+        Test(parallel).run()
+
+        with pytest.raises(ValueError):
+            Counter('c_total', "help", buffered=-1, registry=registry)
+        with pytest.raises(ValueError):
+            Counter('c_total', "help", buffered=True, sharded=True, registry=registry)
+
 class TestGauge:
     @pytest.fixture
     def gauge(self, registry):
@@ -140,6 +196,9 @@ class TestSummary:
         summary.observe(10)
         assert get_sample_value(summary, 's_count') == 1
         assert get_sample_value(summary, 's_sum') == 10
+        summary.observe_many((1, 2))
+        assert get_sample_value(summary, 's_count') == 3
+        assert get_sample_value(summary, 's_sum') == 13
 
     def test_concurrent(self, summary, parallel):
         class Test(ParallelLoop):
@@ -170,6 +229,81 @@ class TestSummary:
             
         Test().run()
 
+class TestQuantileSummary:
+    @given(st.lists(st.floats(1e-6, 1e4), min_size=1))
+    def test_accuracy(self, registry, amounts):
+        quantiles = (0.0, 0.5, 0.9, 1.0)
+        summary = Summary('s', 'help', quantiles=quantiles, relative_accuracy=0.05,
+                          registry=registry)
+        summary.observe_many(amounts)
+
+        amounts.sort()
+        for q in quantiles:
+            actual = amounts[int(q * (len(amounts) - 1))]
+            estimate = get_sample_value(summary, 's', {'quantile': str(q)})
+            assert abs(estimate - actual) <= 0.05 * actual * (1 + 1e-9)
+        assert get_sample_value(summary, 's_count') == len(amounts)
+
+    def test_quantiles(self, registry):
+        summary = Summary('s', 'help', quantiles=(0.5,), lowest=1, highest=10,
+                          registry=registry)
+        assert math.isnan(get_sample_value(summary, 's', {'quantile': '0.5'}))
+
+        summary.observe(100)
+        assert get_sample_value(summary, 's', {'quantile': '0.5'}) >= 10
+        summary.observe(0.5)
+        summary.observe(0.25)
+        assert get_sample_value(summary, 's', {'quantile': '0.5'}) <= 1
+
+    @pytest.mark.parametrize('cls', (Summary, WindowedSummary))
+    def test_not_positive(self, registry, cls):
+        summary = cls('s', 'help', quantiles=(0.5,), registry=registry)
+        summary.observe(1)
+        for amount in (0, -1, -0.0, math.nan):
+            with pytest.raises(ValueError, match="positive"):
+                summary.observe(amount)
+        for amounts in ((2, 0), iter((2, -1)), array.array('d', (2, -1))):
+            with pytest.raises(ValueError, match="positive"):
+                summary.observe_many(amounts)
+
+        # Nothing was observed, so the estimate isn't dragged towards lowest
+        summary.observe_many(iter((1, 1)))
+        summary.observe_many(array.array('d', (1,)))
+        assert get_sample_value(summary, 's_count') == 4
+        assert get_sample_value(summary, 's', {'quantile': '0.5'}) == pytest.approx(1, rel=0.05)
+
+    def test_invalid(self, registry):
+        for kwargs in ({ 'quantiles': (2,) }, { 'relative_accuracy': 1e-4 },
+                       { 'lowest': 0 }, { 'lowest': 2, 'highest': 1 }):
+            kwargs.setdefault('quantiles', (0.5,))
+            with pytest.raises(ValueError):
+                Summary('s', 'help', registry=registry, **kwargs)
+
+    def test_too_big(self, registry):
+        # Too accurate to fit in one page of the heap
+        with pytest.raises(ValueError, match="relative_accuracy"):
+            Summary('s', 'help', quantiles=(0.5,), relative_accuracy=0.01, registry=registry)
+        with pytest.raises(ValueError, match="relative_accuracy"):
+            WindowedSummary('w', 'help', relative_accuracy=0.02, registry=registry)
+        Summary('s', 'help', quantiles=(0.5,), relative_accuracy=0.01, lowest=1e-3,
+                highest=1e3, registry=registry)
+
+    @pytest.mark.parametrize('kwargs', ({}, { 'quantiles': (0.5,) }))
+    def test_fixed_sum(self, registry, kwargs):
+        summary = Summary('s', 'help', fixed_sum=8, registry=registry, **kwargs)
+        summary.observe(1 / 3)
+        summary.observe_many((1, 2))
+        assert get_sample_value(summary, 's_count') == 3
+        assert get_sample_value(summary, 's_sum') == 3 + round(2 ** 8 / 3) / 2 ** 8
+
+    def test_labels(self, registry):
+        s = Summary('s', 'help', ['l'], quantiles=(0.5, 0.99), registry=registry)
+        s.labels('a').observe(1)
+        s = pickle.loads(pickle.dumps(s.labels('a')))
+        s.observe(1)
+        assert s.quantiles == (0.5, 0.99)
+        assert s._data.snapshot()[2] == 2
+
 class TestHistogram:
     @pytest.fixture
     def histogram(self, registry):
@@ -212,6 +346,58 @@ class TestHistogram:
         assert get_sample_value(histogram, 'h_count') == 3
         assert get_sample_value(histogram, 'h_sum') == float("inf")
 
+    def test_observe_many(self, histogram):
+        histogram.observe_many((0.5, 2, 3, 7))
+        assert get_sample_value(histogram, 'h_bucket', {'le': '1.0'}) == 1
+        assert get_sample_value(histogram, 'h_bucket', {'le': '2.5'}) == 2
+        assert get_sample_value(histogram, 'h_bucket', {'le': '5.0'}) == 3
+        assert get_sample_value(histogram, 'h_bucket', {'le': 'inf'}) == 4
+        assert get_sample_value(histogram, 'h_count') == 4
+        assert get_sample_value(histogram, 'h_sum') == 12.5
+
+    def test_concurrent_scrape(self, histogram):
+        histogram.observe(1)
+        assert get_sample_value(histogram, 'h_count') == 1
+        histogram.observe(2)
+        # Scrapers share the last snapshot while another scrape is in progress
+        with histogram._lock.reader():
+            assert get_sample_value(histogram, 'h_count') == 1
+            assert get_sample_value(histogram, 'h_sum') == 1
+        assert get_sample_value(histogram, 'h_count') == 2
+
+    def test_buffered(self, registry, parallel):
+        histogram = Histogram('h', 'help', buffered=7, registry=registry)
+
+        class Test(ParallelLoop):
+            def loop(self, n):
+                histogram.observe(n % 3)
+
+            def final(self):
+                assert get_sample_value(histogram, 'h_count') == self.total
+                assert get_sample_value(histogram, 'h_bucket', {'le': '1.0'}) == \
+                    self.total * 2 // 3
+
+        Test(parallel, count=3000).run()
+
+    @pytest.mark.parametrize('kwargs', ({}, { 'buffered': 3 }, { 'exemplars': True }))
+    def test_fixed_sum(self, registry, parallel, kwargs):
+        histogram = Histogram('h', 'help', fixed_sum=True, registry=registry, **kwargs)
+
+        class Test(ParallelLoop):
+            def loop(self, n):
+                histogram.observe(0.1)
+
+            def final(self):
+                assert get_sample_value(histogram, 'h_count') == self.total
+                # Fixed-point sums don't accumulate rounding errors
+                assert get_sample_value(histogram, 'h_sum') == \
+                    self.total * round(0.1 * 2 ** 32) / 2 ** 32
+
+        Test(parallel, count=3000).run()
+
+        with pytest.raises(ValueError):
+            Histogram('h', 'help', fixed_sum=100, registry=registry)
+
     def test_setting_buckets(self, registry):
         def get_buckets(h):
             buckets = []
@@ -283,6 +469,199 @@ class TestHistogram:
                 buckets, sum, count = self.get_sample()
                 assert buckets[-1] == count == self.total
 
+class TestExponentialHistogram:
+    def test_histogram(self, registry):
+        h = ExponentialHistogram('h', 'help', schema=1, lowest=0.6, highest=4,
+                                 registry=registry)
+        assert h.schema == 1
+        assert h.thresholds == (0.5 ** 0.5, 1, 2 ** 0.5, 2, 2 * 2 ** 0.5, 4, float('inf'))
+
+        h.observe(0.1)
+        h.observe(1)
+        h.observe(1.1)
+        h.observe(100)
+        assert get_sample_value(h, 'h_bucket', {'le': '0.7071067811865476'}) == 1
+        assert get_sample_value(h, 'h_bucket', {'le': '1.0'}) == 2
+        assert get_sample_value(h, 'h_bucket', {'le': '1.4142135623730951'}) == 3
+        assert get_sample_value(h, 'h_bucket', {'le': '4.0'}) == 3
+        assert get_sample_value(h, 'h_bucket', {'le': 'inf'}) == 4
+        assert get_sample_value(h, 'h_count') == 4
+
+    def test_downscale(self, registry):
+        h = ExponentialHistogram('h', 'help', schema=8, lowest=2 ** -10, highest=2 ** 10,
+                                 max_buckets=30, registry=registry)
+        assert h.schema == 0
+        assert len(h.thresholds) == 22
+
+        with pytest.raises(ValueError):
+            ExponentialHistogram('h2', 'help', lowest=1e-300, highest=1e300, max_buckets=5,
+                                 registry=registry)
+
+    def test_invalid(self, registry):
+        for kwargs in ({ 'schema': 9 }, { 'lowest': 0 }, { 'lowest': 2, 'highest': 1 },
+                       { 'buffered': -1 }):
+            with pytest.raises(ValueError):
+                ExponentialHistogram('h', 'help', registry=registry, **kwargs)
+
+    def test_buffered(self, registry, parallel):
+        h = ExponentialHistogram('h', 'help', schema=0, lowest=0.5, highest=4, buffered=7,
+                                 registry=registry)
+        assert h._data.flush_every == 7
+
+        class Test(ParallelLoop):
+            def loop(self, n):
+                h.observe(n % 3)
+
+            def final(self):
+                assert get_sample_value(h, 'h_count') == self.total
+                assert get_sample_value(h, 'h_bucket', {'le': '1.0'}) == \
+                    self.total * 2 // 3
+
+        Test(parallel, count=3000).run()
+
+    def test_labels(self, registry):
+        h = ExponentialHistogram('h', 'help', ['l'], registry=registry)
+        h.labels('a').observe(1)
+        h = pickle.loads(pickle.dumps(h.labels('a')))
+        h.observe(1)
+        assert h._data.snapshot()[2] == 2
+
+class TestExemplars:
+    def get_exemplar(self, collector, name, labels={}):
+        for metric in collector.collect():
+            for s in metric.samples:
+                if s.name == name and s.labels == labels:
+                    return s.exemplar
+
+    def test_counter(self, registry):
+        c = Counter('c', 'help', exemplars=True, registry=registry)
+        assert self.get_exemplar(c, 'c_total') is None
+        c.inc(2, exemplar={'trace_id': 'abc'})
+        exemplar = self.get_exemplar(c, 'c_total')
+        assert exemplar.labels == {'trace_id': 'abc'}
+        assert exemplar.value == 2
+        assert get_sample_value(c, 'c_total') == 2
+
+        with pytest.raises(ValueError):
+            c.inc(exemplar={'trace_id': 'x' * 128})
+        assert get_sample_value(c, 'c_total') == 2
+
+    @pytest.mark.parametrize('kwargs', ({}, { 'sharded': 2 }, { 'buffered': 10 }))
+    def test_counter_variants(self, registry, kwargs):
+        c = Counter('c', 'help', ['l'], exemplars=True, registry=registry, **kwargs)
+        c.labels('a').inc(exemplar={'a': 'b'})
+        c = pickle.loads(pickle.dumps(c.labels('a')))
+        assert c._exemplar(0).labels == {'a': 'b'}
+
+    def test_histogram(self, registry):
+        h = Histogram('h', 'help', buckets=(1, 2), exemplars=2, registry=registry)
+        h.observe(1.5, {'n': '1'})
+        h.observe(0.5, {'n': '2'})
+        h.observe(0.5, {'n': '3'})
+        assert self.get_exemplar(h, 'h_bucket', {'le': '1.0'}).labels == {'n': '3'}
+        assert self.get_exemplar(h, 'h_bucket', {'le': '2.0'}).labels == {'n': '1'}
+        assert self.get_exemplar(h, 'h_bucket', {'le': 'inf'}) is None
+        assert get_sample_value(h, 'h_count') == 3
+
+        h = ExponentialHistogram('e', 'help', ['l'], exemplars=True, registry=registry)
+        h.labels('a').observe(1, {'n': '1'})
+        h = pickle.loads(pickle.dumps(h.labels('a')))
+        assert h._exemplar(h.thresholds.index(1)).value == 1
+
+    def test_disabled(self, registry):
+        c = Counter('c', 'help', registry=registry)
+        h = Histogram('h', 'help', registry=registry)
+        with pytest.raises(ValueError):
+            c.inc(exemplar={'a': 'b'})
+        with pytest.raises(ValueError):
+            h.observe(1, exemplar={'a': 'b'})
+        with pytest.raises(ValueError):
+            Counter('c', 'help', exemplars=0.5, registry=registry)
+
+class TestWindowed:
+    @pytest.fixture
+    def clock(self):
+        with unittest.mock.patch('time.monotonic', return_value=1000.0) as monotonic:
+            yield monotonic
+
+    def test_counter(self, registry, clock):
+        c = WindowedCounter('c', 'help', window=10, slices=5, registry=registry)
+        c.inc()
+        c.inc(2)
+        assert get_sample_value(c, 'c') == 3
+
+        clock.return_value += 5
+        c.inc(4)
+        assert get_sample_value(c, 'c') == 7
+
+        # The first slice has left the window
+        clock.return_value += 6
+        assert get_sample_value(c, 'c') == 4
+
+        # Nothing was updated while idle
+        clock.return_value += 100
+        assert get_sample_value(c, 'c') == 0
+        c.inc()
+        assert get_sample_value(c, 'c') == 1
+
+    def test_clock_restarted(self, registry, clock):
+        c = WindowedCounter('c', 'help', window=10, slices=5, registry=registry)
+        c.inc()
+        # Like reopening a persistent heap after a reboot
+        clock.return_value = 4.0
+        c.inc(2)
+        assert get_sample_value(c, 'c') == 2
+        assert c._window._epoch.get() == c._window.epoch()
+
+        # The window moves again
+        clock.return_value += 4
+        c.inc(3)
+        assert get_sample_value(c, 'c') == 5
+        clock.return_value += 20
+        assert get_sample_value(c, 'c') == 0
+
+    def test_histogram(self, registry, clock):
+        h = WindowedHistogram('h', 'help', buckets=(1, 2), window=10, registry=registry)
+        h.observe(1)
+        clock.return_value += 5
+        h.observe_many((1.5, 3))
+        assert get_sample_value(h, 'h_bucket', {'le': '1.0'}) == 1
+        assert get_sample_value(h, 'h_bucket', {'le': 'inf'}) == 3
+        assert get_sample_value(h, 'h_gcount') == 3
+        assert get_sample_value(h, 'h_gsum') == 5.5
+
+        clock.return_value += 6
+        assert get_sample_value(h, 'h_bucket', {'le': '1.0'}) == 0
+        assert get_sample_value(h, 'h_bucket', {'le': '2.0'}) == 1
+        assert get_sample_value(h, 'h_gcount') == 2
+        assert get_sample_value(h, 'h_gsum') == 4.5
+
+    def test_summary(self, registry, clock):
+        s = WindowedSummary('s', 'help', quantiles=(0.5,), window=10, registry=registry)
+        s.observe_many((1, 1, 1))
+        clock.return_value += 5
+        s.observe(10)
+        assert get_sample_value(s, 's', {'quantile': '0.5'}) == pytest.approx(1, rel=0.05)
+
+        clock.return_value += 6
+        assert get_sample_value(s, 's', {'quantile': '0.5'}) == pytest.approx(10, rel=0.05)
+        assert get_sample_value(s, 's_count') == 4
+        assert get_sample_value(s, 's_sum') == 13
+
+    def test_invalid(self, registry):
+        for cls in (WindowedCounter, WindowedHistogram, WindowedSummary):
+            for kwargs in ({ 'window': 0 }, { 'slices': 0 }):
+                with pytest.raises(ValueError):
+                    cls('w', 'help', registry=registry, **kwargs)
+
+        with pytest.raises(ValueError):
+            WindowedSummary('w', 'help', quantiles=(), registry=registry)
+
+    @pytest.mark.parametrize('cls', (WindowedCounter, WindowedHistogram, WindowedSummary))
+    def test_pickle(self, registry, cls):
+        metric = cls('w', 'help', labelnames=('l'), registry=registry)
+        pickle.loads(pickle.dumps(metric.labels('x')))
+
 @pytest.mark.parametrize(('cls', 'name'), (
     (Gauge, 'm'),
     (Summary, 'm_sum'),
@@ -459,3 +838,133 @@ class TestLabelCollector:
                     assert get_sample_value(self.counter, 'c_total', {'l': str(i)}) == self.count
 
         Test().run()
+
+    def test_child_stable(self, counter):
+        child = counter.labels('x')
+        assert counter.labels('x') is child
+        assert counter.labels(l='x') is child
+        child.inc()
+        assert get_sample_value(counter, 'c_total', {'l': 'x'}) == 1
+
+    def test_children_added(self, counter, parallel):
+        counter.labels('a').inc()
+        assert get_sample_value(counter, 'c_total', {'l': 'a'}) == 1
+        children = counter._children()
+        assert counter._children() is children
+
+        def target():
+            counter.labels('b').inc(2)
+
+        p = parallel.spawn(target=target)
+        p.start()
+        p.join()
+        assert list(counter._children()) == [('a',), ('b',)]
+        assert get_sample_value(counter, 'c_total', {'l': 'a'}) == 1
+        assert get_sample_value(counter, 'c_total', {'l': 'b'}) == 2
+
+    def test_remove(self, counter, two_labels):
+        counter.labels('a').inc()
+        start = counter.labels('b').__getstate__().start
+        series = counter._metrics[('b',)][1]
+        counter.remove('b')
+        counter.remove('missing')
+        assert get_sample_value(counter, 'c_total', {'l': 'b'}) is None
+        assert get_sample_value(counter, 'c_total', {'l': 'a'}) == 1
+        # The child starts over, and reuses the memory (and catalog series) of
+        # the old one
+        counter.labels('b').inc(2)
+        assert counter.labels('b').__getstate__().start == start
+        assert counter._metrics[('b',)][1] == series
+        assert get_sample_value(counter, 'c_total', {'l': 'b'}) == 2
+
+        two_labels.labels('x', 'y').inc()
+        two_labels.remove('x', 'y')
+        assert get_sample_value(two_labels, 'two_total', {'a': 'x', 'b': 'y'}) is None
+        with pytest.raises(ValueError):
+            two_labels.remove('x')
+
+    def test_clear(self, counter):
+        counter.labels('a').inc()
+        counter.labels('b').inc()
+        counter.clear()
+        assert list(counter._children()) == []
+        counter.clear()
+        counter.labels('b').inc(3)
+        assert list(counter._children()) == [('b',)]
+        assert get_sample_value(counter, 'c_total', {'l': 'b'}) == 3
+
+    def test_removed_elsewhere(self, counter, parallel):
+        counter.labels('a').inc()
+        assert get_sample_value(counter, 'c_total', {'l': 'a'}) == 1
+
+        def target():
+            counter.remove('a')
+            counter.labels('b').inc()
+
+        p = parallel.spawn(target=target)
+        p.start()
+        p.join()
+        assert list(counter._children()) == [('b',)]
+        counter.labels('a').inc(2)
+        assert get_sample_value(counter, 'c_total', {'l': 'a'}) == 2
+        assert get_sample_value(counter, 'c_total', {'l': 'b'}) == 1
+
+    def test_removed_in_use(self, counter, parallel):
+        start = counter.labels('a').__getstate__().start
+        looked_up = parallel.barrier(2)
+        removed = parallel.barrier(2)
+
+        def target():
+            counter.labels('a').inc()
+            looked_up.wait()
+            removed.wait()
+            counter.labels('b').inc()
+
+        p = parallel.spawn(target=target)
+        p.start()
+        looked_up.wait()
+        try:
+            counter.remove('a')
+            counter.labels('c').inc()
+            reused = counter.labels('c').__getstate__().start == start
+        finally:
+            removed.wait()
+            p.join()
+        # The other thread might still have been using the old child, so its
+        # memory couldn't be reused yet
+        assert not reused
+        # Until the other thread notices
+        assert counter.labels('b').__getstate__().start == start
+        assert get_sample_value(counter, 'c_total', {'l': 'b'}) == 1
+
+    def test_acks_pruned(self, counter, parallel):
+        for _ in range(5):
+            p = parallel.spawn(target=counter.labels, args=('a',))
+            p.start()
+            p.join()
+        counter.labels('a')
+        # Everyone else has exited, except (perhaps) the last thread, which
+        # may not have finished exiting yet
+        assert len(counter._acks) <= 2
+
+    def test_max_series(self, registry):
+        c = Counter('c', "help", ('l', 'm'), registry=registry, max_series=2)
+        c.labels('a', 'a').inc()
+        c.labels('b', 'b').inc()
+        c.labels('c', 'c').inc()
+        c.labels('d', 'd').inc(2)
+        c.labels('a', 'a').inc()
+        overflow = c.OVERFLOW
+        assert list(c._children()) == [('a', 'a'), ('b', 'b'), (overflow, overflow)]
+        assert get_sample_value(c, 'c_total', {'l': 'a', 'm': 'a'}) == 2
+        assert get_sample_value(c, 'c_total', {'l': overflow, 'm': overflow}) == 3
+
+        # Removing a child makes room for another one
+        c.remove('b', 'b')
+        c.labels('d', 'd').inc()
+        assert get_sample_value(c, 'c_total', {'l': 'd', 'm': 'd'}) == 1
+
+        with pytest.raises(ValueError):
+            Counter('d', "help", ('l',), registry=registry, max_series=0)
+        with pytest.raises(ValueError):
+            Counter('e', "help", registry=registry, max_series=1)
@@ -0,0 +1,100 @@
+# SPDX-License-Identifier: GPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+import pytest
+from prometheus_client.registry import CollectorRegistry
+
+import _mpmetrics
+from mpmetrics import Counter, Gauge, Histogram, Summary, WindowedCounter
+from mpmetrics.exposition import generate_latest
+from mpmetrics.heap import Heap
+from mpmetrics.snapshot import Decoder, Encoder
+
+pytestmark = pytest.mark.skipif(not _mpmetrics.AtomicUInt64,
+                                reason="snapshots need 64-bit atomics")
+
+def metrics_registry(heap=None):
+    registry = CollectorRegistry()
+    registry.heap = heap or Heap()
+    return registry
+
+def decoded(decoder):
+    registry = CollectorRegistry()
+    registry.register(decoder)
+    return generate_latest(registry)
+
+def test_snapshot():
+    registry = metrics_registry()
+    encoder = Encoder(registry.heap)
+    decoder = Decoder()
+    decoder.decode(encoder.encode())
+    assert decoded(decoder) == b''
+
+    c = Counter('c', "help", ('a', 'b'), registry=registry)
+    c.labels('x', 'y').inc()
+    c.labels('"', '\n\\').inc(12345678901)
+    s = Counter('s', "sharded", registry=registry, sharded=True)
+    s.inc(3)
+    g = Gauge('g', "help", registry=registry)
+    g.set(-0.125)
+    h = Histogram('h', "help", ('z',), registry=registry, buckets=(0.1, 1, 1e7))
+    h.labels('x').observe(1)
+    Summary('su', "help", registry=registry).observe(1 / 3)
+    # Not included, so keep it out of the expected output
+    WindowedCounter('w', "help", registry=metrics_registry(registry.heap)).inc()
+
+    decoder.decode(encoder.encode())
+    expected = generate_latest(registry)
+    assert decoded(decoder) == expected
+
+    # Nothing changed, so the snapshot is just its header
+    delta = encoder.encode()
+    assert len(delta) < 16
+    decoder.decode(delta)
+    assert decoded(decoder) == expected
+
+    c.labels('x', 'y').inc()
+    c.labels('new', 'child').inc()
+    g.set(1e20)
+    h.labels('x').observe(100)
+    delta = encoder.encode()
+    decoder.decode(delta)
+    assert len(delta) < 100
+    assert decoded(decoder) == generate_latest(registry)
+
+    c.remove('x', 'y')
+    decoder.decode(encoder.encode())
+    assert decoded(decoder) == generate_latest(registry)
+    decoder.decode(encoder.encode(full=True))
+    assert decoded(decoder) == generate_latest(registry)
+
+def test_resync():
+    registry = metrics_registry()
+    c = Counter('c', "help", registry=registry)
+    encoder = Encoder(registry.heap)
+    decoder = Decoder()
+    decoder.decode(encoder.encode())
+
+    c.inc()
+    encoder.encode()
+    c.inc()
+    with pytest.raises(ValueError):
+        decoder.decode(encoder.encode())
+    with pytest.raises(ValueError):
+        decoder.decode(b'not a snapshot')
+
+    decoder.decode(encoder.encode(full=True))
+    assert decoded(decoder) == generate_latest(registry)
+
+def test_removed(tmp_path):
+    registry = metrics_registry(Heap(path=tmp_path / 'metrics'))
+    Counter('c', "help", registry=registry).inc()
+    encoder = Encoder(registry.heap)
+    decoder = Decoder()
+    decoder.decode(encoder.encode())
+
+    # Re-creating a metric with different arguments starts it over
+    other = metrics_registry(registry.heap)
+    Counter('c', "help", registry=other, sharded=True)
+    decoder.decode(encoder.encode())
+    assert decoded(decoder) == generate_latest(other)
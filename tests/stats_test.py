@@ -0,0 +1,69 @@
+# SPDX-License-Identifier: GPL-3.0-only
+# Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
+
+import mmap
+import threading
+
+from prometheus_client.registry import CollectorRegistry
+import pytest
+
+from _mpmetrics import Lock, Stats
+from mpmetrics import stats
+from mpmetrics.heap import Heap
+from mpmetrics.types import Box
+
+from .common import heap
+
+pytestmark = pytest.mark.skipif(not Stats, reason="built without MPMETRICS_STATS")
+
+def test_record(heap):
+    s = Box[Stats](heap)
+    s.enable()
+    assert s.get() == (0,) * 5
+
+    Stats.record(Stats.CAS_RETRIES)
+    Stats.record(Stats.LOCK_WAIT_NS, 5)
+    assert s.get()[Stats.CAS_RETRIES] == 1
+    assert s.get()[Stats.LOCK_WAIT_NS] == 5
+
+    with pytest.raises(ValueError):
+        Stats.record(len(s.get()))
+
+def test_contention(heap):
+    s = Box[Stats](heap)
+    s.enable()
+    l = Box[Lock](heap)
+
+    l.acquire()
+    t = threading.Thread(target=lambda: l.acquire() and l.release())
+    t.start()
+    t.join(0.01)
+    l.release()
+    t.join()
+
+    waits = s.get()
+    assert waits[Stats.LOCK_WAITS] == 1
+    assert waits[Stats.LOCK_WAIT_NS] > 0
+
+    # Uncontended acquisitions aren't counted
+    with l:
+        pass
+    assert s.get() == waits
+
+def test_heap_grows(heap):
+    s = Box[Stats](heap)
+    s.enable()
+
+    h = Heap(map_size=mmap.PAGESIZE)
+    grows = s.get()[Stats.HEAP_GROWS]
+    h.malloc(mmap.PAGESIZE)
+    h.malloc(mmap.PAGESIZE)
+    assert s.get()[Stats.HEAP_GROWS] > grows
+
+def test_register():
+    registry = CollectorRegistry()
+    collector = stats.register(registry)
+    Stats.record(Stats.LOCK_WAIT_NS, 2000000000)
+    assert registry.get_sample_value('mpmetrics_lock_wait_seconds_total') == 2
+    assert registry.get_sample_value('mpmetrics_heap_grows_total') is not None
+    registry.unregister(collector)
@@ -1,6 +1,7 @@
 # SPDX-License-Identifier: GPL-3.0-only
 # Copyright (C) 2022 Sean Anderson <seanga2@gmail.com>
 
+import mmap
 import pickle
 
 from hypothesis import assume, given, reject, settings, strategies as st
@@ -10,7 +11,9 @@ import pytest
 from mpmetrics.atomic import AtomicInt64, AtomicUInt64, AtomicDouble
 from mpmetrics.generics import ObjectType, ListType
 from mpmetrics.heap import PAGESIZE, Heap
-from mpmetrics.types import Array, Box, Dict, Double, Size_t, Struct
+from mpmetrics.types import PICKLE_PROTOCOL, Array, Box, Dict, Double, OwnLine, ReadMostly, \
+    Size_t, Struct, _dumps
+from mpmetrics.util import CACHELINESIZE
 from _mpmetrics import Lock
 
 from .common import heap
@@ -53,6 +56,48 @@ def test_pickle(heap, cls):
     v = Box[cls](heap)
     pickle.loads(pickle.dumps(v))
 
+def test_lazy(heap):
+    s = Box[GenericStruct[(Size_t, Array[Size_t, 3])]](heap)
+    getattr(s, '0').value = 1
+    getattr(s, '1')[2].value = 2
+
+    # Fields are created when they are first used
+    t = pickle.loads(pickle.dumps(s))
+    assert '0' not in t.__dict__
+    assert getattr(t, '0').value == 1
+    assert [v.value for v in getattr(t, '1')] == [0, 0, 2]
+    assert getattr(t, '1')[-1].value == 2
+    assert [v.value for v in getattr(t, '1')[1:]] == [0, 2]
+    with pytest.raises(AttributeError):
+        t.missing
+
+def test_layout(heap):
+    S = GenericStruct[(AtomicUInt64, ReadMostly[Double], OwnLine[AtomicUInt64],
+                       ReadMostly[Size_t])]
+    offsets = { name: off for name, field, off in S._fields_iter() }
+    # Read-mostly fields come first, and OwnLine fields get their own line
+    assert offsets == { '1': 0, '3': 8, '0': 16, '2': CACHELINESIZE }
+    assert S.size == 2 * CACHELINESIZE
+    assert S.align == CACHELINESIZE
+    pickle.loads(pickle.dumps(S))
+
+    s = Box[S](heap)
+    getattr(s, '1').value = 1.5
+    getattr(s, '2').add(2)
+    t = pickle.loads(pickle.dumps(s))
+    assert getattr(t, '1').value == 1.5
+    assert getattr(t, '2').get() == 2
+
+class Packed(Struct):
+    _fields_ = { 'x': Size_t }
+    _packed_ = True
+
+def test_packed(heap):
+    # Packed structs don't start on a new cache line
+    blocks = [Box[Packed](heap)._Box__block for _ in range(4)]
+    assert any(block.start % CACHELINESIZE for block in blocks)
+    assert not Box[Size_t](heap)._Box__block.start % CACHELINESIZE
+
 # We use Size_t because drawing from types is slow
 @given(st.integers(min_value=1))
 def test_array(heap, n):
@@ -68,6 +113,27 @@ def test_bad_size(n):
     with pytest.raises(ValueError):
         Array[Size_t, n]
 
+def test_dict_pickle_protocol():
+    # Keys must pickle the same no matter which protocol is the default
+    assert _dumps(('x', 1, 2.5))[:2] == pickle.PROTO + bytes((PICKLE_PROTOCOL,))
+
+def test_dict_grow():
+    # Use a small heap so that we need several tables
+    d = Box[Dict](Heap(map_size=mmap.ALLOCATIONGRANULARITY))
+    model = {}
+    for i in range(2000):
+        d[i] = model[i] = str(i)
+    for i in range(0, 2000, 3):
+        del d[i]
+        del model[i]
+    for i in range(0, 2000, 5):
+        d[i] = model[i] = 'x' * (i % 50)
+
+    assert len(d) == len(model)
+    assert list(d.items()) == list(model.items())
+    for i in range(2000):
+        assert d.get(i) == model.get(i)
+
 @settings(max_examples=25)
 class DictComparison(RuleBasedStateMachine):
     keys = Bundle('keys')